@@ -17,7 +17,16 @@ Tcl_ThreadId kafkatcl_loggingCallbackThreadId = NULL;
 Tcl_Interp *loggingInterp = NULL;
 
 int
-kafkatcl_check_consumer_callbacks (kafkatcl_objectClientData *ko);
+kafkatcl_check_consumer_callbacks (kafkatcl_handleClientData *kh, int limit, Tcl_WideInt deadline);
+
+Tcl_WideInt
+kafkatcl_budget_deadline (kafkatcl_objectClientData *ko);
+
+int
+kafkatcl_main_queue_serve (kafkatcl_handleClientData *kh, int timeoutMS, int limit, Tcl_WideInt deadline);
+
+rd_kafka_resp_err_t
+kafkatcl_main_queue_drain (kafkatcl_handleClientData *kh, int timeoutMS);
 
 void
 kafkatcl_subscriber_poll(kafkatcl_handleClientData *kh);
@@ -25,6 +34,27 @@ kafkatcl_subscriber_poll(kafkatcl_handleClientData *kh);
 void
 kafkatcl_consume_stop_all_partitions (kafkatcl_topicClientData *kt);
 
+void
+kafkatcl_clear_queue_consumer (kafkatcl_queueClientData *kq);
+
+void
+kafkatcl_message_ref_detach_all (kafkatcl_handleClientData *kh);
+
+int
+kafkatcl_delivery_report_batch_match (Tcl_Event *tevPtr, ClientData clientData);
+
+int
+kafkatcl_produce_completion_match (Tcl_Event *tevPtr, ClientData clientData);
+
+void
+kafkatcl_produce_opaque_release (void *opaque);
+
+int
+kafkatcl_writable_match (Tcl_Event *tevPtr, ClientData clientData);
+
+void
+kafkatcl_flush_complete (kafkatcl_flushWaiter *waiter, Tcl_Interp *interp, rd_kafka_resp_err_t err, int remaining);
+
 int
 kafkatcl_handleObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
 
@@ -33,7 +63,73 @@ kafkatcl_EventSetupProc (ClientData clientData, int flags);
 void
 kafkatcl_EventCheckProc (ClientData clientData, int flags);
 void
+kafkatcl_FileProc (ClientData clientData, int mask);
+void
+kafkatcl_SubscriberEventSetupProc (ClientData clientData, int flags);
+void
 kafkatcl_SubscriberEventCheckProc (ClientData clientData, int flags);
+void
+kafkatcl_SubscriberFileProc (ClientData clientData, int mask);
+
+int
+kafkatcl_wakeup_init (kafkatcl_handleClientData *kh, Tcl_FileProc *proc);
+void
+kafkatcl_wakeup_watch_queue (kafkatcl_handleClientData *kh, rd_kafka_queue_t *rkqu);
+void
+kafkatcl_wakeup_drain (kafkatcl_handleClientData *kh);
+void
+kafkatcl_wakeup_cleanup (kafkatcl_handleClientData *kh);
+
+int
+kafkatcl_metadata_ensure_topic (kafkatcl_handleClientData *kh, char *topicName);
+void
+kafkatcl_metadata_cleanup (kafkatcl_handleClientData *kh);
+
+int
+kafkatcl_query_eventProc (Tcl_Event *tevPtr, int flags);
+kafkatcl_queryEvent *
+kafkatcl_query_new (kafkatcl_handleClientData *kh, int type, Tcl_Obj *commandObj, int timeoutMS);
+int
+kafkatcl_query_start (kafkatcl_handleClientData *kh, kafkatcl_queryEvent *evPtr);
+void
+kafkatcl_query_cleanup (kafkatcl_handleClientData *kh);
+Tcl_Obj *
+kafkatcl_topic_partition_list_to_list (Tcl_Interp *interp, rd_kafka_topic_partition_list_t *topics);
+int
+kafkatcl_pause_resume (Tcl_Interp *interp, kafkatcl_handleClientData *kh, int pause, int objc, Tcl_Obj *CONST objv[]);
+int
+kafkatcl_seek (Tcl_Interp *interp, kafkatcl_handleClientData *kh, int objc, Tcl_Obj *CONST objv[]);
+int
+kafkatcl_offsets_for_times (Tcl_Interp *interp, kafkatcl_handleClientData *kh, int objc, Tcl_Obj *CONST objv[]);
+int
+kafkatcl_consume_stop (kafkatcl_topicClientData *kt, int partition);
+int
+kafkatcl_range_accept (rd_kafka_message_t *rkmessage, int64_t end, int *finishedPtr);
+void
+kafkatcl_range_pause (kafkatcl_handleClientData *kh, const char *topic, int32_t partition);
+void
+kafkatcl_range_resume (kafkatcl_handleClientData *kh, const char *topic, int32_t partition);
+
+void
+kafkatcl_range_resume_all (kafkatcl_handleClientData *kh);
+void
+kafkatcl_range_forget (kafkatcl_handleClientData *kh, rd_kafka_topic_partition_list_t *partitions);
+void
+kafkatcl_range_queue_done (struct kafkatcl_consumeRange *range, kafkatcl_runningConsumer *krc);
+int
+kafkatcl_range_done_eventProc (Tcl_Event *tevPtr, int flags);
+void
+kafkatcl_range_release (struct kafkatcl_consumeRange *range);
+void
+kafkatcl_range_abandon (kafkatcl_runningConsumer *krc);
+void
+kafkatcl_range_cleanup (kafkatcl_handleClientData *kh);
+int
+kafkatcl_subscriber_range_message (kafkatcl_handleClientData *kh, rd_kafka_message_t *rkmessage);
+int
+kafkatcl_subscriber_consume_range (Tcl_Interp *interp, kafkatcl_handleClientData *kh, int objc, Tcl_Obj *CONST objv[]);
+int
+kafkatcl_topic_consume_range (Tcl_Interp *interp, kafkatcl_topicClientData *kt, int objc, Tcl_Obj *CONST objv[]);
 
 // DEBUG
 #ifdef DEBUGPRINTF
@@ -81,6 +177,39 @@ kafkatcl_kafkaObjectDelete (ClientData clientData)
 
     assert (ko->kafka_object_magic == KAFKA_OBJECT_MAGIC);
 
+	Tcl_HashSearch search;
+	Tcl_HashEntry *entry;
+
+	// handles aren't deleted along with the kafka object on their own,
+	// but their delivery reports and completions point back to it, so
+	// delete them first.  deleting a producer serves the reports of
+	// the messages it drops.
+	while (!KT_LIST_EMPTY (&ko->handles)) {
+		kafkatcl_handleClientData *kh = KT_LIST_FIRST (&ko->handles);
+
+		Tcl_DeleteCommandFromToken (ko->interp, kh->cmdToken);
+	}
+
+	// the handles are gone, so messages still waiting for delivery will
+	// never get a report.  let go of their commands and payloads.
+	while ((entry = Tcl_FirstHashEntry (&ko->pendingCompletions, &search)) != NULL) {
+		kafkatcl_produce_opaque_release (Tcl_GetHashValue (entry));
+	}
+	Tcl_DeleteHashTable (&ko->pendingCompletions);
+
+	// drop delivery reports that haven't been handed to Tcl yet,
+	// including those served by deleting the handles
+	Tcl_DeleteEvents (kafkatcl_delivery_report_batch_match, (ClientData)ko);
+	Tcl_DeleteEvents (kafkatcl_produce_completion_match, (ClientData)ko);
+	if (ko->deliveryReportBatch != NULL) {
+		Tcl_DecrRefCount (ko->deliveryReportBatch);
+	}
+
+	for (entry = Tcl_FirstHashEntry (&ko->topicDeliveryReportSampling, &search); entry != NULL; entry = Tcl_NextHashEntry (&search)) {
+		ckfree (Tcl_GetHashValue (entry));
+	}
+	Tcl_DeleteHashTable (&ko->topicDeliveryReportSampling);
+
 	rd_kafka_conf_destroy (ko->conf);
 	rd_kafka_topic_conf_destroy (ko->topicConf);
     ckfree((char *)clientData);
@@ -151,22 +280,83 @@ kafkatcl_handleObjectDelete (ClientData clientData)
 
     assert (kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
 
-	rd_kafka_destroy (kh->rk);
+	KT_LIST_REMOVE (kh, handleInstance);
 
-	// destroy metadata if it exists
-	if (kh->metadata != NULL) {
-		rd_kafka_metadata_destroy (kh->metadata);
+	// Stop passing this to Tcl event handlers
+        Tcl_DeleteEventSource (kafkatcl_EventSetupProc, kafkatcl_EventCheckProc, (ClientData) kh);
+
+	// drop on_writable events, and complete flush -async calls that are
+	// still waiting with RD_KAFKA_RESP_ERR__DESTROY, since the messages
+	// they were waiting for are about to be dropped
+	Tcl_DeleteEvents (kafkatcl_writable_match, (ClientData)kh);
+	while (!KT_LIST_EMPTY (&kh->flushWaiters)) {
+		kafkatcl_flush_complete (KT_LIST_FIRST (&kh->flushWaiters), kh->interp, RD_KAFKA_RESP_ERR__DESTROY, rd_kafka_outq_len (kh->rk));
+	}
+	if (kh->writableCallbackObj != NULL) {
+		Tcl_DecrRefCount (kh->writableCallbackObj);
+		kh->writableCallbackObj = NULL;
+	}
+
+	if (kh->backpressurePaused != NULL) {
+		rd_kafka_topic_partition_list_destroy (kh->backpressurePaused);
+		kh->backpressurePaused = NULL;
+	}
+
+	if (kh->appPaused != NULL) {
+		rd_kafka_topic_partition_list_destroy (kh->appPaused);
+		kh->appPaused = NULL;
+	}
+
+	if (kh->rangePaused != NULL) {
+		rd_kafka_topic_partition_list_destroy (kh->rangePaused);
+		kh->rangePaused = NULL;
+	}
+
+	// Undelivered messages are dropped when a producer is destroyed
+	// anyway.  Purge them now and serve their delivery reports so that
+	// payloads produced with -nocopy and completions get let go of.
+	// the reports of purged messages come back asynchronously, so wait
+	// for the out queue to drain.
+	if (kh->kafkaType == RD_KAFKA_PRODUCER) {
+		rd_kafka_purge (kh->rk, RD_KAFKA_PURGE_F_QUEUE | RD_KAFKA_PURGE_F_INFLIGHT);
+		kafkatcl_main_queue_drain (kh, KAFKATCL_PURGE_FLUSH_MS);
+	}
+
+	if (kh->mainEvent != NULL) {
+		rd_kafka_event_destroy (kh->mainEvent);
+		kh->mainEvent = NULL;
+	}
+
+	// Stop librdkafka from signalling us and let go of our queue handles,
+	// which have to be released before the kafka handle goes away
+	kafkatcl_wakeup_watch_queue (NULL, kh->mainQueue);
+	rd_kafka_queue_destroy (kh->mainQueue);
+
+	if (kh->callbackQueue != NULL) {
+		kafkatcl_wakeup_watch_queue (NULL, kh->callbackQueue);
+		rd_kafka_queue_destroy (kh->callbackQueue);
 	}
 
+	kafkatcl_wakeup_cleanup (kh);
+	Tcl_DeleteHashTable (&kh->callbackConsumers);
+
+	// messages have to be destroyed before the kafka handle
+	kafkatcl_message_ref_detach_all (kh);
+
+	// background metadata refreshes and queries have to finish before
+	// the kafka handle goes away
+	kafkatcl_query_cleanup (kh);
+	kafkatcl_range_cleanup (kh);
+	kafkatcl_metadata_cleanup (kh);
+
+	rd_kafka_destroy (kh->rk);
+
 	// clear the kafka handle magic number; this will help us catch
 	// attempted reuse of the structure after freeing
     kh->kafka_handle_magic = 0;
 
 	rd_kafka_topic_conf_destroy (kh->topicConf);
 
-	// Stop passing this to Tcl event handlers
-        Tcl_DeleteEventSource (kafkatcl_EventSetupProc, kafkatcl_EventCheckProc, (ClientData) kh);
-
     ckfree((char *)clientData);
 }
 
@@ -191,13 +381,14 @@ kafkatcl_queueObjectDelete (ClientData clientData)
 
     assert (kq->kafka_queue_magic == KAFKA_QUEUE_MAGIC);
 
-	rd_kafka_queue_destroy (kq->rkqu);
-
-	// if we have a running consumer on this queue, free its structure
+	// if we have a running consumer on this queue, stop watching the
+	// queue and free its structure
 	if (kq->krc != NULL) {
-		ckfree (kq->krc);
+		kafkatcl_clear_queue_consumer (kq);
 	}
 
+	rd_kafka_queue_destroy (kq->rkqu);
+
 	// clear the kafka queue magic number; this will help us catch
 	// attempted reuse of the structure after freeing
     kq->kafka_queue_magic = 0;
@@ -231,13 +422,19 @@ kafkatcl_subscriberObjectDelete (ClientData clientData)
 
     assert (kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
 
+	KT_LIST_REMOVE (kh, handleInstance);
+
 	// Clean up embedded Tcl objects
 	if(kh->subscriberCallback)
 		Tcl_DecrRefCount(kh->subscriberCallback);
 	kh->subscriberCallback = NULL;
 
 	// Stop passing Tcl events to this object
-        Tcl_DeleteEventSource (kafkatcl_EventSetupProc, kafkatcl_SubscriberEventCheckProc, (ClientData) kh);
+        Tcl_DeleteEventSource (kafkatcl_SubscriberEventSetupProc, kafkatcl_SubscriberEventCheckProc, (ClientData) kh);
+
+	// Stop librdkafka from signalling us
+	kafkatcl_wakeup_watch_queue (NULL, kh->consumerQueue);
+	kafkatcl_wakeup_cleanup (kh);
 
 	// Clen up topic and metadata before destroying subscriber
 	// (see https://github.com/edenhill/librdkafka/wiki/Proper-termination-sequence )
@@ -245,15 +442,20 @@ kafkatcl_subscriberObjectDelete (ClientData clientData)
 		rd_kafka_topic_conf_destroy (kh->topicConf);
 	}
 
-	// destroy metadata if it exists
-	if (kh->metadata != NULL) {
-		rd_kafka_metadata_destroy (kh->metadata);
-	}
+	kafkatcl_query_cleanup (kh);
+	kafkatcl_range_cleanup (kh);
+	kafkatcl_metadata_cleanup (kh);
 
 	// TODO: if there's a queue out, call rd_kafka_queue_destroy() on it
 
 	rd_kafka_consumer_close(kh->rk);
 
+	// queue handles and messages have to be released before the kafka
+	// handle goes away
+	rd_kafka_queue_destroy (kh->consumerQueue);
+	Tcl_DeleteHashTable (&kh->callbackConsumers);
+	kafkatcl_message_ref_detach_all (kh);
+
 	rd_kafka_destroy (kh->rk);
 
 	// clear the kafka handle magic number; this will help us catch
@@ -356,6 +558,270 @@ kafkatcl_parse_offset (Tcl_Interp *interp, Tcl_Obj *offsetObj, int64_t *offsetPt
 	return TCL_OK;
 }
 
+/*
+ *--------------------------------------------------------------
+ *
+ * kafkatcl_parse_milliseconds -- parse a non-negative time in
+ *   milliseconds, either a bare integer or an integer followed
+ *   by "ms"
+ *
+ * Results:
+ *      a standard Tcl result
+ *
+ *--------------------------------------------------------------
+ */
+int
+kafkatcl_parse_milliseconds (Tcl_Interp *interp, Tcl_Obj *msObj, int *msPtr) {
+	char *string = Tcl_GetString (msObj);
+	char *end;
+	long ms;
+
+	errno = 0;
+	ms = strtol (string, &end, 10);
+
+	if (end != string && strcmp (end, "ms") == 0) {
+		end += 2;
+	}
+
+	if (end == string || *end != '\0' || errno != 0 || ms < 0 || ms > INT_MAX) {
+		Tcl_ResetResult (interp);
+		Tcl_AppendResult (interp, "expected milliseconds but got \"", string, "\"", NULL);
+		return TCL_ERROR;
+	}
+
+	*msPtr = (int)ms;
+	return TCL_OK;
+}
+
+static CONST char *kafkatcl_fieldStrings[] = {
+	"payload",
+	"partition",
+	"offset",
+	"timestamp",
+	"topic",
+	"key",
+	"headers",
+	NULL
+};
+
+static CONST char *kafkatcl_deliveryReportFieldStrings[] = {
+	"payload",
+	"partition",
+	"offset",
+	"timestamp",
+	"topic",
+	"key",
+	"err",
+	"opaque",
+	NULL
+};
+
+/*
+ *--------------------------------------------------------------
+ *
+ * kafkatcl_parse_fields -- parse a list of field names out of
+ *   fieldStrings into a mask with bit n set for the nth of them,
+ *   such as KAFKATCL_FIELD_* bits for kafkatcl_fieldStrings
+ *
+ * Results:
+ *      a standard Tcl result
+ *
+ *--------------------------------------------------------------
+ */
+int
+kafkatcl_parse_fields (Tcl_Interp *interp, Tcl_Obj *fieldsObj, CONST char **fieldStrings, int *fieldsPtr) {
+	int listObjc;
+	Tcl_Obj **listObjv;
+	int fieldIndex;
+	int fields = 0;
+	int i;
+
+	if (Tcl_ListObjGetElements (interp, fieldsObj, &listObjc, &listObjv) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	for (i = 0; i < listObjc; i++) {
+		if (Tcl_GetIndexFromObj (interp, listObjv[i], fieldStrings, "field", TCL_EXACT, &fieldIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		fields |= (1 << fieldIndex);
+	}
+
+	*fieldsPtr = fields;
+	return TCL_OK;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * kafkatcl_parse_consume_options -- parse the ?-fields list? and, if
+ *   allowBatch is set, ?-batch count? ?-linger ms? options accepted
+ *   in front of the arguments of the consuming methods, starting at
+ *   objv[*nextArgPtr]
+ *
+ *   on return *nextArgPtr is the index of the first non-option argument
+ *
+ * Results:
+ *      a standard Tcl result
+ *
+ *--------------------------------------------------------------
+ */
+int
+kafkatcl_parse_consume_options (Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], int *nextArgPtr, int allowBatch, kafkatcl_consumeOptions *options) {
+	int nextArg = *nextArgPtr;
+
+	options->fields = KAFKATCL_FIELDS_DEFAULT;
+	options->batchSize = 0;
+	options->lingerMS = 0;
+
+	while (nextArg + 1 < objc) {
+		char *option = Tcl_GetString (objv[nextArg]);
+
+		if (strcmp (option, "-fields") == 0) {
+			if (kafkatcl_parse_fields (interp, objv[nextArg + 1], kafkatcl_fieldStrings, &options->fields) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+		} else if (allowBatch && strcmp (option, "-batch") == 0) {
+			if (Tcl_GetIntFromObj (interp, objv[nextArg + 1], &options->batchSize) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+			if (options->batchSize < 0) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("-batch count must not be negative", -1));
+				return TCL_ERROR;
+			}
+		} else if (allowBatch && strcmp (option, "-linger") == 0) {
+			if (kafkatcl_parse_milliseconds (interp, objv[nextArg + 1], &options->lingerMS) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+		} else {
+			break;
+		}
+		nextArg += 2;
+	}
+
+	*nextArgPtr = nextArg;
+	return TCL_OK;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * kafkatcl_now_ms -- return the current time in milliseconds
+ *
+ *--------------------------------------------------------------
+ */
+Tcl_WideInt
+kafkatcl_now_ms (void) {
+	Tcl_Time now;
+
+	Tcl_GetTime (&now);
+	return (Tcl_WideInt)now.sec * 1000 + now.usec / 1000;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * kafkatcl_parse_block_timeout -- parse the timeout of a -block option,
+ *   a number of milliseconds that mustn't be negative, since blocking
+ *   forever isn't something to be doing in the middle of an event loop
+ *
+ * Results:
+ *   returns a standard Tcl result
+ *
+ *--------------------------------------------------------------
+ */
+int
+kafkatcl_parse_block_timeout (Tcl_Interp *interp, Tcl_Obj *obj, int *blockMSPtr) {
+	int blockMS;
+
+	if (Tcl_GetIntFromObj (interp, obj, &blockMS) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	if (blockMS < 0) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("-block timeout can't be negative", -1));
+		return TCL_ERROR;
+	}
+
+	*blockMSPtr = blockMS;
+	return TCL_OK;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * kafkatcl_parse_produce_options -- parse the options of producev
+ *   and producev_batch, starting at *nextArgPtr and stopping at the
+ *   last argument, which is the payload or the list of messages.
+ *
+ *   options not given are left as they are, so the options of a
+ *   batch can be the defaults for each of its messages.
+ *
+ * Results:
+ *      A standard Tcl result.  *nextArgPtr is left at the first
+ *      argument that isn't an option.
+ *
+ *--------------------------------------------------------------
+ */
+int
+kafkatcl_parse_produce_options (Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], int *nextArgPtr, kafkatcl_produceOptions *options) {
+	int nextArg = *nextArgPtr;
+
+	while (nextArg + 1 < objc) {
+		char *option = Tcl_GetString (objv[nextArg]);
+
+		if (strcmp (option, "-nocopy") == 0) {
+			options->nocopy = 1;
+			nextArg++;
+			continue;
+		}
+
+		if (nextArg + 2 >= objc) {
+			break;
+		}
+
+		if (strcmp (option, "-partition") == 0) {
+			int partition;
+
+			if (Tcl_GetIntFromObj (interp, objv[nextArg + 1], &partition) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+			options->partition = partition;
+		} else if (strcmp (option, "-key") == 0) {
+			options->keyObj = objv[nextArg + 1];
+		} else if (strcmp (option, "-headers") == 0) {
+			int headerObjc;
+
+			if (Tcl_ListObjLength (interp, objv[nextArg + 1], &headerObjc) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+			if (headerObjc % 2 != 0) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("-headers must be a list of names and values", -1));
+				return TCL_ERROR;
+			}
+			options->headersObj = objv[nextArg + 1];
+		} else if (strcmp (option, "-opaque") == 0) {
+			options->opaqueObj = objv[nextArg + 1];
+		} else if (strcmp (option, "-command") == 0) {
+			options->commandObj = objv[nextArg + 1];
+		} else if (strcmp (option, "-block") == 0) {
+			if (kafkatcl_parse_block_timeout (interp, objv[nextArg + 1], &options->blockMS) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+		} else if (strcmp (option, "-timestamp") == 0) {
+			if (Tcl_GetWideIntFromObj (interp, objv[nextArg + 1], &options->timestamp) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+		} else {
+			break;
+		}
+		nextArg += 2;
+	}
+
+	*nextArgPtr = nextArg;
+	return TCL_OK;
+}
+
 /*
  *--------------------------------------------------------------
  * kafkatcl_NewOffsetObj -- formats an offset into a Tcl object
@@ -459,6 +925,36 @@ const char *kafkatcl_kafka_error_to_errorcode_string (rd_kafka_resp_err_t kafkaE
 		case RD_KAFKA_RESP_ERR_NOT_COORDINATOR_FOR_GROUP:
 			return "RD_KAFKA_RESP_ERR_NOT_COORDINATOR_FOR_GROUP";
 
+		case RD_KAFKA_RESP_ERR__DESTROY:
+			return "RD_KAFKA_RESP_ERR__DESTROY";
+
+		case RD_KAFKA_RESP_ERR__MSG_TIMED_OUT:
+			return "RD_KAFKA_RESP_ERR__MSG_TIMED_OUT";
+
+		case RD_KAFKA_RESP_ERR__UNKNOWN_PARTITION:
+			return "RD_KAFKA_RESP_ERR__UNKNOWN_PARTITION";
+
+		case RD_KAFKA_RESP_ERR__UNKNOWN_TOPIC:
+			return "RD_KAFKA_RESP_ERR__UNKNOWN_TOPIC";
+
+		case RD_KAFKA_RESP_ERR__INVALID_ARG:
+			return "RD_KAFKA_RESP_ERR__INVALID_ARG";
+
+		case RD_KAFKA_RESP_ERR__QUEUE_FULL:
+			return "RD_KAFKA_RESP_ERR__QUEUE_FULL";
+
+		case RD_KAFKA_RESP_ERR__PURGE_QUEUE:
+			return "RD_KAFKA_RESP_ERR__PURGE_QUEUE";
+
+		case RD_KAFKA_RESP_ERR__PURGE_INFLIGHT:
+			return "RD_KAFKA_RESP_ERR__PURGE_INFLIGHT";
+
+		case RD_KAFKA_RESP_ERR__TIMED_OUT:
+			return "RD_KAFKA_RESP_ERR__TIMED_OUT";
+
+		case RD_KAFKA_RESP_ERR__NOT_IMPLEMENTED:
+			return "RD_KAFKA_RESP_ERR__NOT_IMPLEMENTED";
+
 		default:
 			return "RD_KAFKA_UNRECOGNIZED_ERROR";
 	}
@@ -877,23 +1373,563 @@ kafkatcl_handle_command_to_handleClientData (Tcl_Interp *interp, char *handleCom
 }
 
 /*
- *--------------------------------------------------------------
- *
- *   kafkatcl_message_to_tcl_list -- given a Tcl interpreter,
- *   and a kafka rd_kafka_message_t message, generate
- *   a list of key value pairs of the message payload, partition,
- *   key, offset and topic or generate an error key-value pair
- *
- * Results:
- *     a standard Tcl result
- *
+ * per-thread shared Tcl objects for the keys of the message lists we
+ * build and for topic names, so we don't allocate new ones for every
+ * message
+ */
+
+enum kafkatcl_literals {
+	KAFKATCL_LIT_PAYLOAD,
+	KAFKATCL_LIT_PARTITION,
+	KAFKATCL_LIT_OFFSET,
+	KAFKATCL_LIT_TIMESTAMP,
+	KAFKATCL_LIT_TOPIC,
+	KAFKATCL_LIT_KEY,
+	KAFKATCL_LIT_HEADERS,
+	KAFKATCL_LIT_TIMESTAMP_TYPE,
+	KAFKATCL_LIT_CREATE_TIME,
+	KAFKATCL_LIT_LOG_APPEND_TIME,
+	KAFKATCL_LIT_ERR,
+	KAFKATCL_LIT_OPAQUE,
+	KAFKATCL_LIT_ERROR,
+	KAFKATCL_LIT_CODE,
+	KAFKATCL_LIT_MESSAGE,
+	KAFKATCL_LIT_ID,
+	KAFKATCL_LIT_COUNT
+};
+
+static CONST char *kafkatcl_literalStrings[] = {
+	"payload",
+	"partition",
+	"offset",
+	"timestamp",
+	"topic",
+	"key",
+	"headers",
+	"timestamp_type",
+	"create_time",
+	"log_append_time",
+	"err",
+	"opaque",
+	"error",
+	"code",
+	"message",
+	"id"
+};
+
+typedef struct kafkatcl_threadData {
+	int initialized;
+	Tcl_Obj *literals[KAFKATCL_LIT_COUNT];
+	Tcl_HashTable topicNames;
+} kafkatcl_threadData;
+
+static Tcl_ThreadDataKey kafkatcl_threadDataKey;
+
+static void
+kafkatcl_thread_data_cleanup (ClientData clientData) {
+	kafkatcl_threadData *tsdPtr = (kafkatcl_threadData *)clientData;
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hashEntry;
+	int i;
+
+	for (i = 0; i < KAFKATCL_LIT_COUNT; i++) {
+		Tcl_DecrRefCount (tsdPtr->literals[i]);
+	}
+
+	for (hashEntry = Tcl_FirstHashEntry (&tsdPtr->topicNames, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry (&search)) {
+		Tcl_DecrRefCount ((Tcl_Obj *)Tcl_GetHashValue (hashEntry));
+	}
+	Tcl_DeleteHashTable (&tsdPtr->topicNames);
+	tsdPtr->initialized = 0;
+}
+
+static kafkatcl_threadData *
+kafkatcl_thread_data (void) {
+	kafkatcl_threadData *tsdPtr = (kafkatcl_threadData *)Tcl_GetThreadData (&kafkatcl_threadDataKey, sizeof (kafkatcl_threadData));
+
+	if (!tsdPtr->initialized) {
+		int i;
+
+		for (i = 0; i < KAFKATCL_LIT_COUNT; i++) {
+			tsdPtr->literals[i] = Tcl_NewStringObj (kafkatcl_literalStrings[i], -1);
+			Tcl_IncrRefCount (tsdPtr->literals[i]);
+		}
+		Tcl_InitHashTable (&tsdPtr->topicNames, TCL_STRING_KEYS);
+		Tcl_CreateThreadExitHandler (kafkatcl_thread_data_cleanup, (ClientData)tsdPtr);
+		tsdPtr->initialized = 1;
+	}
+
+	return tsdPtr;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ *   kafkatcl_topic_name_obj -- return the shared Tcl object for
+ *   a topic name
+ *
+ *--------------------------------------------------------------
+ */
+Tcl_Obj *
+kafkatcl_topic_name_obj (kafkatcl_threadData *tsdPtr, const char *topic) {
+	int new;
+	Tcl_HashEntry *hashEntry = Tcl_CreateHashEntry (&tsdPtr->topicNames, topic, &new);
+
+	if (new) {
+		Tcl_Obj *topicObj = Tcl_NewStringObj (topic, -1);
+		Tcl_IncrRefCount (topicObj);
+		Tcl_SetHashValue (hashEntry, topicObj);
+	}
+
+	return (Tcl_Obj *)Tcl_GetHashValue (hashEntry);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ *   kafkatcl_message_ref_new -- wrap a consumed message so that Tcl
+ *   objects can refer to its payload without copying it.  the caller
+ *   owns one reference and gives it up with kafkatcl_message_ref_release.
+ *
+ *   the message is kept on the handle's list of referenced messages
+ *   so that it can be let go of before the handle is destroyed.
+ *
+ *--------------------------------------------------------------
+ */
+kafkatcl_messageRef *
+kafkatcl_message_ref_new (kafkatcl_handleClientData *kh, rd_kafka_message_t *rkmessage) {
+	kafkatcl_messageRef *ref = (kafkatcl_messageRef *)ckalloc (sizeof (kafkatcl_messageRef));
+
+	ref->refCount = 1;
+	ref->rkmessage = rkmessage;
+	ref->kh = kh;
+	ref->detachedPayload = NULL;
+	ref->detachedLen = 0;
+	ref->detachedHeaders = NULL;
+	KT_LIST_INSERT_HEAD (&kh->messageRefs, ref, messageRefInstance);
+
+	return ref;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ *   kafkatcl_message_ref_release -- drop a reference to a consumed
+ *   message, destroying the message when it was the last one.
+ *
+ *--------------------------------------------------------------
+ */
+void
+kafkatcl_message_ref_release (kafkatcl_messageRef *ref) {
+	if (--ref->refCount > 0) {
+		return;
+	}
+
+	if (ref->rkmessage != NULL) {
+		KT_LIST_REMOVE (ref, messageRefInstance);
+		rd_kafka_message_destroy (ref->rkmessage);
+	} else {
+		if (ref->detachedPayload != NULL) {
+			ckfree ((char *)ref->detachedPayload);
+		}
+		if (ref->detachedHeaders != NULL) {
+			rd_kafka_headers_destroy (ref->detachedHeaders);
+		}
+	}
+
+	ckfree ((char *)ref);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ *   kafkatcl_message_ref_detach_all -- librdkafka messages have to
+ *   be destroyed before the handle they came from.  copy the payload
+ *   out of every message Tcl still refers to, take its headers and
+ *   destroy the message.
+ *
+ *--------------------------------------------------------------
+ */
+void
+kafkatcl_message_ref_detach_all (kafkatcl_handleClientData *kh) {
+	kafkatcl_messageRef *ref;
+	kafkatcl_messageRef *tmp;
+
+	KT_LIST_FOREACH_SAFE (ref, &kh->messageRefs, messageRefInstance, tmp) {
+		rd_kafka_message_t *rkmessage = ref->rkmessage;
+
+		ref->detachedLen = rkmessage->len;
+		if (rkmessage->len > 0) {
+			ref->detachedPayload = (unsigned char *)ckalloc (rkmessage->len);
+			memcpy (ref->detachedPayload, rkmessage->payload, rkmessage->len);
+		}
+
+		if (rd_kafka_message_detach_headers (rkmessage, &ref->detachedHeaders) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+			ref->detachedHeaders = NULL;
+		}
+
+		KT_LIST_REMOVE (ref, messageRefInstance);
+		rd_kafka_message_destroy (rkmessage);
+		ref->rkmessage = NULL;
+		ref->kh = NULL;
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ *   kafkatcl_message_ref_payload -- return a pointer to the payload
+ *   of a referenced message and store its length
+ *
+ *--------------------------------------------------------------
+ */
+unsigned char *
+kafkatcl_message_ref_payload (kafkatcl_messageRef *ref, size_t *lenPtr) {
+	if (ref->rkmessage != NULL) {
+		*lenPtr = ref->rkmessage->len;
+		return (unsigned char *)ref->rkmessage->payload;
+	}
+
+	*lenPtr = ref->detachedLen;
+	return ref->detachedPayload;
+}
+
+/*
+ * the kafka payload object type.  the internal rep points to a
+ * kafkatcl_messageRef; the payload bytes are only turned into a string
+ * rep when something asks for one.  the string rep is the same one a
+ * Tcl byte array would have, so converting to a byte array later gives
+ * back the original bytes.
+ *
+ * holding the message holds librdkafka's fetch buffer, which is shared
+ * by every message fetched with it.  the message is let go of when the
+ * object is converted to another type, such as a byte array by binary
+ * scan or a string by string commands, which frees the internal rep,
+ * or when the object itself is freed.
+ */
+
+static void kafkatcl_payload_FreeIntRep (Tcl_Obj *objPtr);
+static void kafkatcl_payload_DupIntRep (Tcl_Obj *srcPtr, Tcl_Obj *dupPtr);
+static void kafkatcl_payload_UpdateString (Tcl_Obj *objPtr);
+static int kafkatcl_payload_SetFromAny (Tcl_Interp *interp, Tcl_Obj *objPtr);
+
+static Tcl_ObjType kafkatcl_payloadObjType = {
+	"kafkapayload",
+	kafkatcl_payload_FreeIntRep,
+	kafkatcl_payload_DupIntRep,
+	kafkatcl_payload_UpdateString,
+	kafkatcl_payload_SetFromAny
+};
+
+static void
+kafkatcl_payload_FreeIntRep (Tcl_Obj *objPtr) {
+	kafkatcl_message_ref_release ((kafkatcl_messageRef *)objPtr->internalRep.twoPtrValue.ptr1);
+	objPtr->typePtr = NULL;
+}
+
+static void
+kafkatcl_payload_DupIntRep (Tcl_Obj *srcPtr, Tcl_Obj *dupPtr) {
+	kafkatcl_messageRef *ref = (kafkatcl_messageRef *)srcPtr->internalRep.twoPtrValue.ptr1;
+
+	ref->refCount++;
+	dupPtr->internalRep.twoPtrValue.ptr1 = ref;
+	dupPtr->internalRep.twoPtrValue.ptr2 = NULL;
+	dupPtr->typePtr = srcPtr->typePtr;
+}
+
+static void
+kafkatcl_payload_UpdateString (Tcl_Obj *objPtr) {
+	size_t len;
+	unsigned char *payload = kafkatcl_message_ref_payload ((kafkatcl_messageRef *)objPtr->internalRep.twoPtrValue.ptr1, &len);
+	size_t i;
+	size_t stringLen = len;
+	char *dst;
+
+	// bytes of 0 and 0x80 and up take two bytes of utf-8
+	for (i = 0; i < len; i++) {
+		if (payload[i] == 0 || payload[i] >= 0x80) {
+			stringLen++;
+		}
+	}
+
+	objPtr->bytes = dst = ckalloc (stringLen + 1);
+	objPtr->length = stringLen;
+
+	if (stringLen == len) {
+		memcpy (dst, payload, len);
+	} else {
+		for (i = 0; i < len; i++) {
+			dst += Tcl_UniCharToUtf (payload[i], dst);
+		}
+	}
+	objPtr->bytes[stringLen] = '\0';
+}
+
+static int
+kafkatcl_payload_SetFromAny (Tcl_Interp *interp, Tcl_Obj *objPtr) {
+	if (interp != NULL) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("can't convert a value to a kafka payload", -1));
+	}
+	return TCL_ERROR;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ *   kafkatcl_NewPayloadObj -- create a Tcl object for the payload of
+ *   a referenced message without copying it.  small payloads are
+ *   cheaper to copy than to keep the fetch buffer around for.
+ *
+ *--------------------------------------------------------------
+ */
+Tcl_Obj *
+kafkatcl_NewPayloadObj (kafkatcl_messageRef *ref) {
+	size_t len;
+	unsigned char *payload = kafkatcl_message_ref_payload (ref, &len);
+	Tcl_Obj *objPtr;
+
+	if (len <= KAFKATCL_PAYLOAD_COPY_MAX) {
+		return Tcl_NewByteArrayObj (payload, (int)len);
+	}
+
+	objPtr = Tcl_NewObj ();
+
+	Tcl_InvalidateStringRep (objPtr);
+	ref->refCount++;
+	objPtr->internalRep.twoPtrValue.ptr1 = ref;
+	objPtr->internalRep.twoPtrValue.ptr2 = NULL;
+	objPtr->typePtr = &kafkatcl_payloadObjType;
+
+	return objPtr;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ *   kafkatcl_message_ref_headers -- return the headers of a referenced
+ *   message, or NULL if it has none
+ *
+ *--------------------------------------------------------------
+ */
+rd_kafka_headers_t *
+kafkatcl_message_ref_headers (kafkatcl_messageRef *ref) {
+	rd_kafka_headers_t *headers = NULL;
+
+	if (ref->rkmessage == NULL) {
+		return ref->detachedHeaders;
+	}
+
+	if (rd_kafka_message_headers (ref->rkmessage, &headers) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		return NULL;
+	}
+
+	return headers;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ *   kafkatcl_NewHeadersObj -- create a list of the header names and
+ *   values of a referenced message, usable as a dict.  the headers are
+ *   copied out so that holding onto them doesn't hold onto the message
+ *   and the buffer librdkafka fetched it in.
+ *
+ *--------------------------------------------------------------
+ */
+Tcl_Obj *
+kafkatcl_NewHeadersObj (kafkatcl_messageRef *ref) {
+	rd_kafka_headers_t *headers = kafkatcl_message_ref_headers (ref);
+	Tcl_Obj *listObj = Tcl_NewObj ();
+
+	if (headers != NULL) {
+		const char *name;
+		const void *value;
+		size_t size;
+		size_t idx;
+
+		for (idx = 0; rd_kafka_header_get_all (headers, idx, &name, &value, &size) == RD_KAFKA_RESP_ERR_NO_ERROR; idx++) {
+			Tcl_ListObjAppendElement (NULL, listObj, Tcl_NewStringObj (name, -1));
+			Tcl_ListObjAppendElement (NULL, listObj, (value != NULL) ? Tcl_NewByteArrayObj (value, size) : Tcl_NewObj ());
+		}
+	}
+
+	return listObj;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ *   kafkatcl_payload_bytes -- get the bytes of a payload to produce.
+ *   a payload we consumed is used as-is rather than being converted
+ *   to a byte array and copied.
+ *
+ *--------------------------------------------------------------
+ */
+unsigned char *
+kafkatcl_payload_bytes (Tcl_Obj *objPtr, int *lenPtr) {
+	if (objPtr->typePtr == &kafkatcl_payloadObjType) {
+		size_t len;
+		unsigned char *payload = kafkatcl_message_ref_payload ((kafkatcl_messageRef *)objPtr->internalRep.twoPtrValue.ptr1, &len);
+
+		*lenPtr = (int)len;
+		return payload;
+	}
+
+	return Tcl_GetByteArrayFromObj (objPtr, lenPtr);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ *   kafkatcl_payload_pin -- get the bytes of a payload to produce
+ *   without librdkafka copying them.  the object is held onto until
+ *   the delivery report for the message comes back, so the bytes
+ *   stay put in the meantime.
+ *
+ *   a payload we consumed is copied into a byte array of our own,
+ *   because the consumer handle it came from has to be able to let
+ *   go of its messages whenever it's deleted.  so is an object anyone
+ *   else holds, since they could shimmer it and free the bytes out
+ *   from under librdkafka.
+ *
+ *   the batch paths ask for a copy always, since a payload they got
+ *   from Tcl_ListObjGetElements has a reference count of one while the
+ *   caller's list can still reach it.  a command argument is different,
+ *   Tcl holds a reference to it for the duration of the command (eval
+ *   of a list copies the list first), so if it isn't shared it really
+ *   is only ours.
+ *
+ * Results:
+ *   returns the held object, to be handed to kafkatcl_produce_opaque_new
+ *   so it's let go of when the message has been delivered.
+ *
+ *--------------------------------------------------------------
+ */
+Tcl_Obj *
+kafkatcl_payload_pin (Tcl_Obj *objPtr, int alwaysCopy, unsigned char **payloadPtr, int *lenPtr) {
+	if (objPtr->typePtr == &kafkatcl_payloadObjType) {
+		int len;
+		unsigned char *payload = kafkatcl_payload_bytes (objPtr, &len);
+
+		objPtr = Tcl_NewByteArrayObj (payload, len);
+	} else if (alwaysCopy || Tcl_IsShared (objPtr)) {
+		objPtr = Tcl_DuplicateObj (objPtr);
+	}
+
+	*payloadPtr = Tcl_GetByteArrayFromObj (objPtr, lenPtr);
+	Tcl_IncrRefCount (objPtr);
+	return objPtr;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ *   kafkatcl_produce_opaque_new -- make the opaque for a message being
+ *   produced.  takes over the reference to a payload returned by
+ *   kafkatcl_payload_pin, if any, and holds references to opaqueObj
+ *   and commandObj.
+ *
+ *   a message with a command gets the next message id of the kafka
+ *   object and is entered into its table of pending completions.
+ *
+ * Results:
+ *   returns NULL if there's nothing to hold onto, so messages without
+ *   any of this cost nothing extra
+ *
+ *--------------------------------------------------------------
+ */
+kafkatcl_produceOpaque *
+kafkatcl_produce_opaque_new (kafkatcl_objectClientData *ko, Tcl_Obj *payloadObj, Tcl_Obj *opaqueObj, Tcl_Obj *commandObj) {
+	kafkatcl_produceOpaque *kpo;
+
+	if (payloadObj == NULL && opaqueObj == NULL && commandObj == NULL) {
+		return NULL;
+	}
+
+	kpo = (kafkatcl_produceOpaque *)ckalloc (sizeof (kafkatcl_produceOpaque));
+	kpo->payloadObj = payloadObj;
+	kpo->opaqueObj = opaqueObj;
+	if (opaqueObj != NULL) {
+		Tcl_IncrRefCount (opaqueObj);
+	}
+
+	kpo->commandObj = commandObj;
+	kpo->id = 0;
+	kpo->pendingEntry = NULL;
+	if (commandObj != NULL) {
+		int new;
+
+		Tcl_IncrRefCount (commandObj);
+		kpo->id = ++ko->nextMessageId;
+		kpo->pendingEntry = Tcl_CreateHashEntry (&ko->pendingCompletions, (char *)&kpo->id, &new);
+		Tcl_SetHashValue (kpo->pendingEntry, kpo);
+	}
+
+	return kpo;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ *   kafkatcl_produce_opaque_release -- let go of the opaque of a
+ *   produced message once its delivery report is in, or when it
+ *   couldn't be produced.  the opaque may be NULL.
+ *
+ *--------------------------------------------------------------
+ */
+void
+kafkatcl_produce_opaque_release (void *opaque) {
+	kafkatcl_produceOpaque *kpo = (kafkatcl_produceOpaque *)opaque;
+
+	if (kpo == NULL) {
+		return;
+	}
+
+	if (kpo->payloadObj != NULL) {
+		Tcl_DecrRefCount (kpo->payloadObj);
+	}
+
+	if (kpo->opaqueObj != NULL) {
+		Tcl_DecrRefCount (kpo->opaqueObj);
+	}
+
+	if (kpo->commandObj != NULL) {
+		Tcl_DecrRefCount (kpo->commandObj);
+	}
+
+	if (kpo->pendingEntry != NULL) {
+		Tcl_DeleteHashEntry (kpo->pendingEntry);
+	}
+
+	ckfree ((char *)kpo);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ *   kafkatcl_message_to_tcl_list -- given a Tcl interpreter,
+ *   and a kafka rd_kafka_message_t message, generate
+ *   a list of key value pairs of the message payload, partition,
+ *   key, offset, timestamp, topic and headers or generate an error
+ *   key-value pair
+ *
+ *   only the fields in the fields mask are included
+ *
+ *   if ref is non-NULL it refers to rdm and the payload object shares
+ *   the message rather than copying the payload
+ *
+ * Results:
+ *     a standard Tcl result
+ *
  * Side effects:
  *      None.
  *
  *--------------------------------------------------------------
  */
 Tcl_Obj *
-kafkatcl_message_to_tcl_list (Tcl_Interp *interp, rd_kafka_message_t *rdm, Tcl_WideInt timestamp, rd_kafka_timestamp_type_t tstype) {
+kafkatcl_message_to_tcl_list (Tcl_Interp *interp, rd_kafka_message_t *rdm, kafkatcl_messageRef *ref, int fields, Tcl_WideInt timestamp, rd_kafka_timestamp_type_t tstype) {
+	kafkatcl_threadData *tsdPtr = kafkatcl_thread_data ();
+	Tcl_Obj **literals = tsdPtr->literals;
 	Tcl_Obj *listObj;
 
 	if (rdm->err == RD_KAFKA_RESP_ERR__PARTITION_EOF) {
@@ -909,60 +1945,62 @@ kafkatcl_message_to_tcl_list (Tcl_Interp *interp, rd_kafka_message_t *rdm, Tcl_W
 #define KAFKATCL_MESSAGE_ERROR_LIST_COUNT 6
 		Tcl_Obj *listObjv[KAFKATCL_MESSAGE_ERROR_LIST_COUNT];
 
-		listObjv[0] = Tcl_NewStringObj ("error", -1);
+		listObjv[0] = literals[KAFKATCL_LIT_ERROR];
 		listObjv[1] = Tcl_NewStringObj (kafkaErrorString, -1);
 
-		listObjv[2] = Tcl_NewStringObj ("code", -1);
+		listObjv[2] = literals[KAFKATCL_LIT_CODE];
 		listObjv[3] = Tcl_NewStringObj (kafkaErrorCodeString, -1);
 
-		listObjv[4] = Tcl_NewStringObj ("message", -1);
+		listObjv[4] = literals[KAFKATCL_LIT_MESSAGE];
 		listObjv[5] = Tcl_NewStringObj (rdm->payload, rdm->len);
 
 		listObj = Tcl_NewListObj (KAFKATCL_MESSAGE_ERROR_LIST_COUNT, listObjv);
 	} else {
-#define KAFKATCL_GOOD_MESSAGE_LIST_COUNT 14
+#define KAFKATCL_GOOD_MESSAGE_LIST_COUNT 16
 		Tcl_Obj *listObjv[KAFKATCL_GOOD_MESSAGE_LIST_COUNT];
 		int i = 0;
 
-		listObjv[i++] = Tcl_NewStringObj ("payload", -1);
-		listObjv[i++] = Tcl_NewByteArrayObj (rdm->payload, rdm->len);
+		if (fields & KAFKATCL_FIELD_PAYLOAD) {
+			listObjv[i++] = literals[KAFKATCL_LIT_PAYLOAD];
+			listObjv[i++] = (ref != NULL) ? kafkatcl_NewPayloadObj (ref) : Tcl_NewByteArrayObj (rdm->payload, rdm->len);
+		}
 
-		listObjv[i++] = Tcl_NewStringObj ("partition", -1);
-		listObjv[i++] = Tcl_NewIntObj (rdm->partition);
+		if (fields & KAFKATCL_FIELD_PARTITION) {
+			listObjv[i++] = literals[KAFKATCL_LIT_PARTITION];
+			listObjv[i++] = Tcl_NewIntObj (rdm->partition);
+		}
 
-		listObjv[i++] = Tcl_NewStringObj ("offset", -1);
-		listObjv[i++] = kafkatcl_NewOffsetObj (rdm->offset);
+		if (fields & KAFKATCL_FIELD_OFFSET) {
+			listObjv[i++] = literals[KAFKATCL_LIT_OFFSET];
+			listObjv[i++] = kafkatcl_NewOffsetObj (rdm->offset);
+		}
 
-		if (tstype != RD_KAFKA_TIMESTAMP_NOT_AVAILABLE) {
-#ifdef TIMESTAMP_DEBUG
-			listObjv[i++] = Tcl_NewStringObj ("timestamp_type", -1);
-			switch (tstype) {
-				case RD_KAFKA_TIMESTAMP_CREATE_TIME:
-					listObjv[i++] = Tcl_NewStringObj ("create_time", -1);
-					break;
-				case RD_KAFKA_TIMESTAMP_LOG_APPEND_TIME:
-					listObjv[i++] = Tcl_NewStringObj ("log_append_time", -1);
-					break;
-				default:
-					listObjv[i++] = Tcl_NewStringObj ("unknown_type", -1);
-			}
-#endif
-			listObjv[i++] = Tcl_NewStringObj ("timestamp", -1);
+		if ((fields & KAFKATCL_FIELD_TIMESTAMP) && tstype != RD_KAFKA_TIMESTAMP_NOT_AVAILABLE) {
+			listObjv[i++] = literals[KAFKATCL_LIT_TIMESTAMP];
 			listObjv[i++] = Tcl_NewWideIntObj (timestamp);
+			listObjv[i++] = literals[KAFKATCL_LIT_TIMESTAMP_TYPE];
+			listObjv[i++] = literals[(tstype == RD_KAFKA_TIMESTAMP_LOG_APPEND_TIME) ? KAFKATCL_LIT_LOG_APPEND_TIME : KAFKATCL_LIT_CREATE_TIME];
 		}
 
 		// include the topic name if there is a topic structure
-		if (rdm->rkt != NULL) {
-			listObjv[i++] = Tcl_NewStringObj ("topic", -1);
-			listObjv[i++] = Tcl_NewStringObj (rd_kafka_topic_name (rdm->rkt), -1);
+		if ((fields & KAFKATCL_FIELD_TOPIC) && rdm->rkt != NULL) {
+			listObjv[i++] = literals[KAFKATCL_LIT_TOPIC];
+			listObjv[i++] = kafkatcl_topic_name_obj (tsdPtr, rd_kafka_topic_name (rdm->rkt));
 		}
 
 		// add the key if there is one
-		if (rdm->key != NULL) {
-			listObjv[i++] = Tcl_NewStringObj ("key", -1);
+		if ((fields & KAFKATCL_FIELD_KEY) && rdm->key != NULL) {
+			listObjv[i++] = literals[KAFKATCL_LIT_KEY];
 			listObjv[i++] = Tcl_NewStringObj (rdm->key, rdm->key_len);
 		}
 
+		// headers are only looked at if the script asks for them, and
+		// left out like the key if the message has none
+		if ((fields & KAFKATCL_FIELD_HEADERS) && ref != NULL && kafkatcl_message_ref_headers (ref) != NULL) {
+			listObjv[i++] = literals[KAFKATCL_LIT_HEADERS];
+			listObjv[i++] = kafkatcl_NewHeadersObj (ref);
+		}
+
 		assert (i <= KAFKATCL_GOOD_MESSAGE_LIST_COUNT);
 
 		listObj = Tcl_NewListObj (i, listObjv);
@@ -971,6 +2009,25 @@ kafkatcl_message_to_tcl_list (Tcl_Interp *interp, rd_kafka_message_t *rdm, Tcl_W
 	return listObj;
 }
 
+/*
+ *--------------------------------------------------------------
+ *
+ *   kafkatcl_message_ref_to_tcl_list -- kafkatcl_message_to_tcl_list
+ *   for a referenced message, sharing its payload
+ *
+ *--------------------------------------------------------------
+ */
+Tcl_Obj *
+kafkatcl_message_ref_to_tcl_list (Tcl_Interp *interp, kafkatcl_messageRef *ref, int fields) {
+	rd_kafka_timestamp_type_t tstype = RD_KAFKA_TIMESTAMP_NOT_AVAILABLE;
+	Tcl_WideInt timestamp = 0;
+
+	if (fields & KAFKATCL_FIELD_TIMESTAMP) {
+		timestamp = rd_kafka_message_timestamp (ref->rkmessage, &tstype);
+	}
+
+	return kafkatcl_message_to_tcl_list (interp, ref->rkmessage, ref, fields, timestamp, tstype);
+}
 
 void
 kafkatcl_unset_error_elements (Tcl_Interp *interp, char *arrayName) {
@@ -985,7 +2042,10 @@ kafkatcl_unset_response_elements (Tcl_Interp *interp, char *arrayName) {
 	Tcl_UnsetVar2 (interp, arrayName, "partition", 0);
 	Tcl_UnsetVar2 (interp, arrayName, "key", 0);
 	Tcl_UnsetVar2 (interp, arrayName, "offset", 0);
+	Tcl_UnsetVar2 (interp, arrayName, "timestamp", 0);
+	Tcl_UnsetVar2 (interp, arrayName, "timestamp_type", 0);
 	Tcl_UnsetVar2 (interp, arrayName, "topic", 0);
+	Tcl_UnsetVar2 (interp, arrayName, "headers", 0);
 }
 
 /*
@@ -999,6 +2059,12 @@ kafkatcl_unset_response_elements (Tcl_Interp *interp, char *arrayName) {
  *   convert a Kafka error into a Tcl error. Otherwise it will return the Kafka
  *   error in the array using the same convention as kafkatcl_message_to_tcl_array
  *
+ *   if ref is non-NULL it refers to rdm and the payload element shares
+ *   the message rather than copying the payload
+ *
+ *   only the fields in the fields mask are set, and the others are
+ *   unset so they don't hold values left from an earlier message
+ *
  * Results:
  *     a standard Tcl result
  *
@@ -1008,7 +2074,7 @@ kafkatcl_unset_response_elements (Tcl_Interp *interp, char *arrayName) {
  *--------------------------------------------------------------
  */
 int
-kafkatcl_message_to_tcl_array (Tcl_Interp *interp, char *arrayName, rd_kafka_message_t *rdm, int failOnKafkaError) {
+kafkatcl_message_to_tcl_array (Tcl_Interp *interp, char *arrayName, rd_kafka_message_t *rdm, kafkatcl_messageRef *ref, int fields, int failOnKafkaError) {
 	if (rdm->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
 		kafkatcl_unset_response_elements (interp, arrayName);
 
@@ -1038,31 +2104,82 @@ kafkatcl_message_to_tcl_array (Tcl_Interp *interp, char *arrayName, rd_kafka_mes
 	} else {
 		kafkatcl_unset_error_elements (interp, arrayName);
 
-		Tcl_Obj *payloadObj = Tcl_NewByteArrayObj (rdm->payload, rdm->len);
-		if (Tcl_SetVar2Ex (interp, arrayName, "payload", payloadObj, (TCL_LEAVE_ERR_MSG)) == NULL) {
-			return TCL_ERROR;
-		}
+		if (fields & KAFKATCL_FIELD_PAYLOAD) {
+			Tcl_Obj *payloadObj = (ref != NULL) ? kafkatcl_NewPayloadObj (ref) : Tcl_NewByteArrayObj (rdm->payload, rdm->len);
+			if (Tcl_SetVar2Ex (interp, arrayName, "payload", payloadObj, (TCL_LEAVE_ERR_MSG)) == NULL) {
+				return TCL_ERROR;
+			}
+		} else {
+			// fields that weren't asked for mustn't keep an earlier message's values
+			Tcl_UnsetVar2 (interp, arrayName, "payload", 0);
+		}
 
-		Tcl_Obj *partitionObj = Tcl_NewIntObj (rdm->partition);
-		if (Tcl_SetVar2Ex (interp, arrayName, "partition", partitionObj, (TCL_LEAVE_ERR_MSG)) == NULL) {
-			return TCL_ERROR;
+		if (fields & KAFKATCL_FIELD_PARTITION) {
+			Tcl_Obj *partitionObj = Tcl_NewIntObj (rdm->partition);
+			if (Tcl_SetVar2Ex (interp, arrayName, "partition", partitionObj, (TCL_LEAVE_ERR_MSG)) == NULL) {
+				return TCL_ERROR;
+			}
+		} else {
+			Tcl_UnsetVar2 (interp, arrayName, "partition", 0);
 		}
 
-		if (rdm->key != NULL) {
+		if ((fields & KAFKATCL_FIELD_KEY) && rdm->key != NULL) {
 			Tcl_Obj *keyObj = Tcl_NewByteArrayObj (rdm->key, rdm->key_len);
 			if (Tcl_SetVar2Ex (interp, arrayName, "key", keyObj, (TCL_LEAVE_ERR_MSG)) == NULL) {
 				return TCL_ERROR;
 			}
+		} else {
+			// don't leave the key of a previous message behind
+			Tcl_UnsetVar2 (interp, arrayName, "key", 0);
 		}
 
-		Tcl_Obj *offsetObj = kafkatcl_NewOffsetObj (rdm->offset);
-		if (Tcl_SetVar2Ex (interp, arrayName, "offset", offsetObj, (TCL_LEAVE_ERR_MSG)) == NULL) {
-			return TCL_ERROR;
+		if (fields & KAFKATCL_FIELD_OFFSET) {
+			Tcl_Obj *offsetObj = kafkatcl_NewOffsetObj (rdm->offset);
+			if (Tcl_SetVar2Ex (interp, arrayName, "offset", offsetObj, (TCL_LEAVE_ERR_MSG)) == NULL) {
+				return TCL_ERROR;
+			}
+		} else {
+			Tcl_UnsetVar2 (interp, arrayName, "offset", 0);
 		}
 
-		Tcl_Obj *topicObj = Tcl_NewStringObj (rd_kafka_topic_name (rdm->rkt), -1);
-		if (Tcl_SetVar2Ex (interp, arrayName, "topic", topicObj, (TCL_LEAVE_ERR_MSG)) == NULL) {
-			return TCL_ERROR;
+		if (fields & KAFKATCL_FIELD_TOPIC) {
+			Tcl_Obj *topicObj = kafkatcl_topic_name_obj (kafkatcl_thread_data (), rd_kafka_topic_name (rdm->rkt));
+			if (Tcl_SetVar2Ex (interp, arrayName, "topic", topicObj, (TCL_LEAVE_ERR_MSG)) == NULL) {
+				return TCL_ERROR;
+			}
+		} else {
+			Tcl_UnsetVar2 (interp, arrayName, "topic", 0);
+		}
+
+		if (fields & KAFKATCL_FIELD_TIMESTAMP) {
+			rd_kafka_timestamp_type_t tstype;
+			Tcl_WideInt timestamp = rd_kafka_message_timestamp (rdm, &tstype);
+
+			if (tstype != RD_KAFKA_TIMESTAMP_NOT_AVAILABLE) {
+				Tcl_Obj **literals = kafkatcl_thread_data ()->literals;
+
+				if (Tcl_SetVar2Ex (interp, arrayName, "timestamp", Tcl_NewWideIntObj (timestamp), (TCL_LEAVE_ERR_MSG)) == NULL) {
+					return TCL_ERROR;
+				}
+
+				if (Tcl_SetVar2Ex (interp, arrayName, "timestamp_type", literals[(tstype == RD_KAFKA_TIMESTAMP_LOG_APPEND_TIME) ? KAFKATCL_LIT_LOG_APPEND_TIME : KAFKATCL_LIT_CREATE_TIME], (TCL_LEAVE_ERR_MSG)) == NULL) {
+					return TCL_ERROR;
+				}
+			} else {
+				Tcl_UnsetVar2 (interp, arrayName, "timestamp", 0);
+				Tcl_UnsetVar2 (interp, arrayName, "timestamp_type", 0);
+			}
+		} else {
+			Tcl_UnsetVar2 (interp, arrayName, "timestamp", 0);
+			Tcl_UnsetVar2 (interp, arrayName, "timestamp_type", 0);
+		}
+
+		if ((fields & KAFKATCL_FIELD_HEADERS) && ref != NULL && kafkatcl_message_ref_headers (ref) != NULL) {
+			if (Tcl_SetVar2Ex (interp, arrayName, "headers", kafkatcl_NewHeadersObj (ref), (TCL_LEAVE_ERR_MSG)) == NULL) {
+				return TCL_ERROR;
+			}
+		} else {
+			Tcl_UnsetVar2 (interp, arrayName, "headers", 0);
 		}
 	}
 
@@ -1171,59 +2288,75 @@ kafkatcl_invoke_callback_with_argument (Tcl_Interp *interp, Tcl_Obj *callbackObj
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_EventSetupProc --
- *    This routine is a required argument to Tcl_CreateEventSource
- *
- *    Since we need to poll librdkafka to get events to fire, let's
- *    make sure we get called periodically
- *
+ * kafkatcl_handle_has_pending --
  *
- * Results:
- *    Our polling routine will get called periodically.
+ *    return true if any of the queues a handle services from the event
+ *    loop have something in them.  This is cheap, so we can afford to
+ *    do it on every pass through the event loop.
  *
  *----------------------------------------------------------------------
  */
-void
-kafkatcl_EventSetupProc (ClientData clientData, int flags) {
-	Tcl_Time time = {0, 100000};
+int
+kafkatcl_handle_has_pending (kafkatcl_handleClientData *kh) {
+	kafkatcl_queueClientData *kq;
 
-	Tcl_SetMaxBlockTime (&time);
+	if (kh->mainEvent != NULL || rd_kafka_queue_length (kh->mainQueue) > 0) {
+		return 1;
+	}
+
+	if (kh->callbackQueue != NULL && rd_kafka_queue_length (kh->callbackQueue) > 0) {
+		return 1;
+	}
+
+	KT_LIST_FOREACH(kq, &kh->ko->queueConsumers, queueConsumerInstance) {
+		if (kq->kh == kh && kq->krc != NULL && rd_kafka_queue_length (kq->rkqu) > 0) {
+			return 1;
+		}
+	}
+
+	return 0;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_EventCheckProc --
- *
- *    This is a function we pass to Tcl_CreateEventSource that is
- *    invoked to see if any events have occurred and to queue them.
- *
- *    rdkafkalib requires that we invoke a poll function to trigger
- *    the kafka-provided callbacks to be invoked.  So we do that.
+ * kafkatcl_writable_note --
  *
- * Results:
- *    The program compiles.
+ *    called after producing to arm the handle's on_writable script
+ *    once the output queue has reached the low-water mark, so that it
+ *    fires when the queue drains back below it
  *
  *----------------------------------------------------------------------
  */
 void
-kafkatcl_EventCheckProc (ClientData clientData, int flags) {
-	kafkatcl_handleClientData *kh = (kafkatcl_handleClientData *)clientData;
-
-    assert (kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
+kafkatcl_writable_note (kafkatcl_handleClientData *kh) {
+	if (kh->writableCallbackObj != NULL && !kh->writablePending && rd_kafka_outq_len (kh->rk) >= kh->writableLowWater) {
+		kh->writablePending = 1;
+	}
+}
 
-	// polling with timeoutMS of 0 is nonblocking, which is ideal
-	rd_kafka_poll (kh->rk, 0);
-	kafkatcl_check_consumer_callbacks (kh->ko);
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_writable_ready --
+ *
+ *    return true if the handle's on_writable script is waiting for
+ *    the output queue to go below the low-water mark and it has
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_writable_ready (kafkatcl_handleClientData *kh) {
+	return kh->writableCallbackObj != NULL && kh->writablePending && rd_kafka_outq_len (kh->rk) < kh->writableLowWater;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_logging_eventProc --
+ * kafkatcl_writable_eventProc --
  *
- *    this routine is called by the Tcl event handler to process logging
- *    callbacks we have gotten from the Kafka cpp-driver
+ *    this routine is called by the Tcl event handler to run the
+ *    on_writable script of a handle
  *
  * Results:
  *    returns 1 to say we handled the event and the dispatcher can delete it
@@ -1231,101 +2364,77 @@ kafkatcl_EventCheckProc (ClientData clientData, int flags) {
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_logging_eventProc (Tcl_Event *tevPtr, int flags) {
-
-	// we got called with a Tcl_Event pointer but really it's a pointer to
-	// our kafkatcl_loggingEvent structure that has the Tcl_Event and
-	// some other stuff that we need.
-	// Go get that.
-
-	kafkatcl_loggingEvent *evPtr = (kafkatcl_loggingEvent *)tevPtr;
-	Tcl_Interp *interp = evPtr->interp;
-#define KAFKATCL_LOG_CALLBACK_LISTCOUNT 6
-
-	Tcl_Obj *listObjv[KAFKATCL_LOG_CALLBACK_LISTCOUNT];
+kafkatcl_writable_eventProc (Tcl_Event *tevPtr, int flags) {
+	kafkatcl_writableEvent *evPtr = (kafkatcl_writableEvent *)tevPtr;
+	kafkatcl_handleClientData *kh = evPtr->kh;
+	Tcl_Interp *interp = kh->interp;
+	Tcl_Obj *scriptObj = kh->writableCallbackObj;
 
-	// probably won't happen but if we get a logging callback and have
-	// no callback object, return 1 saying we handled it and let the
-	// dispatcher delete the message NB this isn't exactly cool
-	if (kafkatcl_loggingCallbackObj == NULL) {
+	// the script may have been removed since the event was queued
+	if (scriptObj == NULL) {
 		return 1;
 	}
 
-	// construct a list of key-value pairs representing the log message
-
-	listObjv[0] = Tcl_NewStringObj ("level", -1);
-	listObjv[1] = Tcl_NewIntObj (evPtr->level);
-
-	listObjv[2] = Tcl_NewStringObj ("facility", -1);
-	listObjv[3] = Tcl_NewStringObj (evPtr->fac, -1);
-
-	listObjv[4] = Tcl_NewStringObj ("message", -1);
-	listObjv[5] = Tcl_NewStringObj (evPtr->buf, -1);
-
-
-	Tcl_Obj *listObj = Tcl_NewListObj (KAFKATCL_LOG_CALLBACK_LISTCOUNT, listObjv);
-
-	ckfree (evPtr->fac);
-	evPtr->fac = NULL;
-
-	ckfree (evPtr->buf);
-	evPtr->buf = NULL;
-
-	// even if this fails we still want the event taken off the queue
-	// this function will do the background error thing if there is a tcl
-	// error running the callback
-	kafkatcl_invoke_callback_with_argument (interp, kafkatcl_loggingCallbackObj, listObj);
-	// tell the dispatcher we handled it.  0 would mean we didn't deal with
-	// it and don't want it removed from the queue
+	// the script may replace itself, so hang onto it while it runs
+	Tcl_Preserve (interp);
+	Tcl_IncrRefCount (scriptObj);
+	if (Tcl_EvalObjEx (interp, scriptObj, TCL_EVAL_GLOBAL) == TCL_ERROR) {
+		Tcl_BackgroundError (interp);
+	}
+	Tcl_DecrRefCount (scriptObj);
+	Tcl_Release (interp);
 	return 1;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_stats_eventProc --
- *
- *    this routine is called by the Tcl event handler to process stats
- *    callbacks we have gotten from the Kafka cpp-driver
+ * kafkatcl_writable_match --
  *
- * Results:
- *    returns 1 to say we handled the event and the dispatcher can delete it
+ *    Tcl_DeleteEvents match function for the on_writable events of a
+ *    handle that's going away
  *
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_stats_eventProc (Tcl_Event *tevPtr, int flags) {
-
-	// we got called with a Tcl_Event pointer but really it's a pointer to
-	// our kafkatcl_statsEvent structure that has the Tcl_Event and
-	// some other stuff that we need.
-	// Go get that.
+kafkatcl_writable_match (Tcl_Event *tevPtr, ClientData clientData) {
+	return tevPtr->proc == kafkatcl_writable_eventProc && ((kafkatcl_writableEvent *)tevPtr)->kh == (kafkatcl_handleClientData *)clientData;
+}
 
-	kafkatcl_statsEvent *evPtr = (kafkatcl_statsEvent *)tevPtr;
-	kafkatcl_objectClientData *ko = evPtr->ko;
-	assert (ko->kafka_object_magic == KAFKA_OBJECT_MAGIC);
-	Tcl_Interp *interp = ko->interp;
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_writable_check --
+ *
+ *    queue an event to run the handle's on_writable script if the
+ *    output queue has drained below the low-water mark.  the script
+ *    then isn't run again until the queue has reached the mark again.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_writable_check (kafkatcl_handleClientData *kh) {
+	kafkatcl_writableEvent *evPtr;
 
-	Tcl_Obj *jsonObj = Tcl_NewStringObj (evPtr->json, evPtr->jsonLen);
+	if (!kafkatcl_writable_ready (kh)) {
+		return;
+	}
 
+	kh->writablePending = 0;
 
-	// even if this fails we still want the event taken off the queue
-	// this function will do the background error thing if there is a tcl
-	// error running the callback
-	kafkatcl_invoke_callback_with_argument (interp, ko->statisticsCallbackObj, jsonObj);
-	free (evPtr->json);
-	// tell the dispatcher we handled it.  0 would mean we didn't deal with
-	// it and don't want it removed from the queue
-	return 1;
+	evPtr = ckalloc (sizeof (kafkatcl_writableEvent));
+	evPtr->event.proc = kafkatcl_writable_eventProc;
+	evPtr->kh = kh;
+	Tcl_QueueEvent ((Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_error_eventProc --
+ * kafkatcl_flush_eventProc --
  *
- *    this routine is called by the Tcl event handler to process error
- *    callbacks we have gotten from the Kafka cpp-driver
+ *    this routine is called by the Tcl event handler to invoke the
+ *    callback of a "flush -async" that has completed
  *
  * Results:
  *    returns 1 to say we handled the event and the dispatcher can delete it
@@ -1333,545 +2442,418 @@ kafkatcl_stats_eventProc (Tcl_Event *tevPtr, int flags) {
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_error_eventProc (Tcl_Event *tevPtr, int flags) {
-
-	// we got called with a Tcl_Event pointer but really it's a pointer to
-	// our kafkatcl_errorEvent structure that has the Tcl_Event and
-	// some other stuff that we need.
-	// Go get that.
-
-	kafkatcl_errorEvent *evPtr = (kafkatcl_errorEvent *)tevPtr;
-	kafkatcl_objectClientData *ko = evPtr->ko;
-	assert (ko->kafka_object_magic == KAFKA_OBJECT_MAGIC);
-	Tcl_Interp *interp = ko->interp;
-	const char *kafkaErrorString = rd_kafka_err2str (evPtr->err);
-	const char *kafkaErrorCodeString = kafkatcl_kafka_error_to_errorcode_string (evPtr->err);
-
-#define KAFKATCL_EVENT_CALLBACK_LISTCOUNT 10
-
-	Tcl_Obj *listObjv[KAFKATCL_EVENT_CALLBACK_LISTCOUNT];
-
-	// construct a list of key-value pairs representing the log message
-
-	// err/reason left here for backwards compatibility,
-	// they should eventually go away
-	listObjv[0] = Tcl_NewStringObj ("err", -1);
-	listObjv[1] = Tcl_NewIntObj (evPtr->err);
-
-	listObjv[2] = Tcl_NewStringObj ("reason", -1);
-	listObjv[3] = Tcl_NewStringObj (evPtr->reason, -1);
-
-	// named for consistency with message callbacks.
-	listObjv[4] = Tcl_NewStringObj ("error", -1);
-	listObjv[5] = Tcl_NewStringObj (kafkaErrorString, -1);
+kafkatcl_flush_eventProc (Tcl_Event *tevPtr, int flags) {
+	kafkatcl_flushEvent *evPtr = (kafkatcl_flushEvent *)tevPtr;
 
-	listObjv[6] = Tcl_NewStringObj ("code", -1);
-	listObjv[7] = Tcl_NewStringObj (kafkaErrorCodeString, -1);
-
-	listObjv[8] = Tcl_NewStringObj ("message", -1);
-	listObjv[9] = Tcl_NewStringObj (evPtr->reason, -1);
-
-	ckfree(evPtr->reason);
-
-	Tcl_Obj *listObj = Tcl_NewListObj (KAFKATCL_EVENT_CALLBACK_LISTCOUNT, listObjv);
-
-	// even if this fails we still want the event taken off the queue
-	// this function will do the background error thing if there is a tcl
-	// error running the callback
-	kafkatcl_invoke_callback_with_argument (interp, ko->errorCallbackObj, listObj);
+	if (!Tcl_InterpDeleted (evPtr->interp)) {
+		kafkatcl_invoke_callback_with_argument (evPtr->interp, evPtr->commandObj, evPtr->reportObj);
+	}
 
-	// tell the dispatcher we handled it.  0 would mean we didn't deal with
-	// it and don't want it removed from the queue
+	Tcl_Release (evPtr->interp);
+	Tcl_DecrRefCount (evPtr->commandObj);
+	Tcl_DecrRefCount (evPtr->reportObj);
 	return 1;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_logging_callback --
- *
- *    this routine is called by the kafka cpp-driver as a callback
- *    when a log message has been received and rd_kafka_set_logger
- *    has been done to register this callback
+ * kafkatcl_flush_complete --
  *
- * Results:
- *    an event is queued to the thread that started our conversation with
- *    kafka
+ *    queue an event to invoke the callback of a "flush -async" with a
+ *    key-value list of err, empty unless err is set, and remaining, the
+ *    number of messages still in the queue, and let go of the waiter
  *
  *----------------------------------------------------------------------
  */
-void kafkatcl_logging_callback (const rd_kafka_t *rk, int level, const char *fac, const char *buf) {
-	kafkatcl_loggingEvent *evPtr;
+void
+kafkatcl_flush_complete (kafkatcl_flushWaiter *waiter, Tcl_Interp *interp, rd_kafka_resp_err_t err, int remaining) {
+	kafkatcl_flushEvent *evPtr;
+	Tcl_Obj *listObjv[4];
 
-	Tcl_Interp *interp = loggingInterp;
+	listObjv[0] = kafkatcl_thread_data ()->literals[KAFKATCL_LIT_ERR];
+	listObjv[1] = (err == RD_KAFKA_RESP_ERR_NO_ERROR) ? Tcl_NewObj () : Tcl_NewStringObj (kafkatcl_kafka_error_to_errorcode_string (err), -1);
+	listObjv[2] = Tcl_NewStringObj ("remaining", -1);
+	listObjv[3] = Tcl_NewIntObj (remaining);
 
-	evPtr = ckalloc (sizeof (kafkatcl_loggingEvent));
-	evPtr->event.proc = kafkatcl_logging_eventProc;
+	evPtr = ckalloc (sizeof (kafkatcl_flushEvent));
+	evPtr->event.proc = kafkatcl_flush_eventProc;
 	evPtr->interp = interp;
+	Tcl_Preserve (interp);
+	evPtr->commandObj = waiter->commandObj;
+	evPtr->reportObj = Tcl_NewListObj (4, listObjv);
+	Tcl_IncrRefCount (evPtr->reportObj);
+	Tcl_QueueEvent ((Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
+
+	// the event takes over the reference to the command
+	KT_LIST_REMOVE (waiter, flushWaiterInstance);
+	ckfree (waiter);
+}
 
-	evPtr->level = level;
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_flush_check --
+ *
+ *    complete the "flush -async" calls of a handle whose output queue
+ *    has emptied or whose timeout has passed, queueing an event to
+ *    invoke each one's callback with a key-value list of err, empty
+ *    if the queue emptied or else RD_KAFKA_RESP_ERR__TIMED_OUT, and
+ *    remaining, the number of messages still in the queue
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_flush_check (kafkatcl_handleClientData *kh) {
+	kafkatcl_flushWaiter *waiter;
+	kafkatcl_flushWaiter *nextWaiter;
+	int remaining;
+	Tcl_WideInt now;
 
-	int len = strlen (fac) + 1;
-	evPtr->fac = ckalloc (len);
-	strncpy (evPtr->fac, fac, len);
+	if (KT_LIST_EMPTY (&kh->flushWaiters)) {
+		return;
+	}
 
-	len = strlen (buf) + 1;
-	evPtr->buf = ckalloc (len);
-	strncpy (evPtr->buf, buf, len);
+	remaining = rd_kafka_outq_len (kh->rk);
+	now = kafkatcl_now_ms ();
 
-	Tcl_ThreadQueueEvent(kafkatcl_loggingCallbackThreadId, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
+	KT_LIST_FOREACH_SAFE (waiter, &kh->flushWaiters, flushWaiterInstance, nextWaiter) {
+		if (remaining > 0 && (waiter->deadline < 0 || now < waiter->deadline)) {
+			continue;
+		}
+
+		kafkatcl_flush_complete (waiter, kh->interp, (remaining == 0) ? RD_KAFKA_RESP_ERR_NO_ERROR : RD_KAFKA_RESP_ERR__TIMED_OUT, remaining);
+	}
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_error_callback --
- *
- *    this routine is called by the kafka cpp-driver as a callback
- *    when an error has been received and rd_kafka_set_error_cb
- *    has been done to register this callback
+ * kafkatcl_flush_max_block_time --
  *
- * Results:
- *    an event is queued to the thread that started our conversation with
- *    kafka
+ *    keep the notifier from blocking past the earliest timeout of the
+ *    "flush -async" calls of a handle, or at all if the output queue is
+ *    already empty, so that they're completed on time
  *
  *----------------------------------------------------------------------
  */
-void kafkatcl_error_callback (rd_kafka_t *rk, int err, const char *reason, void *opaque) {
-	kafkatcl_objectClientData *ko = opaque;
+void
+kafkatcl_flush_max_block_time (kafkatcl_handleClientData *kh) {
+	kafkatcl_flushWaiter *waiter;
+	Tcl_WideInt deadline = -1;
+	Tcl_WideInt wait;
+	Tcl_Time time;
 
-	kafkatcl_errorEvent *evPtr;
+	if (KT_LIST_EMPTY (&kh->flushWaiters)) {
+		return;
+	}
 
-	evPtr = ckalloc (sizeof (kafkatcl_errorEvent));
+	if (rd_kafka_outq_len (kh->rk) == 0) {
+		deadline = 0;
+	} else {
+		KT_LIST_FOREACH (waiter, &kh->flushWaiters, flushWaiterInstance) {
+			if (waiter->deadline >= 0 && (deadline < 0 || waiter->deadline < deadline)) {
+				deadline = waiter->deadline;
+			}
+		}
 
-	evPtr->event.proc = kafkatcl_error_eventProc;
-	evPtr->ko = ko;
-	evPtr->err = err;
+		if (deadline < 0) {
+			return;
+		}
+	}
 
-	int len = strlen (reason) + 1;
-	evPtr->reason = ckalloc (len);
-	strncpy (evPtr->reason, reason, len);
+	wait = deadline - kafkatcl_now_ms ();
+	if (wait < 0) {
+		wait = 0;
+	}
 
-	Tcl_ThreadQueueEvent (ko->threadId, (Tcl_Event *)evPtr, TCL_QUEUE_HEAD);
+	time.sec = wait / 1000;
+	time.usec = (wait % 1000) * 1000;
+	Tcl_SetMaxBlockTime (&time);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_stats_callback --
+ * kafkatcl_EventSetupProc --
+ *    This routine is a required argument to Tcl_CreateEventSource
  *
- *    this routine is called by the kafka cpp-driver as a callback
- *    when a stats message has been received and rd_kafka_set_stats_cb
- *    has been done to register this callback
+ *    librdkafka wakes us through the handle's wakeup pipe when one of
+ *    our queues goes from empty to non-empty, so we only need to keep
+ *    the notifier from blocking if something is already waiting.
  *
  * Results:
- *    an event is queued to the thread that started our conversation with
- *    kafka
+ *    Our polling routine will get called right away if there is work.
  *
  *----------------------------------------------------------------------
  */
-int kafkatcl_stats_callback (rd_kafka_t *rk, char  *json, size_t jsonLen, void *opaque) {
-	kafkatcl_objectClientData *ko = opaque;
-
-	kafkatcl_statsEvent *evPtr;
+void
+kafkatcl_EventSetupProc (ClientData clientData, int flags) {
+	kafkatcl_handleClientData *kh = (kafkatcl_handleClientData *)clientData;
 
-	evPtr = ckalloc (sizeof (kafkatcl_statsEvent));
+    assert (kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
 
-	evPtr->event.proc = kafkatcl_stats_eventProc;
-	evPtr->ko = ko;
-	evPtr->json = json;
-	evPtr->jsonLen = jsonLen;
+	if (kafkatcl_handle_has_pending (kh) || kafkatcl_writable_ready (kh)) {
+		Tcl_Time time = {0, 0};
+		Tcl_SetMaxBlockTime (&time);
+	}
 
-	Tcl_ThreadQueueEvent (ko->threadId, (Tcl_Event *)evPtr, TCL_QUEUE_HEAD);
-	// return 0 == free the json pointer immediately, else return 1
-	return 1;
+	kafkatcl_flush_max_block_time (kh);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_delivery_report_eventProc --
- *
- *    this routine is called by the Tcl event handler to process delivery
- *    report callbacks we have gotten from the Kafka cpp-driver
+ * kafkatcl_handle_serve --
  *
- * Results:
- *    returns 1 to say we handled the event and the dispatcher can delete it
+ *    serve a producer or consumer handle's main queue and then its
+ *    consumer callbacks, both out of the kafka object's budget for one
+ *    pass through the event loop, so that a producer with a lot of
+ *    delivery reports waiting doesn't starve timers and other event
+ *    sources any more than a consumer that's behind does.
  *
  *----------------------------------------------------------------------
  */
-int
-kafkatcl_delivery_report_eventProc (Tcl_Event *tevPtr, int flags) {
-
-	// we got called with a Tcl_Event pointer but really it's a pointer to
-	// our kafkatcl_statsEvent structure that has the Tcl_Event and
-	// some other stuff that we need.
-	// Go get that.
-
-	kafkatcl_deliveryReportEvent *evPtr = (kafkatcl_deliveryReportEvent *)tevPtr;
-	kafkatcl_objectClientData *ko = evPtr->ko;
-	Tcl_Interp *interp = ko->interp;
-
-	// We're not timestamping delivery report events yet, possibly later.
-	Tcl_Obj *listObj = kafkatcl_message_to_tcl_list (interp, &evPtr->rkmessage, 0, RD_KAFKA_TIMESTAMP_NOT_AVAILABLE);
-
-	// free the payload
-	ckfree (evPtr->rkmessage.payload);
+void
+kafkatcl_handle_serve (kafkatcl_handleClientData *kh) {
+	int limit = kh->ko->budgetMessages;
+	Tcl_WideInt deadline = kafkatcl_budget_deadline (kh->ko);
+	int count;
 
-	// free the key if there is one
-	if (evPtr->rkmessage.key != NULL) {
-		ckfree (evPtr->rkmessage.key);
-	}
+	// a timeoutMS of 0 is nonblocking, which is ideal
+	count = kafkatcl_main_queue_serve (kh, 0, limit, deadline);
 
-	// even if this fails we still want the event taken off the queue
-	// this function will do the background error thing if there is a tcl
-	// error running the callback
-	if(listObj) {
-		kafkatcl_invoke_callback_with_argument (interp, ko->deliveryReportCallbackObj, listObj);
+	if (limit > 0 && count >= limit) {
+		return;
 	}
 
-	// tell the dispatcher we handled it.  0 would mean we didn't deal with
-	// it and don't want it removed from the queue
-	return 1;
+	kafkatcl_check_consumer_callbacks (kh, (limit > 0) ? limit - count : 0, deadline);
 }
 
-
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_delivery_report_callback --
+ * kafkatcl_EventCheckProc --
  *
- *    this routine is called by the kafka cpp-driver as a callback
- *    when a delivery report has been received and
- *    rd_kafka_set_dr_msg_cb has been done to register
- *    this callback
+ *    This is a function we pass to Tcl_CreateEventSource that is
+ *    invoked to see if any events have occurred and to queue them.
+ *
+ *    rdkafkalib requires that we serve its queues to get delivery
+ *    reports, errors and statistics out of it.  So we do that.
  *
  * Results:
- *    an event is queued to the thread that set up the callback
+ *    The program compiles.
  *
  *----------------------------------------------------------------------
  */
-void kafkatcl_delivery_report_callback (rd_kafka_t *rk, const rd_kafka_message_t *rkmessage, void *opaque) {
-	kafkatcl_objectClientData *ko = opaque;
-
-    assert (ko->kafka_object_magic == KAFKA_OBJECT_MAGIC);
-
-	if (ko->sampleDeliveryReport) {
-		ko->sampleDeliveryReport = 0;
-	} else if (ko->deliveryReportEvery == 0) {
-		return;
-	} else {
-		if (--ko->deliveryReportCountdown > 0) {
-			return;
-		}
-		ko->deliveryReportCountdown = ko->deliveryReportEvery;
-	}
-
-
-	kafkatcl_deliveryReportEvent *evPtr;
-
-	evPtr = ckalloc (sizeof (kafkatcl_deliveryReportEvent));
-
-	evPtr->event.proc = kafkatcl_delivery_report_eventProc;
-	evPtr->ko = ko;
-
-	// structure copy
-	evPtr->rkmessage = *rkmessage;
+void
+kafkatcl_EventCheckProc (ClientData clientData, int flags) {
+	kafkatcl_handleClientData *kh = (kafkatcl_handleClientData *)clientData;
 
-	// then allocate and copy the payload and possibly the key; we will free
-	// all this in the event handler
-	evPtr->rkmessage.payload = ckalloc (rkmessage->len);
-	memcpy (evPtr->rkmessage.payload, rkmessage->payload, rkmessage->len);
+    assert (kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
 
-	if (rkmessage->key != NULL) {
-		evPtr->rkmessage.key = ckalloc (rkmessage->key_len);
-		memcpy (evPtr->rkmessage.key, rkmessage->key, rkmessage->key_len);
+	if (kafkatcl_handle_has_pending (kh)) {
+		kafkatcl_handle_serve (kh);
 	}
 
-	Tcl_ThreadQueueEvent (ko->threadId, (Tcl_Event *)evPtr, TCL_QUEUE_HEAD);
-	return;
+	kafkatcl_writable_check (kh);
+	kafkatcl_flush_check (kh);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_statistics_callback --
+ * kafkatcl_FileProc --
  *
- *    this routine is called by the kafka cpp-driver as a callback
- *    when a delivery report has been received and rd_kafka_set_stats_cb
- *    has been done to register this callback
+ *    Tcl file handler for a producer or consumer handle's wakeup pipe,
+ *    invoked when librdkafka has put something into one of the queues
+ *    we watch.
  *
  * Results:
- *    an event is queued to the thread that set up the callback
+ *    Kafka callbacks are run and consume callback events are queued.
  *
  *----------------------------------------------------------------------
  */
-void kafkatcl_statistics_callback (rd_kafka_t *rk, char *json, size_t json_len, void *opaque) {
-    kafkatcl_objectClientData *ko = opaque;
-	Tcl_Interp *interp = ko->interp;
-	Tcl_Obj *arg = Tcl_NewStringObj (json, json_len);
+void
+kafkatcl_FileProc (ClientData clientData, int mask) {
+	kafkatcl_handleClientData *kh = (kafkatcl_handleClientData *)clientData;
 
-	kafkatcl_invoke_callback_with_argument (interp, ko->statisticsCallbackObj, arg) ;
+    assert (kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
+
+	kafkatcl_wakeup_drain (kh);
+
+	kafkatcl_handle_serve (kh);
+	kafkatcl_writable_check (kh);
+	kafkatcl_flush_check (kh);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_meta_topic_list --
+ * kafkatcl_wakeup_init --
  *
- *    given a handle client data create a tcl list of all of the topics
- *    and set the interpreter result to it if successful
+ *    create the wakeup pipe for a handle and register its read side
+ *    with the Tcl notifier so that proc is invoked when librdkafka
+ *    signals that one of the watched queues has data.
+ *
+ *    both ends are nonblocking; librdkafka writes from its own threads
+ *    and must never stall on us.
  *
  * Results:
- *    a standard tcl result
+ *    a standard Tcl result
  *
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_meta_topic_list (kafkatcl_handleClientData *kh) {
+kafkatcl_wakeup_init (kafkatcl_handleClientData *kh, Tcl_FileProc *proc) {
 	Tcl_Interp *interp = kh->interp;
-	const struct rd_kafka_metadata *metadata = kh->metadata;
-	int i;
-	Tcl_Obj *listObj = Tcl_NewObj();
-
-	for (i = 0 ; i < metadata->topic_cnt ; i++) {
-		const struct rd_kafka_metadata_topic *t = &metadata->topics[i];
 
-		if (Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj (t->topic, -1)) == TCL_ERROR) {
-			return TCL_ERROR;
-		}
+	if (pipe (kh->wakeupPipe) < 0) {
+		kh->wakeupPipe[0] = kh->wakeupPipe[1] = -1;
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("kafka error: unable to create wakeup pipe: ", -1));
+		Tcl_AppendResult (interp, Tcl_PosixError (interp), NULL);
+		return TCL_ERROR;
 	}
-	Tcl_SetObjResult (interp, listObj);
+
+	fcntl (kh->wakeupPipe[0], F_SETFL, fcntl (kh->wakeupPipe[0], F_GETFL) | O_NONBLOCK);
+	fcntl (kh->wakeupPipe[1], F_SETFL, fcntl (kh->wakeupPipe[1], F_GETFL) | O_NONBLOCK);
+	fcntl (kh->wakeupPipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl (kh->wakeupPipe[1], F_SETFD, FD_CLOEXEC);
+
+	Tcl_CreateFileHandler (kh->wakeupPipe[0], TCL_READABLE, proc, (ClientData) kh);
 	return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_meta_find_topic --
- *
- *    given a handle client data and a topic name,
- *    return the matching const struct rd_kafka_metadata_topic *
- *    pointer or NULL if none is found
+ * kafkatcl_wakeup_watch_queue --
  *
- * Results:
- *    the matching const struct rd_kafka_metadata_topic * or NULL
+ *    ask librdkafka to write to the handle's wakeup pipe whenever
+ *    the queue goes from empty to non-empty.  Passing a NULL kh
+ *    stops watching the queue.
  *
  *----------------------------------------------------------------------
  */
-const struct rd_kafka_metadata_topic *
-kafkatcl_meta_find_topic (kafkatcl_handleClientData *kh, char *topic) {
-	const struct rd_kafka_metadata *metadata = kh->metadata;
-	int i;
-
-	for (i = 0 ; i < metadata->topic_cnt ; i++) {
-		const struct rd_kafka_metadata_topic *t = &metadata->topics[i];
-
-		if (strcmp (t->topic, topic) == 0) {
-			return t;
-		}
+void
+kafkatcl_wakeup_watch_queue (kafkatcl_handleClientData *kh, rd_kafka_queue_t *rkqu) {
+	if (kh == NULL) {
+		rd_kafka_queue_io_event_enable (rkqu, -1, NULL, 0);
+	} else {
+		rd_kafka_queue_io_event_enable (rkqu, kh->wakeupPipe[1], "1", 1);
 	}
-
-	return NULL;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_meta_find_topic_tcl_result --
- *
- *    given a handle client data and a topic name,
- *    set the passed-in const struct rd_kafka_metadata_topic *
- *    to the matching metadata topic structure or to NULL if none is found
- *
- *    Set an error message into the Tcl interpreter if there is an
- *    error and return TCL_OK if the topic was found or TCL_ERROR if
- *    it wasn't
+ * kafkatcl_wakeup_drain --
  *
- * Results:
- *    A standard Tcl result
+ *    consume whatever librdkafka has written to the wakeup pipe so the
+ *    notifier doesn't keep reporting it readable.
  *
  *----------------------------------------------------------------------
  */
-int
-kafkatcl_meta_find_topic_tcl_result (kafkatcl_handleClientData *kh, char *topicName, const struct rd_kafka_metadata_topic **topicPtr) {
-	const struct rd_kafka_metadata *metadata = kh->metadata;
-	int i;
-	Tcl_Interp *interp = kh->interp;
-
-	for (i = 0 ; i < metadata->topic_cnt ; i++) {
-		const struct rd_kafka_metadata_topic *t = &metadata->topics[i];
+void
+kafkatcl_wakeup_drain (kafkatcl_handleClientData *kh) {
+	char buf[64];
 
-		if (strcmp (t->topic, topicName) == 0) {
-			*topicPtr = t;
-			return TCL_OK;
-		}
+	while (read (kh->wakeupPipe[0], buf, sizeof buf) > 0) {
+		continue;
 	}
-
-	*topicPtr = NULL;
-	Tcl_ResetResult (interp);
-	Tcl_AppendResult (interp, "kafka error: topic '", topicName, "' not found", NULL);
-	return TCL_ERROR;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_meta_topic_partitions --
- *
- *    given a handle client data and a topic name,
- *    set the interpreter result to the number of partitions
- *    covering that topic if successful
+ * kafkatcl_wakeup_cleanup --
  *
- * Results:
- *    a standard tcl result
+ *    unregister and close the wakeup pipe.  Any queues being watched
+ *    must have been unwatched first.
  *
  *----------------------------------------------------------------------
  */
-int
-kafkatcl_meta_topic_partitions (kafkatcl_handleClientData *kh, char *topic) {
-	const struct rd_kafka_metadata_topic *t;
-	Tcl_Interp *interp = kh->interp;
-
-	if (kafkatcl_meta_find_topic_tcl_result (kh, topic, &t) == TCL_ERROR) {
-		return TCL_ERROR;
+void
+kafkatcl_wakeup_cleanup (kafkatcl_handleClientData *kh) {
+	if (kh->wakeupPipe[0] < 0) {
+		return;
 	}
-	Tcl_SetObjResult (interp, Tcl_NewIntObj (t->partition_cnt));
-	return TCL_OK;
+
+	Tcl_DeleteFileHandler (kh->wakeupPipe[0]);
+	close (kh->wakeupPipe[0]);
+	close (kh->wakeupPipe[1]);
+	kh->wakeupPipe[0] = kh->wakeupPipe[1] = -1;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_meta_broker_list --
+ * kafkatcl_logging_eventProc --
  *
- *    given a handle client data create a tcl list of all of the brokers
- *    and set the interpreter result to it if successful
+ *    this routine is called by the Tcl event handler to process logging
+ *    callbacks we have gotten from the Kafka cpp-driver
  *
  * Results:
- *    a standard tcl result
+ *    returns 1 to say we handled the event and the dispatcher can delete it
  *
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_meta_broker_list (kafkatcl_handleClientData *kh) {
-	Tcl_Interp *interp = kh->interp;
-	const struct rd_kafka_metadata *metadata = kh->metadata;
-	int i;
-	Tcl_Obj *listObj = Tcl_NewObj();
-	struct rd_kafka_metadata_broker *broker;
+kafkatcl_logging_eventProc (Tcl_Event *tevPtr, int flags) {
 
-#define BROKER_STRING_FORMAT "%s:%d"
+	// we got called with a Tcl_Event pointer but really it's a pointer to
+	// our kafkatcl_loggingEvent structure that has the Tcl_Event and
+	// some other stuff that we need.
+	// Go get that.
 
-	for (i = 0 ; i < metadata->broker_cnt ; i++) {
-		broker = &metadata->brokers[i];
-		// figure out the size of the string we need
-		int brokerStringLength = snprintf (NULL, 0, BROKER_STRING_FORMAT, broker->host, broker->port) + 1;
-		char *brokerString = ckalloc (brokerStringLength);
-		snprintf (brokerString, brokerStringLength, BROKER_STRING_FORMAT, broker->host, broker->port);
+	kafkatcl_loggingEvent *evPtr = (kafkatcl_loggingEvent *)tevPtr;
+	Tcl_Interp *interp = evPtr->interp;
+#define KAFKATCL_LOG_CALLBACK_LISTCOUNT 6
 
-		if (Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj (brokerString, brokerStringLength)) == TCL_ERROR) {
-			ckfree (brokerString);
-			return TCL_ERROR;
-		}
-		ckfree (brokerString);
-	}
-	Tcl_SetObjResult (interp, listObj);
-	return TCL_OK;
-}
-
-/*
- *----------------------------------------------------------------------
- *
- * kafkatcl_refresh_metadata --
- *
- *    fetch the metadata into our kafkatcl_handleClientData structure
- *
- * Results:
- *    a standard tcl result
- *
- *----------------------------------------------------------------------
- */
-int
-kafkatcl_refresh_metadata (kafkatcl_handleClientData *kh) {
-	Tcl_Interp *interp = kh->interp;
-	rd_kafka_t *rk = kh->rk;
-
-	// destroy metadata if it exists
-	if (kh->metadata != NULL) {
-		rd_kafka_metadata_destroy (kh->metadata);
-		kh->metadata = NULL;
-	}
-
-	rd_kafka_resp_err_t err = rd_kafka_metadata (rk, 1, NULL, &kh->metadata, 5000);
+	Tcl_Obj *listObjv[KAFKATCL_LOG_CALLBACK_LISTCOUNT];
 
-	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
-		return kafkatcl_kafka_error_to_tcl (interp, err, "failed to acquire metadata");
+	// probably won't happen but if we get a logging callback and have
+	// no callback object, return 1 saying we handled it and let the
+	// dispatcher delete the message NB this isn't exactly cool
+	if (kafkatcl_loggingCallbackObj == NULL) {
+		return 1;
 	}
 
-	return TCL_OK;
-}
-
-static void
-metadata_print (const char *topic, const struct rd_kafka_metadata *metadata) {
-	int i, j, k;
-
-	printf("Metadata for %s (from broker %"PRId32": %s):\n",
-	   topic ? : "all topics",
-	   metadata->orig_broker_id,
-	   metadata->orig_broker_name);
+	// construct a list of key-value pairs representing the log message
 
+	listObjv[0] = Tcl_NewStringObj ("level", -1);
+	listObjv[1] = Tcl_NewIntObj (evPtr->level);
 
-	/* Iterate brokers */
-	printf(" %i brokers:\n", metadata->broker_cnt);
-	for (i = 0 ; i < metadata->broker_cnt ; i++)
-		printf("  broker %"PRId32" at %s:%i\n", metadata->brokers[i].id, metadata->brokers[i].host, metadata->brokers[i].port);
+	listObjv[2] = Tcl_NewStringObj ("facility", -1);
+	listObjv[3] = Tcl_NewStringObj (evPtr->fac, -1);
 
-	/* Iterate topics */
-	printf(" %i topics:\n", metadata->topic_cnt);
-	for (i = 0 ; i < metadata->topic_cnt ; i++) {
-		const struct rd_kafka_metadata_topic *t = &metadata->topics[i];
+	listObjv[4] = Tcl_NewStringObj ("message", -1);
+	listObjv[5] = Tcl_NewStringObj (evPtr->buf, -1);
 
-		printf("  topic \"%s\" with %i partitions:", t->topic, t->partition_cnt);
-		if (t->err) {
-			printf(" %s", rd_kafka_err2str(t->err));
-			if (t->err == RD_KAFKA_RESP_ERR_LEADER_NOT_AVAILABLE)
-				printf(" (try again)");
-		}
-		printf("\n");
 
-		/* Iterate topic's partitions */
-		for (j = 0 ; j < t->partition_cnt ; j++) {
-			const struct rd_kafka_metadata_partition *p;
-			p = &t->partitions[j];
-			printf("    partition %"PRId32", " "leader %"PRId32", replicas: ", p->id, p->leader);
+	Tcl_Obj *listObj = Tcl_NewListObj (KAFKATCL_LOG_CALLBACK_LISTCOUNT, listObjv);
 
-			/* Iterate partition's replicas */
-			for (k = 0 ; k < p->replica_cnt ; k++) {
-				printf("%s%"PRId32, k > 0 ? ",":"", p->replicas[k]);
-			}
+	ckfree (evPtr->fac);
+	evPtr->fac = NULL;
 
-			/* Iterate partition's ISRs */
-			printf(", isrs: ");
+	ckfree (evPtr->buf);
+	evPtr->buf = NULL;
 
-			for (k = 0 ; k < p->isr_cnt ; k++) {
-				printf("%s%"PRId32, k > 0 ? ",":"", p->isrs[k]);
-				if (p->err) {
-					printf(", %s\n", rd_kafka_err2str(p->err));
-				} else {
-					printf("\n");
-				}
-			}
-		}
-	}
+	// even if this fails we still want the event taken off the queue
+	// this function will do the background error thing if there is a tcl
+	// error running the callback
+	kafkatcl_invoke_callback_with_argument (interp, kafkatcl_loggingCallbackObj, listObj);
+	// tell the dispatcher we handled it.  0 would mean we didn't deal with
+	// it and don't want it removed from the queue
+	return 1;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_consume_callback_eventProc --
+ * kafkatcl_stats_eventProc --
  *
- *    this routine is called by the Tcl event handler to process consume
+ *    this routine is called by the Tcl event handler to process stats
  *    callbacks we have gotten from the Kafka cpp-driver
  *
  * Results:
@@ -1880,34 +2862,26 @@ metadata_print (const char *topic, const struct rd_kafka_metadata *metadata) {
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_consume_callback_eventProc (Tcl_Event *tevPtr, int flags) {
+kafkatcl_stats_eventProc (Tcl_Event *tevPtr, int flags) {
 
 	// we got called with a Tcl_Event pointer but really it's a pointer to
 	// our kafkatcl_statsEvent structure that has the Tcl_Event and
 	// some other stuff that we need.
 	// Go get that.
 
-	kafkatcl_consumeCallbackEvent *evPtr = (kafkatcl_consumeCallbackEvent *)tevPtr;
-	kafkatcl_runningConsumer *krc = evPtr->krc;
-
-	assert (krc->kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
+	kafkatcl_statsEvent *evPtr = (kafkatcl_statsEvent *)tevPtr;
+	kafkatcl_objectClientData *ko = evPtr->ko;
+	assert (ko->kafka_object_magic == KAFKA_OBJECT_MAGIC);
+	Tcl_Interp *interp = ko->interp;
 
-	Tcl_Interp *interp = krc->kh->interp;
+	Tcl_Obj *jsonObj = Tcl_NewStringObj (evPtr->json, evPtr->jsonLen);
 
-	Tcl_Obj *listObj = kafkatcl_message_to_tcl_list (interp, &evPtr->rkmessage, evPtr->timestamp, evPtr->timestamp_type);
 
 	// even if this fails we still want the event taken off the queue
 	// this function will do the background error thing if there is a tcl
 	// error running the callback
-
-	if (listObj != NULL) {
-		kafkatcl_invoke_callback_with_argument (interp, krc->callbackObj, listObj);
-		// danger: no longer safe to touch krc from here onwards, the callback may have freed it!
-	}
-
-	// the payload and key were allocated directly into the event,
-	// so no need to separately free them
-
+	kafkatcl_invoke_callback_with_argument (interp, ko->statisticsCallbackObj, jsonObj);
+	free (evPtr->json);
 	// tell the dispatcher we handled it.  0 would mean we didn't deal with
 	// it and don't want it removed from the queue
 	return 1;
@@ -1916,10 +2890,10 @@ kafkatcl_consume_callback_eventProc (Tcl_Event *tevPtr, int flags) {
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_consume_callback_queue_eventProc --
+ * kafkatcl_error_eventProc --
  *
- *    this routine is called by the Tcl event handler to process consume
- *    callbacks we have gotten for queues from the Kafka cpp-driver
+ *    this routine is called by the Tcl event handler to process error
+ *    callbacks we have gotten from the Kafka cpp-driver
  *
  * Results:
  *    returns 1 to say we handled the event and the dispatcher can delete it
@@ -1927,33 +2901,52 @@ kafkatcl_consume_callback_eventProc (Tcl_Event *tevPtr, int flags) {
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_consume_callback_queue_eventProc (Tcl_Event *tevPtr, int flags) {
+kafkatcl_error_eventProc (Tcl_Event *tevPtr, int flags) {
 
 	// we got called with a Tcl_Event pointer but really it's a pointer to
-	// our kafkatcl_statsEvent structure that has the Tcl_Event and
+	// our kafkatcl_errorEvent structure that has the Tcl_Event and
 	// some other stuff that we need.
 	// Go get that.
 
-	kafkatcl_consumeCallbackEvent *evPtr = (kafkatcl_consumeCallbackEvent *)tevPtr;
-	kafkatcl_runningConsumer *krc = evPtr->krc;
+	kafkatcl_errorEvent *evPtr = (kafkatcl_errorEvent *)tevPtr;
+	kafkatcl_objectClientData *ko = evPtr->ko;
+	assert (ko->kafka_object_magic == KAFKA_OBJECT_MAGIC);
+	Tcl_Interp *interp = ko->interp;
+	const char *kafkaErrorString = rd_kafka_err2str (evPtr->err);
+	const char *kafkaErrorCodeString = kafkatcl_kafka_error_to_errorcode_string (evPtr->err);
 
-	assert (krc->kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
+#define KAFKATCL_EVENT_CALLBACK_LISTCOUNT 10
 
-	Tcl_Interp *interp = krc->kh->interp;
+	Tcl_Obj *listObjv[KAFKATCL_EVENT_CALLBACK_LISTCOUNT];
+
+	// construct a list of key-value pairs representing the log message
+
+	// err/reason left here for backwards compatibility,
+	// they should eventually go away
+	listObjv[0] = Tcl_NewStringObj ("err", -1);
+	listObjv[1] = Tcl_NewIntObj (evPtr->err);
+
+	listObjv[2] = Tcl_NewStringObj ("reason", -1);
+	listObjv[3] = Tcl_NewStringObj (evPtr->reason, -1);
+
+	// named for consistency with message callbacks.
+	listObjv[4] = Tcl_NewStringObj ("error", -1);
+	listObjv[5] = Tcl_NewStringObj (kafkaErrorString, -1);
+
+	listObjv[6] = Tcl_NewStringObj ("code", -1);
+	listObjv[7] = Tcl_NewStringObj (kafkaErrorCodeString, -1);
+
+	listObjv[8] = Tcl_NewStringObj ("message", -1);
+	listObjv[9] = Tcl_NewStringObj (evPtr->reason, -1);
+
+	ckfree(evPtr->reason);
 
-	Tcl_Obj *listObj = kafkatcl_message_to_tcl_list (interp, &evPtr->rkmessage, evPtr->timestamp, evPtr->timestamp_type);
+	Tcl_Obj *listObj = Tcl_NewListObj (KAFKATCL_EVENT_CALLBACK_LISTCOUNT, listObjv);
 
 	// even if this fails we still want the event taken off the queue
 	// this function will do the background error thing if there is a tcl
 	// error running the callback
-	if (listObj != NULL) {
-		// free the payload
-		kafkatcl_invoke_callback_with_argument (interp, krc->callbackObj, listObj);
-		// danger: no longer safe to touch krc from here onwards, the callback may have freed it!
-	}
-
-	// the payload and key were allocated directly into the event,
-	// so no need to separately free them
+	kafkatcl_invoke_callback_with_argument (interp, ko->errorCallbackObj, listObj);
 
 	// tell the dispatcher we handled it.  0 would mean we didn't deal with
 	// it and don't want it removed from the queue
@@ -1963,1298 +2956,6034 @@ kafkatcl_consume_callback_queue_eventProc (Tcl_Event *tevPtr, int flags) {
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_consume_callback --
+ * kafkatcl_logging_callback --
  *
  *    this routine is called by the kafka cpp-driver as a callback
- *    designated by a call to rd_kafka_consume_callback to specify
- *    a routine to be called when messages are available from a
- *    topic consumer or queue
+ *    when a log message has been received and rd_kafka_set_logger
+ *    has been done to register this callback
  *
  * Results:
- *    an event is queued to the thread that set up the callback
+ *    an event is queued to the thread that started our conversation with
+ *    kafka
  *
  *----------------------------------------------------------------------
  */
+void kafkatcl_logging_callback (const rd_kafka_t *rk, int level, const char *fac, const char *buf) {
+	kafkatcl_loggingEvent *evPtr;
 
-void
-kafkatcl_consume_callback (rd_kafka_message_t *rkmessage, void *opaque) {
-	kafkatcl_runningConsumer *krc = opaque;
-	kafkatcl_consumeCallbackEvent *evPtr;
-	char *extraSpace;
-
-	// Tcl_DeleteEvents() will free the whole event and not give us a chance to do our own
-	// frees, so allocate just a single block for everything we need
-	evPtr = ckalloc (sizeof (kafkatcl_consumeCallbackEvent) + rkmessage->len + rkmessage->key_len);
-	extraSpace = (char*) (evPtr + 1);
-
-	evPtr->krc = krc;
+	Tcl_Interp *interp = loggingInterp;
 
-	if (krc->kq == NULL) {
-		evPtr->event.proc = kafkatcl_consume_callback_eventProc;
-	} else {
-		evPtr->event.proc = kafkatcl_consume_callback_queue_eventProc;
-	}
+	evPtr = ckalloc (sizeof (kafkatcl_loggingEvent));
+	evPtr->event.proc = kafkatcl_logging_eventProc;
+	evPtr->interp = interp;
 
-	// Get the timestamp if any.
-	evPtr->timestamp = rd_kafka_message_timestamp(rkmessage, &evPtr->timestamp_type);
+	evPtr->level = level;
 
-	// structure copy
-	evPtr->rkmessage = *rkmessage;
+	int len = strlen (fac) + 1;
+	evPtr->fac = ckalloc (len);
+	strncpy (evPtr->fac, fac, len);
 
-	// then copy the payload and possibly the key into the previously allocated block
-	evPtr->rkmessage.payload = extraSpace;
-	memcpy (evPtr->rkmessage.payload, rkmessage->payload, rkmessage->len);
-	extraSpace += rkmessage->len;
+	len = strlen (buf) + 1;
+	evPtr->buf = ckalloc (len);
+	strncpy (evPtr->buf, buf, len);
 
-	if (rkmessage->key != NULL) {
-		evPtr->rkmessage.key = extraSpace;
-		memcpy (evPtr->rkmessage.key, rkmessage->key, rkmessage->key_len);
-	}
+	Tcl_ThreadQueueEvent(kafkatcl_loggingCallbackThreadId, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
 
-	Tcl_ThreadQueueEvent (krc->kh->threadId, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
-	return;
+	// we're on a librdkafka thread, make sure the Tcl thread wakes up
+	Tcl_ThreadAlert(kafkatcl_loggingCallbackThreadId);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_set_conf --
- *
- *    given an object client data and a topic config var and value,
- *		set the topic configuration property
+ * kafkatcl_error_callback --
  *
- *    returns an error if rd_kafka_conf_set returns an error
+ *    this routine is called by kafkatcl_main_queue_serve for each
+ *    error event librdkafka hands us
  *
  * Results:
- *    a standard tcl result
+ *    an event is queued to the thread that started our conversation with
+ *    kafka
  *
  *----------------------------------------------------------------------
  */
-int
-kafkatcl_set_conf (kafkatcl_objectClientData *ko, char *name, char *value) {
-	Tcl_Interp *interp = ko->interp;
-	char errStr[256];
+void kafkatcl_error_callback (rd_kafka_t *rk, int err, const char *reason, void *opaque) {
+	kafkatcl_objectClientData *ko = opaque;
 
-	rd_kafka_conf_res_t res = rd_kafka_conf_set (ko->conf, name, value, errStr, sizeof(errStr));
+	kafkatcl_errorEvent *evPtr;
 
-	if (res != RD_KAFKA_CONF_OK) {
-		Tcl_SetObjResult (interp, Tcl_NewStringObj (errStr, -1));
-		return TCL_ERROR;
-	}
-	return TCL_OK;
+	evPtr = ckalloc (sizeof (kafkatcl_errorEvent));
+
+	evPtr->event.proc = kafkatcl_error_eventProc;
+	evPtr->ko = ko;
+	evPtr->err = err;
+
+	int len = strlen (reason) + 1;
+	evPtr->reason = ckalloc (len);
+	strncpy (evPtr->reason, reason, len);
+
+	Tcl_ThreadQueueEvent (ko->threadId, (Tcl_Event *)evPtr, ko->eventPosition[KAFKATCL_EVENT_ERROR]);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_set_topic_conf --
- *
- *    given an object client data and a topic config var and value,
- *		set the topic configuration property
+ * kafkatcl_stats_callback --
  *
- *    returns an error if rd_kafka_topic_conf_set returns an error
+ *    this routine is called by kafkatcl_main_queue_serve for each
+ *    statistics event librdkafka hands us, with a copy of the json that
+ *    we take over
  *
  * Results:
- *    a standard tcl result
+ *    an event is queued to the thread that started our conversation with
+ *    kafka
  *
  *----------------------------------------------------------------------
  */
-int
-kafkatcl_set_topic_conf (Tcl_Interp *interp, rd_kafka_topic_conf_t *topicConf, char *name, char *value) {
-	char errStr[256];
+int kafkatcl_stats_callback (rd_kafka_t *rk, char  *json, size_t jsonLen, void *opaque) {
+	kafkatcl_objectClientData *ko = opaque;
 
-	rd_kafka_conf_res_t res = rd_kafka_topic_conf_set (topicConf, name, value, errStr, sizeof(errStr));
+	kafkatcl_statsEvent *evPtr;
 
-	if (res != RD_KAFKA_CONF_OK) {
-		Tcl_SetObjResult (interp, Tcl_NewStringObj (errStr, -1));
-		return TCL_ERROR;
-	}
-	return TCL_OK;
+	evPtr = ckalloc (sizeof (kafkatcl_statsEvent));
+
+	evPtr->event.proc = kafkatcl_stats_eventProc;
+	evPtr->ko = ko;
+	evPtr->json = json;
+	evPtr->jsonLen = jsonLen;
+
+	Tcl_ThreadQueueEvent (ko->threadId, (Tcl_Event *)evPtr, ko->eventPosition[KAFKATCL_EVENT_STATISTICS]);
+	// return 0 == free the json pointer immediately, else return 1
+	return 1;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_handle_topic_conf --
- *
- *    given an object client data and a topic config var and value,
- *		set the topic configuration property
+ * kafkatcl_delivery_report_eventProc --
  *
- *    returns an error if rd_kafka_topic_conf_set returns an error
+ *    this routine is called by the Tcl event handler to process delivery
+ *    report callbacks we have gotten from the Kafka cpp-driver
  *
  * Results:
- *    a standard tcl result
+ *    returns 1 to say we handled the event and the dispatcher can delete it
  *
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_handle_topic_conf (Tcl_Interp *interp, rd_kafka_topic_conf_t *topicConf, int objc, Tcl_Obj *CONST objv[]) {
-	if (objc % 2 != 0) {
-		Tcl_WrongNumArgs (interp, 2, objv, "?name value ...?");
-		return TCL_ERROR;
-	}
+kafkatcl_delivery_report_eventProc (Tcl_Event *tevPtr, int flags) {
 
-	if (objc == 0) {
-		return kafkatcl_topic_conf_to_list (interp, topicConf);
-	}
+	// we got called with a Tcl_Event pointer but really it's a pointer to
+	// our kafkatcl_statsEvent structure that has the Tcl_Event and
+	// some other stuff that we need.
+	// Go get that.
 
-	int i;
-	int resultCode = TCL_OK;
-	for (i = 0; i < objc; i += 2) {
-		char *name = Tcl_GetString (objv[i]);
-		char *value = Tcl_GetString (objv[i + 1]);
+	kafkatcl_deliveryReportEvent *evPtr = (kafkatcl_deliveryReportEvent *)tevPtr;
+	kafkatcl_objectClientData *ko = evPtr->ko;
+	Tcl_Interp *interp = ko->interp;
 
-		resultCode = kafkatcl_set_topic_conf (interp, topicConf, name, value);
+	// We're not timestamping delivery report events yet, possibly later.
+	Tcl_Obj *listObj = kafkatcl_message_to_tcl_list (interp, &evPtr->rkmessage, NULL, KAFKATCL_FIELDS_DEFAULT, 0, RD_KAFKA_TIMESTAMP_NOT_AVAILABLE);
 
-		if (resultCode == TCL_ERROR) {
-			break;
-		}
+	// free the payload
+	ckfree (evPtr->rkmessage.payload);
+
+	// free the key if there is one
+	if (evPtr->rkmessage.key != NULL) {
+		ckfree (evPtr->rkmessage.key);
 	}
-	return resultCode;
+
+	// even if this fails we still want the event taken off the queue
+	// this function will do the background error thing if there is a tcl
+	// error running the callback
+	if(listObj) {
+		kafkatcl_invoke_callback_with_argument (interp, ko->deliveryReportCallbackObj, listObj);
+	}
+
+	// tell the dispatcher we handled it.  0 would mean we didn't deal with
+	// it and don't want it removed from the queue
+	return 1;
 }
 
+
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_partitioner_conf --
- *
- *    given an object client data and a topic config structure,
- *    parse the partitioner name and set the partitioner into
- *    the topic conf if it can be figured out
+ * kafkatcl_delivery_report_sampling_init --
  *
- * Results:
- *    a standard tcl result
+ *    set delivery report sampling to its defaults, which is to call
+ *    back for every report
  *
  *----------------------------------------------------------------------
  */
-int
-kafkatcl_partitioner_conf (Tcl_Interp *interp, rd_kafka_topic_conf_t *topicConf, int objc, Tcl_Obj *CONST objv[]) {
-	int suboptIndex;
-
-	static CONST char *subOptions[] = {
-		"random",
-		"consistent",
-		NULL
-	};
-
-	enum subOptions {
-		SUBOPT_RANDOM_PARTITIONER,
-		SUBOPT_CONSISTENT_PARTITIONER,
-	};
-
-	// argument must be one of the subOptions defined above
-	if (Tcl_GetIndexFromObj (interp, objv[0], subOptions, "suboption",
-		TCL_EXACT, &suboptIndex) != TCL_OK) {
-		return TCL_ERROR;
-	}
-
-	switch ((enum subOptions) suboptIndex) {
-		case SUBOPT_RANDOM_PARTITIONER: {
-			rd_kafka_topic_conf_set_partitioner_cb (topicConf, rd_kafka_msg_partitioner_random);
-			break;
-		}
-
-		case SUBOPT_CONSISTENT_PARTITIONER: {
-			rd_kafka_topic_conf_set_partitioner_cb (topicConf, rd_kafka_msg_partitioner_consistent);
-			break;
-		}
-
-	}
-	return TCL_OK;
+void
+kafkatcl_delivery_report_sampling_init (kafkatcl_deliveryReportSampling *drs) {
+	drs->sampleNext = 0;
+	drs->every = 1;
+	drs->countdown = 0;
+	drs->policy = KAFKATCL_DR_POLICY_ALL;
+	drs->delivered = 0;
+	drs->failed = 0;
+	drs->sampled = 0;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_handle_topic_info --
+ * kafkatcl_delivery_report_topic_sampling --
  *
- *    given a pointer to a topic client data and an objc and objv for
- *    a topic producer or topic consumer object, handle the "info"
- *    suboption for that topic consumer or producer
+ *    find the delivery report sampling a topic has of its own.  if it
+ *    has none and create is set, give it some, starting from the kafka
+ *    object's settings.
  *
  * Results:
- *    a standard tcl result
+ *    the topic's sampling, or NULL if it has none and create isn't set
  *
  *----------------------------------------------------------------------
  */
-int
-kafkatcl_handle_topic_info (Tcl_Interp *interp, kafkatcl_topicClientData *kt, int objc, Tcl_Obj *CONST objv[]) {
-	int suboptIndex;
-
-	if ((objc < 3) || (objc > 4)) {
-		Tcl_WrongNumArgs (interp, 2, objv, "option");
-		return TCL_ERROR;
+kafkatcl_deliveryReportSampling *
+kafkatcl_delivery_report_topic_sampling (kafkatcl_objectClientData *ko, char *topic, int create) {
+	kafkatcl_deliveryReportSampling *drs;
+	Tcl_HashEntry *entry;
+	int new;
+
+	if (!create) {
+		entry = Tcl_FindHashEntry (&ko->topicDeliveryReportSampling, topic);
+		return (entry != NULL) ? (kafkatcl_deliveryReportSampling *)Tcl_GetHashValue (entry) : NULL;
 	}
 
-	static CONST char *subOptions[] = {
-		"name",
-		"partitions",
-		"consistent_partition",
-		"output_queue_length",
-		NULL
-	};
-
-	enum subOptions {
-		SUBOPT_NAME,
-		SUBOPT_PARTITIONS,
-		SUBOPT_CONSISTENT_PARTITION,
-		SUBOPT_OUTPUT_QUEUE_LENGTH
-	};
-
-	// argument must be one of the subOptions defined above
-	if (Tcl_GetIndexFromObj (interp, objv[2], subOptions, "suboption",
-		TCL_EXACT, &suboptIndex) != TCL_OK) {
-		return TCL_ERROR;
+	entry = Tcl_CreateHashEntry (&ko->topicDeliveryReportSampling, topic, &new);
+	if (!new) {
+		return (kafkatcl_deliveryReportSampling *)Tcl_GetHashValue (entry);
 	}
 
-	kafkatcl_handleClientData *kh = kt->kh;
-    assert (kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
+	drs = (kafkatcl_deliveryReportSampling *)ckalloc (sizeof (kafkatcl_deliveryReportSampling));
+	kafkatcl_delivery_report_sampling_init (drs);
+	drs->every = ko->deliveryReportSampling.every;
+	drs->policy = ko->deliveryReportSampling.policy;
+	Tcl_SetHashValue (entry, drs);
+	return drs;
+}
 
-	if (kh->metadata == NULL) {
-		if (kafkatcl_refresh_metadata (kh) == TCL_ERROR) {
-			return TCL_ERROR;
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_delivery_report_sampling_for --
+ *
+ *    find the delivery report sampling for messages produced to a topic,
+ *    which is the topic's own if it has been given any and otherwise
+ *    the kafka object's
+ *
+ *----------------------------------------------------------------------
+ */
+kafkatcl_deliveryReportSampling *
+kafkatcl_delivery_report_sampling_for (kafkatcl_objectClientData *ko, rd_kafka_topic_t *rkt) {
+	// don't pay for a lookup unless some topic has its own sampling
+	if (ko->topicDeliveryReportSampling.numEntries > 0) {
+		Tcl_HashEntry *entry = Tcl_FindHashEntry (&ko->topicDeliveryReportSampling, rd_kafka_topic_name (rkt));
+
+		if (entry != NULL) {
+			return (kafkatcl_deliveryReportSampling *)Tcl_GetHashValue (entry);
 		}
 	}
 
-	switch ((enum subOptions) suboptIndex) {
-		case SUBOPT_NAME: {
-			if (objc != 3) {
-				Tcl_WrongNumArgs (interp, 3, objv, "");
-				return TCL_ERROR;
-			}
-
-			Tcl_SetObjResult (interp, Tcl_NewStringObj (kt->topic, -1));
-			break;
-		}
-
-		case SUBOPT_PARTITIONS: {
-			if (objc != 3) {
-				Tcl_WrongNumArgs (interp, 3, objv, "");
-				return TCL_ERROR;
-			}
-
-			return kafkatcl_meta_topic_partitions (kh, kt->topic);
-		}
-
-		case SUBOPT_CONSISTENT_PARTITION: {
-			char *key = NULL;
-			int keyLen = 0;
-			int whichPartition;
-			const struct rd_kafka_metadata_topic *t;
-
-			if (objc != 4) {
-				Tcl_WrongNumArgs (interp, 3, objv, "key");
-				return TCL_ERROR;
-			}
-
-			if (kafkatcl_meta_find_topic_tcl_result (kh, kt->topic, &t) == TCL_ERROR) {
-				return TCL_ERROR;
-			}
-
-			key = Tcl_GetStringFromObj (objv[3], &keyLen);
-
-			if (t->partition_cnt == 0) {
-				whichPartition = -1;
-			} else {
-				whichPartition = rd_kafka_msg_partitioner_consistent (kt->rkt, key, keyLen, t->partition_cnt, NULL, NULL);
-			}
-
-			Tcl_SetObjResult (interp, Tcl_NewIntObj (whichPartition));
-			break;
-		}
-
-		case SUBOPT_OUTPUT_QUEUE_LENGTH: {
-			if (objc != 3) {
-				Tcl_WrongNumArgs (interp, 3, objv, "");
-				return TCL_ERROR;
-			}
-
-			Tcl_SetObjResult (interp, Tcl_NewIntObj (rd_kafka_outq_len (kh->rk)));
-			break;
-		}
-	}
-	return TCL_OK;
+	return &ko->deliveryReportSampling;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_consume_start --
+ * kafkatcl_delivery_report_sample --
  *
- *    given a pointer to a topic client data, a partition, an offset,
- *    and a possibly NULL callback routine, arrange to consume
- *    from the topic and partition at the specified offset,
- *    calling the callback routine if it is non-NULL
+ *    count a delivery report and decide whether it makes it through to
+ *    the delivery report callback.
+ *
+ *    a report asked for by "sample" always does.  under the errors
+ *    policy every failure does and nothing else; otherwise it's one out
+ *    of every "every" reports.
+ *
+ *    delivery reports are served by rd_kafka_poll, which is only ever
+ *    called from the thread that owns the kafka object, the same thread
+ *    the delivery_report subcommands run in, so none of this needs
+ *    locking.
  *
  * Results:
- *    a standard tcl result
+ *    returns 1 if the report is to be passed on, else 0
  *
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_consume_start (kafkatcl_topicClientData *kt, int partition, int64_t offset, Tcl_Obj *callbackObj) {
-	Tcl_Interp *interp = kt->kh->interp;
-	rd_kafka_topic_t *rkt = kt->rkt;
+kafkatcl_delivery_report_sample (kafkatcl_deliveryReportSampling *drs, const rd_kafka_message_t *rkmessage) {
+	int failed = (rkmessage->err != RD_KAFKA_RESP_ERR_NO_ERROR);
 
-	// tell librdkafka we want to start consuming this topic, partition,
-	// and offset
-	if (rd_kafka_consume_start (rkt, partition, offset) < 0) {
-		return kafkatcl_last_error_to_tcl_error (interp);
+	if (failed) {
+		drs->failed++;
+	} else {
+		drs->delivered++;
 	}
 
-
-	//   lock down the callback object if there is one.
-	//
-	//   allocate and fill a running consumer structure.
-	//   insert the structure onto the list of running consumers for the topic.
-
-	if (callbackObj != NULL) {
-		Tcl_IncrRefCount (callbackObj);
+	if (drs->sampleNext) {
+		drs->sampleNext = 0;
+	} else if (drs->policy == KAFKATCL_DR_POLICY_ERRORS) {
+		if (!failed) {
+			return 0;
+		}
+	} else if (drs->every == 0) {
+		return 0;
+	} else {
+		if (--drs->countdown > 0) {
+			return 0;
+		}
+		drs->countdown = drs->every;
 	}
 
-	kafkatcl_runningConsumer *krc = ckalloc (sizeof (kafkatcl_runningConsumer));
-	krc->kh = kt->kh;
-	krc->kt = kt;
-	krc->kq = NULL;
-	krc->partition = partition;
-	krc->callbackObj = callbackObj;
-
-	KT_LIST_INSERT_HEAD (&kt->runningConsumers, krc, runningConsumerInstance);
-
-	return TCL_OK;
+	drs->sampled++;
+	return 1;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_set_queue_consumer --
- *
- *    given a pointer to a queue client data and a tcl object containing
- *    the callback function, set up a running consumer instance and
- *    point to it from the queue client data.
+ * kafkatcl_produce_completion_eventProc --
  *
- *    handle the reference counts and work properly whether or not one
- *    was already defined.
+ *    this routine is called by the Tcl event handler to invoke the
+ *    -command of a produced message with its delivery report
  *
  * Results:
- *    a standard tcl result
+ *    returns 1 to say we handled the event and the dispatcher can delete it
  *
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_set_queue_consumer (kafkatcl_queueClientData *kq, Tcl_Obj *callbackObj) {
-	kafkatcl_runningConsumer *krc;
-
-	Tcl_IncrRefCount (callbackObj);
+kafkatcl_produce_completion_eventProc (Tcl_Event *tevPtr, int flags) {
+	kafkatcl_produceCompletionEvent *evPtr = (kafkatcl_produceCompletionEvent *)tevPtr;
 
-	krc = kq->krc;
+	kafkatcl_invoke_callback_with_argument (evPtr->ko->interp, evPtr->commandObj, evPtr->reportObj);
 
-	if (krc == NULL) {
-		krc = ckalloc (sizeof (kafkatcl_runningConsumer));
-	} else {
-		Tcl_DecrRefCount (krc->callbackObj);
-	}
-
-	krc->kq = kq;
-	krc->kh = kq->kh;
-	krc->kt = NULL;
-	krc->partition = 0;
-	krc->callbackObj = callbackObj;
-
-	kq->krc = krc;
-
-	return TCL_OK;
+	Tcl_DecrRefCount (evPtr->commandObj);
+	Tcl_DecrRefCount (evPtr->reportObj);
+	return 1;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_match_consumer_event --
- *
- *    return true if the passed-in event is an instance
- *    of the passed-in client data.
- *
- *    this is used as an argument to Tcl_DeleteEvents in order for
- *    kafkatcl_consume_stop to delete pending events for this topic
- *    but leave other events alone.
+ * kafkatcl_produce_completion_match --
  *
- * Results:
- *    a standard tcl result
+ *    Tcl_DeleteEvents match function for the completions of a kafka
+ *    object that's going away, letting go of what they hold
  *
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_match_consumer_event(Tcl_Event *tevPtr, ClientData clientData) {
-    if (tevPtr->proc != kafkatcl_consume_callback_eventProc &&
-        tevPtr->proc != kafkatcl_consume_callback_queue_eventProc)
-        return 0;
+kafkatcl_produce_completion_match (Tcl_Event *tevPtr, ClientData clientData) {
+	kafkatcl_produceCompletionEvent *evPtr = (kafkatcl_produceCompletionEvent *)tevPtr;
 
-    kafkatcl_consumeCallbackEvent *evPtr = (kafkatcl_consumeCallbackEvent *)tevPtr;
-    kafkatcl_runningConsumer *krc = evPtr->krc;
+	if (tevPtr->proc != kafkatcl_produce_completion_eventProc || evPtr->ko != (kafkatcl_objectClientData *)clientData) {
+		return 0;
+	}
 
-    return (krc == (kafkatcl_runningConsumer *)clientData);
+	Tcl_DecrRefCount (evPtr->commandObj);
+	Tcl_DecrRefCount (evPtr->reportObj);
+	return 1;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_consume_start_queue --
+ * kafkatcl_produce_completion_queue --
  *
- *    given a pointer to a topic client data, a partition, an offset,
- *    and a queue object, arrange for librdkafka to consume
- *    from the topic and partition at the specified offset,
- *    queueing received messages into the specified queue.
+ *    queue an event to invoke the -command of a produced message with
+ *    a key-value list of its message id, partition, offset and error,
+ *    which is empty if the message was delivered.
  *
- * Results:
- *    a standard tcl result
+ *    this isn't subject to delivery report sampling; every message
+ *    with a command gets it called.
  *
  *----------------------------------------------------------------------
  */
-int
-kafkatcl_consume_start_queue (kafkatcl_topicClientData *kt, int partition, int64_t offset, kafkatcl_queueClientData *kq) {
-	Tcl_Interp *interp = kt->kh->interp;
-	rd_kafka_topic_t *rkt = kt->rkt;
-
-	if (rd_kafka_consume_start_queue (rkt, partition, offset, kq->rkqu) < 0) {
-		return kafkatcl_last_error_to_tcl_error (interp);
+void
+kafkatcl_produce_completion_queue (kafkatcl_objectClientData *ko, kafkatcl_produceOpaque *kpo, const rd_kafka_message_t *rkmessage) {
+	Tcl_Obj **literals = kafkatcl_thread_data ()->literals;
+	kafkatcl_produceCompletionEvent *evPtr;
+	Tcl_Obj *listObjv[8];
+
+	listObjv[0] = literals[KAFKATCL_LIT_ID];
+	listObjv[1] = Tcl_NewWideIntObj (kpo->id);
+	listObjv[2] = literals[KAFKATCL_LIT_PARTITION];
+	listObjv[3] = Tcl_NewIntObj (rkmessage->partition);
+	listObjv[4] = literals[KAFKATCL_LIT_OFFSET];
+	listObjv[5] = kafkatcl_NewOffsetObj (rkmessage->offset);
+	listObjv[6] = literals[KAFKATCL_LIT_ERR];
+	if (rkmessage->err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+		listObjv[7] = Tcl_NewObj ();
+	} else {
+		listObjv[7] = Tcl_NewStringObj (kafkatcl_kafka_error_to_errorcode_string (rkmessage->err), -1);
 	}
 
-	return TCL_OK;
+	evPtr = ckalloc (sizeof (kafkatcl_produceCompletionEvent));
+	evPtr->event.proc = kafkatcl_produce_completion_eventProc;
+	evPtr->ko = ko;
+	evPtr->commandObj = kpo->commandObj;
+	Tcl_IncrRefCount (evPtr->commandObj);
+	evPtr->reportObj = Tcl_NewListObj (8, listObjv);
+	Tcl_IncrRefCount (evPtr->reportObj);
+
+	Tcl_ThreadQueueEvent (ko->threadId, (Tcl_Event *)evPtr, ko->eventPosition[KAFKATCL_EVENT_DELIVERY_REPORT]);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_consume_stop --
- *
- *    given a pointer to a topic client data and a partition number,
- *    stop consuming from that partition.
+ * kafkatcl_delivery_report_batch_eventProc --
  *
- *    delete from the list of running consumers if it's in there.
+ *    this routine is called by the Tcl event handler to hand the
+ *    delivery reports collected since it was queued to the delivery
+ *    report callback as one list
  *
  * Results:
- *    a standard tcl result
+ *    returns 1 to say we handled the event and the dispatcher can delete it
  *
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_consume_stop (kafkatcl_topicClientData *kt, int partition) {
-	kafkatcl_runningConsumer *krc;
-	Tcl_Interp *interp = kt->kh->interp;
+kafkatcl_delivery_report_batch_eventProc (Tcl_Event *tevPtr, int flags) {
+	kafkatcl_deliveryReportBatchEvent *evPtr = (kafkatcl_deliveryReportBatchEvent *)tevPtr;
+	kafkatcl_objectClientData *ko = evPtr->ko;
+	Tcl_Obj *batchObj = ko->deliveryReportBatch;
 
-	if (rd_kafka_consume_stop (kt->rkt, partition) < 0) {
-		return kafkatcl_last_error_to_tcl_error (interp);
+	// the next report starts a new batch
+	ko->deliveryReportBatch = NULL;
+
+	if (batchObj == NULL) {
+		return 1;
 	}
 
-	KT_LIST_FOREACH(krc, &kt->runningConsumers, runningConsumerInstance) {
-		if (krc->partition == partition) {
-			KT_LIST_REMOVE (krc, runningConsumerInstance);
-			Tcl_DeleteEvents(kafkatcl_match_consumer_event, (ClientData)krc);
-			ckfree (krc);
-			break;
-		}
+	if (ko->deliveryReportCallbackObj != NULL) {
+		kafkatcl_invoke_callback_with_argument (ko->interp, ko->deliveryReportCallbackObj, batchObj);
 	}
 
-	return TCL_OK;
+	Tcl_DecrRefCount (batchObj);
+	return 1;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_consume_stop_all_partitions --
+ * kafkatcl_delivery_report_batch_append --
  *
- *    given a pointer to a topic client data and a partition, stop
- *    consuming.  delete from the list of running consumers if it's
- *    in there.
+ *    add a delivery report made up of the fields in
+ *    ko->deliveryReportFields to the batch of reports for the next
+ *    delivery report batch event, queueing the event if the batch is new.
  *
- * Results:
- *    a standard tcl result
+ *    delivery reports are served by rd_kafka_poll, which is only ever
+ *    called from the thread that owns the kafka object, so all the
+ *    reports from one pass through the event loop end up in the same
+ *    batch, in the order they were delivered.
  *
  *----------------------------------------------------------------------
  */
 void
-kafkatcl_consume_stop_all_partitions (kafkatcl_topicClientData *kt) {
-	kafkatcl_runningConsumer *krc;
-	kafkatcl_runningConsumer *tmp;
+kafkatcl_delivery_report_batch_append (kafkatcl_objectClientData *ko, const rd_kafka_message_t *rkmessage) {
+	kafkatcl_threadData *tsdPtr = kafkatcl_thread_data ();
+	Tcl_Obj **literals = tsdPtr->literals;
+	kafkatcl_produceOpaque *kpo = (kafkatcl_produceOpaque *)rkmessage->_private;
+	int fields = ko->deliveryReportFields;
+
+#define KAFKATCL_DELIVERY_REPORT_LIST_COUNT 16
+	Tcl_Obj *listObjv[KAFKATCL_DELIVERY_REPORT_LIST_COUNT];
+	int i = 0;
+
+	if (fields & KAFKATCL_DR_FIELD_PAYLOAD) {
+		listObjv[i++] = literals[KAFKATCL_LIT_PAYLOAD];
+		listObjv[i++] = Tcl_NewByteArrayObj (rkmessage->payload, rkmessage->len);
+	}
 
-	// for each running consumer (perhaps multiple partitions)
-	KT_LIST_FOREACH_SAFE (krc, &kt->runningConsumers, runningConsumerInstance, tmp) {
-		kafkatcl_consume_stop (kt, krc->partition);
+	if (fields & KAFKATCL_DR_FIELD_PARTITION) {
+		listObjv[i++] = literals[KAFKATCL_LIT_PARTITION];
+		listObjv[i++] = Tcl_NewIntObj (rkmessage->partition);
 	}
-}
 
+	if (fields & KAFKATCL_DR_FIELD_OFFSET) {
+		listObjv[i++] = literals[KAFKATCL_LIT_OFFSET];
+		listObjv[i++] = kafkatcl_NewOffsetObj (rkmessage->offset);
+	}
 
-/*
- *----------------------------------------------------------------------
- *
- * kafkatcl_check_consumer_callbacks --
- *
- *    run through all the running consumers that have callbacks defined
- *    on partitions and topics and queues.
- *
- * Results:
- *    the numbers of messages consumed
- *
- *----------------------------------------------------------------------
- */
-int
-kafkatcl_check_consumer_callbacks (kafkatcl_objectClientData *ko) {
-	kafkatcl_topicClientData *kt;
-	kafkatcl_queueClientData *kq;
-	int count = 0;
-	int result;
+	if (fields & KAFKATCL_DR_FIELD_TIMESTAMP) {
+		rd_kafka_timestamp_type_t tstype;
+		Tcl_WideInt timestamp = rd_kafka_message_timestamp (rkmessage, &tstype);
 
-	// for each defined topic consumer
-	KT_LIST_FOREACH(kt, &ko->topicConsumers, topicConsumerInstance) {
-		kafkatcl_runningConsumer *krc;
+		if (tstype != RD_KAFKA_TIMESTAMP_NOT_AVAILABLE) {
+			listObjv[i++] = literals[KAFKATCL_LIT_TIMESTAMP];
+			listObjv[i++] = Tcl_NewWideIntObj (timestamp);
+		}
+	}
 
-		// for each running consumer (perhaps multiple partitions)
-		KT_LIST_FOREACH(krc, &kt->runningConsumers, runningConsumerInstance) {
+	if ((fields & KAFKATCL_DR_FIELD_TOPIC) && rkmessage->rkt != NULL) {
+		listObjv[i++] = literals[KAFKATCL_LIT_TOPIC];
+		listObjv[i++] = kafkatcl_topic_name_obj (tsdPtr, rd_kafka_topic_name (rkmessage->rkt));
+	}
 
-			if (krc->callbackObj != NULL) {
+	if ((fields & KAFKATCL_DR_FIELD_KEY) && rkmessage->key != NULL) {
+		listObjv[i++] = literals[KAFKATCL_LIT_KEY];
+		listObjv[i++] = Tcl_NewByteArrayObj (rkmessage->key, rkmessage->key_len);
+	}
 
-				// get kafka to invoke our callback function for this
-				result = rd_kafka_consume_callback (krc->kt->rkt, krc->partition, 0, kafkatcl_consume_callback, krc);
-				if (result < 0) {
-					// NB do something here
-					// Tcl_BackgroundError (interp);
-				} else {
-					count += result;
-				}
-			}
+	// err is empty if the message was delivered
+	if (fields & KAFKATCL_DR_FIELD_ERR) {
+		listObjv[i++] = literals[KAFKATCL_LIT_ERR];
+		if (rkmessage->err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+			listObjv[i++] = Tcl_NewObj ();
+		} else {
+			listObjv[i++] = Tcl_NewStringObj (kafkatcl_kafka_error_to_errorcode_string (rkmessage->err), -1);
 		}
 	}
 
-	// for each queue see if there's a queue consumer and if so,
-	// try to consume
-	KT_LIST_FOREACH(kq, &ko->queueConsumers, queueConsumerInstance) {
-		kafkatcl_runningConsumer *krc = kq->krc;
+	if (fields & KAFKATCL_DR_FIELD_OPAQUE) {
+		listObjv[i++] = literals[KAFKATCL_LIT_OPAQUE];
+		listObjv[i++] = (kpo != NULL && kpo->opaqueObj != NULL) ? kpo->opaqueObj : Tcl_NewObj ();
+	}
 
-		if (krc == NULL) {
-			continue;
-		}
+	assert (i <= KAFKATCL_DELIVERY_REPORT_LIST_COUNT);
 
-		result = rd_kafka_consume_callback_queue (kq->rkqu, 0, kafkatcl_consume_callback, krc);
-		if (result < 0) {
-			// NB do something here
-			// Tcl_BackgroundError (interp);
-		} else {
-			count += result;
-		}
+	if (ko->deliveryReportBatch == NULL) {
+		kafkatcl_deliveryReportBatchEvent *evPtr;
+
+		ko->deliveryReportBatch = Tcl_NewObj ();
+		Tcl_IncrRefCount (ko->deliveryReportBatch);
+
+		evPtr = ckalloc (sizeof (kafkatcl_deliveryReportBatchEvent));
+		evPtr->event.proc = kafkatcl_delivery_report_batch_eventProc;
+		evPtr->ko = ko;
+		Tcl_ThreadQueueEvent (ko->threadId, (Tcl_Event *)evPtr, ko->eventPosition[KAFKATCL_EVENT_DELIVERY_REPORT]);
 	}
 
-	return count;
+	Tcl_ListObjAppendElement (NULL, ko->deliveryReportBatch, Tcl_NewListObj (i, listObjv));
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_topicConsumerObjectObjCmd --
- *
- *    dispatches the subcommands of a kafkatcl batch-handling command
+ * kafkatcl_delivery_report_batch_match --
  *
- * Results:
- *    stuff
+ *    Tcl_DeleteEvents match function for the delivery report batch
+ *    events of a kafka object that's going away.  its produce
+ *    completion events are kafkatcl_produce_completion_match's.
  *
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_topicConsumerObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
-{
-    int         optIndex;
-	kafkatcl_topicClientData *kt = (kafkatcl_topicClientData *)cData;
-	rd_kafka_topic_t *rkt = kt->rkt;
-	int resultCode = TCL_OK;
-
-    static CONST char *options[] = {
-        "consume",
-        "consume_batch",
-		"info",
-        "start",
-        "start_queue",
-        "stop",
-	"creator",
-        "delete",
-	"consume_start",
-	"consume_start_queue",
-	"consume_stop",
-        NULL
-    };
+kafkatcl_delivery_report_batch_match (Tcl_Event *tevPtr, ClientData clientData) {
+	if (tevPtr->proc != kafkatcl_delivery_report_batch_eventProc) {
+		return 0;
+	}
 
-    enum options {
-		OPT_CONSUME,
-		OPT_CONSUME_BATCH,
-		OPT_INFO,
-		OPT_CONSUME_START,
-		OPT_CONSUME_START_QUEUE,
-		OPT_CONSUME_STOP,
-		OPT_CREATOR,
-		OPT_DELETE,
-		OPT_LEGACY_CONSUME_START,
-		OPT_LEGACY_CONSUME_START_QUEUE,
-		OPT_LEGACY_CONSUME_STOP
-    };
+	return ((kafkatcl_deliveryReportBatchEvent *)tevPtr)->ko == (kafkatcl_objectClientData *)clientData;
+}
 
-    /* basic validation of command line arguments */
-    if (objc < 2) {
-        Tcl_WrongNumArgs (interp, 1, objv, "subcommand ?args?");
-        return TCL_ERROR;
-    }
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_delivery_report_callback --
+ *
+ *    this routine is called by the kafka cpp-driver as a callback
+ *    when a delivery report has been received and
+ *    rd_kafka_set_dr_msg_cb has been done to register
+ *    this callback
+ *
+ * Results:
+ *    an event is queued to the thread that set up the callback
+ *
+ *----------------------------------------------------------------------
+ */
+void kafkatcl_delivery_report_callback (rd_kafka_t *rk, const rd_kafka_message_t *rkmessage, void *opaque) {
+	kafkatcl_objectClientData *ko = opaque;
 
-    if (Tcl_GetIndexFromObj (interp, objv[1], options, "option", TCL_EXACT, &optIndex) != TCL_OK) {
-		return TCL_ERROR;
-    }
+    assert (ko->kafka_object_magic == KAFKA_OBJECT_MAGIC);
 
-    switch ((enum options) optIndex) {
-		case OPT_CONSUME: {
-			int partition;
-			int timeoutMS;
+	kafkatcl_produceOpaque *kpo = (kafkatcl_produceOpaque *)rkmessage->_private;
 
-			if (objc != 5) {
-				Tcl_WrongNumArgs (interp, 2, objv, "partition timeout array");
-				return TCL_ERROR;
-			}
+	if (kpo != NULL && kpo->commandObj != NULL) {
+		kafkatcl_produce_completion_queue (ko, kpo, rkmessage);
+	}
 
-			if (Tcl_GetIntFromObj (interp, objv[2], &partition) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
-				break;
-			}
+	if (!kafkatcl_delivery_report_sample (kafkatcl_delivery_report_sampling_for (ko, rkmessage->rkt), rkmessage)) {
+		goto release;
+	}
 
-			if (Tcl_GetIntFromObj (interp, objv[3], &timeoutMS) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
-				break;
-			}
+	if (ko->deliveryReportCallbackObj == NULL) {
+		goto release;
+	}
 
-			char *arrayName = Tcl_GetString (objv[4]);
+	if (ko->deliveryReportFields != 0) {
+		kafkatcl_delivery_report_batch_append (ko, rkmessage);
+		goto release;
+	}
 
-			rd_kafka_message_t *rdm = rd_kafka_consume (rkt, partition, timeoutMS);
+	kafkatcl_deliveryReportEvent *evPtr;
 
-			if (rdm == NULL) {
-				resultCode =  kafkatcl_last_error_to_tcl_error (interp);
-				break;
-			}
+	evPtr = ckalloc (sizeof (kafkatcl_deliveryReportEvent));
 
-			resultCode = kafkatcl_message_to_tcl_array (interp, arrayName, rdm, 1);
+	evPtr->event.proc = kafkatcl_delivery_report_eventProc;
+	evPtr->ko = ko;
 
-			// TCL_BREAK is returned on EOF
-			if (resultCode == TCL_BREAK) {
-				Tcl_SetObjResult (interp, Tcl_NewIntObj (0));
-				resultCode = TCL_OK;
-			} else if (resultCode == TCL_OK) {
-				Tcl_SetObjResult (interp, Tcl_NewIntObj (1));
-			}
+	// structure copy
+	evPtr->rkmessage = *rkmessage;
 
-			rd_kafka_message_destroy (rdm);
-			break;
-		}
+	// then allocate and copy the payload and possibly the key; we will free
+	// all this in the event handler
+	evPtr->rkmessage.payload = ckalloc (rkmessage->len);
+	memcpy (evPtr->rkmessage.payload, rkmessage->payload, rkmessage->len);
 
-		case OPT_CONSUME_BATCH: {
-			int partition;
-			int timeoutMS;
-			int count;
+	if (rkmessage->key != NULL) {
+		evPtr->rkmessage.key = ckalloc (rkmessage->key_len);
+		memcpy (evPtr->rkmessage.key, rkmessage->key, rkmessage->key_len);
+	}
 
-			if (objc != 7) {
-				Tcl_WrongNumArgs (interp, 2, objv, "partition timeout count array code");
-				return TCL_ERROR;
-			}
+	Tcl_ThreadQueueEvent (ko->threadId, (Tcl_Event *)evPtr, ko->eventPosition[KAFKATCL_EVENT_DELIVERY_REPORT]);
 
-			if (Tcl_GetIntFromObj (interp, objv[2], &partition) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
-				break;
-			}
+  release:
+	// librdkafka is done with the message, including the payload if
+	// it was produced with -nocopy.  delivery reports are served by
+	// rd_kafka_poll, which only ever gets called from the thread that
+	// owns the object.
+	kafkatcl_produce_opaque_release (rkmessage->_private);
+	return;
+}
 
-			if (Tcl_GetIntFromObj (interp, objv[3], &timeoutMS) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_statistics_callback --
+ *
+ *    this routine is called by the kafka cpp-driver as a callback
+ *    when a delivery report has been received and rd_kafka_set_stats_cb
+ *    has been done to register this callback
+ *
+ * Results:
+ *    an event is queued to the thread that set up the callback
+ *
+ *----------------------------------------------------------------------
+ */
+void kafkatcl_statistics_callback (rd_kafka_t *rk, char *json, size_t json_len, void *opaque) {
+    kafkatcl_objectClientData *ko = opaque;
+	Tcl_Interp *interp = ko->interp;
+	Tcl_Obj *arg = Tcl_NewStringObj (json, json_len);
+
+	kafkatcl_invoke_callback_with_argument (interp, ko->statisticsCallbackObj, arg) ;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_meta_topic_list --
+ *
+ *    given a handle client data create a tcl list of all of the topics
+ *    and set the interpreter result to it if successful
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_meta_topic_list (kafkatcl_handleClientData *kh) {
+	Tcl_Interp *interp = kh->interp;
+	const struct rd_kafka_metadata *metadata = kh->metadata;
+	int i;
+	Tcl_Obj *listObj = Tcl_NewObj();
+
+	for (i = 0 ; i < metadata->topic_cnt ; i++) {
+		const struct rd_kafka_metadata_topic *t = &metadata->topics[i];
+
+		if (Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj (t->topic, -1)) == TCL_ERROR) {
+			return TCL_ERROR;
+		}
+	}
+	Tcl_SetObjResult (interp, listObj);
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_meta_find_topic --
+ *
+ *    given a handle client data and a topic name,
+ *    return the matching const struct rd_kafka_metadata_topic *
+ *    pointer or NULL if none is found
+ *
+ * Results:
+ *    the matching const struct rd_kafka_metadata_topic * or NULL
+ *
+ *----------------------------------------------------------------------
+ */
+const struct rd_kafka_metadata_topic *
+kafkatcl_meta_find_topic (kafkatcl_handleClientData *kh, char *topic) {
+	Tcl_HashEntry *entry = Tcl_FindHashEntry (&kh->metadataTopics, topic);
+
+	if (entry == NULL) {
+		return NULL;
+	}
+
+	return ((kafkatcl_metadataTopic *)Tcl_GetHashValue (entry))->topic;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_meta_find_topic_tcl_result --
+ *
+ *    given a handle client data and a topic name,
+ *    set the passed-in const struct rd_kafka_metadata_topic *
+ *    to the matching metadata topic structure or to NULL if none is found
+ *
+ *    if we don't have metadata for the topic, it's fetched for that
+ *    topic alone
+ *
+ *    Set an error message into the Tcl interpreter if there is an
+ *    error and return TCL_OK if the topic was found or TCL_ERROR if
+ *    it wasn't
+ *
+ * Results:
+ *    A standard Tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_meta_find_topic_tcl_result (kafkatcl_handleClientData *kh, char *topicName, const struct rd_kafka_metadata_topic **topicPtr) {
+	Tcl_Interp *interp = kh->interp;
+
+	if (kafkatcl_metadata_ensure_topic (kh, topicName) == TCL_ERROR) {
+		*topicPtr = NULL;
+		return TCL_ERROR;
+	}
+
+	*topicPtr = kafkatcl_meta_find_topic (kh, topicName);
+	if (*topicPtr != NULL) {
+		return TCL_OK;
+	}
+
+	Tcl_ResetResult (interp);
+	Tcl_AppendResult (interp, "kafka error: topic '", topicName, "' not found", NULL);
+	return TCL_ERROR;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_meta_topic_partitions --
+ *
+ *    given a handle client data and a topic name,
+ *    set the interpreter result to the number of partitions
+ *    covering that topic if successful
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_meta_topic_partitions (kafkatcl_handleClientData *kh, char *topic) {
+	const struct rd_kafka_metadata_topic *t;
+	Tcl_Interp *interp = kh->interp;
+
+	if (kafkatcl_meta_find_topic_tcl_result (kh, topic, &t) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+	Tcl_SetObjResult (interp, Tcl_NewIntObj (t->partition_cnt));
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_meta_broker_list --
+ *
+ *    given a handle client data create a tcl list of all of the brokers
+ *    and set the interpreter result to it if successful
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_meta_broker_list (kafkatcl_handleClientData *kh) {
+	Tcl_Interp *interp = kh->interp;
+	const struct rd_kafka_metadata *metadata = kh->metadata;
+	int i;
+	Tcl_Obj *listObj = Tcl_NewObj();
+	struct rd_kafka_metadata_broker *broker;
+
+#define BROKER_STRING_FORMAT "%s:%d"
+
+	for (i = 0 ; i < metadata->broker_cnt ; i++) {
+		broker = &metadata->brokers[i];
+		// figure out the size of the string we need
+		int brokerStringLength = snprintf (NULL, 0, BROKER_STRING_FORMAT, broker->host, broker->port) + 1;
+		char *brokerString = ckalloc (brokerStringLength);
+		snprintf (brokerString, brokerStringLength, BROKER_STRING_FORMAT, broker->host, broker->port);
+
+		if (Tcl_ListObjAppendElement (interp, listObj, Tcl_NewStringObj (brokerString, brokerStringLength)) == TCL_ERROR) {
+			ckfree (brokerString);
+			return TCL_ERROR;
+		}
+		ckfree (brokerString);
+	}
+	Tcl_SetObjResult (interp, listObj);
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_partition_change_eventProc --
+ *
+ *    this routine is called by the Tcl event handler to invoke the
+ *    meta on_partition_change command of a handle with a list of the
+ *    topics whose partition counts changed
+ *
+ * Results:
+ *    returns 1 to say we handled the event and the dispatcher can delete it
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_partition_change_eventProc (Tcl_Event *tevPtr, int flags) {
+	kafkatcl_partitionChangeEvent *evPtr = (kafkatcl_partitionChangeEvent *)tevPtr;
+	kafkatcl_handleClientData *kh = evPtr->kh;
+
+	if (kh->partitionChangeCallbackObj != NULL) {
+		kafkatcl_invoke_callback_with_argument (kh->interp, kh->partitionChangeCallbackObj, evPtr->changesObj);
+	}
+
+	Tcl_DecrRefCount (evPtr->changesObj);
+	return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_metadata_block_release --
+ *
+ *    let go of a reference to a metadata block, destroying the metadata
+ *    it holds when it was the last one
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_metadata_block_release (kafkatcl_metadataBlock *block) {
+	if (--block->refCount > 0) {
+		return;
+	}
+
+	rd_kafka_metadata_destroy (block->metadata);
+	ckfree (block);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_metadata_topic_delete --
+ *
+ *    remove a topic from a handle's metadata cache
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_metadata_topic_delete (Tcl_HashEntry *entry) {
+	kafkatcl_metadataTopic *mt = (kafkatcl_metadataTopic *)Tcl_GetHashValue (entry);
+
+	kafkatcl_metadata_block_release (mt->block);
+	ckfree (mt);
+	Tcl_DeleteHashEntry (entry);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_metadata_install --
+ *
+ *    merge newly fetched metadata into the handle's metadata cache,
+ *    indexing its topics by name and letting go of the metadata they
+ *    replace.
+ *
+ *    if allTopics is set the metadata covers the whole cluster and also
+ *    becomes the handle's list of topics and brokers, and cached topics
+ *    that aren't in it are dropped.  otherwise it covers only the topics
+ *    that were asked for, and those the cluster says don't exist are
+ *    dropped.
+ *
+ *    if the handle has an on_partition_change command and any topic's
+ *    partition count differs from what it was, an event is queued to
+ *    invoke the command with a list of topic, old count and new count
+ *    for each of them.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_metadata_install (kafkatcl_handleClientData *kh, const struct rd_kafka_metadata *metadata, int allTopics) {
+	kafkatcl_metadataBlock *block = ckalloc (sizeof (kafkatcl_metadataBlock));
+	Tcl_WideInt now = kafkatcl_now_ms ();
+	Tcl_Obj *changesObj = NULL;
+	int i;
+
+	block->metadata = metadata;
+	// hold on to it until we're done, in case no topic ends up using it
+	block->refCount = 1;
+
+	if (kh->partitionChangeCallbackObj != NULL) {
+		changesObj = Tcl_NewObj ();
+	}
+
+	for (i = 0 ; i < metadata->topic_cnt ; i++) {
+		const struct rd_kafka_metadata_topic *t = &metadata->topics[i];
+		Tcl_HashEntry *entry = Tcl_FindHashEntry (&kh->metadataTopics, t->topic);
+		kafkatcl_metadataTopic *mt;
+
+		if (t->err == RD_KAFKA_RESP_ERR_UNKNOWN_TOPIC_OR_PART) {
+			if (entry != NULL) {
+				kafkatcl_metadata_topic_delete (entry);
+			}
+			continue;
+		}
+
+		if (entry == NULL) {
+			int new;
+
+			entry = Tcl_CreateHashEntry (&kh->metadataTopics, t->topic, &new);
+			mt = ckalloc (sizeof (kafkatcl_metadataTopic));
+			Tcl_SetHashValue (entry, mt);
+		} else {
+			mt = (kafkatcl_metadataTopic *)Tcl_GetHashValue (entry);
+
+			if (changesObj != NULL && mt->topic->partition_cnt != t->partition_cnt) {
+				Tcl_ListObjAppendElement (NULL, changesObj, Tcl_NewStringObj (t->topic, -1));
+				Tcl_ListObjAppendElement (NULL, changesObj, Tcl_NewIntObj (mt->topic->partition_cnt));
+				Tcl_ListObjAppendElement (NULL, changesObj, Tcl_NewIntObj (t->partition_cnt));
+			}
+
+			kafkatcl_metadata_block_release (mt->block);
+		}
+
+		mt->topic = t;
+		mt->block = block;
+		mt->fetched = now;
+		block->refCount++;
+	}
+
+	if (allTopics) {
+		Tcl_HashSearch search;
+		Tcl_HashEntry *entry;
+
+		// drop the topics the cluster no longer has
+		for (entry = Tcl_FirstHashEntry (&kh->metadataTopics, &search); entry != NULL; entry = Tcl_NextHashEntry (&search)) {
+			kafkatcl_metadataTopic *mt = (kafkatcl_metadataTopic *)Tcl_GetHashValue (entry);
+
+			if (mt->block != block) {
+				kafkatcl_metadata_topic_delete (entry);
+			}
+		}
+
+		if (kh->metadataBlock != NULL) {
+			kafkatcl_metadata_block_release (kh->metadataBlock);
+		}
+
+		block->refCount++;
+		kh->metadataBlock = block;
+		kh->metadata = metadata;
+		kh->metadataFetched = now;
+	}
+
+	kafkatcl_metadata_block_release (block);
+
+	if (changesObj != NULL) {
+		int changeCount;
+
+		Tcl_ListObjLength (NULL, changesObj, &changeCount);
+		if (changeCount == 0) {
+			Tcl_DecrRefCount (changesObj);
+		} else {
+			kafkatcl_partitionChangeEvent *evPtr = ckalloc (sizeof (kafkatcl_partitionChangeEvent));
+
+			evPtr->event.proc = kafkatcl_partition_change_eventProc;
+			evPtr->kh = kh;
+			evPtr->changesObj = changesObj;
+			Tcl_IncrRefCount (changesObj);
+			Tcl_QueueEvent ((Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
+		}
+	}
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_metadata_topics_new --
+ *
+ *    create librdkafka topic handles for topics we're about to fetch
+ *    metadata for.  they're made from the handle's topic config, if it
+ *    has one, so that a topic created later with new_topic gets the
+ *    same config.
+ *
+ * Results:
+ *    a ckalloc'ed array of topicCount topic handles, or NULL if one
+ *    couldn't be created, in which case an error is left in the
+ *    interpreter
+ *
+ *----------------------------------------------------------------------
+ */
+rd_kafka_topic_t **
+kafkatcl_metadata_topics_new (kafkatcl_handleClientData *kh, int topicCount, char **topics) {
+	rd_kafka_topic_t **rkts = (rd_kafka_topic_t **)ckalloc (sizeof (rd_kafka_topic_t *) * topicCount);
+	int i;
+
+	for (i = 0; i < topicCount; i++) {
+		// subscribers don't have a topic config of their own
+		rd_kafka_topic_conf_t *topicConf = (kh->topicConf != NULL) ? rd_kafka_topic_conf_dup (kh->topicConf) : NULL;
+
+		rkts[i] = rd_kafka_topic_new (kh->rk, topics[i], topicConf);
+
+		if (rkts[i] == NULL) {
+			kafkatcl_kafka_error_to_tcl (kh->interp, rd_kafka_last_error (), topics[i]);
+
+			while (--i >= 0) {
+				rd_kafka_topic_destroy (rkts[i]);
+			}
+			ckfree (rkts);
+			return NULL;
+		}
+	}
+
+	return rkts;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_metadata_topics_destroy --
+ *
+ *    let go of the topic handles made by kafkatcl_metadata_topics_new
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_metadata_topics_destroy (int rktCount, rd_kafka_topic_t **rkts) {
+	int i;
+
+	for (i = 0; i < rktCount; i++) {
+		rd_kafka_topic_destroy (rkts[i]);
+	}
+
+	if (rkts != NULL) {
+		ckfree (rkts);
+	}
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_metadata_fetch --
+ *
+ *    ask the brokers for metadata.  if rktCount is -1 it covers the
+ *    whole cluster, otherwise just the passed topics.  one topic is
+ *    asked for on its own; several are asked for in a single request
+ *    for every topic the handle knows of, which includes them since we
+ *    hold handles for them.
+ *
+ *    this doesn't touch the interpreter and can run in any thread.
+ *
+ * Results:
+ *    a librdkafka error code
+ *
+ *----------------------------------------------------------------------
+ */
+rd_kafka_resp_err_t
+kafkatcl_metadata_fetch (rd_kafka_t *rk, int rktCount, rd_kafka_topic_t **rkts, const struct rd_kafka_metadata **metadataPtr) {
+	if (rktCount < 0) {
+		return rd_kafka_metadata (rk, 1, NULL, metadataPtr, KAFKATCL_METADATA_TIMEOUT_MS);
+	}
+
+	if (rktCount == 1) {
+		return rd_kafka_metadata (rk, 0, rkts[0], metadataPtr, KAFKATCL_METADATA_TIMEOUT_MS);
+	}
+
+	return rd_kafka_metadata (rk, 0, NULL, metadataPtr, KAFKATCL_METADATA_TIMEOUT_MS);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_refresh_metadata --
+ *
+ *    fetch the metadata for the whole cluster into our
+ *    kafkatcl_handleClientData structure
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_refresh_metadata (kafkatcl_handleClientData *kh) {
+	Tcl_Interp *interp = kh->interp;
+	const struct rd_kafka_metadata *metadata;
+
+	rd_kafka_resp_err_t err = kafkatcl_metadata_fetch (kh->rk, -1, NULL, &metadata);
+
+	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		return kafkatcl_kafka_error_to_tcl (interp, err, "failed to acquire metadata");
+	}
+
+	kafkatcl_metadata_install (kh, metadata, 1);
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_refresh_topic_metadata --
+ *
+ *    fetch the metadata for just the named topics into our
+ *    kafkatcl_handleClientData structure, in a single request
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_refresh_topic_metadata (kafkatcl_handleClientData *kh, int topicCount, char **topics) {
+	Tcl_Interp *interp = kh->interp;
+	const struct rd_kafka_metadata *metadata;
+	rd_kafka_topic_t **rkts;
+	rd_kafka_resp_err_t err;
+
+	rkts = kafkatcl_metadata_topics_new (kh, topicCount, topics);
+	if (rkts == NULL) {
+		return TCL_ERROR;
+	}
+
+	err = kafkatcl_metadata_fetch (kh->rk, topicCount, rkts, &metadata);
+	kafkatcl_metadata_topics_destroy (topicCount, rkts);
+
+	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		return kafkatcl_kafka_error_to_tcl (interp, err, "failed to acquire metadata");
+	}
+
+	kafkatcl_metadata_install (kh, metadata, 0);
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_metadata_thread --
+ *
+ *    thread that fetches metadata for a background refresh and queues
+ *    it back to the thread that owns the handle.  librdkafka handles
+ *    can be used from any thread.
+ *
+ *----------------------------------------------------------------------
+ */
+static Tcl_ThreadCreateType
+kafkatcl_metadata_thread (ClientData clientData) {
+	kafkatcl_metadataEvent *evPtr = (kafkatcl_metadataEvent *)clientData;
+
+	evPtr->err = kafkatcl_metadata_fetch (evPtr->kh->rk, evPtr->rktCount, evPtr->rkts, &evPtr->metadata);
+
+	Tcl_ThreadQueueEvent (evPtr->ownerThreadId, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert (evPtr->ownerThreadId);
+	TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_metadata_eventProc --
+ *
+ *    this routine is called by the Tcl event handler when a background
+ *    metadata refresh has finished.  if it failed, the metadata we have
+ *    stays in use until the TTL runs out again.
+ *
+ * Results:
+ *    returns 1 to say we handled the event and the dispatcher can delete it
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_metadata_eventProc (Tcl_Event *tevPtr, int flags) {
+	kafkatcl_metadataEvent *evPtr = (kafkatcl_metadataEvent *)tevPtr;
+	kafkatcl_handleClientData *kh = evPtr->kh;
+	int threadResult;
+
+	Tcl_JoinThread (kh->metadataThread, &threadResult);
+	kh->metadataRefreshing = 0;
+	kafkatcl_metadata_topics_destroy (evPtr->rktCount, evPtr->rkts);
+
+	if (evPtr->err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+		kafkatcl_metadata_install (kh, evPtr->metadata, evPtr->rktCount < 0);
+	} else {
+		Tcl_HashSearch search;
+		Tcl_HashEntry *entry;
+		Tcl_WideInt now = kafkatcl_now_ms ();
+
+		for (entry = Tcl_FirstHashEntry (&kh->metadataTopics, &search); entry != NULL; entry = Tcl_NextHashEntry (&search)) {
+			((kafkatcl_metadataTopic *)Tcl_GetHashValue (entry))->fetched = now;
+		}
+		kh->metadataFetched = now;
+	}
+	return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_metadata_match --
+ *
+ *    Tcl_DeleteEvents match function for the metadata and partition
+ *    change events of a handle that's going away, letting go of what
+ *    they hold
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_metadata_match (Tcl_Event *tevPtr, ClientData clientData) {
+	kafkatcl_handleClientData *kh = (kafkatcl_handleClientData *)clientData;
+
+	if (tevPtr->proc == kafkatcl_metadata_eventProc) {
+		kafkatcl_metadataEvent *evPtr = (kafkatcl_metadataEvent *)tevPtr;
+
+		if (evPtr->kh != kh) {
+			return 0;
+		}
+
+		kafkatcl_metadata_topics_destroy (evPtr->rktCount, evPtr->rkts);
+		if (evPtr->err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+			rd_kafka_metadata_destroy (evPtr->metadata);
+		}
+		return 1;
+	}
+
+	if (tevPtr->proc == kafkatcl_partition_change_eventProc) {
+		kafkatcl_partitionChangeEvent *evPtr = (kafkatcl_partitionChangeEvent *)tevPtr;
+
+		if (evPtr->kh != kh) {
+			return 0;
+		}
+
+		Tcl_DecrRefCount (evPtr->changesObj);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_metadata_refresh_in_background --
+ *
+ *    start a thread refreshing the handle's metadata.  if we have the
+ *    whole cluster's metadata it's refreshed, otherwise just that of
+ *    the topics we've cached.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_metadata_refresh_in_background (kafkatcl_handleClientData *kh) {
+	kafkatcl_metadataEvent *evPtr = ckalloc (sizeof (kafkatcl_metadataEvent));
+
+	evPtr->event.proc = kafkatcl_metadata_eventProc;
+	evPtr->kh = kh;
+	evPtr->ownerThreadId = Tcl_GetCurrentThread ();
+	evPtr->rktCount = -1;
+	evPtr->rkts = NULL;
+	evPtr->metadata = NULL;
+
+	if (kh->metadata == NULL) {
+		Tcl_HashSearch search;
+		Tcl_HashEntry *entry;
+		char **topics = (char **)ckalloc (sizeof (char *) * kh->metadataTopics.numEntries);
+		int topicCount = 0;
+
+		for (entry = Tcl_FirstHashEntry (&kh->metadataTopics, &search); entry != NULL; entry = Tcl_NextHashEntry (&search)) {
+			topics[topicCount++] = Tcl_GetHashKey (&kh->metadataTopics, entry);
+		}
+
+		evPtr->rkts = kafkatcl_metadata_topics_new (kh, topicCount, topics);
+		ckfree (topics);
+
+		if (evPtr->rkts == NULL) {
+			Tcl_ResetResult (kh->interp);
+			ckfree (evPtr);
+			return;
+		}
+		evPtr->rktCount = topicCount;
+	}
+
+	if (Tcl_CreateThread (&kh->metadataThread, kafkatcl_metadata_thread, evPtr, TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+		// carry on with what we have and try again when the TTL is up
+		kafkatcl_metadata_topics_destroy (evPtr->rktCount, evPtr->rkts);
+		ckfree (evPtr);
+		return;
+	}
+
+	kh->metadataRefreshing = 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_metadata_ensure --
+ *
+ *    make sure a handle has the whole cluster's metadata, fetching it
+ *    if it has none.  if it has a TTL and the metadata is older than
+ *    that, a refresh is started in the background and the metadata we
+ *    have is used in the meantime.
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_metadata_ensure (kafkatcl_handleClientData *kh) {
+	if (kh->metadata == NULL) {
+		return kafkatcl_refresh_metadata (kh);
+	}
+
+	if (kh->metadataTTL <= 0 || kh->metadataRefreshing || kafkatcl_now_ms () - kh->metadataFetched < kh->metadataTTL) {
+		return TCL_OK;
+	}
+
+	kh->metadataFetched = kafkatcl_now_ms ();
+	kafkatcl_metadata_refresh_in_background (kh);
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_metadata_ensure_topic --
+ *
+ *    make sure a handle has metadata for a topic, fetching it for that
+ *    topic alone if it has none.  as with kafkatcl_metadata_ensure,
+ *    metadata older than the TTL is refreshed in the background.
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_metadata_ensure_topic (kafkatcl_handleClientData *kh, char *topicName) {
+	Tcl_HashEntry *entry = Tcl_FindHashEntry (&kh->metadataTopics, topicName);
+	kafkatcl_metadataTopic *mt;
+
+	if (entry == NULL) {
+		return kafkatcl_refresh_topic_metadata (kh, 1, &topicName);
+	}
+
+	mt = (kafkatcl_metadataTopic *)Tcl_GetHashValue (entry);
+	if (kh->metadataTTL <= 0 || kh->metadataRefreshing || kafkatcl_now_ms () - mt->fetched < kh->metadataTTL) {
+		return TCL_OK;
+	}
+
+	mt->fetched = kafkatcl_now_ms ();
+	kafkatcl_metadata_refresh_in_background (kh);
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_metadata_cleanup --
+ *
+ *    let go of a handle's metadata, waiting for a background refresh
+ *    to finish first since it's using the librdkafka handle
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_metadata_cleanup (kafkatcl_handleClientData *kh) {
+	Tcl_HashSearch search;
+	Tcl_HashEntry *entry;
+
+	if (kh->metadataRefreshing) {
+		int threadResult;
+
+		Tcl_JoinThread (kh->metadataThread, &threadResult);
+		kh->metadataRefreshing = 0;
+	}
+
+	Tcl_DeleteEvents (kafkatcl_metadata_match, (ClientData)kh);
+
+	if (kh->partitionChangeCallbackObj != NULL) {
+		Tcl_DecrRefCount (kh->partitionChangeCallbackObj);
+		kh->partitionChangeCallbackObj = NULL;
+	}
+
+	for (entry = Tcl_FirstHashEntry (&kh->metadataTopics, &search); entry != NULL; entry = Tcl_NextHashEntry (&search)) {
+		kafkatcl_metadata_topic_delete (entry);
+	}
+	Tcl_DeleteHashTable (&kh->metadataTopics);
+
+	// destroy metadata if it exists
+	if (kh->metadataBlock != NULL) {
+		kafkatcl_metadata_block_release (kh->metadataBlock);
+		kh->metadataBlock = NULL;
+		kh->metadata = NULL;
+	}
+}
+
+static void
+metadata_print (const char *topic, const struct rd_kafka_metadata *metadata) {
+	int i, j, k;
+
+	printf("Metadata for %s (from broker %"PRId32": %s):\n",
+	   topic ? : "all topics",
+	   metadata->orig_broker_id,
+	   metadata->orig_broker_name);
+
+
+	/* Iterate brokers */
+	printf(" %i brokers:\n", metadata->broker_cnt);
+	for (i = 0 ; i < metadata->broker_cnt ; i++)
+		printf("  broker %"PRId32" at %s:%i\n", metadata->brokers[i].id, metadata->brokers[i].host, metadata->brokers[i].port);
+
+	/* Iterate topics */
+	printf(" %i topics:\n", metadata->topic_cnt);
+	for (i = 0 ; i < metadata->topic_cnt ; i++) {
+		const struct rd_kafka_metadata_topic *t = &metadata->topics[i];
+
+		printf("  topic \"%s\" with %i partitions:", t->topic, t->partition_cnt);
+		if (t->err) {
+			printf(" %s", rd_kafka_err2str(t->err));
+			if (t->err == RD_KAFKA_RESP_ERR_LEADER_NOT_AVAILABLE)
+				printf(" (try again)");
+		}
+		printf("\n");
+
+		/* Iterate topic's partitions */
+		for (j = 0 ; j < t->partition_cnt ; j++) {
+			const struct rd_kafka_metadata_partition *p;
+			p = &t->partitions[j];
+			printf("    partition %"PRId32", " "leader %"PRId32", replicas: ", p->id, p->leader);
+
+			/* Iterate partition's replicas */
+			for (k = 0 ; k < p->replica_cnt ; k++) {
+				printf("%s%"PRId32, k > 0 ? ",":"", p->replicas[k]);
+			}
+
+			/* Iterate partition's ISRs */
+			printf(", isrs: ");
+
+			for (k = 0 ; k < p->isr_cnt ; k++) {
+				printf("%s%"PRId32, k > 0 ? ",":"", p->isrs[k]);
+				if (p->err) {
+					printf(", %s\n", rd_kafka_err2str(p->err));
+				} else {
+					printf("\n");
+				}
+			}
+		}
+	}
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_handle_meta --
+ *
+ *    handle the "meta" subcommand of a producer, consumer or subscriber
+ *    handle
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_handle_meta (Tcl_Interp *interp, kafkatcl_handleClientData *kh, int objc, Tcl_Obj *CONST objv[]) {
+	int suboptIndex;
+
+	if (objc < 3) {
+		Tcl_WrongNumArgs (interp, 2, objv, "refresh|print|ttl|on_partition_change ?args?");
+		return TCL_ERROR;
+	}
+
+	static CONST char *subOptions[] = {
+		"refresh",
+		"print",
+		"ttl",
+		"on_partition_change",
+		NULL
+	};
+
+	enum subOptions {
+		SUBOPT_REFRESH,
+		SUBOPT_PRINT,
+		SUBOPT_TTL,
+		SUBOPT_ON_PARTITION_CHANGE
+	};
+
+	// argument must be one of the subOptions defined above
+	if (Tcl_GetIndexFromObj (interp, objv[2], subOptions, "suboption",
+		TCL_EXACT, &suboptIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	switch ((enum subOptions) suboptIndex) {
+		case SUBOPT_REFRESH: {
+			Tcl_Obj *commandObj = NULL;
+			int firstTopic = 3;
+			int topicCount;
+			char **topics;
+			int i;
+			int resultCode;
+
+			if (objc > 3 && strcmp (Tcl_GetString (objv[3]), "-command") == 0) {
+				if (objc < 5) {
+					Tcl_WrongNumArgs (interp, 3, objv, "?-command command? ?topic ...?");
+					return TCL_ERROR;
+				}
+				commandObj = objv[4];
+				firstTopic = 5;
+			}
+			topicCount = objc - firstTopic;
+
+			if (commandObj == NULL && topicCount == 0) {
+				return kafkatcl_refresh_metadata (kh);
+			}
+
+			// just the named topics, all in one request
+			topics = (char **)ckalloc (sizeof (char *) * (topicCount + 1));
+			for (i = 0; i < topicCount; i++) {
+				topics[i] = Tcl_GetString (objv[firstTopic + i]);
+			}
+
+			if (commandObj == NULL) {
+				resultCode = kafkatcl_refresh_topic_metadata (kh, topicCount, topics);
+			} else if (topicCount == 0) {
+				resultCode = kafkatcl_query_start (kh, kafkatcl_query_new (kh, KAFKATCL_QUERY_METADATA, commandObj, KAFKATCL_METADATA_TIMEOUT_MS));
+			} else {
+				rd_kafka_topic_t **rkts = kafkatcl_metadata_topics_new (kh, topicCount, topics);
+
+				if (rkts == NULL) {
+					resultCode = TCL_ERROR;
+				} else {
+					kafkatcl_queryEvent *evPtr = kafkatcl_query_new (kh, KAFKATCL_QUERY_METADATA, commandObj, KAFKATCL_METADATA_TIMEOUT_MS);
+
+					evPtr->rktCount = topicCount;
+					evPtr->rkts = rkts;
+					resultCode = kafkatcl_query_start (kh, evPtr);
+				}
+			}
+
+			ckfree (topics);
+			return resultCode;
+		}
+
+		case SUBOPT_PRINT: {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 3, objv, "");
+				return TCL_ERROR;
+			}
+
+			if (kafkatcl_metadata_ensure (kh) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			metadata_print (NULL, kh->metadata);
+			break;
+		}
+
+		case SUBOPT_TTL: {
+			int ttl;
+
+			if (objc > 4) {
+				Tcl_WrongNumArgs (interp, 3, objv, "?milliseconds?");
+				return TCL_ERROR;
+			}
+
+			if (objc == 3) {
+				Tcl_SetObjResult (interp, Tcl_NewIntObj (kh->metadataTTL));
+				break;
+			}
+
+			if (Tcl_GetIntFromObj (interp, objv[3], &ttl) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (ttl < 0) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("ttl can't be negative", -1));
+				return TCL_ERROR;
+			}
+
+			kh->metadataTTL = ttl;
+			break;
+		}
+
+		case SUBOPT_ON_PARTITION_CHANGE: {
+			if (objc > 4) {
+				Tcl_WrongNumArgs (interp, 3, objv, "?command?");
+				return TCL_ERROR;
+			}
+
+			if (objc == 3) {
+				if (kh->partitionChangeCallbackObj != NULL) {
+					Tcl_SetObjResult (interp, kh->partitionChangeCallbackObj);
+				}
+				break;
+			}
+
+			if (kh->partitionChangeCallbackObj != NULL) {
+				Tcl_DecrRefCount (kh->partitionChangeCallbackObj);
+				kh->partitionChangeCallbackObj = NULL;
+			}
+
+			if (*Tcl_GetString (objv[3]) != '\0') {
+				kh->partitionChangeCallbackObj = objv[3];
+				Tcl_IncrRefCount (kh->partitionChangeCallbackObj);
+			}
+			break;
+		}
+	}
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_backpressure_over --
+ *
+ *    return 1 if a handle has more consumed messages or bytes waiting
+ *    for their callbacks than its high-water marks allow
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_backpressure_over (kafkatcl_handleClientData *kh) {
+	if (kh->backpressureHighMessages > 0 && kh->pendingMessages > kh->backpressureHighMessages) {
+		return 1;
+	}
+
+	if (kh->backpressureHighBytes > 0 && kh->pendingBytes > kh->backpressureHighBytes) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_backpressure_add --
+ *
+ *    account for a consumed message about to be passed to a callback
+ *    through the event loop.  while the handle is over its high-water
+ *    marks, the partition each new message comes from is paused, so
+ *    librdkafka stops fetching it while the callbacks catch up.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_backpressure_add (kafkatcl_handleClientData *kh, rd_kafka_message_t *rkmessage, size_t bytes) {
+	rd_kafka_topic_partition_list_t *partitions;
+	const char *topic;
+
+	kh->pendingMessages++;
+	kh->pendingBytes += bytes;
+
+	if (!kafkatcl_backpressure_over (kh) || rkmessage->rkt == NULL) {
+		return;
+	}
+
+	topic = rd_kafka_topic_name (rkmessage->rkt);
+
+	// messages already fetched from a partition the application paused
+	// still arrive, but it's up to the application to resume it
+	if (kh->appPaused != NULL && rd_kafka_topic_partition_list_find (kh->appPaused, topic, rkmessage->partition) != NULL) {
+		return;
+	}
+
+	if (kh->backpressurePaused == NULL) {
+		kh->backpressurePaused = rd_kafka_topic_partition_list_new (0);
+	} else if (rd_kafka_topic_partition_list_find (kh->backpressurePaused, topic, rkmessage->partition) != NULL) {
+		return;
+	}
+
+	partitions = rd_kafka_topic_partition_list_new (1);
+	rd_kafka_topic_partition_list_add (partitions, topic, rkmessage->partition);
+
+	if (rd_kafka_pause_partitions (kh->rk, partitions) == RD_KAFKA_RESP_ERR_NO_ERROR && partitions->elems[0].err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+		rd_kafka_topic_partition_list_add (kh->backpressurePaused, topic, rkmessage->partition);
+	}
+
+	rd_kafka_topic_partition_list_destroy (partitions);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_backpressure_release --
+ *
+ *    account for consumed messages that have been passed to their
+ *    callback or thrown away.  once the handle is down to its low-water
+ *    marks, the partitions it paused are resumed, other than any the
+ *    application has since paused itself.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_backpressure_release (kafkatcl_handleClientData *kh, int messages, size_t bytes) {
+	kh->pendingMessages -= messages;
+	kh->pendingBytes -= bytes;
+
+	if (kh->backpressurePaused == NULL) {
+		return;
+	}
+
+	if (kh->backpressureHighMessages > 0 && kh->pendingMessages > kh->backpressureLowMessages) {
+		return;
+	}
+
+	if (kh->backpressureHighBytes > 0 && kh->pendingBytes > kh->backpressureLowBytes) {
+		return;
+	}
+
+	if (kh->appPaused != NULL) {
+		int i;
+
+		for (i = 0; i < kh->appPaused->cnt; i++) {
+			rd_kafka_topic_partition_list_del (kh->backpressurePaused, kh->appPaused->elems[i].topic, kh->appPaused->elems[i].partition);
+		}
+	}
+
+	if (kh->backpressurePaused->cnt > 0) {
+		rd_kafka_resume_partitions (kh->rk, kh->backpressurePaused);
+	}
+	rd_kafka_topic_partition_list_destroy (kh->backpressurePaused);
+	kh->backpressurePaused = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_backpressure_forget --
+ *
+ *    stop tracking partitions the application has paused or resumed
+ *    itself, so we don't resume them behind its back
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_backpressure_forget (kafkatcl_handleClientData *kh, rd_kafka_topic_partition_list_t *partitions) {
+	int i;
+
+	if (kh->backpressurePaused == NULL) {
+		return;
+	}
+
+	for (i = 0; i < partitions->cnt; i++) {
+		rd_kafka_topic_partition_list_del (kh->backpressurePaused, partitions->elems[i].topic, partitions->elems[i].partition);
+	}
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_consume_callback_eventProc --
+ *
+ *    this routine is called by the Tcl event handler to process consume
+ *    callbacks we have gotten from the Kafka cpp-driver
+ *
+ * Results:
+ *    returns 1 to say we handled the event and the dispatcher can delete it
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_consume_callback_eventProc (Tcl_Event *tevPtr, int flags) {
+
+	// we got called with a Tcl_Event pointer but really it's a pointer to
+	// our kafkatcl_statsEvent structure that has the Tcl_Event and
+	// some other stuff that we need.
+	// Go get that.
+
+	kafkatcl_consumeCallbackEvent *evPtr = (kafkatcl_consumeCallbackEvent *)tevPtr;
+	kafkatcl_runningConsumer *krc = evPtr->krc;
+
+	assert (krc->kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
+
+	Tcl_Interp *interp = krc->kh->interp;
+
+	kafkatcl_backpressure_release (krc->kh, 1, evPtr->bytes);
+
+	Tcl_Obj *listObj = kafkatcl_message_ref_to_tcl_list (interp, evPtr->ref, krc->fields);
+
+	// the list holds its own reference to the message if it needs it
+	kafkatcl_message_ref_release (evPtr->ref);
+
+	// even if this fails we still want the event taken off the queue
+	// this function will do the background error thing if there is a tcl
+	// error running the callback
+
+	if (listObj != NULL) {
+		kafkatcl_invoke_callback_with_argument (interp, krc->callbackObj, listObj);
+		// danger: no longer safe to touch krc from here onwards, the callback may have freed it!
+	}
+
+	// tell the dispatcher we handled it.  0 would mean we didn't deal with
+	// it and don't want it removed from the queue
+	return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_consume_callback_queue_eventProc --
+ *
+ *    this routine is called by the Tcl event handler to process consume
+ *    callbacks we have gotten for queues from the Kafka cpp-driver
+ *
+ * Results:
+ *    returns 1 to say we handled the event and the dispatcher can delete it
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_consume_callback_queue_eventProc (Tcl_Event *tevPtr, int flags) {
+
+	// we got called with a Tcl_Event pointer but really it's a pointer to
+	// our kafkatcl_statsEvent structure that has the Tcl_Event and
+	// some other stuff that we need.
+	// Go get that.
+
+	kafkatcl_consumeCallbackEvent *evPtr = (kafkatcl_consumeCallbackEvent *)tevPtr;
+	kafkatcl_runningConsumer *krc = evPtr->krc;
+
+	assert (krc->kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
+
+	Tcl_Interp *interp = krc->kh->interp;
+
+	kafkatcl_backpressure_release (krc->kh, 1, evPtr->bytes);
+
+	Tcl_Obj *listObj = kafkatcl_message_ref_to_tcl_list (interp, evPtr->ref, krc->fields);
+
+	// the list holds its own reference to the message if it needs it
+	kafkatcl_message_ref_release (evPtr->ref);
+
+	// even if this fails we still want the event taken off the queue
+	// this function will do the background error thing if there is a tcl
+	// error running the callback
+	if (listObj != NULL) {
+		// free the payload
+		kafkatcl_invoke_callback_with_argument (interp, krc->callbackObj, listObj);
+		// danger: no longer safe to touch krc from here onwards, the callback may have freed it!
+	}
+
+	// tell the dispatcher we handled it.  0 would mean we didn't deal with
+	// it and don't want it removed from the queue
+	return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_consume_batch_eventProc --
+ *
+ *    this routine is called by the Tcl event handler to pass a batch
+ *    of consumed messages to a topic or queue callback
+ *
+ * Results:
+ *    returns 1 to say we handled the event and the dispatcher can delete it
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_consume_batch_eventProc (Tcl_Event *tevPtr, int flags) {
+	kafkatcl_consumeBatchEvent *evPtr = (kafkatcl_consumeBatchEvent *)tevPtr;
+	kafkatcl_runningConsumer *krc = evPtr->krc;
+
+	assert (krc->kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
+
+	kafkatcl_backpressure_release (krc->kh, evPtr->messageCount, evPtr->byteCount);
+
+	kafkatcl_invoke_callback_with_argument (krc->kh->interp, krc->callbackObj, evPtr->batchObj);
+	// danger: no longer safe to touch krc from here onwards, the callback may have freed it!
+
+	Tcl_DecrRefCount (evPtr->batchObj);
+	return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_consume_batch_flush --
+ *
+ *    queue the batch a running consumer has accumulated, if any, as a
+ *    single event for its callback
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_consume_batch_flush (kafkatcl_runningConsumer *krc) {
+	kafkatcl_consumeBatchEvent *evPtr;
+
+	if (krc->lingerTimer != NULL) {
+		Tcl_DeleteTimerHandler (krc->lingerTimer);
+		krc->lingerTimer = NULL;
+	}
+
+	if (krc->batchObj == NULL) {
+		return;
+	}
+
+	evPtr = ckalloc (sizeof (kafkatcl_consumeBatchEvent));
+	evPtr->event.proc = kafkatcl_consume_batch_eventProc;
+	evPtr->krc = krc;
+
+	// the event takes over our reference
+	evPtr->batchObj = krc->batchObj;
+	evPtr->messageCount = krc->batchMessages;
+	evPtr->byteCount = krc->batchBytes;
+	krc->batchObj = NULL;
+	krc->batchMessages = 0;
+	krc->batchBytes = 0;
+
+	Tcl_ThreadQueueEvent (krc->kh->threadId, (Tcl_Event *)evPtr, krc->kh->ko->eventPosition[KAFKATCL_EVENT_CONSUME]);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_consume_batch_discard --
+ *
+ *    throw away a running consumer's partial batch, if any
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_consume_batch_discard (kafkatcl_runningConsumer *krc) {
+	if (krc->lingerTimer != NULL) {
+		Tcl_DeleteTimerHandler (krc->lingerTimer);
+		krc->lingerTimer = NULL;
+	}
+
+	if (krc->batchObj != NULL) {
+		Tcl_DecrRefCount (krc->batchObj);
+		krc->batchObj = NULL;
+		kafkatcl_backpressure_release (krc->kh, krc->batchMessages, krc->batchBytes);
+		krc->batchMessages = 0;
+		krc->batchBytes = 0;
+	}
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_consume_batch_timerProc --
+ *
+ *    timer handler that sends off a partial batch once it has been
+ *    lingering for the running consumer's linger time
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_consume_batch_timerProc (ClientData clientData) {
+	kafkatcl_runningConsumer *krc = (kafkatcl_runningConsumer *)clientData;
+
+	krc->lingerTimer = NULL;
+	kafkatcl_consume_batch_flush (krc);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_consume_batch_append --
+ *
+ *    add a consumed message to a running consumer's batch, sending the
+ *    batch off when it's full.  the first message of a batch starts the
+ *    linger timer.
+ *
+ *    we're called on the Tcl thread from inside kafkatcl_check_consumer_callbacks,
+ *    so we can build the Tcl list directly rather than queueing an
+ *    event per message.
+ *
+ *    takes over the caller's reference to the message.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_consume_batch_append (kafkatcl_runningConsumer *krc, kafkatcl_messageRef *ref) {
+	Tcl_Obj *listObj = kafkatcl_message_ref_to_tcl_list (krc->kh->interp, ref, krc->fields);
+	int length;
+
+	if (listObj != NULL) {
+		size_t bytes = ref->rkmessage->len + ref->rkmessage->key_len;
+
+		kafkatcl_backpressure_add (krc->kh, ref->rkmessage, bytes);
+		krc->batchMessages++;
+		krc->batchBytes += bytes;
+	}
+
+	kafkatcl_message_ref_release (ref);
+
+	if (listObj == NULL) {
+		return;
+	}
+
+	if (krc->batchObj == NULL) {
+		krc->batchObj = Tcl_NewListObj (0, NULL);
+		Tcl_IncrRefCount (krc->batchObj);
+		krc->lingerTimer = Tcl_CreateTimerHandler (krc->lingerMS, kafkatcl_consume_batch_timerProc, (ClientData)krc);
+	}
+
+	Tcl_ListObjAppendElement (NULL, krc->batchObj, listObj);
+	Tcl_ListObjLength (NULL, krc->batchObj, &length);
+
+	if (length >= krc->batchSize) {
+		kafkatcl_consume_batch_flush (krc);
+	}
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_consume_callback --
+ *
+ *    this routine is called for each message kafkatcl_check_consumer_callbacks
+ *    gets from a queue being consumed with callbacks.  it takes over
+ *    ownership of the message.
+ *
+ *    the message itself goes into the event, so that the payload can
+ *    be handed to Tcl without being copied
+ *
+ * Results:
+ *    an event is queued to the thread that set up the callback
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+kafkatcl_consume_callback (rd_kafka_message_t *rkmessage, void *opaque) {
+	kafkatcl_runningConsumer *krc = opaque;
+	kafkatcl_consumeCallbackEvent *evPtr;
+	kafkatcl_messageRef *ref;
+	int rangeFinished = 0;
+
+	// a partition consumed by consume_range stops at the end of the range
+	if (krc->range != NULL) {
+		if (krc->rangeEnd == RD_KAFKA_OFFSET_INVALID) {
+			rd_kafka_message_destroy (rkmessage);
+			return;
+		}
+
+		int accept = kafkatcl_range_accept (rkmessage, krc->rangeEnd, &rangeFinished);
+
+		if (rangeFinished) {
+			krc->rangeEnd = RD_KAFKA_OFFSET_INVALID;
+			kafkatcl_range_pause (krc->kh, rd_kafka_topic_name (krc->kt->rkt), krc->partition);
+		}
+
+		if (!accept) {
+			rd_kafka_message_destroy (rkmessage);
+			if (rangeFinished) {
+				kafkatcl_range_queue_done (krc->range, krc);
+			}
+			return;
+		}
+	}
+
+	ref = kafkatcl_message_ref_new (krc->kh, rkmessage);
+
+	if (krc->batchSize > 0) {
+		kafkatcl_consume_batch_append (krc, ref);
+		return;
+	}
+
+	evPtr = ckalloc (sizeof (kafkatcl_consumeCallbackEvent));
+
+	evPtr->krc = krc;
+	evPtr->ref = ref;
+	evPtr->bytes = rkmessage->len + rkmessage->key_len;
+	kafkatcl_backpressure_add (krc->kh, rkmessage, evPtr->bytes);
+
+	if (krc->kq == NULL) {
+		evPtr->event.proc = kafkatcl_consume_callback_eventProc;
+	} else {
+		evPtr->event.proc = kafkatcl_consume_callback_queue_eventProc;
+	}
+
+	Tcl_ThreadQueueEvent (krc->kh->threadId, (Tcl_Event *)evPtr, krc->kh->ko->eventPosition[KAFKATCL_EVENT_CONSUME]);
+
+	if (rangeFinished) {
+		kafkatcl_range_queue_done (krc->range, krc);
+	}
+	return;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_partition_key --
+ *
+ *    fill in a hash key for a topic and partition
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_partition_key (kafkatcl_partitionKey *key, rd_kafka_topic_t *rkt, int32_t partition) {
+	memset (key, 0, sizeof (*key));
+	key->rkt = rkt;
+	key->partition = partition;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_consume_callback_dispatch --
+ *
+ *    this routine is called for messages from the handle's callback
+ *    queue, which all partitions started with a callback feed into.
+ *    It looks up the running consumer for the message's topic and
+ *    partition and hands it on to kafkatcl_consume_callback.
+ *
+ *    takes over ownership of the message.
+ *
+ * Results:
+ *    an event is queued to the thread that set up the callback
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_consume_callback_dispatch (rd_kafka_message_t *rkmessage, void *opaque) {
+	kafkatcl_handleClientData *kh = opaque;
+	kafkatcl_partitionKey key;
+	Tcl_HashEntry *hashEntry;
+
+	kafkatcl_partition_key (&key, rkmessage->rkt, rkmessage->partition);
+	hashEntry = Tcl_FindHashEntry (&kh->callbackConsumers, (char *)&key);
+
+	// the partition may have been stopped while this was queued
+	if (hashEntry == NULL) {
+		rd_kafka_message_destroy (rkmessage);
+		return;
+	}
+
+	kafkatcl_consume_callback (rkmessage, Tcl_GetHashValue (hashEntry));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_callback_queue --
+ *
+ *    return the handle's callback queue, creating it and having
+ *    librdkafka signal our wakeup pipe for it the first time through
+ *
+ *----------------------------------------------------------------------
+ */
+rd_kafka_queue_t *
+kafkatcl_callback_queue (kafkatcl_handleClientData *kh) {
+	if (kh->callbackQueue == NULL) {
+		kh->callbackQueue = rd_kafka_queue_new (kh->rk);
+		kafkatcl_wakeup_watch_queue (kh, kh->callbackQueue);
+	}
+	return kh->callbackQueue;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_set_conf --
+ *
+ *    given an object client data and a topic config var and value,
+ *		set the topic configuration property
+ *
+ *    returns an error if rd_kafka_conf_set returns an error
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_set_conf (kafkatcl_objectClientData *ko, char *name, char *value) {
+	Tcl_Interp *interp = ko->interp;
+	char errStr[256];
+
+	rd_kafka_conf_res_t res = rd_kafka_conf_set (ko->conf, name, value, errStr, sizeof(errStr));
+
+	if (res != RD_KAFKA_CONF_OK) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj (errStr, -1));
+		return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_set_topic_conf --
+ *
+ *    given an object client data and a topic config var and value,
+ *		set the topic configuration property
+ *
+ *    returns an error if rd_kafka_topic_conf_set returns an error
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_set_topic_conf (Tcl_Interp *interp, rd_kafka_topic_conf_t *topicConf, char *name, char *value) {
+	char errStr[256];
+
+	rd_kafka_conf_res_t res = rd_kafka_topic_conf_set (topicConf, name, value, errStr, sizeof(errStr));
+
+	if (res != RD_KAFKA_CONF_OK) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj (errStr, -1));
+		return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_handle_topic_conf --
+ *
+ *    given an object client data and a topic config var and value,
+ *		set the topic configuration property
+ *
+ *    returns an error if rd_kafka_topic_conf_set returns an error
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_handle_topic_conf (Tcl_Interp *interp, rd_kafka_topic_conf_t *topicConf, int objc, Tcl_Obj *CONST objv[]) {
+	if (objc % 2 != 0) {
+		Tcl_WrongNumArgs (interp, 2, objv, "?name value ...?");
+		return TCL_ERROR;
+	}
+
+	if (objc == 0) {
+		return kafkatcl_topic_conf_to_list (interp, topicConf);
+	}
+
+	int i;
+	int resultCode = TCL_OK;
+	for (i = 0; i < objc; i += 2) {
+		char *name = Tcl_GetString (objv[i]);
+		char *value = Tcl_GetString (objv[i + 1]);
+
+		resultCode = kafkatcl_set_topic_conf (interp, topicConf, name, value);
+
+		if (resultCode == TCL_ERROR) {
+			break;
+		}
+	}
+	return resultCode;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_partitioner_conf --
+ *
+ *    given an object client data and a topic config structure,
+ *    parse the partitioner name and set the partitioner into
+ *    the topic conf if it can be figured out.
+ *
+ *    the partitioner is set by name through the "partitioner" topic
+ *    property rather than as a callback, so that librdkafka's sticky
+ *    partitioning of unkeyed messages applies to the *_random
+ *    partitioners and kafkatcl_key_partitioner can tell which one it is.
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_partitioner_conf (Tcl_Interp *interp, rd_kafka_topic_conf_t *topicConf, int objc, Tcl_Obj *CONST objv[]) {
+	int suboptIndex;
+	char errstr[512];
+
+	static CONST char *subOptions[] = {
+		"random",
+		"consistent",
+		"consistent_random",
+		"murmur2",
+		"murmur2_random",
+		"fnv1a",
+		"fnv1a_random",
+		"sticky",
+		NULL
+	};
+
+	// the librdkafka partitioner for each of the subOptions.  sticky is
+	// the partitioner of the Java client: murmur2 for keyed messages,
+	// and unkeyed messages stick to a partition for a batch at a time
+	static CONST char *partitionerNames[] = {
+		"random",
+		"consistent",
+		"consistent_random",
+		"murmur2",
+		"murmur2_random",
+		"fnv1a",
+		"fnv1a_random",
+		"murmur2_random"
+	};
+
+	// argument must be one of the subOptions defined above
+	if (Tcl_GetIndexFromObj (interp, objv[0], subOptions, "suboption",
+		TCL_EXACT, &suboptIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (rd_kafka_topic_conf_set (topicConf, "partitioner", partitionerNames[suboptIndex], errstr, sizeof (errstr)) != RD_KAFKA_CONF_OK) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj (errstr, -1));
+		return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_key_partitioner --
+ *
+ *    return the librdkafka partitioner that a topic conf's partitioner
+ *    puts keyed messages into partitions with.  the *_random ones only
+ *    differ from their plain counterparts for unkeyed messages.  the
+ *    random partitioner doesn't go by the key at all, so for it this is
+ *    consistent, the same as it has always been.
+ *
+ *----------------------------------------------------------------------
+ */
+kafkatcl_partitionerProc *
+kafkatcl_key_partitioner (const rd_kafka_topic_conf_t *topicConf) {
+	char name[64];
+	size_t nameSize = sizeof (name);
+
+	if (rd_kafka_topic_conf_get (topicConf, "partitioner", name, &nameSize) != RD_KAFKA_CONF_OK) {
+		return rd_kafka_msg_partitioner_consistent;
+	}
+
+	if (strncmp (name, "murmur2", 7) == 0) {
+		return rd_kafka_msg_partitioner_murmur2;
+	}
+
+	if (strncmp (name, "fnv1a", 5) == 0) {
+		return rd_kafka_msg_partitioner_fnv1a;
+	}
+
+	return rd_kafka_msg_partitioner_consistent;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_handle_topic_info --
+ *
+ *    given a pointer to a topic client data and an objc and objv for
+ *    a topic producer or topic consumer object, handle the "info"
+ *    suboption for that topic consumer or producer
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_handle_topic_info (Tcl_Interp *interp, kafkatcl_topicClientData *kt, int objc, Tcl_Obj *CONST objv[]) {
+	int suboptIndex;
+
+	if ((objc < 3) || (objc > 4)) {
+		Tcl_WrongNumArgs (interp, 2, objv, "option");
+		return TCL_ERROR;
+	}
+
+	static CONST char *subOptions[] = {
+		"name",
+		"partitions",
+		"consistent_partition",
+		"partitions_for_keys",
+		"output_queue_length",
+		NULL
+	};
+
+	enum subOptions {
+		SUBOPT_NAME,
+		SUBOPT_PARTITIONS,
+		SUBOPT_CONSISTENT_PARTITION,
+		SUBOPT_PARTITIONS_FOR_KEYS,
+		SUBOPT_OUTPUT_QUEUE_LENGTH
+	};
+
+	// argument must be one of the subOptions defined above
+	if (Tcl_GetIndexFromObj (interp, objv[2], subOptions, "suboption",
+		TCL_EXACT, &suboptIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	kafkatcl_handleClientData *kh = kt->kh;
+    assert (kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
+
+	switch ((enum subOptions) suboptIndex) {
+		case SUBOPT_NAME: {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 3, objv, "");
+				return TCL_ERROR;
+			}
+
+			Tcl_SetObjResult (interp, Tcl_NewStringObj (kt->topic, -1));
+			break;
+		}
+
+		case SUBOPT_PARTITIONS: {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 3, objv, "");
+				return TCL_ERROR;
+			}
+
+			return kafkatcl_meta_topic_partitions (kh, kt->topic);
+		}
+
+		case SUBOPT_CONSISTENT_PARTITION: {
+			unsigned char *key = NULL;
+			int keyLen = 0;
+			int whichPartition;
+			const struct rd_kafka_metadata_topic *t;
+
+			if (objc != 4) {
+				Tcl_WrongNumArgs (interp, 3, objv, "key");
+				return TCL_ERROR;
+			}
+
+			if (kafkatcl_meta_find_topic_tcl_result (kh, kt->topic, &t) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			// the same bytes produce hands the partitioner, so a key
+			// that isn't plain ascii gets the same partition
+			key = Tcl_GetByteArrayFromObj (objv[3], &keyLen);
+
+			if (t->partition_cnt == 0) {
+				whichPartition = -1;
+			} else {
+				whichPartition = kt->keyPartitioner (kt->rkt, key, keyLen, t->partition_cnt, NULL, NULL);
+			}
+
+			Tcl_SetObjResult (interp, Tcl_NewIntObj (whichPartition));
+			break;
+		}
+
+		case SUBOPT_PARTITIONS_FOR_KEYS: {
+			const struct rd_kafka_metadata_topic *t;
+			int keyObjc;
+			Tcl_Obj **keyObjv;
+			Tcl_Obj **partitionObjs;
+			Tcl_Obj **resultObjv;
+			int i;
+
+			if (objc != 4) {
+				Tcl_WrongNumArgs (interp, 3, objv, "keyList");
+				return TCL_ERROR;
+			}
+
+			if (Tcl_ListObjGetElements (interp, objv[3], &keyObjc, &keyObjv) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			// look up the partition count once for all the keys
+			if (kafkatcl_meta_find_topic_tcl_result (kh, kt->topic, &t) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			resultObjv = (Tcl_Obj **)ckalloc (sizeof (Tcl_Obj *) * (keyObjc + 1));
+
+			if (t->partition_cnt == 0) {
+				// made only if there's a key to share it, so it isn't leaked
+				Tcl_Obj *noPartitionObj = (keyObjc > 0) ? Tcl_NewIntObj (-1) : NULL;
+
+				for (i = 0; i < keyObjc; i++) {
+					resultObjv[i] = noPartitionObj;
+				}
+			} else {
+				kafkatcl_partitionerProc *keyPartitioner = kt->keyPartitioner;
+				int32_t partitionCount = t->partition_cnt;
+
+				// share one object per partition rather than making
+				// one per key, there being far fewer partitions than keys
+				partitionObjs = (Tcl_Obj **)ckalloc (sizeof (Tcl_Obj *) * partitionCount);
+				for (i = 0; i < partitionCount; i++) {
+					partitionObjs[i] = NULL;
+				}
+
+				for (i = 0; i < keyObjc; i++) {
+					int keyLen;
+					unsigned char *key = Tcl_GetByteArrayFromObj (keyObjv[i], &keyLen);
+					int32_t whichPartition = keyPartitioner (kt->rkt, key, keyLen, partitionCount, NULL, NULL);
+
+					if (partitionObjs[whichPartition] == NULL) {
+						partitionObjs[whichPartition] = Tcl_NewIntObj (whichPartition);
+					}
+					resultObjv[i] = partitionObjs[whichPartition];
+				}
+
+				ckfree (partitionObjs);
+			}
+
+			Tcl_SetObjResult (interp, Tcl_NewListObj (keyObjc, resultObjv));
+			ckfree (resultObjv);
+			break;
+		}
+
+		case SUBOPT_OUTPUT_QUEUE_LENGTH: {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 3, objv, "");
+				return TCL_ERROR;
+			}
+
+			Tcl_SetObjResult (interp, Tcl_NewIntObj (rd_kafka_outq_len (kh->rk)));
+			break;
+		}
+	}
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_consume_start --
+ *
+ *    given a pointer to a topic client data, a partition, an offset,
+ *    and a possibly NULL callback routine, arrange to consume
+ *    from the topic and partition at the specified offset,
+ *    calling the callback routine if it is non-NULL
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_consume_start (kafkatcl_topicClientData *kt, int partition, int64_t offset, Tcl_Obj *callbackObj, kafkatcl_consumeOptions *options) {
+	Tcl_Interp *interp = kt->kh->interp;
+	rd_kafka_topic_t *rkt = kt->rkt;
+
+	// tell librdkafka we want to start consuming this topic, partition,
+	// and offset.  if there's a callback, feed the partition into the
+	// handle's callback queue so that we don't have to go looking at
+	// every partition on every pass through the event loop
+	if (callbackObj != NULL) {
+		if (rd_kafka_consume_start_queue (rkt, partition, offset, kafkatcl_callback_queue (kt->kh)) < 0) {
+			return kafkatcl_last_error_to_tcl_error (interp);
+		}
+	} else if (rd_kafka_consume_start (rkt, partition, offset) < 0) {
+		return kafkatcl_last_error_to_tcl_error (interp);
+	}
+
+
+	//   lock down the callback object if there is one.
+	//
+	//   allocate and fill a running consumer structure.
+	//   insert the structure onto the list of running consumers for the topic.
+
+	if (callbackObj != NULL) {
+		Tcl_IncrRefCount (callbackObj);
+	}
+
+	kafkatcl_runningConsumer *krc = ckalloc (sizeof (kafkatcl_runningConsumer));
+	krc->kh = kt->kh;
+	krc->kt = kt;
+	krc->kq = NULL;
+	krc->partition = partition;
+	krc->callbackObj = callbackObj;
+	krc->fields = options->fields;
+	krc->batchSize = options->batchSize;
+	krc->lingerMS = options->lingerMS;
+	krc->batchObj = NULL;
+	krc->batchMessages = 0;
+	krc->batchBytes = 0;
+	krc->lingerTimer = NULL;
+	krc->range = NULL;
+	krc->rangeEnd = RD_KAFKA_OFFSET_INVALID;
+
+	KT_LIST_INSERT_HEAD (&kt->runningConsumers, krc, runningConsumerInstance);
+
+	if (callbackObj != NULL) {
+		kafkatcl_partitionKey key;
+		int new;
+
+		kafkatcl_partition_key (&key, rkt, partition);
+		Tcl_HashEntry *hashEntry = Tcl_CreateHashEntry (&kt->kh->callbackConsumers, (char *)&key, &new);
+		Tcl_SetHashValue (hashEntry, krc);
+	}
+
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_set_queue_consumer --
+ *
+ *    given a pointer to a queue client data and a tcl object containing
+ *    the callback function, set up a running consumer instance and
+ *    point to it from the queue client data.
+ *
+ *    handle the reference counts and work properly whether or not one
+ *    was already defined.  an empty callback removes it.
+ *
+ *    while a queue has a callback librdkafka signals the handle's
+ *    wakeup pipe when messages arrive on it.
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_set_queue_consumer (kafkatcl_queueClientData *kq, Tcl_Obj *callbackObj, kafkatcl_consumeOptions *options) {
+	kafkatcl_runningConsumer *krc;
+
+	if (Tcl_GetCharLength (callbackObj) == 0) {
+		if (kq->krc != NULL) {
+			kafkatcl_clear_queue_consumer (kq);
+		}
+		return TCL_OK;
+	}
+
+	Tcl_IncrRefCount (callbackObj);
+
+	krc = kq->krc;
+
+	if (krc == NULL) {
+		krc = ckalloc (sizeof (kafkatcl_runningConsumer));
+		krc->batchObj = NULL;
+		krc->batchMessages = 0;
+		krc->batchBytes = 0;
+		krc->lingerTimer = NULL;
+		krc->range = NULL;
+		krc->rangeEnd = RD_KAFKA_OFFSET_INVALID;
+		kafkatcl_wakeup_watch_queue (kq->kh, kq->rkqu);
+	} else {
+		// anything batched up so far goes to the old callback
+		kafkatcl_consume_batch_flush (krc);
+		Tcl_DecrRefCount (krc->callbackObj);
+	}
+
+	krc->kq = kq;
+	krc->kh = kq->kh;
+	krc->kt = NULL;
+	krc->partition = 0;
+	krc->callbackObj = callbackObj;
+	krc->fields = options->fields;
+	krc->batchSize = options->batchSize;
+	krc->lingerMS = options->lingerMS;
+
+	kq->krc = krc;
+
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_match_consumer_event --
+ *
+ *    return true if the passed-in event is an instance
+ *    of the passed-in client data.
+ *
+ *    this is used as an argument to Tcl_DeleteEvents in order for
+ *    kafkatcl_consume_stop to delete pending events for this topic
+ *    but leave other events alone.
+ *
+ *    Tcl_DeleteEvents frees the event itself, so the batch list or
+ *    message of a matching event is released here.
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_match_consumer_event(Tcl_Event *tevPtr, ClientData clientData) {
+	if (tevPtr->proc == kafkatcl_range_done_eventProc) {
+		kafkatcl_rangeDoneEvent *doneEvPtr = (kafkatcl_rangeDoneEvent *)tevPtr;
+
+		if (doneEvPtr->krc != (kafkatcl_runningConsumer *)clientData) {
+			return 0;
+		}
+
+		kafkatcl_range_release (doneEvPtr->range);
+		return 1;
+	}
+
+	if (tevPtr->proc == kafkatcl_consume_batch_eventProc) {
+		kafkatcl_consumeBatchEvent *batchEvPtr = (kafkatcl_consumeBatchEvent *)tevPtr;
+
+		if (batchEvPtr->krc != (kafkatcl_runningConsumer *)clientData) {
+			return 0;
+		}
+
+		kafkatcl_backpressure_release (batchEvPtr->krc->kh, batchEvPtr->messageCount, batchEvPtr->byteCount);
+		Tcl_DecrRefCount (batchEvPtr->batchObj);
+		return 1;
+	}
+
+    if (tevPtr->proc != kafkatcl_consume_callback_eventProc &&
+        tevPtr->proc != kafkatcl_consume_callback_queue_eventProc)
+        return 0;
+
+    kafkatcl_consumeCallbackEvent *evPtr = (kafkatcl_consumeCallbackEvent *)tevPtr;
+    kafkatcl_runningConsumer *krc = evPtr->krc;
+
+    if (krc != (kafkatcl_runningConsumer *)clientData) {
+		return 0;
+	}
+
+	kafkatcl_backpressure_release (krc->kh, 1, evPtr->bytes);
+	kafkatcl_message_ref_release (evPtr->ref);
+	return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_clear_queue_consumer --
+ *
+ *    remove the callback from a queue object, stop watching the queue
+ *    and discard any callback events still pending for it.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_clear_queue_consumer (kafkatcl_queueClientData *kq) {
+	kafkatcl_runningConsumer *krc = kq->krc;
+
+	kafkatcl_wakeup_watch_queue (NULL, kq->rkqu);
+	kafkatcl_consume_batch_discard (krc);
+	Tcl_DeleteEvents (kafkatcl_match_consumer_event, (ClientData)krc);
+	Tcl_DecrRefCount (krc->callbackObj);
+	ckfree (krc);
+	kq->krc = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_consume_start_queue --
+ *
+ *    given a pointer to a topic client data, a partition, an offset,
+ *    and a queue object, arrange for librdkafka to consume
+ *    from the topic and partition at the specified offset,
+ *    queueing received messages into the specified queue.
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_consume_start_queue (kafkatcl_topicClientData *kt, int partition, int64_t offset, kafkatcl_queueClientData *kq) {
+	Tcl_Interp *interp = kt->kh->interp;
+	rd_kafka_topic_t *rkt = kt->rkt;
+
+	if (rd_kafka_consume_start_queue (rkt, partition, offset, kq->rkqu) < 0) {
+		return kafkatcl_last_error_to_tcl_error (interp);
+	}
+
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_consume_stop --
+ *
+ *    given a pointer to a topic client data and a partition number,
+ *    stop consuming from that partition.
+ *
+ *    delete from the list of running consumers if it's in there.
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_consume_stop (kafkatcl_topicClientData *kt, int partition) {
+	kafkatcl_runningConsumer *krc;
+	Tcl_Interp *interp = kt->kh->interp;
+
+	if (rd_kafka_consume_stop (kt->rkt, partition) < 0) {
+		return kafkatcl_last_error_to_tcl_error (interp);
+	}
+
+	// a range pauses its partitions as they finish
+	kafkatcl_range_resume (kt->kh, rd_kafka_topic_name (kt->rkt), partition);
+
+	KT_LIST_FOREACH(krc, &kt->runningConsumers, runningConsumerInstance) {
+		if (krc->partition == partition) {
+			if (krc->callbackObj != NULL) {
+				kafkatcl_partitionKey key;
+
+				kafkatcl_partition_key (&key, kt->rkt, partition);
+				Tcl_HashEntry *hashEntry = Tcl_FindHashEntry (&kt->kh->callbackConsumers, (char *)&key);
+				if (hashEntry != NULL) {
+					Tcl_DeleteHashEntry (hashEntry);
+				}
+			}
+
+			KT_LIST_REMOVE (krc, runningConsumerInstance);
+			kafkatcl_consume_batch_discard (krc);
+			Tcl_DeleteEvents(kafkatcl_match_consumer_event, (ClientData)krc);
+			if (krc->range != NULL) {
+				kafkatcl_range_abandon (krc);
+			}
+			ckfree (krc);
+			break;
+		}
+	}
+
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_consume_stop_all_partitions --
+ *
+ *    given a pointer to a topic client data and a partition, stop
+ *    consuming.  delete from the list of running consumers if it's
+ *    in there.
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_consume_stop_all_partitions (kafkatcl_topicClientData *kt) {
+	kafkatcl_runningConsumer *krc;
+	kafkatcl_runningConsumer *tmp;
+
+	// for each running consumer (perhaps multiple partitions)
+	KT_LIST_FOREACH_SAFE (krc, &kt->runningConsumers, runningConsumerInstance, tmp) {
+		kafkatcl_consume_stop (kt, krc->partition);
+	}
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_consume_queue_messages --
+ *
+ *    take what's currently in a queue, up to limit messages if limit is
+ *    greater than zero and until the deadline if it isn't -1, and pass
+ *    each message to consumeProc, which takes over ownership of it.
+ *
+ *    unlike rd_kafka_consume_callback_queue this leaves the messages
+ *    alive after the callback, so their payloads can be given to Tcl
+ *    without copying them.
+ *
+ * Results:
+ *    the numbers of messages consumed
+ *
+ *----------------------------------------------------------------------
+ */
+#define KAFKATCL_CALLBACK_CONSUME_COUNT 256
+
+int
+kafkatcl_consume_queue_messages (rd_kafka_queue_t *rkqu, void (*consumeProc)(rd_kafka_message_t *rkmessage, void *opaque), void *opaque, int limit, Tcl_WideInt deadline) {
+	rd_kafka_message_t *rkMessages[KAFKATCL_CALLBACK_CONSUME_COUNT];
+	int count = 0;
+	int wantCount;
+	int gotCount;
+	int i;
+
+	do {
+		wantCount = KAFKATCL_CALLBACK_CONSUME_COUNT;
+		if (limit > 0 && limit - count < wantCount) {
+			wantCount = limit - count;
+		}
+
+		gotCount = rd_kafka_consume_batch_queue (rkqu, 0, rkMessages, wantCount);
+		if (gotCount < 0) {
+			// NB do something here
+			// Tcl_BackgroundError (interp);
+			break;
+		}
+
+		for (i = 0; i < gotCount; i++) {
+			consumeProc (rkMessages[i], opaque);
+		}
+		count += gotCount;
+	} while (gotCount == wantCount && (limit <= 0 || count < limit) && (deadline < 0 || kafkatcl_now_ms () < deadline));
+
+	return count;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_budget_deadline --
+ *
+ *    return when a pass through the event loop that starts now has to
+ *    stop handing messages to callbacks, or -1 if there's no time limit
+ *
+ *----------------------------------------------------------------------
+ */
+Tcl_WideInt
+kafkatcl_budget_deadline (kafkatcl_objectClientData *ko) {
+	if (ko->budgetMS <= 0) {
+		return -1;
+	}
+
+	return kafkatcl_now_ms () + ko->budgetMS;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_check_consumer_callbacks --
+ *
+ *    consume what is waiting in the handle's callback queue, which
+ *    is fed by all partitions started with a callback, and in each of
+ *    the handle's queues that have callbacks defined.
+ *
+ *    no more than limit messages are consumed, or until the deadline,
+ *    which come from the kafka object's budget; anything left over is
+ *    picked up on the next pass through the event loop, so that a
+ *    consumer that's behind doesn't starve timers and other event
+ *    sources.
+ *
+ * Results:
+ *    the numbers of messages consumed
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_check_consumer_callbacks (kafkatcl_handleClientData *kh, int limit, Tcl_WideInt deadline) {
+	kafkatcl_queueClientData *kq;
+	int count = 0;
+
+	if (kh->callbackQueue != NULL && rd_kafka_queue_length (kh->callbackQueue) > 0) {
+		count += kafkatcl_consume_queue_messages (kh->callbackQueue, kafkatcl_consume_callback_dispatch, kh, limit, deadline);
+	}
+
+	// for each of our queues see if there's a queue consumer and if so,
+	// try to consume
+	KT_LIST_FOREACH(kq, &kh->ko->queueConsumers, queueConsumerInstance) {
+		kafkatcl_runningConsumer *krc = kq->krc;
+
+		if ((limit > 0 && count >= limit) || (deadline >= 0 && kafkatcl_now_ms () >= deadline)) {
+			break;
+		}
+
+		if (kq->kh != kh || krc == NULL || rd_kafka_queue_length (kq->rkqu) == 0) {
+			continue;
+		}
+
+		count += kafkatcl_consume_queue_messages (kq->rkqu, kafkatcl_consume_callback, krc, (limit > 0) ? limit - count : 0, deadline);
+	}
+
+	return count;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_topicConsumerObjectObjCmd --
+ *
+ *    dispatches the subcommands of a kafkatcl batch-handling command
+ *
+ * Results:
+ *    stuff
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_topicConsumerObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    int         optIndex;
+	kafkatcl_topicClientData *kt = (kafkatcl_topicClientData *)cData;
+	rd_kafka_topic_t *rkt = kt->rkt;
+	int resultCode = TCL_OK;
+
+    static CONST char *options[] = {
+        "consume",
+        "consume_batch",
+		"consume_range",
+		"info",
+        "start",
+        "start_queue",
+        "stop",
+	"creator",
+        "delete",
+	"consume_start",
+	"consume_start_queue",
+	"consume_stop",
+        NULL
+    };
+
+    enum options {
+		OPT_CONSUME,
+		OPT_CONSUME_BATCH,
+		OPT_CONSUME_RANGE,
+		OPT_INFO,
+		OPT_CONSUME_START,
+		OPT_CONSUME_START_QUEUE,
+		OPT_CONSUME_STOP,
+		OPT_CREATOR,
+		OPT_DELETE,
+		OPT_LEGACY_CONSUME_START,
+		OPT_LEGACY_CONSUME_START_QUEUE,
+		OPT_LEGACY_CONSUME_STOP
+    };
+
+    /* basic validation of command line arguments */
+    if (objc < 2) {
+        Tcl_WrongNumArgs (interp, 1, objv, "subcommand ?args?");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIndexFromObj (interp, objv[1], options, "option", TCL_EXACT, &optIndex) != TCL_OK) {
+		return TCL_ERROR;
+    }
+
+    switch ((enum options) optIndex) {
+		case OPT_CONSUME: {
+			int nextArg = 2;
+			kafkatcl_consumeOptions options;
+			int partition;
+			int timeoutMS;
+
+			if (kafkatcl_parse_consume_options (interp, objc, objv, &nextArg, 0, &options) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (objc - nextArg != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-fields list? partition timeout array");
+				return TCL_ERROR;
+			}
+
+			if (Tcl_GetIntFromObj (interp, objv[nextArg], &partition) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+				break;
+			}
+
+			if (Tcl_GetIntFromObj (interp, objv[nextArg + 1], &timeoutMS) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+				break;
+			}
+
+			char *arrayName = Tcl_GetString (objv[nextArg + 2]);
+
+			rd_kafka_message_t *rdm = rd_kafka_consume (rkt, partition, timeoutMS);
+
+			if (rdm == NULL) {
+				resultCode =  kafkatcl_last_error_to_tcl_error (interp);
+				break;
+			}
+
+			kafkatcl_messageRef *ref = kafkatcl_message_ref_new (kt->kh, rdm);
+			resultCode = kafkatcl_message_to_tcl_array (interp, arrayName, rdm, ref, options.fields, 1);
+
+			// TCL_BREAK is returned on EOF
+			if (resultCode == TCL_BREAK) {
+				Tcl_SetObjResult (interp, Tcl_NewIntObj (0));
+				resultCode = TCL_OK;
+			} else if (resultCode == TCL_OK) {
+				Tcl_SetObjResult (interp, Tcl_NewIntObj (1));
+			}
+
+			kafkatcl_message_ref_release (ref);
+			break;
+		}
+
+		case OPT_CONSUME_BATCH: {
+			int nextArg = 2;
+			kafkatcl_consumeOptions options;
+			int partition;
+			int timeoutMS;
+			int count;
+
+			if (kafkatcl_parse_consume_options (interp, objc, objv, &nextArg, 0, &options) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (objc - nextArg != 5) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-fields list? partition timeout count array code");
+				return TCL_ERROR;
+			}
+
+			if (Tcl_GetIntFromObj (interp, objv[nextArg], &partition) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+				break;
+			}
+
+			if (Tcl_GetIntFromObj (interp, objv[nextArg + 1], &timeoutMS) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+				break;
+			}
+
+			if (Tcl_GetIntFromObj (interp, objv[nextArg + 2], &count) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+				break;
+			}
+
+			char *arrayName = Tcl_GetString (objv[nextArg + 3]);
+
+			Tcl_Obj *codeObj = objv[nextArg + 4];
+
+			rd_kafka_message_t **rkMessages = ckalloc (sizeof (rd_kafka_message_t *) * count);
+
+			int gotCount = rd_kafka_consume_batch (rkt, partition, timeoutMS, rkMessages, count);
+
+			int i;
+			for (i = 0; i < gotCount; i++) {
+				// the array's payload element keeps the message alive
+				// for as long as it needs it
+				kafkatcl_messageRef *ref = kafkatcl_message_ref_new (kt->kh, rkMessages[i]);
+				resultCode = kafkatcl_message_to_tcl_array (interp, arrayName, rkMessages[i], ref, options.fields, 0);
+				kafkatcl_message_ref_release (ref);
+
+				if (resultCode == TCL_BREAK) {
+					resultCode = TCL_OK;
+					continue;
+				} else if (resultCode == TCL_ERROR) {
+					break;
+				}
+
+				resultCode = Tcl_EvalObjEx (interp, codeObj,  0);
+
+				if (resultCode == TCL_ERROR) {
+					break;
+				}
+			}
+
+			/* Free trailing unprocessed messages; message i has been released already */
+			for (i++; i < gotCount; ++i) {
+				rd_kafka_message_destroy (rkMessages[i]);
+			}
+
+			ckfree (rkMessages);
+
+			if (resultCode != TCL_ERROR) {
+				Tcl_SetObjResult (interp, Tcl_NewIntObj (gotCount));
+			}
+			break;
+		}
+
+		case OPT_CONSUME_RANGE: {
+			return kafkatcl_topic_consume_range (interp, kt, objc, objv);
+		}
+
+		case OPT_CREATOR: {
+			return kafkatcl_handleObjectObjCmd(kt->kh, interp, objc-1, objv+1);
+		}
+
+		case OPT_INFO: {
+			return kafkatcl_handle_topic_info (interp, kt, objc, objv);
+		}
+
+		case OPT_LEGACY_CONSUME_START:
+		case OPT_CONSUME_START: {
+			int64_t offset;
+			int partition;
+			Tcl_Obj *callbackObj = NULL;
+			int nextArg = 2;
+			kafkatcl_consumeOptions options;
+
+			if (kafkatcl_parse_consume_options (interp, objc, objv, &nextArg, 1, &options) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if ((objc - nextArg < 2) || (objc - nextArg > 3)) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-fields list? ?-batch count? ?-linger ms? partition offset ?callback?");
+				return TCL_ERROR;
+			}
+
+			if (Tcl_GetIntFromObj (interp, objv[nextArg], &partition) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+				break;
+			}
+
+			if (kafkatcl_parse_offset (interp, objv[nextArg + 1], &offset) != TCL_OK) {
+				resultCode = TCL_ERROR;
+				break;
+			}
+
+			if (objc - nextArg == 3) {
+				callbackObj = objv[nextArg + 2];
+			} else if (options.batchSize > 0) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("-batch requires a callback", -1));
+				return TCL_ERROR;
+			}
+
+			if (kafkatcl_consume_start (kt, partition, offset, callbackObj, &options) == TCL_ERROR) {
+				resultCode =  TCL_ERROR;
+				break;
+			}
+
+			break;
+		}
+
+		case OPT_LEGACY_CONSUME_START_QUEUE:
+		case OPT_CONSUME_START_QUEUE: {
+			int64_t offset;
+			int partition;
+
+			if (objc != 5) {
+				Tcl_WrongNumArgs (interp, 2, objv, "partition offset queue");
+				return TCL_ERROR;
+			}
+
+			if (Tcl_GetIntFromObj (interp, objv[2], &partition) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+				break;
+			}
+
+			if (kafkatcl_parse_offset (interp, objv[3], &offset) != TCL_OK) {
+				resultCode = TCL_ERROR;
+				break;
+			}
+
+			char *queueCommandName = Tcl_GetString (objv[4]);
+			kafkatcl_queueClientData *qcd = kafkatcl_queue_command_to_queueClientData (interp, queueCommandName);
+			if (qcd == NULL) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("command name '", -1));
+				Tcl_AppendResult (interp, queueCommandName, "' is not a kafkatcl queue object", NULL);
+				resultCode = TCL_ERROR;
+				break;
+			}
+
+			if (kafkatcl_consume_start_queue (kt, partition, offset, qcd) == TCL_ERROR) {
+				resultCode =  TCL_ERROR;
+				break;
+			}
+
+			break;
+		}
+
+		case OPT_LEGACY_CONSUME_STOP:
+		case OPT_CONSUME_STOP: {
+			int partition;
+
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "partition");
+				return TCL_ERROR;
+			}
+
+			if (Tcl_GetIntFromObj (interp, objv[2], &partition) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+				break;
+			}
+
+			return kafkatcl_consume_stop (kt, partition);
+		}
+
+		case OPT_DELETE: {
+			if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "");
+				return TCL_ERROR;
+			}
+
+			if (Tcl_DeleteCommandFromToken (kt->kh->interp, kt->cmdToken) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+			}
+			break;
+		}
+    }
+    return resultCode;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_block_deadline --
+ *
+ *    return the time in milliseconds at which a produce that blocks for
+ *    up to timeoutMS when the output queue is full gives up
+ *
+ *----------------------------------------------------------------------
+ */
+Tcl_WideInt
+kafkatcl_block_deadline (int timeoutMS) {
+	return kafkatcl_now_ms () + timeoutMS;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_block_wait --
+ *
+ *    wait for room in a producer's output queue by serving delivery
+ *    reports, for no longer than until the deadline
+ *
+ * Results:
+ *    returns 1 if the produce should be tried again, or 0 if the
+ *    deadline has passed
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_block_wait (kafkatcl_handleClientData *kh, Tcl_WideInt deadline) {
+	Tcl_WideInt remaining = deadline - kafkatcl_now_ms ();
+
+	if (remaining <= 0) {
+		return 0;
+	}
+
+	kafkatcl_main_queue_serve (kh, (remaining < KAFKATCL_BLOCK_POLL_MS) ? (int)remaining : KAFKATCL_BLOCK_POLL_MS, 0, -1);
+	return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_main_queue_serve --
+ *
+ *    hand the delivery reports, errors and statistics waiting in a
+ *    handle's main queue to their callbacks, waiting up to timeoutMS
+ *    for the first event.
+ *
+ *    librdkafka gives us these as events rather than calling back from
+ *    rd_kafka_poll, which would serve everything in the queue at once,
+ *    so we can stop after limit delivery reports or once the deadline
+ *    has passed, 0 and -1 for no limit.  A delivery report event holds
+ *    a batch of messages; if we stop partway through one it's kept in
+ *    the handle and picked up where we left off next time.
+ *
+ * Results:
+ *    the number of reports, errors and statistics handled
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_main_queue_serve (kafkatcl_handleClientData *kh, int timeoutMS, int limit, Tcl_WideInt deadline) {
+	int count = 0;
+
+	while (!((limit > 0 && count >= limit) || (deadline >= 0 && kafkatcl_now_ms () >= deadline))) {
+		rd_kafka_event_t *rkev = kh->mainEvent;
+
+		if (rkev == NULL) {
+			rkev = rd_kafka_queue_poll (kh->mainQueue, timeoutMS);
+			if (rkev == NULL) {
+				break;
+			}
+			// only wait for the first one
+			timeoutMS = 0;
+		}
+		kh->mainEvent = NULL;
+
+		switch (rd_kafka_event_type (rkev)) {
+			case RD_KAFKA_EVENT_DR: {
+				const rd_kafka_message_t *rkmessage;
+
+				while ((rkmessage = rd_kafka_event_message_next (rkev)) != NULL) {
+					kafkatcl_delivery_report_callback (kh->rk, rkmessage, kh->ko);
+					count++;
+
+					if ((limit > 0 && count >= limit) || (deadline >= 0 && kafkatcl_now_ms () >= deadline)) {
+						kh->mainEvent = rkev;
+						return count;
+					}
+				}
+				break;
+			}
+
+			case RD_KAFKA_EVENT_ERROR: {
+				// errors come out of the queue whether or not we asked
+				// for them; without an error callback there's no one
+				// to tell
+				if (kh->ko->errorCallbackObj != NULL) {
+					kafkatcl_error_callback (kh->rk, rd_kafka_event_error (rkev), rd_kafka_event_error_string (rkev), kh->ko);
+				}
+				count++;
+				break;
+			}
+
+			case RD_KAFKA_EVENT_STATS: {
+				if (kh->ko->statisticsCallbackObj != NULL) {
+					// the json belongs to the event; the stats callback
+					// takes over what it's given and frees it
+					const char *json = rd_kafka_event_stats (rkev);
+					size_t jsonLen = strlen (json);
+					char *copy = malloc (jsonLen + 1);
+
+					memcpy (copy, json, jsonLen + 1);
+					kafkatcl_stats_callback (kh->rk, copy, jsonLen, kh->ko);
+				}
+				count++;
+				break;
+			}
+
+			default:
+				break;
+		}
+
+		rd_kafka_event_destroy (rkev);
+	}
+
+	return count;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_main_queue_drain --
+ *
+ *    wait for a handle's output queue to empty, serving its delivery
+ *    reports as they come in, for up to timeoutMS, or forever if it's
+ *    negative.  Stands in for rd_kafka_flush, which doesn't serve the
+ *    main queue when delivery reports are delivered as events.
+ *
+ * Results:
+ *    RD_KAFKA_RESP_ERR__TIMED_OUT if there were still messages in the
+ *    queue when time ran out, else RD_KAFKA_RESP_ERR_NO_ERROR
+ *
+ *----------------------------------------------------------------------
+ */
+rd_kafka_resp_err_t
+kafkatcl_main_queue_drain (kafkatcl_handleClientData *kh, int timeoutMS) {
+	Tcl_WideInt deadline = (timeoutMS < 0) ? -1 : kafkatcl_now_ms () + timeoutMS;
+
+	// get messages lingering in librdkafka's queues sent right away
+	rd_kafka_flush (kh->rk, 0);
+
+	while (rd_kafka_outq_len (kh->rk) > 0) {
+		Tcl_WideInt remaining = (deadline < 0) ? KAFKATCL_BLOCK_POLL_MS : deadline - kafkatcl_now_ms ();
+
+		if (remaining <= 0) {
+			return RD_KAFKA_RESP_ERR__TIMED_OUT;
+		}
+
+		kafkatcl_main_queue_serve (kh, (remaining < KAFKATCL_BLOCK_POLL_MS) ? (int)remaining : KAFKATCL_BLOCK_POLL_MS, 0, -1);
+	}
+
+	return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_produce_check_reports --
+ *
+ *    a producer created without delivery reports has no way to tell
+ *    when a message has been delivered.  -command is an error on one,
+ *    and -nocopy falls back to librdkafka copying the payload, since
+ *    nothing would ever let go of a pinned one.
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_produce_check_reports (Tcl_Interp *interp, kafkatcl_handleClientData *kh, Tcl_Obj *commandObj, int *nocopyPtr)
+{
+	if (kh->deliveryReports) {
+		return TCL_OK;
+	}
+
+	if (commandObj != NULL) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("-command needs delivery reports, create the producer with -deliveryreports", -1));
+		return TCL_ERROR;
+	}
+
+	*nocopyPtr = 0;
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_producev --
+ *
+ *    produce a message to a topic with rd_kafka_producev, which unlike
+ *    rd_kafka_produce can attach headers and a timestamp to it.  with
+ *    -block, a full output queue is waited on rather than failing.
+ *    fromList says payloadObj is an element of a list, which -nocopy
+ *    has to copy, see kafkatcl_payload_pin.
+ *
+ * Results:
+ *    returns the kafka error producing the message, if any.  if the
+ *    message has a -command, its message id is stored in *idPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+rd_kafka_resp_err_t
+kafkatcl_producev (kafkatcl_topicClientData *kt, kafkatcl_produceOptions *options, Tcl_Obj *payloadObj, int fromList, Tcl_WideInt *idPtr)
+{
+	rd_kafka_headers_t *headers = NULL;
+	rd_kafka_resp_err_t err;
+
+	// header names and values are copied by librdkafka, so get them
+	// over with before fetching the bytes of the key and payload
+	if (options->headersObj != NULL) {
+		int headerObjc;
+		Tcl_Obj **headerObjv;
+		int i;
+
+		if (Tcl_ListObjGetElements (NULL, options->headersObj, &headerObjc, &headerObjv) == TCL_ERROR) {
+			return RD_KAFKA_RESP_ERR__INVALID_ARG;
+		}
+
+		headers = rd_kafka_headers_new (headerObjc / 2);
+
+		for (i = 0; i + 1 < headerObjc; i += 2) {
+			int valueLength;
+			const char *name = Tcl_GetString (headerObjv[i]);
+			unsigned char *value = Tcl_GetByteArrayFromObj (headerObjv[i + 1], &valueLength);
+
+			rd_kafka_header_add (headers, name, -1, value, valueLength);
+		}
+	}
+
+	const void *key = NULL;
+	int keyLength = 0;
+
+	if (options->keyObj != NULL) {
+		key = Tcl_GetByteArrayFromObj (options->keyObj, &keyLength);
+	}
+
+	int payloadLength;
+	unsigned char *payload;
+	Tcl_Obj *pinnedObj = NULL;
+	int msgflags = RD_KAFKA_MSG_F_COPY;
+
+	if (options->nocopy) {
+		pinnedObj = kafkatcl_payload_pin (payloadObj, fromList, &payload, &payloadLength);
+		msgflags = 0;
+	} else {
+		payload = kafkatcl_payload_bytes (payloadObj, &payloadLength);
+	}
+
+	// the opaque only goes to the delivery report callback, and without
+	// delivery reports nothing would let go of it
+	kafkatcl_produceOpaque *kpo = kafkatcl_produce_opaque_new (kt->kh->ko, pinnedObj, kt->kh->deliveryReports ? options->opaqueObj : NULL, options->commandObj);
+	Tcl_WideInt deadline = kafkatcl_block_deadline (options->blockMS);
+
+	do {
+		err = rd_kafka_producev (kt->kh->rk,
+			RD_KAFKA_V_RKT (kt->rkt),
+			RD_KAFKA_V_PARTITION (options->partition),
+			RD_KAFKA_V_MSGFLAGS (msgflags),
+			RD_KAFKA_V_VALUE (payload, payloadLength),
+			RD_KAFKA_V_KEY (key, keyLength),
+			RD_KAFKA_V_TIMESTAMP (options->timestamp),
+			RD_KAFKA_V_HEADERS (headers),
+			RD_KAFKA_V_OPAQUE (kpo),
+			RD_KAFKA_V_END);
+	} while (err == RD_KAFKA_RESP_ERR__QUEUE_FULL && options->blockMS >= 0 && kafkatcl_block_wait (kt->kh, deadline));
+
+	kafkatcl_writable_note (kt->kh);
+
+	// librdkafka only takes the headers if the message was produced
+	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		kafkatcl_produce_opaque_release (kpo);
+		if (headers != NULL) {
+			rd_kafka_headers_destroy (headers);
+		}
+	} else if (kpo != NULL) {
+		*idPtr = kpo->id;
+	}
+
+	return err;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_produce_batch --
+ *
+ *    produce count messages to a topic with one call to
+ *    rd_kafka_produce_batch.  keyObjv and partitionObjv may be NULL,
+ *    and their elements may be NULL, meaning no key and the default
+ *    partition respectively.  an empty partition is the default too.
+ *
+ *    all the partitions are fetched before any of the bytes, so that
+ *    one object being used as both a number and a key can't have its
+ *    bytes freed out from under us while we're still gathering them.
+ *
+ *    if blockMS isn't -1, messages rejected because the output queue
+ *    is full are tried again as it drains, for up to blockMS.
+ *
+ *    with a commandObj, each message gets a message id and the command
+ *    is invoked with its delivery report, as with produce -command.
+ *
+ * Results:
+ *    sets the interpreter result to a list with an element for each
+ *    message, empty (or the message id, with a command) if the message
+ *    was queued or else the kafka error code it was rejected with, and
+ *    returns a standard Tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_produce_batch (Tcl_Interp *interp, kafkatcl_topicClientData *kt, int32_t partition, int nocopy, Tcl_Obj *commandObj, int blockMS, int count, Tcl_Obj **payloadObjv, Tcl_Obj **keyObjv, Tcl_Obj **partitionObjv)
+{
+	rd_kafka_message_t *rkmessages;
+	Tcl_WideInt *ids = NULL;
+	Tcl_Obj **resultObjv;
+	Tcl_Obj *emptyObj;
+	int i;
+
+	// nothing produced, so the list of per-message results is empty
+	if (count == 0) {
+		Tcl_SetObjResult (interp, Tcl_NewObj ());
+		return TCL_OK;
+	}
+
+	rkmessages = (rd_kafka_message_t *)ckalloc (sizeof(rd_kafka_message_t) * count);
+
+	for (i = 0; i < count; i++) {
+		rd_kafka_message_t *rk = &rkmessages[i];
+		int rowPartition = partition;
+
+		if (partitionObjv != NULL && partitionObjv[i] != NULL && *Tcl_GetString (partitionObjv[i]) != '\0') {
+			if (Tcl_GetIntFromObj (interp, partitionObjv[i], &rowPartition) == TCL_ERROR) {
+				Tcl_AppendResult (interp, " while parsing partition of message ", NULL);
+				Tcl_AppendObjToObj (Tcl_GetObjResult (interp), Tcl_NewIntObj (i));
+				ckfree (rkmessages);
+				return TCL_ERROR;
+			}
+		}
+
+		rk->partition = rowPartition;
+		rk->err = RD_KAFKA_RESP_ERR_NO_ERROR;
+	}
+
+	// turn every key into a byte array and pin every payload before
+	// fetching any of the bytes.  one object can be the key of one
+	// message and the payload of another, and converting it for the
+	// later message would free the bytes gathered for the earlier one.
+	for (i = 0; i < count; i++) {
+		rd_kafka_message_t *rk = &rkmessages[i];
+		int length;
+
+		if (keyObjv != NULL && keyObjv[i] != NULL) {
+			Tcl_GetByteArrayFromObj (keyObjv[i], &length);
+		}
+
+		Tcl_Obj *pinnedObj = NULL;
+		if (nocopy) {
+			unsigned char *payload;
+
+			pinnedObj = kafkatcl_payload_pin (payloadObjv[i], 1, &payload, &length);
+		}
+		rk->_private = kafkatcl_produce_opaque_new (kt->kh->ko, pinnedObj, NULL, commandObj);
+	}
+
+	// delivery reports served while blocking could free the opaques,
+	// so note the message ids now
+	if (commandObj != NULL) {
+		ids = (Tcl_WideInt *)ckalloc (sizeof (Tcl_WideInt) * count);
+		for (i = 0; i < count; i++) {
+			ids[i] = ((kafkatcl_produceOpaque *)rkmessages[i]._private)->id;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		rd_kafka_message_t *rk = &rkmessages[i];
+		int payloadLength;
+		int keyLength = 0;
+
+		// an empty key is a zero-length key, as with produce
+		rk->key = NULL;
+		if (keyObjv != NULL && keyObjv[i] != NULL) {
+			rk->key = Tcl_GetByteArrayFromObj (keyObjv[i], &keyLength);
+		}
+		rk->key_len = keyLength;
+
+		if (nocopy) {
+			rk->payload = Tcl_GetByteArrayFromObj (((kafkatcl_produceOpaque *)rk->_private)->payloadObj, &payloadLength);
+		} else {
+			rk->payload = kafkatcl_payload_bytes (payloadObjv[i], &payloadLength);
+		}
+		rk->len = payloadLength;
+	}
+
+	int msgflags = RD_KAFKA_MSG_F_PARTITION | (nocopy ? 0 : RD_KAFKA_MSG_F_COPY);
+	int nDone = rd_kafka_produce_batch (kt->rkt, partition, msgflags, rkmessages, count);
+
+	if (nDone < count && blockMS >= 0) {
+		rd_kafka_message_t *retryMessages = (rd_kafka_message_t *)ckalloc (sizeof(rd_kafka_message_t) * count);
+		int *retryIndex = (int *)ckalloc (sizeof (int) * count);
+		Tcl_WideInt deadline = kafkatcl_block_deadline (blockMS);
+
+		while (1) {
+			int nRetry = 0;
+
+			for (i = 0; i < count; i++) {
+				if (rkmessages[i].err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+					retryMessages[nRetry] = rkmessages[i];
+					retryMessages[nRetry].err = RD_KAFKA_RESP_ERR_NO_ERROR;
+					retryIndex[nRetry++] = i;
+				}
+			}
+
+			if (nRetry == 0 || !kafkatcl_block_wait (kt->kh, deadline)) {
+				break;
+			}
+
+			rd_kafka_produce_batch (kt->rkt, partition, msgflags, retryMessages, nRetry);
+
+			for (i = 0; i < nRetry; i++) {
+				rkmessages[retryIndex[i]].err = retryMessages[i].err;
+			}
+		}
+
+		ckfree (retryIndex);
+		ckfree (retryMessages);
+	}
+
+	kafkatcl_writable_note (kt->kh);
+
+	resultObjv = (Tcl_Obj **)ckalloc (sizeof (Tcl_Obj *) * count);
+	emptyObj = Tcl_NewObj ();
+
+	for (i = 0; i < count; i++) {
+		if (nDone == count || rkmessages[i].err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+			resultObjv[i] = (ids != NULL) ? Tcl_NewWideIntObj (ids[i]) : emptyObj;
+		} else {
+			// messages librdkafka didn't take won't get a delivery report
+			kafkatcl_produce_opaque_release (rkmessages[i]._private);
+			resultObjv[i] = Tcl_NewStringObj (kafkatcl_kafka_error_to_errorcode_string (rkmessages[i].err), -1);
+		}
+	}
+
+	Tcl_SetObjResult (interp, Tcl_NewListObj (count, resultObjv));
+
+	if (ids != NULL) {
+		ckfree (ids);
+	}
+	ckfree (resultObjv);
+	ckfree (rkmessages);
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_topicProducerObjectObjCmd --
+ *
+ *    dispatches the subcommands of a kafkatcl batch-handling command
+ *
+ * Results:
+ *    stuff
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_topicProducerObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    int         optIndex;
+	kafkatcl_topicClientData *kt = (kafkatcl_topicClientData *)cData;
+	rd_kafka_topic_t *rkt = kt->rkt;
+	int resultCode = TCL_OK;
+
+    static CONST char *options[] = {
+        "produce",
+        "produce_batch",
+		"producev",
+		"producev_batch",
+		"info",
+		"creator",
+        "delete",
+        NULL
+    };
+
+    enum options {
+		OPT_PRODUCE,
+		OPT_PRODUCE_BATCH,
+		OPT_PRODUCEV,
+		OPT_PRODUCEV_BATCH,
+		OPT_INFO,
+		OPT_CREATOR,
+		OPT_DELETE
+    };
+
+    /* basic validation of command line arguments */
+    if (objc < 2) {
+        Tcl_WrongNumArgs (interp, 1, objv, "subcommand ?args?");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIndexFromObj (interp, objv[1], options, "option", TCL_EXACT, &optIndex) != TCL_OK) {
+		return TCL_ERROR;
+    }
+
+    switch ((enum options) optIndex) {
+		case OPT_PRODUCE: {
+			int partition;
+			int nextArg = 2;
+			int nocopy = 0;
+			Tcl_Obj *commandObj = NULL;
+			int blockMS = -1;
+
+			while (objc > nextArg) {
+				char *option = Tcl_GetString (objv[nextArg]);
+
+				if (strcmp (option, "-nocopy") == 0) {
+					nocopy = 1;
+					nextArg++;
+				} else if (strcmp (option, "-command") == 0 && objc > nextArg + 1) {
+					commandObj = objv[nextArg + 1];
+					nextArg += 2;
+				} else if (strcmp (option, "-block") == 0 && objc > nextArg + 1) {
+					if (kafkatcl_parse_block_timeout (interp, objv[nextArg + 1], &blockMS) == TCL_ERROR) {
+						return TCL_ERROR;
+					}
+					nextArg += 2;
+				} else {
+					break;
+				}
+			}
+
+			if (objc - nextArg < 2 || objc - nextArg > 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-nocopy? ?-command command? ?-block timeoutMS? partition payload ?key?");
+				return TCL_ERROR;
+			}
+
+			if (kafkatcl_produce_check_reports (interp, kt->kh, commandObj, &nocopy) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (Tcl_GetIntFromObj (interp, objv[nextArg], &partition) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+				break;
+			}
+
+			const void *key = NULL;
+			int keyLength = 0;
+
+			// get the key first in case it's the same object as a consumed
+			// payload, which turning into a byte array would let go of
+			if (objc - nextArg == 3) {
+				key = Tcl_GetByteArrayFromObj (objv[nextArg + 2], &keyLength);
+			}
+
+			int payloadLength;
+			unsigned char *payload;
+			Tcl_Obj *pinnedObj = NULL;
+			int msgflags = RD_KAFKA_MSG_F_COPY;
+
+			if (nocopy) {
+				pinnedObj = kafkatcl_payload_pin (objv[nextArg + 1], 0, &payload, &payloadLength);
+				msgflags = 0;
+			} else {
+				payload = kafkatcl_payload_bytes (objv[nextArg + 1], &payloadLength);
+			}
+
+			kafkatcl_produceOpaque *kpo = kafkatcl_produce_opaque_new (kt->kh->ko, pinnedObj, NULL, commandObj);
+			Tcl_WideInt deadline = kafkatcl_block_deadline (blockMS);
+			int produced;
+
+			// with -block, wait out a full queue rather than failing
+			while ((produced = rd_kafka_produce (rkt, partition, msgflags, payload, payloadLength, key, keyLength, kpo)) < 0) {
+				if (blockMS < 0 || rd_kafka_last_error () != RD_KAFKA_RESP_ERR__QUEUE_FULL || !kafkatcl_block_wait (kt->kh, deadline)) {
+					break;
+				}
+			}
+
+			kafkatcl_writable_note (kt->kh);
+
+			if (produced < 0) {
+				kafkatcl_produce_opaque_release (kpo);
+				resultCode =  kafkatcl_last_error_to_tcl_error (interp);
+				break;
+			}
+
+			// the message id identifies the message to its command
+			if (commandObj != NULL) {
+				Tcl_SetObjResult (interp, Tcl_NewWideIntObj (kpo->id));
+			}
+			break;
+		}
+
+		case OPT_PRODUCE_BATCH: {
+			int listObjc;
+			Tcl_Obj **listObjv;
+			int partition;
+			int nextArg = 2;
+			int nocopy = 0;
+			Tcl_Obj *commandObj = NULL;
+			int blockMS = -1;
+
+			while (objc > nextArg) {
+				char *option = Tcl_GetString (objv[nextArg]);
+
+				if (strcmp (option, "-nocopy") == 0) {
+					nocopy = 1;
+					nextArg++;
+				} else if (strcmp (option, "-command") == 0 && objc > nextArg + 1) {
+					commandObj = objv[nextArg + 1];
+					nextArg += 2;
+				} else if (strcmp (option, "-block") == 0 && objc > nextArg + 1) {
+					if (kafkatcl_parse_block_timeout (interp, objv[nextArg + 1], &blockMS) == TCL_ERROR) {
+						return TCL_ERROR;
+					}
+					nextArg += 2;
+				} else {
+					break;
+				}
+			}
+
+			if (objc - nextArg < 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-nocopy? ?-command command? ?-block timeoutMS? partition list-of-payload-key-partition-lists|-payloads list ?-keys list? ?-partitions list?");
+				return TCL_ERROR;
+			}
+
+			if (kafkatcl_produce_check_reports (interp, kt->kh, commandObj, &nocopy) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (Tcl_GetIntFromObj (interp, objv[nextArg++], &partition) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			// one list of messages, each a list of payload, key and partition
+			if (objc - nextArg == 1) {
+				if (Tcl_ListObjGetElements (interp, objv[nextArg], &listObjc, &listObjv) == TCL_ERROR) {
+					Tcl_AppendResult (interp, " while parsing list of payload-key-partition lists", NULL);
+					return TCL_ERROR;
+				}
+
+				Tcl_Obj **columnObjv = (Tcl_Obj **)ckalloc (sizeof (Tcl_Obj *) * (listObjc * 3 + 1));
+				Tcl_Obj **payloadObjv = columnObjv;
+				Tcl_Obj **keyObjv = columnObjv + listObjc;
+				Tcl_Obj **partitionObjv = columnObjv + listObjc * 2;
+				int i;
+
+				for (i = 0; i < listObjc; i++) {
+					int rowObjc;
+					Tcl_Obj **rowObjv;
+
+					if (Tcl_ListObjGetElements (interp, listObjv[i], &rowObjc, &rowObjv) == TCL_ERROR) {
+						Tcl_AppendResult (interp, " while parsing list within payload-key-partition lists", NULL);
+						resultCode = TCL_ERROR;
+						break;
+					}
+
+					if (rowObjc < 1 || rowObjc > 3) {
+						Tcl_AppendResult (interp, "list within payload-key-partition lists must contain payload, optional key and optional partition", NULL);
+						resultCode = TCL_ERROR;
+						break;
+					}
+
+					payloadObjv[i] = rowObjv[0];
+					keyObjv[i] = (rowObjc > 1) ? rowObjv[1] : NULL;
+					partitionObjv[i] = (rowObjc > 2) ? rowObjv[2] : NULL;
+				}
+
+				if (resultCode == TCL_OK) {
+					resultCode = kafkatcl_produce_batch (interp, kt, partition, nocopy, commandObj, blockMS, listObjc, payloadObjv, keyObjv, partitionObjv);
+				}
+
+				ckfree (columnObjv);
+				break;
+			}
+
+			// separate lists of payloads, keys and partitions
+			Tcl_Obj **payloadObjv = NULL;
+			Tcl_Obj **keyObjv = NULL;
+			Tcl_Obj **partitionObjv = NULL;
+			int payloadObjc = -1;
+
+			while (nextArg < objc) {
+				char *option = Tcl_GetString (objv[nextArg]);
+				Tcl_Obj ***columnPtr;
+				int columnObjc;
+
+				if (strcmp (option, "-payloads") == 0) {
+					columnPtr = &payloadObjv;
+				} else if (strcmp (option, "-keys") == 0) {
+					columnPtr = &keyObjv;
+				} else if (strcmp (option, "-partitions") == 0) {
+					columnPtr = &partitionObjv;
+				} else {
+					Tcl_AppendResult (interp, "bad option \"", option, "\": must be -payloads, -keys or -partitions", NULL);
+					return TCL_ERROR;
+				}
+
+				if (nextArg + 1 >= objc) {
+					Tcl_AppendResult (interp, "value for \"", option, "\" missing", NULL);
+					return TCL_ERROR;
+				}
+
+				if (Tcl_ListObjGetElements (interp, objv[nextArg + 1], &columnObjc, columnPtr) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+
+				if (payloadObjc >= 0 && columnObjc != payloadObjc) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("lists of payloads, keys and partitions must be the same length", -1));
+					return TCL_ERROR;
+				}
+				payloadObjc = columnObjc;
+				nextArg += 2;
+			}
+
+			if (payloadObjv == NULL) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("-payloads must be specified", -1));
+				return TCL_ERROR;
+			}
+
+			return kafkatcl_produce_batch (interp, kt, partition, nocopy, commandObj, blockMS, payloadObjc, payloadObjv, keyObjv, partitionObjv);
+		}
+
+		case OPT_PRODUCEV: {
+			int nextArg = 2;
+			kafkatcl_produceOptions options = {RD_KAFKA_PARTITION_UA, NULL, NULL, NULL, NULL, 0, 0, -1};
+
+			if (kafkatcl_parse_produce_options (interp, objc, objv, &nextArg, &options) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (objc - nextArg != 1) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-partition partition? ?-key key? ?-headers list? ?-timestamp ms? ?-opaque value? ?-command command? ?-block timeoutMS? ?-nocopy? payload");
+				return TCL_ERROR;
+			}
+
+			if (kafkatcl_produce_check_reports (interp, kt->kh, options.commandObj, &options.nocopy) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			Tcl_WideInt id = 0;
+
+			if (kafkatcl_kafka_error_to_tcl (interp, kafkatcl_producev (kt, &options, objv[nextArg], 0, &id), NULL) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			// the message id identifies the message to its command
+			if (options.commandObj != NULL) {
+				Tcl_SetObjResult (interp, Tcl_NewWideIntObj (id));
+			}
+			break;
+		}
+
+		case OPT_PRODUCEV_BATCH: {
+			int nextArg = 2;
+			kafkatcl_produceOptions defaults = {RD_KAFKA_PARTITION_UA, NULL, NULL, NULL, NULL, 0, 0, -1};
+			int listObjc;
+			Tcl_Obj **listObjv;
+			int i;
+
+			if (kafkatcl_parse_produce_options (interp, objc, objv, &nextArg, &defaults) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (objc - nextArg != 1) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-partition partition? ?-key key? ?-headers list? ?-timestamp ms? ?-opaque value? ?-command command? ?-block timeoutMS? ?-nocopy? list-of-messages");
+				return TCL_ERROR;
+			}
+
+			if (Tcl_ListObjGetElements (interp, objv[nextArg], &listObjc, &listObjv) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (listObjc == 0) {
+				Tcl_SetObjResult (interp, Tcl_NewObj ());
+				break;
+			}
+
+			// parse every message before producing any of them, so a
+			// mistake in one doesn't leave the batch half produced
+			kafkatcl_produceOptions *rowOptions = (kafkatcl_produceOptions *)ckalloc (sizeof (kafkatcl_produceOptions) * listObjc);
+			Tcl_Obj **payloadObjv = (Tcl_Obj **)ckalloc (sizeof (Tcl_Obj *) * listObjc);
+
+			for (i = 0; i < listObjc; i++) {
+				int rowObjc;
+				Tcl_Obj **rowObjv;
+				int rowArg = 0;
+
+				rowOptions[i] = defaults;
+
+				if (Tcl_ListObjGetElements (interp, listObjv[i], &rowObjc, &rowObjv) == TCL_ERROR
+				  || kafkatcl_parse_produce_options (interp, rowObjc, rowObjv, &rowArg, &rowOptions[i]) == TCL_ERROR) {
+					resultCode = TCL_ERROR;
+					break;
+				}
+
+				if (rowObjc - rowArg != 1) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("each message must be a list of options followed by the payload", -1));
+					resultCode = TCL_ERROR;
+					break;
+				}
+
+				if (kafkatcl_produce_check_reports (interp, kt->kh, rowOptions[i].commandObj, &rowOptions[i].nocopy) == TCL_ERROR) {
+					resultCode = TCL_ERROR;
+					break;
+				}
+
+				payloadObjv[i] = rowObjv[rowArg];
+			}
+
+			if (resultCode == TCL_OK) {
+				Tcl_Obj **resultObjv = (Tcl_Obj **)ckalloc (sizeof (Tcl_Obj *) * listObjc);
+				Tcl_Obj *emptyObj = Tcl_NewObj ();
+
+				for (i = 0; i < listObjc; i++) {
+					Tcl_WideInt id;
+					rd_kafka_resp_err_t err = kafkatcl_producev (kt, &rowOptions[i], payloadObjv[i], 1, &id);
+
+					if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+						resultObjv[i] = Tcl_NewStringObj (kafkatcl_kafka_error_to_errorcode_string (err), -1);
+					} else if (rowOptions[i].commandObj != NULL) {
+						resultObjv[i] = Tcl_NewWideIntObj (id);
+					} else {
+						resultObjv[i] = emptyObj;
+					}
+				}
+
+				Tcl_SetObjResult (interp, Tcl_NewListObj (listObjc, resultObjv));
+				ckfree (resultObjv);
+			}
+
+			ckfree (payloadObjv);
+			ckfree (rowOptions);
+			break;
+		}
+
+		case OPT_CREATOR: {
+			return kafkatcl_handleObjectObjCmd(kt->kh, interp, objc-1, objv+1);
+		}
+
+		case OPT_INFO: {
+			return kafkatcl_handle_topic_info (interp, kt, objc, objv);
+		}
+
+		case OPT_DELETE: {
+			if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "");
+				return TCL_ERROR;
+			}
+
+			if (Tcl_DeleteCommandFromToken (kt->kh->interp, kt->cmdToken) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+			}
+			break;
+		}
+    }
+    return resultCode;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_createTopicObjectCommand --
+ *
+ *    given a kafkatcl_handleClientData pointer, an object name (or "#auto"),
+ *    and a topic string, create a corresponding topic object command
+ *
+ * Results:
+ *    A standard Tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_createTopicObjectCommand (kafkatcl_handleClientData *kh, char *cmdName, const char *topic)
+{
+	Tcl_Interp *interp = kh->interp;
+	Tcl_ObjCmdProc *proc = NULL;
+
+	// dup the topic conf that we pass to rd_kafka_topic_new because
+	// rd_kafka_topic_new is documented as freeing the conf object
+	// and we don't want to give up our copy
+	rd_kafka_topic_conf_t *topicConf = rd_kafka_topic_conf_dup (kh->topicConf);
+	kafkatcl_partitionerProc *keyPartitioner = kafkatcl_key_partitioner (topicConf);
+	rd_kafka_topic_t *rkt = rd_kafka_topic_new (kh->rk, topic, topicConf);
+
+	if (rkt == NULL) {
+		return kafkatcl_last_error_to_tcl_error (interp);
+	}
+
+	switch (kh->kafkaType) {
+		case RD_KAFKA_PRODUCER:
+			proc = kafkatcl_topicProducerObjectObjCmd;
+			break;
+
+		case RD_KAFKA_CONSUMER:
+			proc = kafkatcl_topicConsumerObjectObjCmd;
+			break;
+
+		default:
+			assert (0 == 1);
+	}
+
+
+	// allocate one of our kafka topic client data objects for Tcl and
+	// configure it
+	kafkatcl_topicClientData *kt = (kafkatcl_topicClientData *)ckalloc (sizeof (kafkatcl_topicClientData));
+
+	kt->kafka_topic_magic = KAFKA_TOPIC_MAGIC;
+	kt->rkt = rkt;
+	kt->kh = kh;
+	kt->keyPartitioner = keyPartitioner;
+	KT_LIST_INIT (&kt->runningConsumers);
+
+	if (kh->kafkaType == RD_KAFKA_CONSUMER) {
+		KT_LIST_INSERT_HEAD (&kh->ko->topicConsumers, kt, topicConsumerInstance);
+	}
+
+	kt->topic = ckalloc (strlen (topic) + 1);
+	strcpy (kt->topic, topic);
+
+#define TOPIC_STRING_FORMAT "kafka_topic%lu"
+	// if cmdName is #auto, generate a unique name for the object
+	int autoGeneratedName = 0;
+	if (strcmp (cmdName, "#auto") == 0) {
+		static unsigned long nextAutoCounter = 0;
+		int baseNameLength = snprintf (NULL, 0, TOPIC_STRING_FORMAT, nextAutoCounter) + 1;
+		cmdName = ckalloc (baseNameLength);
+		snprintf (cmdName, baseNameLength, TOPIC_STRING_FORMAT, nextAutoCounter++);
+		autoGeneratedName = 1;
+	}
+
+	// create a Tcl command to interface to the topic object
+	kt->cmdToken = Tcl_CreateObjCommand (interp, cmdName, proc, kt, kafkatcl_topicObjectDelete);
+	// set the full name to the command in the interpreter result
+	Tcl_GetCommandFullName(interp, kt->cmdToken, Tcl_GetObjResult (interp));
+	if (autoGeneratedName == 1) {
+		ckfree(cmdName);
+	}
+
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_queueObjectObjCmd --
+ *
+ *    dispatches the subcommands of a kafkatcl queue object
+ *
+ * Results:
+ *    A standard Tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_queueObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    int         optIndex;
+	kafkatcl_queueClientData *kq = (kafkatcl_queueClientData *)cData;
+	rd_kafka_queue_t *rkqu = kq->rkqu;
+	int resultCode = TCL_OK;
+
+    static CONST char *options[] = {
+        "consume",
+        "consume_batch",
+        "consume_callback",
+        "delete",
+        NULL
+    };
+
+    enum options {
+		OPT_CONSUME_QUEUE,
+		OPT_CONSUME_QUEUE_BATCH,
+		OPT_CONSUME_CALLBACK,
+		OPT_DELETE
+    };
+
+    /* basic validation of command line arguments */
+    if (objc < 2) {
+        Tcl_WrongNumArgs (interp, 1, objv, "subcommand ?args?");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIndexFromObj (interp, objv[1], options, "option", TCL_EXACT, &optIndex) != TCL_OK) {
+		return TCL_ERROR;
+    }
+
+    switch ((enum options) optIndex) {
+		case OPT_CONSUME_QUEUE: {
+			int nextArg = 2;
+			kafkatcl_consumeOptions options;
+			int timeoutMS;
+
+			if (kafkatcl_parse_consume_options (interp, objc, objv, &nextArg, 0, &options) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (objc - nextArg != 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-fields list? timeout array");
+				return TCL_ERROR;
+			}
+
+			if (Tcl_GetIntFromObj (interp, objv[nextArg], &timeoutMS) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+				break;
+			}
+
+			char *arrayName = Tcl_GetString (objv[nextArg + 1]);
+
+			rd_kafka_message_t *rdm = rd_kafka_consume_queue (rkqu, timeoutMS);
+
+			if (rdm == NULL) {
+				resultCode =  kafkatcl_last_error_to_tcl_error (interp);
+				break;
+			}
+
+			kafkatcl_messageRef *ref = kafkatcl_message_ref_new (kq->kh, rdm);
+			resultCode = kafkatcl_message_to_tcl_array (interp, arrayName, rdm, ref, options.fields, 1);
+			kafkatcl_message_ref_release (ref);
+
+			break;
+		}
+
+		// NB bears an awful lot in common with OPT_CONSUME_QUEUE elsewhere
+		case OPT_CONSUME_QUEUE_BATCH: {
+			int nextArg = 2;
+			kafkatcl_consumeOptions options;
+			int timeoutMS;
+			int count;
+
+			if (kafkatcl_parse_consume_options (interp, objc, objv, &nextArg, 0, &options) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (objc - nextArg != 4) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-fields list? timeout count array code");
+				return TCL_ERROR;
+			}
+
+			if (Tcl_GetIntFromObj (interp, objv[nextArg], &timeoutMS) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+				break;
+			}
+
+			if (Tcl_GetIntFromObj (interp, objv[nextArg + 1], &count) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+				break;
+			}
+
+			char *arrayName = Tcl_GetString (objv[nextArg + 2]);
+
+			Tcl_Obj *codeObj = objv[nextArg + 3];
+
+			rd_kafka_message_t **rkMessages = ckalloc (sizeof (rd_kafka_message_t *) * count);
+
+			int gotCount = rd_kafka_consume_batch_queue (rkqu, timeoutMS, rkMessages, count);
+
+			int i;
+			for (i = 0; i < gotCount; i++) {
+				// the array's payload element keeps the message alive
+				// for as long as it needs it
+				kafkatcl_messageRef *ref = kafkatcl_message_ref_new (kq->kh, rkMessages[i]);
+				resultCode = kafkatcl_message_to_tcl_array (interp, arrayName, rkMessages[i], ref, options.fields, 0);
+				kafkatcl_message_ref_release (ref);
+
+				if (resultCode == TCL_BREAK) {
+					resultCode = TCL_OK;
+					continue;
+				} else if (resultCode == TCL_ERROR) {
+					break;
+				}
+
+				resultCode = Tcl_EvalObjEx (interp, codeObj,  0);
+
+				if (resultCode == TCL_ERROR) {
+					break;
+				}
+			}
+
+			/* Free trailing unprocessed messages; message i has been released already */
+			for (i++; i < gotCount; ++i) {
+				rd_kafka_message_destroy (rkMessages[i]);
+			}
+
+			ckfree (rkMessages);
+
+			if (resultCode != TCL_ERROR) {
+				Tcl_SetObjResult (interp, Tcl_NewIntObj (gotCount));
+			}
+
+			break;
+		}
+
+		case OPT_CONSUME_CALLBACK: {
+			int nextArg = 2;
+			kafkatcl_consumeOptions options;
+
+			if (kafkatcl_parse_consume_options (interp, objc, objv, &nextArg, 1, &options) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+            if ((objc - nextArg > 1) || (nextArg > 2 && objc == nextArg)) {
+                Tcl_WrongNumArgs (interp, 2, objv, "?-fields list? ?-batch count? ?-linger ms? ?callback?");
+                return TCL_ERROR;
+            }
+
+            if (objc == 2) {
+                if (kq->krc == NULL) {
+                    break;
+                }
+                Tcl_SetObjResult (interp, kq->krc->callbackObj);
+				break;
+			}
+
+			return kafkatcl_set_queue_consumer (kq, objv[nextArg], &options);
+		}
+
+		case OPT_DELETE: {
+			if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "");
+				return TCL_ERROR;
+			}
+
+			if (Tcl_DeleteCommandFromToken (kq->kh->interp, kq->cmdToken) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+			}
+			break;
+		}
+    }
+    return resultCode;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_add_brokers --
+ *
+ *    given a handle client data and a char* with some brokers,
+ *    try to add the brokers
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_add_brokers (kafkatcl_handleClientData *kh, Tcl_Obj *brokers) {
+	Tcl_Interp *interp = kh->interp;
+	int brokersObjc;
+	Tcl_Obj **brokersObjv;
+	int i;
+	Tcl_DString ds;
+	char *brokerString;
+
+	if (Tcl_ListObjGetElements (interp, brokers, &brokersObjc, &brokersObjv) == TCL_ERROR) {
+		Tcl_AppendResult (interp, " while converting broker list", NULL);
+		return TCL_ERROR;
+	}
+
+	if (brokersObjc < 1) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("Broker list must contain at least one element", -1));
+		return TCL_ERROR;
+	}
+
+	/* convert list to comma-separated */
+	Tcl_DStringInit (&ds);
+
+	for (i = 0; i < brokersObjc; i++) {
+		char *broker;
+		int brokerLen;
+
+		broker = Tcl_GetStringFromObj (brokersObjv[i], &brokerLen);
+		Tcl_DStringAppend (&ds, broker, brokerLen);
+
+		if (i < brokersObjc - 1) {
+			Tcl_DStringAppend (&ds, ",", 1);
+		}
+	}
+
+	brokerString = Tcl_DStringValue (&ds);
+
+	if (rd_kafka_brokers_add (kh->rk, brokerString) == 0) {
+		Tcl_DStringFree (&ds);
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("No valid brokers specified", -1));
+		return TCL_ERROR;
+	}
+
+	Tcl_DStringFree (&ds);
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_handleObjectObjCmd --
+ *
+ *    dispatches the subcommands of a kafkatcl handle-handling command
+ *
+ * Results:
+ *    stuff
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_handleObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    int         optIndex;
+	kafkatcl_handleClientData *kh = (kafkatcl_handleClientData *)cData;
+    assert (kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
+	rd_kafka_t *rk = kh->rk;
+	int resultCode = TCL_OK;
+
+    static CONST char *options[] = {
+        "name",
+        "new_topic",
+		"log_level",
+		"add_brokers",
+		"create_queue",
+		"output_queue_length",
+		"meta",
+		"info",
+		"config",
+		"partitioner",
+		"on_writable",
+		"backpressure",
+		"flush",
+		"purge",
+		"pause",
+		"resume",
+		"seek",
+		"offsets_for_times",
+        "delete",
+        NULL
+    };
+
+    enum options {
+        OPT_NAME,
+		OPT_NEW_TOPIC,
+		OPT_LOG_LEVEL,
+		OPT_ADD_BROKERS,
+        OPT_CREATE_QUEUE,
+        OPT_OUTPUT_QUEUE_LENGTH,
+		OPT_META,
+		OPT_INFO,
+		OPT_TOPIC_CONFIG,
+		OPT_PARTITIONER,
+		OPT_ON_WRITABLE,
+		OPT_BACKPRESSURE,
+		OPT_FLUSH,
+		OPT_PURGE,
+		OPT_PAUSE,
+		OPT_RESUME,
+		OPT_SEEK,
+		OPT_OFFSETS_FOR_TIMES,
+		OPT_DELETE
+    };
+
+    /* basic validation of command line arguments */
+    if (objc < 2) {
+        Tcl_WrongNumArgs (interp, 1, objv, "subcommand ?args?");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIndexFromObj (interp, objv[1], options, "option", TCL_EXACT, &optIndex) != TCL_OK) {
+		return TCL_ERROR;
+    }
+
+    switch ((enum options) optIndex) {
+		case OPT_NAME: {
+			if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "");
+				return TCL_ERROR;
+			}
+
+			Tcl_SetObjResult (interp, Tcl_NewStringObj (rd_kafka_name (rk), -1));
+			break;
+		}
+
+		case OPT_NEW_TOPIC: {
+			if (objc != 4) {
+				Tcl_WrongNumArgs (interp, 2, objv, "cmdName topic");
+				return TCL_ERROR;
+			}
+
+			char *cmdName = Tcl_GetString (objv[2]);
+			char *topic = Tcl_GetString (objv[3]);
+
+			resultCode = kafkatcl_createTopicObjectCommand (kh, cmdName, topic);
+			break;
+		}
+
+		case OPT_LOG_LEVEL: {
+			int kafkaLogLevel;
+
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "level");
+				return TCL_ERROR;
+			}
+
+			if (kafkatcl_obj_to_log_level (interp, objv[2], &kafkaLogLevel) == TCL_OK) {
+				rd_kafka_set_log_level (rk, kafkaLogLevel);
+			} else {
+				return TCL_ERROR;
+			}
+			break;
+		}
+
+		case OPT_ADD_BROKERS: {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "brokerList");
+				return TCL_ERROR;
+			}
+
+			resultCode = kafkatcl_add_brokers (kh, objv[2]);
+			break;
+		}
+
+		case OPT_CREATE_QUEUE: {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "command");
+				return TCL_ERROR;
+			}
+
+			// allocate one of our kafka client data objects for Tcl and configure it
+			kafkatcl_queueClientData *kq = (kafkatcl_queueClientData *)ckalloc (sizeof (kafkatcl_queueClientData));
+
+			kq->kafka_queue_magic = KAFKA_QUEUE_MAGIC;
+			kq->interp = interp;
+			kq->rkqu = rd_kafka_queue_new  (rk);
+			kq->kh = kh;
+			kq->krc = NULL;
+
+			KT_LIST_INSERT_HEAD (&kh->ko->queueConsumers, kq, queueConsumerInstance);
+
+			char *cmdName = Tcl_GetString (objv[2]);
+
+#define QUEUE_STRING_FORMAT "kafka_queue%lu"
+			// if cmdName is #auto, generate a unique name for the object
+			int autoGeneratedName = 0;
+			if (strcmp (cmdName, "#auto") == 0) {
+				static unsigned long nextAutoCounter = 0;
+				int baseNameLength = snprintf (NULL, 0, QUEUE_STRING_FORMAT, nextAutoCounter) + 1;
+				cmdName = ckalloc (baseNameLength);
+				snprintf (cmdName, baseNameLength, QUEUE_STRING_FORMAT, nextAutoCounter++);
+				autoGeneratedName = 1;
+			}
+
+			// create a Tcl command to interface to the handle object
+			kq->cmdToken = Tcl_CreateObjCommand (interp, cmdName, kafkatcl_queueObjectObjCmd, kq, kafkatcl_queueObjectDelete);
+			// set the full name to the command in the interpreter result
+			Tcl_GetCommandFullName(interp, kq->cmdToken, Tcl_GetObjResult (interp));
+			if (autoGeneratedName == 1) {
+				ckfree(cmdName);
+			}
+
+			break;
+		}
+
+		case OPT_OUTPUT_QUEUE_LENGTH: {
+			if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "");
+				return TCL_ERROR;
+			}
+
+			Tcl_SetObjResult (interp, Tcl_NewIntObj (rd_kafka_outq_len (rk)));
+			break;
+		}
+
+		case OPT_FLUSH: {
+			int nextArg = 2;
+			int timeoutMS = -1;
+			Tcl_Obj *asyncObj = NULL;
+
+			if (objc > 3 && strcmp (Tcl_GetString (objv[2]), "-async") == 0) {
+				asyncObj = objv[3];
+				nextArg = 4;
+			}
+
+			if (objc > nextArg + 1) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-async command? ?timeoutMS?");
+				return TCL_ERROR;
+			}
+
+			if (objc == nextArg + 1 && Tcl_GetIntFromObj (interp, objv[nextArg], &timeoutMS) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if (asyncObj == NULL) {
+				return kafkatcl_kafka_error_to_tcl (interp, kafkatcl_main_queue_drain (kh, timeoutMS), NULL);
+			}
+
+			kafkatcl_flushWaiter *waiter = (kafkatcl_flushWaiter *)ckalloc (sizeof (kafkatcl_flushWaiter));
+
+			waiter->commandObj = asyncObj;
+			Tcl_IncrRefCount (waiter->commandObj);
+			waiter->deadline = (timeoutMS < 0) ? -1 : kafkatcl_now_ms () + timeoutMS;
+			KT_LIST_INSERT_HEAD (&kh->flushWaiters, waiter, flushWaiterInstance);
+
+			// a flush with no timeout doesn't wait, but it does get
+			// messages lingering in librdkafka's queues sent right away
+			rd_kafka_flush (rk, 0);
+			break;
+		}
+
+		case OPT_PAUSE:
+		case OPT_RESUME: {
+			return kafkatcl_pause_resume (interp, kh, optIndex == OPT_PAUSE, objc, objv);
+		}
+
+		case OPT_SEEK: {
+			return kafkatcl_seek (interp, kh, objc, objv);
+		}
+
+		case OPT_OFFSETS_FOR_TIMES: {
+			return kafkatcl_offsets_for_times (interp, kh, objc, objv);
+		}
+
+		case OPT_PURGE: {
+			int purgeFlags = RD_KAFKA_PURGE_F_QUEUE;
+
+			if (objc == 3 && strcmp (Tcl_GetString (objv[2]), "-inflight") == 0) {
+				purgeFlags |= RD_KAFKA_PURGE_F_INFLIGHT;
+			} else if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-inflight?");
+				return TCL_ERROR;
+			}
+
+			// purged messages get delivery reports with an error of
+			// RD_KAFKA_RESP_ERR__PURGE_QUEUE or _PURGE_INFLIGHT
+			return kafkatcl_kafka_error_to_tcl (interp, rd_kafka_purge (rk, purgeFlags), NULL);
+		}
+
+		case OPT_ON_WRITABLE: {
+			int nextArg = 2;
+			int lowWater = -1;
+
+			if (objc > 3 && strcmp (Tcl_GetString (objv[2]), "-lowwater") == 0) {
+				if (Tcl_GetIntFromObj (interp, objv[3], &lowWater) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+				if (lowWater <= 0) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("-lowwater must be greater than zero", -1));
+					return TCL_ERROR;
+				}
+				nextArg = 4;
+			}
+
+			if (objc > nextArg + 1) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-lowwater count? ?script?");
+				return TCL_ERROR;
+			}
+
+			// -lowwater by itself moves the mark of the current script
+			if (objc == nextArg && lowWater > 0) {
+				if (kh->writableCallbackObj == NULL) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("-lowwater needs a script, and there's no on_writable script to apply it to", -1));
+					return TCL_ERROR;
+				}
+				kh->writableLowWater = lowWater;
+				break;
+			}
+
+			if (objc == nextArg) {
+				if (kh->writableCallbackObj != NULL) {
+					Tcl_SetObjResult (interp, kh->writableCallbackObj);
+				}
+				break;
+			}
+
+			if (kh->writableCallbackObj != NULL) {
+				Tcl_DecrRefCount (kh->writableCallbackObj);
+				kh->writableCallbackObj = NULL;
+			}
+
+			// an empty script removes it, like fileevent
+			if (*Tcl_GetString (objv[nextArg]) == '\0') {
+				break;
+			}
+
+			// the low-water mark defaults to half the most messages
+			// the output queue can hold
+			if (lowWater < 0) {
+				char value[32];
+				size_t valueSize = sizeof (value);
+
+				lowWater = KAFKATCL_DEFAULT_QUEUE_MAX_MESSAGES;
+				if (rd_kafka_conf_get (rd_kafka_conf (rk), "queue.buffering.max.messages", value, &valueSize) == RD_KAFKA_CONF_OK) {
+					lowWater = atoi (value);
+				}
+				lowWater = (lowWater > 1) ? lowWater / 2 : 1;
+			}
+
+			kh->writableCallbackObj = objv[nextArg];
+			Tcl_IncrRefCount (kh->writableCallbackObj);
+			kh->writableLowWater = lowWater;
+
+			// like fileevent, the script runs once right away if the
+			// queue is already below the low-water mark
+			kh->writablePending = 1;
+			break;
+		}
+
+		case OPT_BACKPRESSURE: {
+			int lowMessagesSet = 0;
+			int lowBytesSet = 0;
+			int highMessages = kh->backpressureHighMessages;
+			int lowMessages = kh->backpressureLowMessages;
+			Tcl_WideInt highBytes = kh->backpressureHighBytes;
+			Tcl_WideInt lowBytes = kh->backpressureLowBytes;
+			int i;
+
+			if (objc == 2) {
+				Tcl_Obj *listObjv[8];
+
+				listObjv[0] = Tcl_NewStringObj ("-high_messages", -1);
+				listObjv[1] = Tcl_NewIntObj (kh->backpressureHighMessages);
+				listObjv[2] = Tcl_NewStringObj ("-low_messages", -1);
+				listObjv[3] = Tcl_NewIntObj (kh->backpressureLowMessages);
+				listObjv[4] = Tcl_NewStringObj ("-high_bytes", -1);
+				listObjv[5] = Tcl_NewWideIntObj (kh->backpressureHighBytes);
+				listObjv[6] = Tcl_NewStringObj ("-low_bytes", -1);
+				listObjv[7] = Tcl_NewWideIntObj (kh->backpressureLowBytes);
+				Tcl_SetObjResult (interp, Tcl_NewListObj (8, listObjv));
 				break;
 			}
 
-			if (Tcl_GetIntFromObj (interp, objv[4], &count) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
-				break;
-			}
+			if (objc % 2 != 0) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-high_messages count? ?-low_messages count? ?-high_bytes bytes? ?-low_bytes bytes?");
+				return TCL_ERROR;
+			}
+
+			for (i = 2; i < objc; i += 2) {
+				char *option = Tcl_GetString (objv[i]);
+				Tcl_WideInt value;
+
+				if (Tcl_GetWideIntFromObj (interp, objv[i + 1], &value) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+
+				if (value < 0) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("backpressure marks can't be negative", -1));
+					return TCL_ERROR;
+				}
+
+				if (strcmp (option, "-high_messages") == 0) {
+					highMessages = (value > INT_MAX) ? INT_MAX : (int)value;
+				} else if (strcmp (option, "-low_messages") == 0) {
+					lowMessages = (value > INT_MAX) ? INT_MAX : (int)value;
+					lowMessagesSet = 1;
+				} else if (strcmp (option, "-high_bytes") == 0) {
+					highBytes = value;
+				} else if (strcmp (option, "-low_bytes") == 0) {
+					lowBytes = value;
+					lowBytesSet = 1;
+				} else {
+					Tcl_ResetResult (interp);
+					Tcl_AppendResult (interp, "unknown option '", option, "', should be -high_messages, -low_messages, -high_bytes or -low_bytes", NULL);
+					return TCL_ERROR;
+				}
+			}
+
+			// a high-water mark given without its low-water mark
+			// brings the low-water mark along to half of it
+			if (!lowMessagesSet && highMessages != kh->backpressureHighMessages) {
+				lowMessages = highMessages / 2;
+			}
+
+			if (!lowBytesSet && highBytes != kh->backpressureHighBytes) {
+				lowBytes = highBytes / 2;
+			}
+
+			if ((highMessages > 0 && lowMessages >= highMessages) || (highBytes > 0 && lowBytes >= highBytes)) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("low-water marks must be below their high-water marks", -1));
+				return TCL_ERROR;
+			}
+
+			kh->backpressureHighMessages = highMessages;
+			kh->backpressureLowMessages = lowMessages;
+			kh->backpressureHighBytes = highBytes;
+			kh->backpressureLowBytes = lowBytes;
+
+			// the new marks may let paused partitions go right away
+			kafkatcl_backpressure_release (kh, 0, 0);
+			break;
+		}
+
+		case OPT_META: {
+			return kafkatcl_handle_meta (interp, kh, objc, objv);
+		}
+
+		case OPT_INFO: {
+			int suboptIndex;
+
+			if (objc < 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?topics?");
+				return TCL_ERROR;
+			}
+
+			static CONST char *subOptions[] = {
+				"topics",
+				"brokers",
+				"partitions",
+				"pending",
+				NULL
+			};
+
+			enum subOptions {
+				SUBOPT_TOPICS,
+				SUBOPT_BROKERS,
+				SUBOPT_PARTITIONS,
+				SUBOPT_PENDING,
+			};
+
+			// argument must be one of the subOptions defined above
+			if (Tcl_GetIndexFromObj (interp, objv[2], subOptions, "suboption",
+				TCL_EXACT, &suboptIndex) != TCL_OK) {
+				return TCL_ERROR;
+			}
+
+			switch ((enum subOptions) suboptIndex) {
+				case SUBOPT_TOPICS: {
+					if (objc != 3) {
+						Tcl_WrongNumArgs (interp, 3, objv, "");
+						return TCL_ERROR;
+					}
+
+					if (kafkatcl_metadata_ensure (kh) == TCL_ERROR) {
+						return TCL_ERROR;
+					}
+
+					return kafkatcl_meta_topic_list (kh);
+				}
+
+				case SUBOPT_BROKERS: {
+					if (objc != 3) {
+						Tcl_WrongNumArgs (interp, 3, objv, "");
+						return TCL_ERROR;
+					}
+
+					if (kafkatcl_metadata_ensure (kh) == TCL_ERROR) {
+						return TCL_ERROR;
+					}
+
+					return kafkatcl_meta_broker_list (kh);
+				}
+
+				case SUBOPT_PARTITIONS: {
+					if (objc != 4) {
+						Tcl_WrongNumArgs (interp, 3, objv, "topic");
+						return TCL_ERROR;
+					}
+
+					return kafkatcl_meta_topic_partitions (kh, Tcl_GetString (objv[3]));
+				}
+
+				case SUBOPT_PENDING: {
+					Tcl_Obj *listObjv[6];
+					Tcl_Obj *pausedObj = Tcl_NewObj ();
+					int i;
+
+					if (objc != 3) {
+						Tcl_WrongNumArgs (interp, 3, objv, "");
+						return TCL_ERROR;
+					}
+
+					for (i = 0; kh->backpressurePaused != NULL && i < kh->backpressurePaused->cnt; i++) {
+						Tcl_Obj *elementObjv[2];
+
+						elementObjv[0] = Tcl_NewStringObj (kh->backpressurePaused->elems[i].topic, -1);
+						elementObjv[1] = Tcl_NewIntObj (kh->backpressurePaused->elems[i].partition);
+						Tcl_ListObjAppendElement (NULL, pausedObj, Tcl_NewListObj (2, elementObjv));
+					}
+
+					// consumed messages waiting on their callbacks and the
+					// partitions paused until they've been handled
+					listObjv[0] = Tcl_NewStringObj ("messages", -1);
+					listObjv[1] = Tcl_NewIntObj (kh->pendingMessages);
+					listObjv[2] = Tcl_NewStringObj ("bytes", -1);
+					listObjv[3] = Tcl_NewWideIntObj (kh->pendingBytes);
+					listObjv[4] = Tcl_NewStringObj ("paused", -1);
+					listObjv[5] = pausedObj;
+					Tcl_SetObjResult (interp, Tcl_NewListObj (6, listObjv));
+					return TCL_OK;
+				}
+			}
+			break;
+		}
+
+		case OPT_TOPIC_CONFIG: {
+			resultCode = kafkatcl_handle_topic_conf (interp, kh->topicConf, objc - 2, &objv[2]);
+			break;
+		}
+
+		case OPT_PARTITIONER: {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "consistent|random");
+				return TCL_ERROR;
+			}
+
+			resultCode = kafkatcl_partitioner_conf (interp, kh->topicConf, objc - 2, &objv[2]);
+			break;
+		}
+
+
+		case OPT_DELETE: {
+			if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "");
+				return TCL_ERROR;
+			}
+
+			if (Tcl_DeleteCommandFromToken (kh->interp, kh->cmdToken) == TCL_ERROR) {
+				resultCode = TCL_ERROR;
+			}
+			break;
+		}
+
+    }
+    return resultCode;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_objv_to_topic_partition_list --
+ *
+ *    converts a Tcl list of { {topic partition offset} {topic partition offset} }
+ *    to a new-consumer-interface rd_kafka_topic_partition_list_t
+ *
+ *    offset is optional, and if the offset is not provided then the partition is
+ *    optional, so you can provide a simple {topic topic topic} list.
+ *
+ *    Topics starting with "^" are regular expressions.
+ *
+ *    Empty topics (like the second topic in this list: {topic {} topic}) are
+ *    silently dropped.
+ *
+ * Results:
+ *    Pointer to rd_kafka_topic_partition_list_t
+ *    Or NULL if there is an error in the provided Tcl list.
+ *
+ *----------------------------------------------------------------------
+ */
+rd_kafka_topic_partition_list_t *kafkatcl_objv_to_topic_partition_list(Tcl_Interp *interp, Tcl_Obj *const*objv, int objc)
+{
+	rd_kafka_topic_partition_list_t *list = rd_kafka_topic_partition_list_new(0);
+	int i;
+
+	for(i = 0; i < objc; i++) {
+		rd_kafka_topic_partition_t *added;
+		char     *topic = NULL;
+		int       partition = 0;
+		Tcl_WideInt offset = 0;
+		int       tupleObjc;
+		Tcl_Obj **tupleObjv;
+
+		// make this split out a Tcl list (tuple) {topic ?partition? ?offset?}
+		if (Tcl_ListObjGetElements (interp, objv[i], &tupleObjc, &tupleObjv) == TCL_ERROR) {
+			rd_kafka_topic_partition_list_destroy(list);
+			return NULL;
+		}
+
+		// skip {}
+		if(tupleObjc == 0)
+			continue;
+
+		topic = Tcl_GetString(tupleObjv[0]);
+
+		if(tupleObjc > 1) {
+			if(Tcl_GetIntFromObj(interp, tupleObjv[1], &partition) == TCL_ERROR) {
+				rd_kafka_topic_partition_list_destroy(list);
+				return NULL;
+			}
+		}
+
+		if(tupleObjc > 2) {
+			if(kafkatcl_parse_offset(interp, tupleObjv[2], &offset) == TCL_ERROR) {
+				rd_kafka_topic_partition_list_destroy(list);
+				return NULL;
+			}
+		}
+
+		added = rd_kafka_topic_partition_list_add(list, topic, partition);
+
+		if(tupleObjc > 2)
+			added->offset = offset;
+	}
+
+	return list;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_topic_partition_list_to_list --
+ *
+ *    converts rd_kafka_topic_partition_list_t to a Tcl list. Only the topic, partition
+ *    and offset (if non zero) is retained. Metadata is discarded.
+ *
+ * Results:
+ *    A Tcl_Obj containing a list of the form {{topic ?partition ?offset??}}
+ *
+ *----------------------------------------------------------------------
+ */
+Tcl_Obj *kafkatcl_topic_partition_list_to_list(Tcl_Interp *interp, rd_kafka_topic_partition_list_t *topics)
+{
+	Tcl_Obj *result = Tcl_NewObj();
+	int i;
+
+	for(i = 0; i < topics->cnt; i++) {
+		Tcl_Obj *topicPartition = Tcl_NewObj();
 
-			char *arrayName = Tcl_GetString (objv[5]);
+		Tcl_ListObjAppendElement(interp, topicPartition, Tcl_NewStringObj(topics->elems[i].topic, -1));
+		if(topics->elems[i].partition || topics->elems[i].offset)
+			Tcl_ListObjAppendElement(interp, topicPartition, Tcl_NewIntObj(topics->elems[i].partition));
+		if(topics->elems[i].offset)
+			Tcl_ListObjAppendElement(interp, topicPartition, kafkatcl_NewOffsetObj(topics->elems[i].offset));
 
-			Tcl_Obj *codeObj = objv[6];
+		Tcl_ListObjAppendElement(interp, result, topicPartition);
+	}
 
-			rd_kafka_message_t **rkMessages = ckalloc (sizeof (rd_kafka_message_t *) * count);
+	return result;
+}
 
-			int gotCount = rd_kafka_consume_batch (rkt, partition, timeoutMS, rkMessages, count);
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_topic_partition_offsets_to_list --
+ *
+ *    make a list of {topic partition offset} for each partition in a
+ *    topic-partition list that came back without an error.  unlike
+ *    kafkatcl_topic_partition_list_to_list, zeros aren't left out, so
+ *    the result can be handed straight to seek.
+ *
+ *----------------------------------------------------------------------
+ */
+Tcl_Obj *
+kafkatcl_topic_partition_offsets_to_list (rd_kafka_topic_partition_list_t *partitions) {
+	Tcl_Obj *listObj = Tcl_NewObj ();
+	int i;
 
-			int i;
-			for (i = 0; i < gotCount; i++) {
-				resultCode = kafkatcl_message_to_tcl_array (interp, arrayName, rkMessages[i], 0);
+	for (i = 0; i < partitions->cnt; i++) {
+		rd_kafka_topic_partition_t *tp = &partitions->elems[i];
+		Tcl_Obj *elementObjv[3];
 
-				if (resultCode == TCL_BREAK) {
-					resultCode = TCL_OK;
-					rd_kafka_message_destroy (rkMessages[i]);
-					continue;
-				} else if (resultCode == TCL_ERROR) {
-					break;
-				}
+		if (tp->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+			continue;
+		}
 
-				resultCode = Tcl_EvalObjEx (interp, codeObj,  0);
+		elementObjv[0] = Tcl_NewStringObj (tp->topic, -1);
+		elementObjv[1] = Tcl_NewIntObj (tp->partition);
+		elementObjv[2] = kafkatcl_NewOffsetObj (tp->offset);
+		Tcl_ListObjAppendElement (NULL, listObj, Tcl_NewListObj (3, elementObjv));
+	}
 
-				if (resultCode == TCL_ERROR) {
-					break;
-				}
+	return listObj;
+}
 
-				rd_kafka_message_destroy (rkMessages[i]);
-			}
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_first_partition_error --
+ *
+ *    return the error of the first partition in a topic-partition list
+ *    that has one, or RD_KAFKA_RESP_ERR_NO_ERROR
+ *
+ *----------------------------------------------------------------------
+ */
+rd_kafka_resp_err_t
+kafkatcl_first_partition_error (rd_kafka_topic_partition_list_t *partitions) {
+	int i;
 
-			/* Free trailing unprocessed messages */
-			for (; i < gotCount; ++i) {
-				rd_kafka_message_destroy (rkMessages[i]);
-			}
+	for (i = 0; i < partitions->cnt; i++) {
+		if (partitions->elems[i].err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+			return partitions->elems[i].err;
+		}
+	}
 
-			ckfree (rkMessages);
+	return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
 
-			if (resultCode != TCL_ERROR) {
-				Tcl_SetObjResult (interp, Tcl_NewIntObj (gotCount));
-			}
-			break;
-		}
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_partition_errors_to_tcl --
+ *
+ *    report the first partition in a topic-partition list that came
+ *    back with an error as a kafka error naming the partition
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_partition_errors_to_tcl (Tcl_Interp *interp, rd_kafka_topic_partition_list_t *partitions) {
+	int i;
 
-		case OPT_CREATOR: {
-			return kafkatcl_handleObjectObjCmd(kt->kh, interp, objc-1, objv+1);
+	for (i = 0; i < partitions->cnt; i++) {
+		rd_kafka_topic_partition_t *tp = &partitions->elems[i];
+
+		if (tp->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+			char *what = ckalloc (strlen (tp->topic) + 32);
+
+			sprintf (what, "%s partition %d", tp->topic, tp->partition);
+			kafkatcl_kafka_error_to_tcl (interp, tp->err, what);
+			ckfree (what);
+			return TCL_ERROR;
 		}
+	}
 
-		case OPT_INFO: {
-			return kafkatcl_handle_topic_info (interp, kt, objc, objv);
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_app_paused_update --
+ *
+ *    add the partitions the application just paused to kh->appPaused,
+ *    or take the ones it just resumed out of it.  partitions that failed
+ *    to pause are left out.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_app_paused_update (kafkatcl_handleClientData *kh, int pause, rd_kafka_topic_partition_list_t *partitions) {
+	int i;
+
+	if (!pause && kh->appPaused == NULL) {
+		return;
+	}
+
+	if (kh->appPaused == NULL) {
+		kh->appPaused = rd_kafka_topic_partition_list_new (partitions->cnt);
+	}
+
+	for (i = 0; i < partitions->cnt; i++) {
+		const char *topic = partitions->elems[i].topic;
+		int32_t partition = partitions->elems[i].partition;
+
+		if (!pause) {
+			rd_kafka_topic_partition_list_del (kh->appPaused, topic, partition);
+		} else if (partitions->elems[i].err == RD_KAFKA_RESP_ERR_NO_ERROR && rd_kafka_topic_partition_list_find (kh->appPaused, topic, partition) == NULL) {
+			rd_kafka_topic_partition_list_add (kh->appPaused, topic, partition);
 		}
+	}
+}
 
-		case OPT_LEGACY_CONSUME_START:
-		case OPT_CONSUME_START: {
-			int64_t offset;
-			int partition;
-			Tcl_Obj *callbackObj = NULL;
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_pause_resume --
+ *
+ *    handle the "pause" and "resume" subcommands of a handle, which
+ *    take a topic-partition list as separate arguments, as offsets and
+ *    commit do.
+ *
+ *    a paused partition stops being fetched (or produced to) without
+ *    losing its place or what has already been fetched into the local
+ *    queues, and resuming it carries on from there.  partitions paused
+ *    here are remembered in kh->appPaused until they're resumed here, so
+ *    backpressure leaves them alone.
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_pause_resume (Tcl_Interp *interp, kafkatcl_handleClientData *kh, int pause, int objc, Tcl_Obj *CONST objv[]) {
+	rd_kafka_topic_partition_list_t *partitions;
+	rd_kafka_resp_err_t status;
+	int resultCode;
+
+	if (objc < 3) {
+		Tcl_WrongNumArgs (interp, 2, objv, "{topic partition} ?{topic partition}...?");
+		return TCL_ERROR;
+	}
+
+	partitions = kafkatcl_objv_to_topic_partition_list (interp, &objv[2], objc - 2);
+	if (partitions == NULL) {
+		return TCL_ERROR;
+	}
+
+	// from here on these partitions are the application's to resume
+	kafkatcl_backpressure_forget (kh, partitions);
+	kafkatcl_range_forget (kh, partitions);
+
+	if (pause) {
+		status = rd_kafka_pause_partitions (kh->rk, partitions);
+	} else {
+		status = rd_kafka_resume_partitions (kh->rk, partitions);
+	}
+
+	if (status != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		rd_kafka_topic_partition_list_destroy (partitions);
+		return kafkatcl_kafka_error_to_tcl (interp, status, NULL);
+	}
+
+	kafkatcl_app_paused_update (kh, pause, partitions);
+
+	resultCode = kafkatcl_partition_errors_to_tcl (interp, partitions);
+	rd_kafka_topic_partition_list_destroy (partitions);
+	return resultCode;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_parse_query_options --
+ *
+ *    parse the ?-timeout ms? ?-command command? options of seek and
+ *    offsets_for_times, leaving *nextArgPtr at the first partition.
+ *    *commandObjPtr is left alone if there's no -command.
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_parse_query_options (Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], int *nextArgPtr, int *timeoutPtr, Tcl_Obj **commandObjPtr) {
+	int nextArg = *nextArgPtr;
 
-			if ((objc < 4) || (objc > 5)) {
-				Tcl_WrongNumArgs (interp, 2, objv, "partition offset ?callback?");
+	while (nextArg + 1 < objc) {
+		char *option = Tcl_GetString (objv[nextArg]);
+
+		if (strcmp (option, "-timeout") == 0) {
+			if (Tcl_GetIntFromObj (interp, objv[nextArg + 1], timeoutPtr) == TCL_ERROR) {
 				return TCL_ERROR;
 			}
+		} else if (strcmp (option, "-command") == 0) {
+			*commandObjPtr = objv[nextArg + 1];
+		} else {
+			break;
+		}
+		nextArg += 2;
+	}
 
-			if (Tcl_GetIntFromObj (interp, objv[2], &partition) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
-				break;
-			}
+	*nextArgPtr = nextArg;
+	return TCL_OK;
+}
 
-			if (kafkatcl_parse_offset (interp, objv[3], &offset) != TCL_OK) {
-				resultCode = TCL_ERROR;
-				break;
-			}
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_seek --
+ *
+ *    handle the "seek" subcommand of a handle or subscriber, which
+ *    takes {topic partition offset} lists as separate arguments, as
+ *    commit does, and moves where each partition is being consumed
+ *    from.  prefetched messages for the partitions are thrown away.
+ *
+ *    with -command the seek is done on a worker thread and the command
+ *    is invoked with the outcome.  otherwise we wait up to -timeout ms
+ *    for the seek to take; a timeout of 0 doesn't wait, and doesn't
+ *    find out whether it worked.
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_seek (Tcl_Interp *interp, kafkatcl_handleClientData *kh, int objc, Tcl_Obj *CONST objv[]) {
+	rd_kafka_topic_partition_list_t *partitions;
+	rd_kafka_error_t *error;
+	Tcl_Obj *commandObj = NULL;
+	int timeoutMS = 5000;
+	int nextArg = 2;
+	int resultCode;
+	int i;
 
-			if (objc == 5) {
-				callbackObj = objv[4];
-			}
+	if (kafkatcl_parse_query_options (interp, objc, objv, &nextArg, &timeoutMS, &commandObj) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
 
-			if (kafkatcl_consume_start (kt, partition, offset, callbackObj) == TCL_ERROR) {
-				resultCode =  TCL_ERROR;
-				break;
-			}
+	if (objc <= nextArg) {
+		Tcl_WrongNumArgs (interp, 2, objv, "?-timeout ms? ?-command command? {topic partition offset} ?{topic partition offset}...?");
+		return TCL_ERROR;
+	}
 
-			break;
+	partitions = kafkatcl_objv_to_topic_partition_list (interp, &objv[nextArg], objc - nextArg);
+	if (partitions == NULL) {
+		return TCL_ERROR;
+	}
+
+	for (i = 0; i < partitions->cnt; i++) {
+		if (partitions->elems[i].offset == RD_KAFKA_OFFSET_INVALID) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("no offset to seek to for %s partition %d", partitions->elems[i].topic, partitions->elems[i].partition));
+			rd_kafka_topic_partition_list_destroy (partitions);
+			return TCL_ERROR;
 		}
+	}
 
-		case OPT_LEGACY_CONSUME_START_QUEUE:
-		case OPT_CONSUME_START_QUEUE: {
-			int64_t offset;
-			int partition;
+	if (commandObj != NULL) {
+		kafkatcl_queryEvent *evPtr = kafkatcl_query_new (kh, KAFKATCL_QUERY_SEEK, commandObj, timeoutMS);
 
-			if (objc != 5) {
-				Tcl_WrongNumArgs (interp, 2, objv, "partition offset queue");
-				return TCL_ERROR;
-			}
+		evPtr->partitions = partitions;
+		return kafkatcl_query_start (kh, evPtr);
+	}
 
-			if (Tcl_GetIntFromObj (interp, objv[2], &partition) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
-				break;
-			}
+	error = rd_kafka_seek_partitions (kh->rk, partitions, timeoutMS);
+	if (error != NULL) {
+		rd_kafka_resp_err_t err = rd_kafka_error_code (error);
 
-			if (kafkatcl_parse_offset (interp, objv[3], &offset) != TCL_OK) {
-				resultCode = TCL_ERROR;
-				break;
-			}
+		rd_kafka_error_destroy (error);
+		rd_kafka_topic_partition_list_destroy (partitions);
+		return kafkatcl_kafka_error_to_tcl (interp, err, NULL);
+	}
+
+	// without a timeout each partition just says the seek is in progress
+	resultCode = (timeoutMS == 0) ? TCL_OK : kafkatcl_partition_errors_to_tcl (interp, partitions);
+	rd_kafka_topic_partition_list_destroy (partitions);
+	return resultCode;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_offsets_for_times --
+ *
+ *    handle the "offsets_for_times" subcommand of a handle or
+ *    subscriber, which takes {topic partition timestamp} lists, the
+ *    timestamps in milliseconds since the epoch, and finds the earliest
+ *    offset in each partition whose timestamp is at or after it, or end
+ *    if there isn't one.  the results are in the form seek takes.
+ *
+ *    with -command the lookup is done on a worker thread and the
+ *    command is invoked with the results.
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_offsets_for_times (Tcl_Interp *interp, kafkatcl_handleClientData *kh, int objc, Tcl_Obj *CONST objv[]) {
+	rd_kafka_topic_partition_list_t *partitions;
+	rd_kafka_resp_err_t err;
+	Tcl_Obj *commandObj = NULL;
+	int timeoutMS = 5000;
+	int nextArg = 2;
+	int resultCode;
+	int i;
+
+	if (kafkatcl_parse_query_options (interp, objc, objv, &nextArg, &timeoutMS, &commandObj) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	if (objc <= nextArg) {
+		Tcl_WrongNumArgs (interp, 2, objv, "?-timeout ms? ?-command command? {topic partition timestamp} ?{topic partition timestamp}...?");
+		return TCL_ERROR;
+	}
+
+	partitions = kafkatcl_objv_to_topic_partition_list (interp, &objv[nextArg], objc - nextArg);
+	if (partitions == NULL) {
+		return TCL_ERROR;
+	}
+
+	// librdkafka takes the timestamps in the offsets and replaces them
+	// with the offsets it finds
+	for (i = 0; i < partitions->cnt; i++) {
+		if (partitions->elems[i].offset < 0) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("%s partition %d needs a timestamp in milliseconds since the epoch", partitions->elems[i].topic, partitions->elems[i].partition));
+			rd_kafka_topic_partition_list_destroy (partitions);
+			return TCL_ERROR;
+		}
+	}
+
+	if (commandObj != NULL) {
+		kafkatcl_queryEvent *evPtr = kafkatcl_query_new (kh, KAFKATCL_QUERY_OFFSETS_FOR_TIMES, commandObj, timeoutMS);
+
+		evPtr->partitions = partitions;
+		return kafkatcl_query_start (kh, evPtr);
+	}
+
+	err = rd_kafka_offsets_for_times (kh->rk, partitions, timeoutMS);
+	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		rd_kafka_topic_partition_list_destroy (partitions);
+		return kafkatcl_kafka_error_to_tcl (interp, err, NULL);
+	}
 
-			char *queueCommandName = Tcl_GetString (objv[4]);
-			kafkatcl_queueClientData *qcd = kafkatcl_queue_command_to_queueClientData (interp, queueCommandName);
-			if (qcd == NULL) {
-				Tcl_SetObjResult (interp, Tcl_NewStringObj ("command name '", -1));
-				Tcl_AppendResult (interp, queueCommandName, "' is not a kafkatcl queue object", NULL);
-				resultCode = TCL_ERROR;
-				break;
-			}
+	resultCode = kafkatcl_partition_errors_to_tcl (interp, partitions);
+	if (resultCode == TCL_OK) {
+		Tcl_SetObjResult (interp, kafkatcl_topic_partition_offsets_to_list (partitions));
+	}
 
-			if (kafkatcl_consume_start_queue (kt, partition, offset, qcd) == TCL_ERROR) {
-				resultCode =  TCL_ERROR;
-				break;
-			}
+	rd_kafka_topic_partition_list_destroy (partitions);
+	return resultCode;
+}
 
-			break;
-		}
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_parse_range_options --
+ *
+ *    parse the -from ms -to ms ?-fields list? ?-timeout ms?
+ *    ?-command command? options of consume_range, leaving *nextArgPtr
+ *    at the first partition
+ *
+ * Results:
+ *    a standard tcl result
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_parse_range_options (Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], int *nextArgPtr, kafkatcl_rangeOptions *options) {
+	int nextArg = *nextArgPtr;
 
-		case OPT_LEGACY_CONSUME_STOP:
-		case OPT_CONSUME_STOP: {
-			int partition;
+	options->from = -1;
+	options->to = -1;
+	options->fields = KAFKATCL_FIELDS_DEFAULT;
+	options->timeoutMS = 5000;
+	options->commandObj = NULL;
 
-			if (objc != 3) {
-				Tcl_WrongNumArgs (interp, 2, objv, "partition");
+	while (nextArg + 1 < objc) {
+		char *option = Tcl_GetString (objv[nextArg]);
+
+		if (strcmp (option, "-from") == 0) {
+			if (Tcl_GetWideIntFromObj (interp, objv[nextArg + 1], &options->from) == TCL_ERROR) {
 				return TCL_ERROR;
 			}
-
-			if (Tcl_GetIntFromObj (interp, objv[2], &partition) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
-				break;
+		} else if (strcmp (option, "-to") == 0) {
+			if (Tcl_GetWideIntFromObj (interp, objv[nextArg + 1], &options->to) == TCL_ERROR) {
+				return TCL_ERROR;
 			}
-
-			return kafkatcl_consume_stop (kt, partition);
-		}
-
-		case OPT_DELETE: {
-			if (objc != 2) {
-				Tcl_WrongNumArgs (interp, 2, objv, "");
+		} else if (strcmp (option, "-fields") == 0) {
+			if (kafkatcl_parse_fields (interp, objv[nextArg + 1], kafkatcl_fieldStrings, &options->fields) == TCL_ERROR) {
 				return TCL_ERROR;
 			}
-
-			if (Tcl_DeleteCommandFromToken (kt->kh->interp, kt->cmdToken) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
+		} else if (strcmp (option, "-timeout") == 0) {
+			if (kafkatcl_parse_milliseconds (interp, objv[nextArg + 1], &options->timeoutMS) == TCL_ERROR) {
+				return TCL_ERROR;
 			}
+		} else if (strcmp (option, "-command") == 0) {
+			options->commandObj = objv[nextArg + 1];
+		} else {
 			break;
 		}
-    }
-    return resultCode;
+		nextArg += 2;
+	}
+
+	if (options->from < 0 || options->to < 0) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("-from and -to are required, in milliseconds since the epoch", -1));
+		return TCL_ERROR;
+	}
+
+	if (options->to <= options->from) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("-to must be after -from", -1));
+		return TCL_ERROR;
+	}
+
+	*nextArgPtr = nextArg;
+	return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_topicProducerObjectObjCmd --
+ * kafkatcl_range_resolve --
  *
- *    dispatches the subcommands of a kafkatcl batch-handling command
+ *    turn a time range into offsets for each partition in a
+ *    topic-partition list.  the list's offsets become the first offset
+ *    at or after from, and *endsPtr gets a copy whose offsets are the
+ *    first offset at or after to, so a partition stops just before it.
+ *    where there's no such message the high watermark is used, which
+ *    keeps messages produced after we start out of the range.
+ *    partitions with nothing in the range are taken out of both lists.
+ *
+ *    it only touches the lists and the librdkafka handle, so it can be
+ *    used from any thread.
  *
  * Results:
- *    stuff
+ *    a kafka error, and *endsPtr if there wasn't one
  *
  *----------------------------------------------------------------------
  */
-int
-kafkatcl_topicProducerObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
-{
-    int         optIndex;
-	kafkatcl_topicClientData *kt = (kafkatcl_topicClientData *)cData;
-	rd_kafka_topic_t *rkt = kt->rkt;
-	int resultCode = TCL_OK;
+rd_kafka_resp_err_t
+kafkatcl_range_resolve (rd_kafka_t *rk, rd_kafka_topic_partition_list_t *starts, Tcl_WideInt from, Tcl_WideInt to, int timeoutMS, rd_kafka_topic_partition_list_t **endsPtr) {
+	Tcl_WideInt deadline = kafkatcl_now_ms () + timeoutMS;
+	rd_kafka_topic_partition_list_t *ends = rd_kafka_topic_partition_list_copy (starts);
+	rd_kafka_resp_err_t err;
+	int i;
 
-    static CONST char *options[] = {
-        "produce",
-        "produce_batch",
-		"info",
-		"creator",
-        "delete",
-        NULL
-    };
+	for (i = 0; i < starts->cnt; i++) {
+		starts->elems[i].offset = from;
+		ends->elems[i].offset = to;
+	}
 
-    enum options {
-		OPT_PRODUCE,
-		OPT_PRODUCE_BATCH,
-		OPT_INFO,
-		OPT_CREATOR,
-		OPT_DELETE
-    };
+	err = rd_kafka_offsets_for_times (rk, starts, timeoutMS);
+	if (err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+		err = kafkatcl_first_partition_error (starts);
+	}
 
-    /* basic validation of command line arguments */
-    if (objc < 2) {
-        Tcl_WrongNumArgs (interp, 1, objv, "subcommand ?args?");
-        return TCL_ERROR;
-    }
+	if (err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+		Tcl_WideInt remaining = deadline - kafkatcl_now_ms ();
 
-    if (Tcl_GetIndexFromObj (interp, objv[1], options, "option", TCL_EXACT, &optIndex) != TCL_OK) {
-		return TCL_ERROR;
-    }
+		err = (remaining <= 0) ? RD_KAFKA_RESP_ERR__TIMED_OUT : rd_kafka_offsets_for_times (rk, ends, (int)remaining);
+		if (err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+			err = kafkatcl_first_partition_error (ends);
+		}
+	}
 
-    switch ((enum options) optIndex) {
-		case OPT_PRODUCE: {
-			int partition;
+	for (i = 0; i < starts->cnt && err == RD_KAFKA_RESP_ERR_NO_ERROR; i++) {
+		rd_kafka_topic_partition_t *start = &starts->elems[i];
+		rd_kafka_topic_partition_t *end = &ends->elems[i];
+		Tcl_WideInt remaining = deadline - kafkatcl_now_ms ();
+		int64_t low, high;
 
-			if (objc < 4 || objc > 5) {
-				Tcl_WrongNumArgs (interp, 2, objv, "partition payload ?key?");
-				return TCL_ERROR;
-			}
+		if (remaining <= 0) {
+			err = RD_KAFKA_RESP_ERR__TIMED_OUT;
+			break;
+		}
 
-			if (Tcl_GetIntFromObj (interp, objv[2], &partition) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
-				break;
-			}
+		err = rd_kafka_query_watermark_offsets (rk, start->topic, start->partition, &low, &high, (int)remaining);
+		if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+			break;
+		}
 
-			int payloadLength;
-			unsigned char *payload = Tcl_GetByteArrayFromObj (objv[3], &payloadLength);
+		if (start->offset < 0 || start->offset > high) {
+			start->offset = high;
+		}
 
-			const void *key = NULL;
-			int keyLength = 0;
+		if (end->offset < 0 || end->offset > high) {
+			end->offset = high;
+		}
+	}
 
-			if (objc == 5) {
-				key = Tcl_GetByteArrayFromObj (objv[4], &keyLength);
-			}
+	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		rd_kafka_topic_partition_list_destroy (ends);
+		return err;
+	}
 
-			if (rd_kafka_produce (rkt, partition, RD_KAFKA_MSG_F_COPY, payload, payloadLength, key, keyLength, kt) < 0) {
-				resultCode =  kafkatcl_last_error_to_tcl_error (interp);
-				break;
-			}
-			break;
+	for (i = starts->cnt - 1; i >= 0; i--) {
+		if (starts->elems[i].offset >= ends->elems[i].offset) {
+			char *topic = starts->elems[i].topic;
+			int32_t partition = starts->elems[i].partition;
+
+			rd_kafka_topic_partition_list_del (ends, topic, partition);
+			rd_kafka_topic_partition_list_del_by_idx (starts, i);
 		}
+	}
 
-		case OPT_PRODUCE_BATCH: {
-			int listObjc;
-			Tcl_Obj **listObjv;
-			int partition;
+	*endsPtr = ends;
+	return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
 
-			if (objc != 4) {
-				Tcl_WrongNumArgs (interp, 2, objv, "partition list-of-payload-key-lists");
-				return TCL_ERROR;
-			}
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_range_accept --
+ *
+ *    decide what to do with a message consumed from a partition of a
+ *    range that stops at end.  *finishedPtr is set if the partition
+ *    has nothing more to give, because this is the last message of the
+ *    range, it's past the range, or it's the end of the partition.
+ *
+ * Results:
+ *    1 if the message should be passed on, 0 if it should be dropped
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_range_accept (rd_kafka_message_t *rkmessage, int64_t end, int *finishedPtr) {
+	*finishedPtr = 0;
+
+	// the end of the partition comes before a range that ends on, say,
+	// a transaction marker would otherwise finish
+	if (rkmessage->err == RD_KAFKA_RESP_ERR__PARTITION_EOF) {
+		*finishedPtr = 1;
+		return 0;
+	}
 
-			if (Tcl_GetIntFromObj (interp, objv[2], &partition) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
-				break;
-			}
+	if (rkmessage->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		return 1;
+	}
 
-			if (Tcl_ListObjGetElements (interp, objv[3], &listObjc, &listObjv) == TCL_ERROR) {
-				Tcl_AppendResult (interp, " while parsing list of partition-payload-key lists", NULL);
-				resultCode = TCL_ERROR;
-				break;
-			}
+	if (rkmessage->offset >= end) {
+		*finishedPtr = 1;
+		return 0;
+	}
 
-			int i;
+	*finishedPtr = (rkmessage->offset + 1 >= end);
+	return 1;
+}
 
-			if (listObjc == 0) {
-				break;
-			}
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_range_pause --
+ *
+ *    pause a partition that has finished its range so that librdkafka
+ *    doesn't go on fetching it, and remember that we paused it so that
+ *    it can be resumed once the range is over
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_range_pause (kafkatcl_handleClientData *kh, const char *topic, int32_t partition) {
+	rd_kafka_topic_partition_list_t *partitions = rd_kafka_topic_partition_list_new (1);
 
-			rd_kafka_message_t *rkmessages = (rd_kafka_message_t *)ckalloc (sizeof(rd_kafka_message_t) * listObjc);
+	rd_kafka_topic_partition_list_add (partitions, topic, partition);
 
-			for (i = 0; i < listObjc; i++) {
-				int rowObjc;
-				Tcl_Obj **rowObjv;
+	if (rd_kafka_pause_partitions (kh->rk, partitions) == RD_KAFKA_RESP_ERR_NO_ERROR && partitions->elems[0].err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+		if (kh->rangePaused == NULL) {
+			kh->rangePaused = rd_kafka_topic_partition_list_new (1);
+		}
+		if (rd_kafka_topic_partition_list_find (kh->rangePaused, topic, partition) == NULL) {
+			rd_kafka_topic_partition_list_add (kh->rangePaused, topic, partition);
+		}
+	}
 
-				if (Tcl_ListObjGetElements (interp, listObjv[i], &rowObjc, &rowObjv) == TCL_ERROR) {
-					Tcl_AppendResult (interp, " while parsing list within partition-payload-key lists", NULL);
-					resultCode = TCL_ERROR;
-					goto batcherr;
-				}
+	rd_kafka_topic_partition_list_destroy (partitions);
+}
 
-				if (rowObjc < 1 || rowObjc > 2) {
-					Tcl_AppendResult (interp, " list within payload-key must contain payload and optional key", NULL);
-					resultCode = TCL_ERROR;
-					goto batcherr;
-				}
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_range_resume --
+ *
+ *    resume a partition a range paused, once it has been stopped,
+ *    since librdkafka remembers the pause and it would still be paused
+ *    the next time it's started.  a partition paused by anything else
+ *    is left alone.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_range_resume (kafkatcl_handleClientData *kh, const char *topic, int32_t partition) {
+	rd_kafka_topic_partition_list_t *partitions;
+
+	if (kh->rangePaused == NULL || !rd_kafka_topic_partition_list_del (kh->rangePaused, topic, partition)) {
+		return;
+	}
 
-				int payloadLength;
-				unsigned char *payload = Tcl_GetByteArrayFromObj (rowObjv[0], &payloadLength);
+	partitions = rd_kafka_topic_partition_list_new (1);
+	rd_kafka_topic_partition_list_add (partitions, topic, partition);
+	rd_kafka_resume_partitions (kh->rk, partitions);
+	rd_kafka_topic_partition_list_destroy (partitions);
+}
 
-				void *key = NULL;
-				int keyLength = 0;
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_range_resume_all --
+ *
+ *    resume every partition a subscriber's range paused, once the range
+ *    is over and they've been unassigned, so that they aren't still
+ *    paused when they're next assigned
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_range_resume_all (kafkatcl_handleClientData *kh) {
+	if (kh->rangePaused == NULL) {
+		return;
+	}
 
-				rd_kafka_message_t *rk = &rkmessages[i];
+	if (kh->rangePaused->cnt > 0) {
+		rd_kafka_resume_partitions (kh->rk, kh->rangePaused);
+	}
 
-				rk->payload = payload;
-				rk->len = payloadLength;
+	rd_kafka_topic_partition_list_destroy (kh->rangePaused);
+	kh->rangePaused = NULL;
+}
 
-				rk->key = key;
-				rk->key_len = keyLength;
-			}
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_range_forget --
+ *
+ *    stop tracking partitions the application has paused or resumed
+ *    itself, so a later range doesn't resume them behind its back
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_range_forget (kafkatcl_handleClientData *kh, rd_kafka_topic_partition_list_t *partitions) {
+	int i;
 
-			int nDone = rd_kafka_produce_batch (rkt, partition, RD_KAFKA_MSG_F_COPY, rkmessages, listObjc);
-			ckfree(rkmessages);
+	if (kh->rangePaused == NULL) {
+		return;
+	}
 
-			// NB dig through rkmessages looking for errors
-			if (nDone != listObjc) {
-				resultCode = TCL_ERROR;
-			}
+	for (i = 0; i < partitions->cnt; i++) {
+		rd_kafka_topic_partition_list_del (kh->rangePaused, partitions->elems[i].topic, partitions->elems[i].partition);
+	}
+}
 
-		  batcherr:
-			break;
-		}
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_range_new --
+ *
+ *    allocate a range for consume_range -command, with no holders
+ *
+ *----------------------------------------------------------------------
+ */
+kafkatcl_consumeRange *
+kafkatcl_range_new (kafkatcl_handleClientData *kh, kafkatcl_rangeOptions *options) {
+	kafkatcl_consumeRange *range = ckalloc (sizeof (kafkatcl_consumeRange));
+
+	range->kh = kh;
+	range->commandObj = options->commandObj;
+	Tcl_IncrRefCount (range->commandObj);
+	range->fields = options->fields;
+	range->refCount = 0;
+	range->remaining = 0;
+	range->ends = NULL;
+	return range;
+}
 
-		case OPT_CREATOR: {
-			return kafkatcl_handleObjectObjCmd(kt->kh, interp, objc-1, objv+1);
-		}
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_range_release --
+ *
+ *    drop a reference to a range, freeing it when it's the last one
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_range_release (kafkatcl_consumeRange *range) {
+	if (--range->refCount > 0) {
+		return;
+	}
 
-		case OPT_INFO: {
-			return kafkatcl_handle_topic_info (interp, kt, objc, objv);
-		}
+	Tcl_DecrRefCount (range->commandObj);
+	if (range->ends != NULL) {
+		rd_kafka_topic_partition_list_destroy (range->ends);
+	}
+	ckfree (range);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_range_queue_done --
+ *
+ *    queue the event that finishes off a partition of a range, or for
+ *    a subscriber the whole range, behind the messages already queued
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_range_queue_done (kafkatcl_consumeRange *range, kafkatcl_runningConsumer *krc) {
+	kafkatcl_rangeDoneEvent *evPtr = ckalloc (sizeof (kafkatcl_rangeDoneEvent));
 
-		case OPT_DELETE: {
-			if (objc != 2) {
-				Tcl_WrongNumArgs (interp, 2, objv, "");
-				return TCL_ERROR;
-			}
+	evPtr->event.proc = kafkatcl_range_done_eventProc;
+	evPtr->range = range;
+	evPtr->krc = krc;
+	range->refCount++;
 
-			if (Tcl_DeleteCommandFromToken (kt->kh->interp, kt->cmdToken) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
-			}
-			break;
-		}
-    }
-    return resultCode;
+	Tcl_QueueEvent ((Tcl_Event *)evPtr, range->kh->ko->eventPosition[KAFKATCL_EVENT_CONSUME]);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_createTopicObjectCommand --
+ * kafkatcl_range_done_eventProc --
  *
- *    given a kafkatcl_handleClientData pointer, an object name (or "#auto"),
- *    and a topic string, create a corresponding topic object command
+ *    this routine is called by the Tcl event handler when a partition
+ *    of a range has delivered its last message.  a topic's partition
+ *    is stopped and resumed.  once every partition is done, a
+ *    subscriber's range partitions are unassigned and resumed and the
+ *    range's command is invoked with a key-value list of err, which is
+ *    empty, and done, 1.
  *
  * Results:
- *    A standard Tcl result
+ *    returns 1 to say we handled the event and the dispatcher can delete it
  *
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_createTopicObjectCommand (kafkatcl_handleClientData *kh, char *cmdName, const char *topic)
-{
-	Tcl_Interp *interp = kh->interp;
-	Tcl_ObjCmdProc *proc = NULL;
+kafkatcl_range_done_eventProc (Tcl_Event *tevPtr, int flags) {
+	kafkatcl_rangeDoneEvent *evPtr = (kafkatcl_rangeDoneEvent *)tevPtr;
+	kafkatcl_consumeRange *range = evPtr->range;
+	kafkatcl_handleClientData *kh = range->kh;
+	Tcl_Obj *commandObj = range->commandObj;
+	Tcl_Obj *listObjv[4];
+
+	if (evPtr->krc != NULL) {
+		// the partition's share of the range is accounted for here
+		// rather than by kafkatcl_consume_stop
+		evPtr->krc->range = NULL;
+		kafkatcl_consume_stop (evPtr->krc->kt, evPtr->krc->partition);
+		kafkatcl_range_release (range);
+	}
 
-	// dup the topic conf that we pass to rd_kafka_topic_new because
-	// rd_kafka_topic_new is documented as freeing the conf object
-	// and we don't want to give up our copy
-	rd_kafka_topic_conf_t *topicConf = rd_kafka_topic_conf_dup (kh->topicConf);
-	rd_kafka_topic_t *rkt = rd_kafka_topic_new (kh->rk, topic, topicConf);
+	if (--range->remaining > 0) {
+		kafkatcl_range_release (range);
+		return 1;
+	}
 
-	if (rkt == NULL) {
-		return kafkatcl_last_error_to_tcl_error (interp);
+	if (kh->range == range) {
+		rd_kafka_assign (kh->rk, NULL);
+		kafkatcl_range_resume_all (kh);
+		kh->range = NULL;
+		kafkatcl_range_release (range);
 	}
 
-	switch (kh->kafkaType) {
-		case RD_KAFKA_PRODUCER:
-			proc = kafkatcl_topicProducerObjectObjCmd;
-			break;
+	// let go of the range before invoking the command, which may
+	// delete the handle
+	Tcl_IncrRefCount (commandObj);
+	kafkatcl_range_release (range);
+
+	listObjv[0] = kafkatcl_thread_data ()->literals[KAFKATCL_LIT_ERR];
+	listObjv[1] = Tcl_NewObj ();
+	listObjv[2] = Tcl_NewStringObj ("done", -1);
+	listObjv[3] = Tcl_NewIntObj (1);
+	kafkatcl_invoke_callback_with_argument (kh->interp, commandObj, Tcl_NewListObj (4, listObjv));
+	Tcl_DecrRefCount (commandObj);
+	return 1;
+}
 
-		case RD_KAFKA_CONSUMER:
-			proc = kafkatcl_topicConsumerObjectObjCmd;
-			break;
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_range_match --
+ *
+ *    Tcl_DeleteEvents match function for the pending done events of
+ *    a handle's ranges that aren't tied to a running consumer, letting
+ *    go of their ranges.  those that are tied to one are deleted by
+ *    kafkatcl_match_consumer_event when it's stopped.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_range_match (Tcl_Event *tevPtr, ClientData clientData) {
+	kafkatcl_rangeDoneEvent *evPtr = (kafkatcl_rangeDoneEvent *)tevPtr;
 
-		default:
-			assert (0 == 1);
+	if (tevPtr->proc != kafkatcl_range_done_eventProc || evPtr->krc != NULL || evPtr->range->kh != (kafkatcl_handleClientData *)clientData) {
+		return 0;
 	}
 
+	kafkatcl_range_release (evPtr->range);
+	return 1;
+}
 
-	// allocate one of our kafka topic client data objects for Tcl and
-	// configure it
-	kafkatcl_topicClientData *kt = (kafkatcl_topicClientData *)ckalloc (sizeof (kafkatcl_topicClientData));
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_range_abandon --
+ *
+ *    a running consumer of a range is being stopped before its done
+ *    event got to it, so stop waiting on its partition
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_range_abandon (kafkatcl_runningConsumer *krc) {
+	kafkatcl_consumeRange *range = krc->range;
 
-	kt->kafka_topic_magic = KAFKA_TOPIC_MAGIC;
-	kt->rkt = rkt;
-	kt->kh = kh;
-	KT_LIST_INIT (&kt->runningConsumers);
+	krc->range = NULL;
 
-	if (kh->kafkaType == RD_KAFKA_CONSUMER) {
-		KT_LIST_INSERT_HEAD (&kh->ko->topicConsumers, kt, topicConsumerInstance);
+	// the other partitions have already finished, so the range is done
+	if (range->remaining == 1) {
+		kafkatcl_range_queue_done (range, NULL);
+	} else {
+		range->remaining--;
 	}
 
-	kt->topic = ckalloc (strlen (topic) + 1);
-	strcpy (kt->topic, topic);
-
-#define TOPIC_STRING_FORMAT "kafka_topic%lu"
-	// if cmdName is #auto, generate a unique name for the object
-	int autoGeneratedName = 0;
-	if (strcmp (cmdName, "#auto") == 0) {
-		static unsigned long nextAutoCounter = 0;
-		int baseNameLength = snprintf (NULL, 0, TOPIC_STRING_FORMAT, nextAutoCounter) + 1;
-		cmdName = ckalloc (baseNameLength);
-		snprintf (cmdName, baseNameLength, TOPIC_STRING_FORMAT, nextAutoCounter++);
-		autoGeneratedName = 1;
-	}
+	kafkatcl_range_release (range);
+}
 
-	// create a Tcl command to interface to the topic object
-	kt->cmdToken = Tcl_CreateObjCommand (interp, cmdName, proc, kt, kafkatcl_topicObjectDelete);
-	// set the full name to the command in the interpreter result
-	Tcl_GetCommandFullName(interp, kt->cmdToken, Tcl_GetObjResult (interp));
-	if (autoGeneratedName == 1) {
-		ckfree(cmdName);
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_range_cleanup --
+ *
+ *    throw away a handle's range and the done events waiting for it
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_range_cleanup (kafkatcl_handleClientData *kh) {
+	if (kh->range != NULL) {
+		kafkatcl_range_release (kh->range);
+		kh->range = NULL;
 	}
 
-	return TCL_OK;
+	Tcl_DeleteEvents (kafkatcl_range_match, (ClientData)kh);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_queueObjectObjCmd --
+ * kafkatcl_subscriber_range_message --
  *
- *    dispatches the subcommands of a kafkatcl queue object
+ *    offer a message consumed by a subscriber to its range, passing it
+ *    to the range's command if it's in the range.  once the last
+ *    partition has finished, the done event is queued.
  *
  * Results:
- *    A standard Tcl result
+ *    1 if the message belonged to the range, which has taken care of
+ *    it, or 0 if it's to go to the subscriber's callback
  *
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_queueObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
-{
-    int         optIndex;
-	kafkatcl_queueClientData *kq = (kafkatcl_queueClientData *)cData;
-	rd_kafka_queue_t *rkqu = kq->rkqu;
-	int resultCode = TCL_OK;
-
-    static CONST char *options[] = {
-        "consume",
-        "consume_batch",
-        "consume_callback",
-        "delete",
-        NULL
-    };
-
-    enum options {
-		OPT_CONSUME_QUEUE,
-		OPT_CONSUME_QUEUE_BATCH,
-		OPT_CONSUME_CALLBACK,
-		OPT_DELETE
-    };
-
-    /* basic validation of command line arguments */
-    if (objc < 2) {
-        Tcl_WrongNumArgs (interp, 1, objv, "subcommand ?args?");
-        return TCL_ERROR;
-    }
-
-    if (Tcl_GetIndexFromObj (interp, objv[1], options, "option", TCL_EXACT, &optIndex) != TCL_OK) {
-		return TCL_ERROR;
-    }
-
-    switch ((enum options) optIndex) {
-		case OPT_CONSUME_QUEUE: {
-			int timeoutMS;
-
-			if (objc != 4) {
-				Tcl_WrongNumArgs (interp, 2, objv, "timeout array");
-				return TCL_ERROR;
-			}
-
-			if (Tcl_GetIntFromObj (interp, objv[2], &timeoutMS) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
-				break;
-			}
-
-			char *arrayName = Tcl_GetString (objv[3]);
-
-			rd_kafka_message_t *rdm = rd_kafka_consume_queue (rkqu, timeoutMS);
-
-			if (rdm == NULL) {
-				resultCode =  kafkatcl_last_error_to_tcl_error (interp);
-				break;
-			}
-
-			resultCode = kafkatcl_message_to_tcl_array (interp, arrayName, rdm, 1);
-			rd_kafka_message_destroy (rdm);
-
-			break;
-		}
-
-		// NB bears an awful lot in common with OPT_CONSUME_QUEUE elsewhere
-		case OPT_CONSUME_QUEUE_BATCH: {
-			int timeoutMS;
-			int count;
-
-			if (objc != 6) {
-				Tcl_WrongNumArgs (interp, 2, objv, "timeout count array code");
-				return TCL_ERROR;
-			}
-
-			if (Tcl_GetIntFromObj (interp, objv[2], &timeoutMS) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
-				break;
-			}
-
-			if (Tcl_GetIntFromObj (interp, objv[3], &count) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
-				break;
-			}
-
-			char *arrayName = Tcl_GetString (objv[4]);
-
-			Tcl_Obj *codeObj = objv[5];
-
-			rd_kafka_message_t **rkMessages = ckalloc (sizeof (rd_kafka_message_t *) * count);
-
-			int gotCount = rd_kafka_consume_batch_queue (rkqu, timeoutMS, rkMessages, count);
-
-			int i;
-			for (i = 0; i < gotCount; i++) {
-				resultCode = kafkatcl_message_to_tcl_array (interp, arrayName, rkMessages[i], 0);
-
-				if (resultCode == TCL_BREAK) {
-					resultCode = TCL_OK;
-					rd_kafka_message_destroy (rkMessages[i]);
-					continue;
-				} else if (resultCode == TCL_ERROR) {
-					break;
-				}
-
-				resultCode = Tcl_EvalObjEx (interp, codeObj,  0);
-
-				if (resultCode == TCL_ERROR) {
-					break;
-				}
-
-				rd_kafka_message_destroy (rkMessages[i]);
-			}
+kafkatcl_subscriber_range_message (kafkatcl_handleClientData *kh, rd_kafka_message_t *rkmessage) {
+	kafkatcl_consumeRange *range = kh->range;
+	kafkatcl_messageRef *ref;
+	rd_kafka_topic_partition_t *tp;
+	const char *topic;
+	int32_t partition = rkmessage->partition;
+	int finished;
+
+	if (range == NULL || rkmessage->rkt == NULL) {
+		return 0;
+	}
 
-			/* Free trailing unprocessed messages */
-			for (; i < gotCount; ++i) {
-				rd_kafka_message_destroy (rkMessages[i]);
-			}
+	topic = rd_kafka_topic_name (rkmessage->rkt);
+	tp = rd_kafka_topic_partition_list_find (range->ends, topic, partition);
+	if (tp == NULL) {
+		return 0;
+	}
 
-			ckfree (rkMessages);
+	// the command may run the event loop, which may finish the range,
+	// and the message keeps the topic name around
+	range->refCount++;
+	ref = kafkatcl_message_ref_new (kh, rkmessage);
 
-			if (resultCode != TCL_ERROR) {
-				Tcl_SetObjResult (interp, Tcl_NewIntObj (gotCount));
-			}
+	if (kafkatcl_range_accept (rkmessage, tp->offset, &finished)) {
+		Tcl_Obj *msgList = kafkatcl_message_ref_to_tcl_list (kh->interp, ref, range->fields);
 
-			break;
+		if (msgList != NULL) {
+			kafkatcl_invoke_callback_with_argument (kh->interp, range->commandObj, msgList);
 		}
+	}
 
-		case OPT_CONSUME_CALLBACK: {
-            if ((objc < 2) || (objc > 3)) {
-                Tcl_WrongNumArgs (interp, 2, objv, "?callback?");
-                return TCL_ERROR;
-            }
-
-            if (objc == 2) {
-                if (kq->krc == NULL) {
-                    break;
-                }
-                Tcl_SetObjResult (interp, kq->krc->callbackObj);
-				break;
-			}
+	if (finished && kh->range == range) {
+		kafkatcl_range_pause (kh, topic, partition);
+		rd_kafka_topic_partition_list_del (range->ends, topic, partition);
 
-			return kafkatcl_set_queue_consumer (kq, objv[2]);
+		if (range->ends->cnt == 0) {
+			kafkatcl_range_queue_done (range, NULL);
 		}
+	}
 
-		case OPT_DELETE: {
-			if (objc != 2) {
-				Tcl_WrongNumArgs (interp, 2, objv, "");
-				return TCL_ERROR;
-			}
-
-			if (Tcl_DeleteCommandFromToken (kq->kh->interp, kq->cmdToken) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
-			}
-			break;
-		}
-    }
-    return resultCode;
+	kafkatcl_message_ref_release (ref);
+	kafkatcl_range_release (range);
+	return 1;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_add_brokers --
+ * kafkatcl_subscriber_consume_range --
  *
- *    given a handle client data and a char* with some brokers,
- *    try to add the brokers
+ *    handle a subscriber's "consume_range" subcommand.  the listed
+ *    partitions are assigned at the offsets of -from and each is
+ *    consumed up to the offset of -to as it was when we started.  it's
+ *    an error while the subscriber is subscribed, since the assignment
+ *    belongs to the group then.
+ *
+ *    the offsets are always looked up before we return.  without
+ *    -command the messages are returned as a list.  with it they're
+ *    passed to the command from the event loop and the subscriber's
+ *    callback gets anything else.
  *
  * Results:
  *    a standard tcl result
@@ -3262,456 +8991,642 @@ kafkatcl_queueObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_add_brokers (kafkatcl_handleClientData *kh, Tcl_Obj *brokers) {
-	Tcl_Interp *interp = kh->interp;
-	int brokersObjc;
-	Tcl_Obj **brokersObjv;
-	int i;
-	Tcl_DString ds;
-	char *brokerString;
+kafkatcl_subscriber_consume_range (Tcl_Interp *interp, kafkatcl_handleClientData *kh, int objc, Tcl_Obj *CONST objv[]) {
+	rd_kafka_topic_partition_list_t *partitions;
+	rd_kafka_topic_partition_list_t *ends;
+	kafkatcl_rangeOptions options;
+	rd_kafka_resp_err_t err;
+	Tcl_Obj *listObj;
+	Tcl_WideInt idleDeadline;
+	int nextArg = 2;
+
+	if (kafkatcl_parse_range_options (interp, objc, objv, &nextArg, &options) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	if (objc <= nextArg) {
+		Tcl_WrongNumArgs (interp, 2, objv, "-from ms -to ms ?-fields list? ?-timeout ms? ?-command command? {topic partition} ?{topic partition}...?");
+		return TCL_ERROR;
+	}
 
-	if (Tcl_ListObjGetElements (interp, brokers, &brokersObjc, &brokersObjv) == TCL_ERROR) {
-		Tcl_AppendResult (interp, " while converting broker list", NULL);
+	if (kh->range != NULL) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("already consuming a range", -1));
 		return TCL_ERROR;
 	}
 
-	if (brokersObjc < 1) {
-		Tcl_SetObjResult (interp, Tcl_NewStringObj ("Broker list must contain at least one element", -1));
+	// assigning the range's partitions would take the subscriber's
+	// partitions away from it without the group knowing
+	err = rd_kafka_subscription (kh->rk, &partitions);
+	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		return kafkatcl_kafka_error_to_tcl (interp, err, NULL);
+	}
+	if (partitions->cnt > 0) {
+		rd_kafka_topic_partition_list_destroy (partitions);
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("can't consume a range while subscribed", -1));
 		return TCL_ERROR;
 	}
+	rd_kafka_topic_partition_list_destroy (partitions);
 
-	/* convert list to comma-separated */
-	Tcl_DStringInit (&ds);
+	partitions = kafkatcl_objv_to_topic_partition_list (interp, &objv[nextArg], objc - nextArg);
+	if (partitions == NULL) {
+		return TCL_ERROR;
+	}
 
-	for (i = 0; i < brokersObjc; i++) {
-		char *broker;
-		int brokerLen;
+	err = kafkatcl_range_resolve (kh->rk, partitions, options.from, options.to, options.timeoutMS, &ends);
+	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		rd_kafka_topic_partition_list_destroy (partitions);
+		return kafkatcl_kafka_error_to_tcl (interp, err, NULL);
+	}
 
-		broker = Tcl_GetStringFromObj (brokersObjv[i], &brokerLen);
-		Tcl_DStringAppend (&ds, broker, brokerLen);
+	err = rd_kafka_assign (kh->rk, partitions);
+	rd_kafka_topic_partition_list_destroy (partitions);
+	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		rd_kafka_topic_partition_list_destroy (ends);
+		return kafkatcl_kafka_error_to_tcl (interp, err, NULL);
+	}
 
-		if (i < brokersObjc - 1) {
-			Tcl_DStringAppend (&ds, ",", 1);
+	if (options.commandObj != NULL) {
+		kafkatcl_consumeRange *range = kafkatcl_range_new (kh, &options);
+
+		range->ends = ends;
+		range->remaining = 1;
+		range->refCount = 1;
+		kh->range = range;
+
+		if (ends->cnt == 0) {
+			kafkatcl_range_queue_done (range, NULL);
 		}
+		return TCL_OK;
 	}
 
-	brokerString = Tcl_DStringValue (&ds);
+	listObj = Tcl_NewObj ();
+	idleDeadline = kafkatcl_now_ms () + options.timeoutMS;
 
-	if (rd_kafka_brokers_add (kh->rk, brokerString) == 0) {
-		Tcl_DStringFree (&ds);
-		Tcl_SetObjResult (interp, Tcl_NewStringObj ("No valid brokers specified", -1));
-		return TCL_ERROR;
+	while (ends->cnt > 0) {
+		rd_kafka_message_t *rkmessage = rd_kafka_consumer_poll (kh->rk, 100);
+		rd_kafka_topic_partition_t *tp;
+		kafkatcl_messageRef *ref;
+		int finished;
+
+		if (rkmessage == NULL) {
+			if (kafkatcl_now_ms () >= idleDeadline) {
+				err = RD_KAFKA_RESP_ERR__TIMED_OUT;
+				break;
+			}
+			continue;
+		}
+
+		idleDeadline = kafkatcl_now_ms () + options.timeoutMS;
+
+		tp = (rkmessage->rkt != NULL) ? rd_kafka_topic_partition_list_find (ends, rd_kafka_topic_name (rkmessage->rkt), rkmessage->partition) : NULL;
+
+		if (tp == NULL) {
+			rd_kafka_message_destroy (rkmessage);
+			continue;
+		}
+
+		ref = kafkatcl_message_ref_new (kh, rkmessage);
+
+		if (kafkatcl_range_accept (rkmessage, tp->offset, &finished)) {
+			Tcl_Obj *msgList = kafkatcl_message_ref_to_tcl_list (interp, ref, options.fields);
+
+			if (msgList != NULL) {
+				Tcl_ListObjAppendElement (NULL, listObj, msgList);
+			}
+		}
+
+		kafkatcl_message_ref_release (ref);
+
+		if (finished) {
+			kafkatcl_range_pause (kh, tp->topic, tp->partition);
+			rd_kafka_topic_partition_list_del_by_idx (ends, tp - ends->elems);
+		}
 	}
 
-	Tcl_DStringFree (&ds);
+	rd_kafka_assign (kh->rk, NULL);
+	kafkatcl_range_resume_all (kh);
+	rd_kafka_topic_partition_list_destroy (ends);
+
+	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		Tcl_DecrRefCount (listObj);
+		return kafkatcl_kafka_error_to_tcl (interp, err, NULL);
+	}
+
+	Tcl_SetObjResult (interp, listObj);
 	return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_handleObjectObjCmd --
+ * kafkatcl_topic_consume_range --
  *
- *    dispatches the subcommands of a kafkatcl handle-handling command
+ *    handle a topic consumer's "consume_range" subcommand, which does
+ *    for partitions of the topic what the subscriber's does.  without
+ *    -command the partitions are consumed through a queue of their own
+ *    and the messages returned as a list.  with it each partition is
+ *    started with the command as its callback, and stopped once it
+ *    has delivered the last message of the range.
  *
  * Results:
- *    stuff
+ *    a standard tcl result
  *
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_handleObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
-{
-    int         optIndex;
-	kafkatcl_handleClientData *kh = (kafkatcl_handleClientData *)cData;
-    assert (kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
-	rd_kafka_t *rk = kh->rk;
-	int resultCode = TCL_OK;
-
-    static CONST char *options[] = {
-        "name",
-        "new_topic",
-		"log_level",
-		"add_brokers",
-		"create_queue",
-		"output_queue_length",
-		"meta",
-		"info",
-		"config",
-		"partitioner",
-        "delete",
-        NULL
-    };
-
-    enum options {
-        OPT_NAME,
-		OPT_NEW_TOPIC,
-		OPT_LOG_LEVEL,
-		OPT_ADD_BROKERS,
-        OPT_CREATE_QUEUE,
-        OPT_OUTPUT_QUEUE_LENGTH,
-		OPT_META,
-		OPT_INFO,
-		OPT_TOPIC_CONFIG,
-		OPT_PARTITIONER,
-		OPT_DELETE
-    };
+kafkatcl_topic_consume_range (Tcl_Interp *interp, kafkatcl_topicClientData *kt, int objc, Tcl_Obj *CONST objv[]) {
+	rd_kafka_topic_t *rkt = kt->rkt;
+	const char *topic = rd_kafka_topic_name (rkt);
+	rd_kafka_topic_partition_list_t *partitions;
+	rd_kafka_topic_partition_list_t *ends;
+	kafkatcl_rangeOptions options;
+	rd_kafka_resp_err_t err;
+	rd_kafka_queue_t *rkqu;
+	Tcl_Obj *listObj;
+	Tcl_WideInt idleDeadline;
+	int nextArg = 2;
+	int i;
 
-    /* basic validation of command line arguments */
-    if (objc < 2) {
-        Tcl_WrongNumArgs (interp, 1, objv, "subcommand ?args?");
-        return TCL_ERROR;
-    }
+	if (kafkatcl_parse_range_options (interp, objc, objv, &nextArg, &options) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
 
-    if (Tcl_GetIndexFromObj (interp, objv[1], options, "option", TCL_EXACT, &optIndex) != TCL_OK) {
+	if (objc <= nextArg) {
+		Tcl_WrongNumArgs (interp, 2, objv, "-from ms -to ms ?-fields list? ?-timeout ms? ?-command command? partition ?partition...?");
 		return TCL_ERROR;
-    }
+	}
 
-    switch ((enum options) optIndex) {
-		case OPT_NAME: {
-			if (objc != 2) {
-				Tcl_WrongNumArgs (interp, 2, objv, "");
-				return TCL_ERROR;
-			}
+	partitions = rd_kafka_topic_partition_list_new (objc - nextArg);
+	for (i = nextArg; i < objc; i++) {
+		int partition;
 
-			Tcl_SetObjResult (interp, Tcl_NewStringObj (rd_kafka_name (rk), -1));
-			break;
+		if (Tcl_GetIntFromObj (interp, objv[i], &partition) == TCL_ERROR) {
+			rd_kafka_topic_partition_list_destroy (partitions);
+			return TCL_ERROR;
 		}
+		rd_kafka_topic_partition_list_add (partitions, topic, partition);
+	}
 
-		case OPT_NEW_TOPIC: {
-			if (objc != 4) {
-				Tcl_WrongNumArgs (interp, 2, objv, "cmdName topic");
-				return TCL_ERROR;
-			}
+	err = kafkatcl_range_resolve (kt->kh->rk, partitions, options.from, options.to, options.timeoutMS, &ends);
+	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		rd_kafka_topic_partition_list_destroy (partitions);
+		return kafkatcl_kafka_error_to_tcl (interp, err, NULL);
+	}
 
-			char *cmdName = Tcl_GetString (objv[2]);
-			char *topic = Tcl_GetString (objv[3]);
+	if (options.commandObj != NULL) {
+		kafkatcl_consumeRange *range = kafkatcl_range_new (kt->kh, &options);
+		kafkatcl_consumeOptions consumeOptions;
 
-			resultCode = kafkatcl_createTopicObjectCommand (kh, cmdName, topic);
-			break;
-		}
+		consumeOptions.fields = options.fields;
+		consumeOptions.batchSize = 0;
+		consumeOptions.lingerMS = 0;
 
-		case OPT_LOG_LEVEL: {
-			int kafkaLogLevel;
+		// hold the range while the partitions are started
+		range->refCount = 1;
 
-			if (objc != 3) {
-				Tcl_WrongNumArgs (interp, 2, objv, "level");
-				return TCL_ERROR;
-			}
+		for (i = 0; i < partitions->cnt; i++) {
+			kafkatcl_runningConsumer *krc;
 
-			if (kafkatcl_obj_to_log_level (interp, objv[2], &kafkaLogLevel) == TCL_OK) {
-				rd_kafka_set_log_level (rk, kafkaLogLevel);
-			} else {
+			if (kafkatcl_consume_start (kt, partitions->elems[i].partition, partitions->elems[i].offset, range->commandObj, &consumeOptions) == TCL_ERROR) {
+				// stop the ones already started without finishing the range
+				while (--i >= 0) {
+					KT_LIST_FOREACH (krc, &kt->runningConsumers, runningConsumerInstance) {
+						if (krc->range == range && krc->partition == partitions->elems[i].partition) {
+							krc->range = NULL;
+							range->refCount--;
+							break;
+						}
+					}
+					kafkatcl_consume_stop (kt, partitions->elems[i].partition);
+				}
+				kafkatcl_range_release (range);
+				rd_kafka_topic_partition_list_destroy (partitions);
+				rd_kafka_topic_partition_list_destroy (ends);
 				return TCL_ERROR;
 			}
-			break;
+
+			// kafkatcl_consume_start puts the new consumer first
+			krc = KT_LIST_FIRST (&kt->runningConsumers);
+			krc->range = range;
+			krc->rangeEnd = ends->elems[i].offset;
+			range->refCount++;
+			range->remaining++;
 		}
 
-		case OPT_ADD_BROKERS: {
-			if (objc != 3) {
-				Tcl_WrongNumArgs (interp, 2, objv, "brokerList");
-				return TCL_ERROR;
-			}
+		rd_kafka_topic_partition_list_destroy (partitions);
+		rd_kafka_topic_partition_list_destroy (ends);
 
-			resultCode = kafkatcl_add_brokers (kh, objv[2]);
-			break;
+		if (range->remaining == 0) {
+			range->remaining = 1;
+			kafkatcl_range_queue_done (range, NULL);
 		}
 
-		case OPT_CREATE_QUEUE: {
-			if (objc != 3) {
-				Tcl_WrongNumArgs (interp, 2, objv, "command");
-				return TCL_ERROR;
-			}
+		kafkatcl_range_release (range);
+		return TCL_OK;
+	}
 
-			// allocate one of our kafka client data objects for Tcl and configure it
-			kafkatcl_queueClientData *kq = (kafkatcl_queueClientData *)ckalloc (sizeof (kafkatcl_queueClientData));
+	rkqu = rd_kafka_queue_new (kt->kh->rk);
 
-			kq->kafka_queue_magic = KAFKA_QUEUE_MAGIC;
-			kq->interp = interp;
-			kq->rkqu = rd_kafka_queue_new  (rk);
-			kq->kh = kh;
-			kq->krc = NULL;
+	for (i = 0; i < partitions->cnt; i++) {
+		if (rd_kafka_consume_start_queue (rkt, partitions->elems[i].partition, partitions->elems[i].offset, rkqu) < 0) {
+			int resultCode = kafkatcl_last_error_to_tcl_error (interp);
 
-			KT_LIST_INSERT_HEAD (&kh->ko->queueConsumers, kq, queueConsumerInstance);
+			while (--i >= 0) {
+				rd_kafka_consume_stop (rkt, partitions->elems[i].partition);
+			}
+			rd_kafka_queue_destroy (rkqu);
+			rd_kafka_topic_partition_list_destroy (partitions);
+			rd_kafka_topic_partition_list_destroy (ends);
+			return resultCode;
+		}
+	}
 
-			char *cmdName = Tcl_GetString (objv[2]);
+	rd_kafka_topic_partition_list_destroy (partitions);
 
-#define QUEUE_STRING_FORMAT "kafka_queue%lu"
-			// if cmdName is #auto, generate a unique name for the object
-			int autoGeneratedName = 0;
-			if (strcmp (cmdName, "#auto") == 0) {
-				static unsigned long nextAutoCounter = 0;
-				int baseNameLength = snprintf (NULL, 0, QUEUE_STRING_FORMAT, nextAutoCounter) + 1;
-				cmdName = ckalloc (baseNameLength);
-				snprintf (cmdName, baseNameLength, QUEUE_STRING_FORMAT, nextAutoCounter++);
-				autoGeneratedName = 1;
-			}
+	listObj = Tcl_NewObj ();
+	idleDeadline = kafkatcl_now_ms () + options.timeoutMS;
 
-			// create a Tcl command to interface to the handle object
-			kq->cmdToken = Tcl_CreateObjCommand (interp, cmdName, kafkatcl_queueObjectObjCmd, kq, kafkatcl_queueObjectDelete);
-			// set the full name to the command in the interpreter result
-			Tcl_GetCommandFullName(interp, kq->cmdToken, Tcl_GetObjResult (interp));
-			if (autoGeneratedName == 1) {
-				ckfree(cmdName);
-			}
+	while (ends->cnt > 0) {
+		rd_kafka_message_t *rkmessage = rd_kafka_consume_queue (rkqu, 100);
+		rd_kafka_topic_partition_t *tp;
+		kafkatcl_messageRef *ref;
+		int32_t partition;
+		int finished;
 
-			break;
+		if (rkmessage == NULL) {
+			if (kafkatcl_now_ms () >= idleDeadline) {
+				err = RD_KAFKA_RESP_ERR__TIMED_OUT;
+				break;
+			}
+			continue;
 		}
 
-		case OPT_OUTPUT_QUEUE_LENGTH: {
-			if (objc != 2) {
-				Tcl_WrongNumArgs (interp, 2, objv, "");
-				return TCL_ERROR;
-			}
+		idleDeadline = kafkatcl_now_ms () + options.timeoutMS;
+		partition = rkmessage->partition;
 
-			Tcl_SetObjResult (interp, Tcl_NewIntObj (rd_kafka_outq_len (rk)));
-			break;
+		tp = rd_kafka_topic_partition_list_find (ends, topic, partition);
+		if (tp == NULL) {
+			rd_kafka_message_destroy (rkmessage);
+			continue;
 		}
 
-		case OPT_META: {
-			int suboptIndex;
+		ref = kafkatcl_message_ref_new (kt->kh, rkmessage);
 
-			if (objc != 3) {
-				Tcl_WrongNumArgs (interp, 2, objv, "refresh|print");
-				return TCL_ERROR;
+		if (kafkatcl_range_accept (rkmessage, tp->offset, &finished)) {
+			Tcl_Obj *msgList = kafkatcl_message_ref_to_tcl_list (interp, ref, options.fields);
+
+			if (msgList != NULL) {
+				Tcl_ListObjAppendElement (NULL, listObj, msgList);
 			}
+		}
 
-			static CONST char *subOptions[] = {
-				"refresh",
-				"print",
-				NULL
-			};
+		kafkatcl_message_ref_release (ref);
 
-			enum subOptions {
-				SUBOPT_REFRESH,
-				SUBOPT_PRINT,
-			};
+		if (finished) {
+			rd_kafka_consume_stop (rkt, partition);
+			rd_kafka_topic_partition_list_del_by_idx (ends, tp - ends->elems);
+		}
+	}
 
-			// argument must be one of the subOptions defined above
-			if (Tcl_GetIndexFromObj (interp, objv[2], subOptions, "suboption",
-				TCL_EXACT, &suboptIndex) != TCL_OK) {
-				return TCL_ERROR;
-			}
+	// partitions left over after a timeout
+	for (i = 0; i < ends->cnt; i++) {
+		rd_kafka_consume_stop (rkt, ends->elems[i].partition);
+	}
 
-			switch ((enum subOptions) suboptIndex) {
-				case SUBOPT_REFRESH: {
-					if (kafkatcl_refresh_metadata (kh) == TCL_ERROR) {
-						return TCL_ERROR;
-					}
-					break;
-				}
+	rd_kafka_queue_destroy (rkqu);
+	rd_kafka_topic_partition_list_destroy (ends);
 
-				case SUBOPT_PRINT: {
-					if (kh->metadata == NULL) {
-						if (kafkatcl_refresh_metadata (kh) == TCL_ERROR) {
-							return TCL_ERROR;
-						}
-					}
+	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		Tcl_DecrRefCount (listObj);
+		return kafkatcl_kafka_error_to_tcl (interp, err, NULL);
+	}
 
-					metadata_print (NULL, kh->metadata);
-					break;
-				}
-			}
-			break;
-		}
+	Tcl_SetObjResult (interp, listObj);
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_query_new --
+ *
+ *    allocate a query of the given KAFKATCL_QUERY_* type for a handle,
+ *    to be filled in and passed to kafkatcl_query_start
+ *
+ * Results:
+ *    the new query
+ *
+ *----------------------------------------------------------------------
+ */
+kafkatcl_queryEvent *
+kafkatcl_query_new (kafkatcl_handleClientData *kh, int type, Tcl_Obj *commandObj, int timeoutMS) {
+	kafkatcl_queryEvent *evPtr = ckalloc (sizeof (kafkatcl_queryEvent));
+
+	evPtr->event.proc = kafkatcl_query_eventProc;
+	evPtr->kh = kh;
+	evPtr->ownerThreadId = Tcl_GetCurrentThread ();
+	evPtr->type = type;
+	evPtr->timeoutMS = timeoutMS;
+	evPtr->commandObj = commandObj;
+	Tcl_IncrRefCount (commandObj);
+	evPtr->err = RD_KAFKA_RESP_ERR_NO_ERROR;
+	evPtr->rktCount = -1;
+	evPtr->rkts = NULL;
+	evPtr->metadata = NULL;
+	evPtr->partitions = NULL;
+	evPtr->highWatermarks = NULL;
+	return evPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_query_free --
+ *
+ *    let go of everything a query holds but its command and the event
+ *    itself
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_query_free (kafkatcl_queryEvent *evPtr) {
+	if (evPtr->rkts != NULL) {
+		kafkatcl_metadata_topics_destroy (evPtr->rktCount, evPtr->rkts);
+		evPtr->rkts = NULL;
+	}
 
-		case OPT_INFO: {
-			int suboptIndex;
+	if (evPtr->metadata != NULL) {
+		rd_kafka_metadata_destroy (evPtr->metadata);
+		evPtr->metadata = NULL;
+	}
 
-			if (objc < 3) {
-				Tcl_WrongNumArgs (interp, 2, objv, "?topics?");
-				return TCL_ERROR;
-			}
+	if (evPtr->partitions != NULL) {
+		rd_kafka_topic_partition_list_destroy (evPtr->partitions);
+		evPtr->partitions = NULL;
+	}
 
-			static CONST char *subOptions[] = {
-				"topics",
-				"brokers",
-				"partitions",
-				NULL
-			};
+	if (evPtr->highWatermarks != NULL) {
+		ckfree (evPtr->highWatermarks);
+		evPtr->highWatermarks = NULL;
+	}
+}
 
-			enum subOptions {
-				SUBOPT_TOPICS,
-				SUBOPT_BROKERS,
-				SUBOPT_PARTITIONS,
-			};
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_query_thread --
+ *
+ *    thread that runs a query against the brokers and queues the
+ *    results back to the thread that owns the handle.  it touches
+ *    nothing but the query and the librdkafka handle.
+ *
+ *----------------------------------------------------------------------
+ */
+static Tcl_ThreadCreateType
+kafkatcl_query_thread (ClientData clientData) {
+	kafkatcl_queryEvent *evPtr = (kafkatcl_queryEvent *)clientData;
+	rd_kafka_t *rk = evPtr->kh->rk;
 
-			// argument must be one of the subOptions defined above
-			if (Tcl_GetIndexFromObj (interp, objv[2], subOptions, "suboption",
-				TCL_EXACT, &suboptIndex) != TCL_OK) {
-				return TCL_ERROR;
+	switch (evPtr->type) {
+		case KAFKATCL_QUERY_METADATA: {
+			evPtr->err = kafkatcl_metadata_fetch (rk, evPtr->rktCount, evPtr->rkts, &evPtr->metadata);
+			if (evPtr->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+				evPtr->metadata = NULL;
 			}
+			break;
+		}
 
-			if (kh->metadata == NULL) {
-				if (kafkatcl_refresh_metadata (kh) == TCL_ERROR) {
-					return TCL_ERROR;
-				}
-			}
+		case KAFKATCL_QUERY_WATERMARKS: {
+			// librdkafka asks for one partition at a time, so the timeout
+			// covers the whole list rather than each partition
+			Tcl_WideInt deadline = kafkatcl_now_ms () + evPtr->timeoutMS;
+			int i;
 
-			switch ((enum subOptions) suboptIndex) {
-				case SUBOPT_TOPICS: {
-					if (objc != 3) {
-						Tcl_WrongNumArgs (interp, 3, objv, "");
-						return TCL_ERROR;
-					}
+			for (i = 0; i < evPtr->partitions->cnt; i++) {
+				rd_kafka_topic_partition_t *tp = &evPtr->partitions->elems[i];
+				Tcl_WideInt remaining = deadline - kafkatcl_now_ms ();
+				int64_t low, high;
 
-					return kafkatcl_meta_topic_list (kh);
+				if (remaining <= 0) {
+					tp->err = RD_KAFKA_RESP_ERR__TIMED_OUT;
+				} else {
+					tp->err = rd_kafka_query_watermark_offsets (rk, tp->topic, tp->partition, &low, &high, (int)remaining);
 				}
 
-				case SUBOPT_BROKERS: {
-					if (objc != 3) {
-						Tcl_WrongNumArgs (interp, 3, objv, "");
-						return TCL_ERROR;
-					}
-
-					return kafkatcl_meta_broker_list (kh);
+				if (tp->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+					evPtr->err = tp->err;
+					continue;
 				}
 
-				case SUBOPT_PARTITIONS: {
-					if (objc != 4) {
-						Tcl_WrongNumArgs (interp, 3, objv, "topic");
-						return TCL_ERROR;
-					}
-
-					return kafkatcl_meta_topic_partitions (kh, Tcl_GetString (objv[3]));
-				}
+				tp->offset = low;
+				evPtr->highWatermarks[i] = high;
 			}
 			break;
 		}
 
-		case OPT_TOPIC_CONFIG: {
-			resultCode = kafkatcl_handle_topic_conf (interp, kh->topicConf, objc - 2, &objv[2]);
+		case KAFKATCL_QUERY_COMMITTED: {
+			evPtr->err = rd_kafka_committed (rk, evPtr->partitions, evPtr->timeoutMS);
 			break;
 		}
 
-		case OPT_PARTITIONER: {
-			if (objc != 3) {
-				Tcl_WrongNumArgs (interp, 2, objv, "consistent|random");
-				return TCL_ERROR;
-			}
-
-			resultCode = kafkatcl_partitioner_conf (interp, kh->topicConf, objc - 2, &objv[2]);
+		case KAFKATCL_QUERY_POSITION: {
+			evPtr->err = rd_kafka_position (rk, evPtr->partitions);
 			break;
 		}
 
+		case KAFKATCL_QUERY_SEEK: {
+			rd_kafka_error_t *error = rd_kafka_seek_partitions (rk, evPtr->partitions, evPtr->timeoutMS);
 
-		case OPT_DELETE: {
-			if (objc != 2) {
-				Tcl_WrongNumArgs (interp, 2, objv, "");
-				return TCL_ERROR;
+			if (error != NULL) {
+				evPtr->err = rd_kafka_error_code (error);
+				rd_kafka_error_destroy (error);
+			} else {
+				evPtr->err = kafkatcl_first_partition_error (evPtr->partitions);
 			}
+			break;
+		}
 
-			if (Tcl_DeleteCommandFromToken (kh->interp, kh->cmdToken) == TCL_ERROR) {
-				resultCode = TCL_ERROR;
+		case KAFKATCL_QUERY_OFFSETS_FOR_TIMES: {
+			evPtr->err = rd_kafka_offsets_for_times (rk, evPtr->partitions, evPtr->timeoutMS);
+			if (evPtr->err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+				evPtr->err = kafkatcl_first_partition_error (evPtr->partitions);
 			}
 			break;
 		}
+	}
 
-    }
-    return resultCode;
+	Tcl_ThreadQueueEvent (evPtr->ownerThreadId, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert (evPtr->ownerThreadId);
+	TCL_THREAD_CREATE_RETURN;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_objv_to_topic_partition_list --
- *
- *    converts a Tcl list of { {topic partition offset} {topic partition offset} }
- *    to a new-consumer-interface rd_kafka_topic_partition_list_t
- *
- *    offset is optional, and if the offset is not provided then the partition is
- *    optional, so you can provide a simple {topic topic topic} list.
- *
- *    Topics starting with "^" are regular expressions.
+ * kafkatcl_query_eventProc --
  *
- *    Empty topics (like the second topic in this list: {topic {} topic}) are
- *    silently dropped.
+ *    this routine is called by the Tcl event handler when a query has
+ *    finished.  it invokes the query's command with a key-value list
+ *    of err, which is empty unless something failed, and the results:
+ *    watermarks, a list of {topic partition low high} for each
+ *    partition that was found, or offsets, the topic-partition-offset
+ *    list.  a metadata query's results go into the handle's metadata.
  *
  * Results:
- *    Pointer to rd_kafka_topic_partition_list_t
- *    Or NULL if there is an error in the provided Tcl list.
+ *    returns 1 to say we handled the event and the dispatcher can delete it
  *
  *----------------------------------------------------------------------
  */
-rd_kafka_topic_partition_list_t *kafkatcl_objv_to_topic_partition_list(Tcl_Interp *interp, Tcl_Obj *const*objv, int objc)
-{
-	rd_kafka_topic_partition_list_t *list = rd_kafka_topic_partition_list_new(0);
+int
+kafkatcl_query_eventProc (Tcl_Event *tevPtr, int flags) {
+	kafkatcl_queryEvent *evPtr = (kafkatcl_queryEvent *)tevPtr;
+	kafkatcl_handleClientData *kh = evPtr->kh;
+	Tcl_Interp *interp = kh->interp;
+	Tcl_Obj *commandObj = evPtr->commandObj;
+	Tcl_Obj *listObjv[4];
+	int listObjc = 2;
+	int threadResult;
 	int i;
 
-	for(i = 0; i < objc; i++) {
-		rd_kafka_topic_partition_t *added;
-		char     *topic = NULL;
-		int       partition = 0;
-		Tcl_WideInt offset = 0;
-		int       tupleObjc;
-		Tcl_Obj **tupleObjv;
+	Tcl_JoinThread (evPtr->thread, &threadResult);
+	KT_LIST_REMOVE (evPtr, queryInstance);
 
-		// make this split out a Tcl list (tuple) {topic ?partition? ?offset?}
-		if (Tcl_ListObjGetElements (interp, objv[i], &tupleObjc, &tupleObjv) == TCL_ERROR) {
-			rd_kafka_topic_partition_list_destroy(list);
-			return NULL;
+	listObjv[0] = kafkatcl_thread_data ()->literals[KAFKATCL_LIT_ERR];
+	listObjv[1] = (evPtr->err == RD_KAFKA_RESP_ERR_NO_ERROR) ? Tcl_NewObj () : Tcl_NewStringObj (kafkatcl_kafka_error_to_errorcode_string (evPtr->err), -1);
+
+	switch (evPtr->type) {
+		case KAFKATCL_QUERY_METADATA: {
+			if (evPtr->metadata != NULL) {
+				kafkatcl_metadata_install (kh, evPtr->metadata, evPtr->rktCount < 0);
+				evPtr->metadata = NULL;
+			}
+			break;
 		}
 
-		// skip {}
-		if(tupleObjc == 0)
-			continue;
+		case KAFKATCL_QUERY_WATERMARKS: {
+			Tcl_Obj *watermarksObj = Tcl_NewObj ();
 
-		topic = Tcl_GetString(tupleObjv[0]);
+			for (i = 0; i < evPtr->partitions->cnt; i++) {
+				rd_kafka_topic_partition_t *tp = &evPtr->partitions->elems[i];
+				Tcl_Obj *elementObjv[4];
 
-		if(tupleObjc > 1) {
-			if(Tcl_GetIntFromObj(interp, tupleObjv[1], &partition) == TCL_ERROR) {
-				rd_kafka_topic_partition_list_destroy(list);
-				return NULL;
+				if (tp->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+					continue;
+				}
+
+				elementObjv[0] = Tcl_NewStringObj (tp->topic, -1);
+				elementObjv[1] = Tcl_NewIntObj (tp->partition);
+				elementObjv[2] = Tcl_NewWideIntObj (tp->offset);
+				elementObjv[3] = Tcl_NewWideIntObj (evPtr->highWatermarks[i]);
+				Tcl_ListObjAppendElement (NULL, watermarksObj, Tcl_NewListObj (4, elementObjv));
 			}
+
+			listObjv[listObjc++] = Tcl_NewStringObj ("watermarks", -1);
+			listObjv[listObjc++] = watermarksObj;
+			break;
 		}
 
-		if(tupleObjc > 2) {
-			if(kafkatcl_parse_offset(interp, tupleObjv[2], &offset) == TCL_ERROR) {
-				rd_kafka_topic_partition_list_destroy(list);
-				return NULL;
-			}
+		case KAFKATCL_QUERY_COMMITTED:
+		case KAFKATCL_QUERY_POSITION: {
+			listObjv[listObjc++] = Tcl_NewStringObj ("offsets", -1);
+			listObjv[listObjc++] = (evPtr->err == RD_KAFKA_RESP_ERR_NO_ERROR) ? kafkatcl_topic_partition_list_to_list (NULL, evPtr->partitions) : Tcl_NewObj ();
+			break;
 		}
 
-		added = rd_kafka_topic_partition_list_add(list, topic, partition);
+		case KAFKATCL_QUERY_SEEK:
+		case KAFKATCL_QUERY_OFFSETS_FOR_TIMES: {
+			// the partitions that worked, even if some didn't
+			listObjv[listObjc++] = Tcl_NewStringObj ("offsets", -1);
+			listObjv[listObjc++] = kafkatcl_topic_partition_offsets_to_list (evPtr->partitions);
+			break;
+		}
+	}
 
-		if(tupleObjc > 2)
-			added->offset = offset;
+	// let go of the query before invoking the command, which may
+	// delete the handle
+	kafkatcl_query_free (evPtr);
+
+	kafkatcl_invoke_callback_with_argument (interp, commandObj, Tcl_NewListObj (listObjc, listObjv));
+	Tcl_DecrRefCount (commandObj);
+	return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_query_match --
+ *
+ *    Tcl_DeleteEvents match function for the finished queries of a
+ *    handle that's going away, letting go of what they hold
+ *
+ *----------------------------------------------------------------------
+ */
+int
+kafkatcl_query_match (Tcl_Event *tevPtr, ClientData clientData) {
+	kafkatcl_queryEvent *evPtr = (kafkatcl_queryEvent *)tevPtr;
+
+	if (tevPtr->proc != kafkatcl_query_eventProc || evPtr->kh != (kafkatcl_handleClientData *)clientData) {
+		return 0;
 	}
 
-	return list;
+	kafkatcl_query_free (evPtr);
+	Tcl_DecrRefCount (evPtr->commandObj);
+	return 1;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_topic_partition_list_to_list --
+ * kafkatcl_query_start --
  *
- *    converts rd_kafka_topic_partition_list_t to a Tcl list. Only the topic, partition
- *    and offset (if non zero) is retained. Metadata is discarded.
+ *    start a worker thread running a query made by kafkatcl_query_new.
+ *    the query belongs to the thread from here on, and comes back to
+ *    us through the event loop.
  *
  * Results:
- *    A Tcl_Obj containing a list of the form {{topic ?partition ?offset??}}
+ *    a standard tcl result; on error the query has been freed
  *
  *----------------------------------------------------------------------
  */
-Tcl_Obj *kafkatcl_topic_partition_list_to_list(Tcl_Interp *interp, rd_kafka_topic_partition_list_t *topics)
-{
-	Tcl_Obj *result = Tcl_NewObj();
-	int i;
+int
+kafkatcl_query_start (kafkatcl_handleClientData *kh, kafkatcl_queryEvent *evPtr) {
+	KT_LIST_INSERT_HEAD (&kh->queries, evPtr, queryInstance);
 
-	for(i = 0; i < topics->cnt; i++) {
-		Tcl_Obj *topicPartition = Tcl_NewObj();
+	if (Tcl_CreateThread (&evPtr->thread, kafkatcl_query_thread, evPtr, TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+		KT_LIST_REMOVE (evPtr, queryInstance);
+		kafkatcl_query_free (evPtr);
+		Tcl_DecrRefCount (evPtr->commandObj);
+		ckfree (evPtr);
 
-		Tcl_ListObjAppendElement(interp, topicPartition, Tcl_NewStringObj(topics->elems[i].topic, -1));
-		if(topics->elems[i].partition || topics->elems[i].offset)
-			Tcl_ListObjAppendElement(interp, topicPartition, Tcl_NewIntObj(topics->elems[i].partition));
-		if(topics->elems[i].offset)
-			Tcl_ListObjAppendElement(interp, topicPartition, kafkatcl_NewOffsetObj(topics->elems[i].offset));
+		Tcl_SetObjResult (kh->interp, Tcl_NewStringObj ("couldn't create query thread", -1));
+		return TCL_ERROR;
+	}
 
-		Tcl_ListObjAppendElement(interp, result, topicPartition);
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_query_cleanup --
+ *
+ *    wait for a handle's running queries to finish, since they're using
+ *    the librdkafka handle, and throw away their results
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_query_cleanup (kafkatcl_handleClientData *kh) {
+	kafkatcl_queryEvent *evPtr;
+
+	KT_LIST_FOREACH (evPtr, &kh->queries, queryInstance) {
+		int threadResult;
+
+		Tcl_JoinThread (evPtr->thread, &threadResult);
 	}
+	KT_LIST_INIT (&kh->queries);
 
-	return result;
+	Tcl_DeleteEvents (kafkatcl_query_match, (ClientData)kh);
 }
 
 /*
@@ -3752,13 +9667,14 @@ kafkatcl_set_subscriber_callback(Tcl_Interp *interp, kafkatcl_handleClientData *
 /*
  *----------------------------------------------------------------------
  *
- * kafkatcl_SubscriberEventCheckProc --
- *
- *    This is a function we pass to Tcl_CreateEventSource that is
- *    invoked to see if any subscriber events have occurred and to queue them.
+ * kafkatcl_subscriber_poll --
  *
- *    polls rd_kafka_consumer_poll until we get no messages returned or an EOF
- *    message (null return from kafkatcl_message_to_tcl_list).
+ *    polls rd_kafka_consumer_poll until we get no messages returned or
+ *    until the kafka object's budget for a pass through the event loop is
+ *    used up.  partition EOF messages (null return from
+ *    kafkatcl_message_to_tcl_list) are skipped, not a reason to stop, and
+ *    messages belonging to a consume_range -command go to its command.
+ *    the subscriber's event source picks up what's left on the next pass.
  *
  * Results:
  *    Executes the subscriber callback for each event.
@@ -3766,41 +9682,128 @@ kafkatcl_set_subscriber_callback(Tcl_Interp *interp, kafkatcl_handleClientData *
  *----------------------------------------------------------------------
  */
 void
-kafkatcl_SubscriberEventCheckProc (ClientData clientData, int flags) {
-	kafkatcl_handleClientData *kh = (kafkatcl_handleClientData *)clientData;
-	assert (kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
+kafkatcl_subscriber_poll (kafkatcl_handleClientData *kh) {
 	rd_kafka_t *rk = kh->rk;
 	rd_kafka_message_t *message;
 	Tcl_Interp *interp = kh->interp;
+	int limit = kh->ko->budgetMessages;
+	Tcl_WideInt deadline = kafkatcl_budget_deadline (kh->ko);
+	int count = 0;
 
-	// If we don't have a subscriber callback, leave subscriber messages alone.
+	// If we don't have a subscriber callback or a range, leave subscriber messages alone.
 	// User must then explicitly read messages (via subscriber consume) frequently!
-	if(!kh->subscriberCallback)
+	if(!kh->subscriberCallback && !kh->range)
 		return;
 
 	kh->inCallback = 1;
 
 	Tcl_Obj *cb = kh->subscriberCallback;
-	Tcl_IncrRefCount(cb); // Save it from being deleted if the hadle is deleted in the callback
+	if(cb)
+		Tcl_IncrRefCount(cb); // Save it from being deleted if the hadle is deleted in the callback
 
 	while((message = rd_kafka_consumer_poll(rk, 0))) {
-		rd_kafka_timestamp_type_t tstype;
-		Tcl_WideInt timestamp = rd_kafka_message_timestamp(message, &tstype);
-		Tcl_Obj *msgList = kafkatcl_message_to_tcl_list(interp, message, timestamp, tstype);
+		// messages of a consume_range -command go to its command
+		if(kafkatcl_subscriber_range_message(kh, message)) {
+			if ((limit > 0 && ++count >= limit) || (deadline >= 0 && kafkatcl_now_ms () >= deadline)) {
+				break;
+			}
+			continue;
+		}
 
-		// We don't need this any more
-		rd_kafka_message_destroy(message);
+		kafkatcl_messageRef *ref = kafkatcl_message_ref_new(kh, message);
+		Tcl_Obj *msgList = kafkatcl_message_ref_to_tcl_list(interp, ref, kh->subscriberFields);
 
-		if(msgList) {
+		// We don't need this any more, the list has its own reference
+		kafkatcl_message_ref_release(ref);
+
+		if(msgList && cb) {
 			// Note - this increments and decrements the refcount on msgList.
 			kafkatcl_invoke_callback_with_argument (interp, cb, msgList);
+		} else if(msgList) {
+			Tcl_DecrRefCount(msgList);
+		}
+
+		if ((limit > 0 && ++count >= limit) || (deadline >= 0 && kafkatcl_now_ms () >= deadline)) {
+			break;
 		}
 	}
 
 	kh->inCallback = 0;
 
-	// Stake undead callbacks.
-	Tcl_DecrRefCount(cb);
+	// Stake undead callbacks.
+	if(cb)
+		Tcl_DecrRefCount(cb);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_SubscriberEventSetupProc --
+ *
+ *    Subscribers are woken through their wakeup pipe, so normally there
+ *    is no reason to limit how long the notifier blocks.  If messages
+ *    are already waiting (librdkafka only signals the empty to non-empty
+ *    transition) make sure the notifier doesn't block at all.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_SubscriberEventSetupProc (ClientData clientData, int flags) {
+	kafkatcl_handleClientData *kh = (kafkatcl_handleClientData *)clientData;
+	assert (kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
+
+	if ((kh->subscriberCallback || kh->range) && rd_kafka_queue_length (kh->consumerQueue) > 0) {
+		Tcl_Time time = {0, 0};
+		Tcl_SetMaxBlockTime (&time);
+	}
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_SubscriberEventCheckProc --
+ *
+ *    This is a function we pass to Tcl_CreateEventSource that is
+ *    invoked to see if any subscriber events have occurred and to queue them.
+ *
+ *    It only has work to do if messages are sitting in the consumer
+ *    queue, otherwise we wait to be woken by the file handler.
+ *
+ * Results:
+ *    Executes the subscriber callback for each event.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_SubscriberEventCheckProc (ClientData clientData, int flags) {
+	kafkatcl_handleClientData *kh = (kafkatcl_handleClientData *)clientData;
+	assert (kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
+
+	if ((kh->subscriberCallback || kh->range) && rd_kafka_queue_length (kh->consumerQueue) > 0) {
+		kafkatcl_subscriber_poll (kh);
+	}
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * kafkatcl_SubscriberFileProc --
+ *
+ *    Tcl file handler for the subscriber's wakeup pipe, invoked when
+ *    librdkafka has put something into the consumer queue.
+ *
+ * Results:
+ *    Executes the subscriber callback for each event.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+kafkatcl_SubscriberFileProc (ClientData clientData, int mask) {
+	kafkatcl_handleClientData *kh = (kafkatcl_handleClientData *)clientData;
+	assert (kh->kafka_handle_magic == KAFKA_HANDLE_MAGIC);
+
+	kafkatcl_wakeup_drain (kh);
+	kafkatcl_subscriber_poll (kh);
 }
 
 /*
@@ -3831,11 +9834,17 @@ kafkatcl_handleSubscriberObjectObjCmd(ClientData cData, Tcl_Interp *interp, int
 		"assignment", // current actual assignment
 		"commit",
 		"consume",
+		"consume_batch",
+		"consume_range",
 		"callback",
 		"offsets",
 		"watermarks",
 		"meta",
 		"info",
+		"pause",
+		"resume",
+		"seek",
+		"offsets_for_times",
 		"delete",
 		"error",
 		NULL
@@ -3848,11 +9857,17 @@ kafkatcl_handleSubscriberObjectObjCmd(ClientData cData, Tcl_Interp *interp, int
 		OPT_ASSIGNMENT,
 		OPT_COMMIT,
 		OPT_CONSUME,
+		OPT_CONSUME_BATCH,
+		OPT_CONSUME_RANGE,
 		OPT_CALLBACK,
 		OPT_OFFSETS,
 		OPT_WATERMARKS,
 		OPT_META,
 		OPT_INFO,
+		OPT_PAUSE,
+		OPT_RESUME,
+		OPT_SEEK,
+		OPT_OFFSETS_FOR_TIMES,
 		OPT_DELETE,
 		OPT_ERROR
 	};
@@ -3991,10 +10006,24 @@ kafkatcl_handleSubscriberObjectObjCmd(ClientData cData, Tcl_Interp *interp, int
 			break;
 		}
 
+		case OPT_PAUSE:
+		case OPT_RESUME: {
+			return kafkatcl_pause_resume (interp, kh, optIndex == OPT_PAUSE, objc, objv);
+		}
+
+		case OPT_SEEK: {
+			return kafkatcl_seek (interp, kh, objc, objv);
+		}
+
+		case OPT_OFFSETS_FOR_TIMES: {
+			return kafkatcl_offsets_for_times (interp, kh, objc, objv);
+		}
+
 		case OPT_WATERMARKS: {
 			int      nextOption = 2;
 			int      cached = 0;
 			Tcl_Obj *result;
+			Tcl_Obj *commandObj = NULL;
 			int      timeoutMS = 5000; // default 5s timout for un-cached
 
 			while (objc > nextOption + 2) {
@@ -4008,11 +10037,34 @@ kafkatcl_handleSubscriberObjectObjCmd(ClientData cData, Tcl_Interp *interp, int
 						return TCL_ERROR;
 					}
 					nextOption++;
+				} else if(strcmp(option, "-command") == 0) {
+					nextOption++;
+					commandObj = objv[nextOption++];
 				} else {
 					break;
 				}
 			}
 
+			if(commandObj) {
+				// query a list of {topic partition} on a worker thread
+				kafkatcl_queryEvent *evPtr;
+				rd_kafka_topic_partition_list_t *partitions;
+
+				if(cached || objc <= nextOption) {
+					Tcl_WrongNumArgs (interp, 2, objv, "?-timeout ms? -command command {topic partition} ?{topic partition}...?");
+					return TCL_ERROR;
+				}
+
+				partitions = kafkatcl_objv_to_topic_partition_list(interp, &objv[nextOption], objc-nextOption);
+				if(!partitions)
+					return TCL_ERROR;
+
+				evPtr = kafkatcl_query_new (kh, KAFKATCL_QUERY_WATERMARKS, commandObj, timeoutMS);
+				evPtr->partitions = partitions;
+				evPtr->highWatermarks = (int64_t *)ckalloc (sizeof (int64_t) * (partitions->cnt + 1));
+				return kafkatcl_query_start (kh, evPtr);
+			}
+
 			if(objc - nextOption != 2) {
 				Tcl_WrongNumArgs (interp, 2, objv, "?-cached? ?-timeout ms? topic partition");
 				return TCL_ERROR;
@@ -4059,6 +10111,7 @@ kafkatcl_handleSubscriberObjectObjCmd(ClientData cData, Tcl_Interp *interp, int
 			int committed = 0;
 			int status;
 			Tcl_Obj *result;
+			Tcl_Obj *commandObj = NULL;
 			int timeoutMS = 5000; // default 5s timout for -committed
 
 			while (objc > partitionIndex) {
@@ -4072,19 +10125,30 @@ kafkatcl_handleSubscriberObjectObjCmd(ClientData cData, Tcl_Interp *interp, int
 						return TCL_ERROR;
 					}
 					partitionIndex++;
+				} else if(strcmp(possibleOptionName, "-command") == 0 && objc > partitionIndex + 1) {
+					partitionIndex++;
+					commandObj = objv[partitionIndex++];
 				} else {
 					break;
 				}
 			}
 
 			if(objc <= partitionIndex) {
-				Tcl_WrongNumArgs (interp, 2, objv, "?-committed? ?-timeout ms? {topic partition} ?{topic partition}...?");
+				Tcl_WrongNumArgs (interp, 2, objv, "?-committed? ?-timeout ms? ?-command command? {topic partition} ?{topic partition}...?");
 				return TCL_ERROR;
 			}
 
 			partitions = kafkatcl_objv_to_topic_partition_list(interp, &objv[partitionIndex], objc-partitionIndex);
 			if(!partitions)
 				return TCL_ERROR;
+
+			if(commandObj) {
+				// look them up on a worker thread
+				kafkatcl_queryEvent *evPtr = kafkatcl_query_new (kh, committed ? KAFKATCL_QUERY_COMMITTED : KAFKATCL_QUERY_POSITION, commandObj, timeoutMS);
+
+				evPtr->partitions = partitions;
+				return kafkatcl_query_start (kh, evPtr);
+			}
 #ifdef DEBUGPRINTF
 			fprintf(stderr, "Checking "); kafkatcl_dump_topic_partition_list(partitions);
 #endif
@@ -4114,26 +10178,31 @@ kafkatcl_handleSubscriberObjectObjCmd(ClientData cData, Tcl_Interp *interp, int
 
 		case OPT_CONSUME: {
 			int timeoutMS;
+			int nextArg = 2;
+			kafkatcl_consumeOptions options;
+
+			if (kafkatcl_parse_consume_options (interp, objc, objv, &nextArg, 0, &options) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
 
-			if(objc <= 2) {
+			if(objc <= nextArg) {
 				timeoutMS = 0; // no timeout means poll
-			} else if (objc == 3) {
-				if(Tcl_GetIntFromObj(interp, objv[2], &timeoutMS) == TCL_ERROR) {
+			} else if (objc == nextArg + 1) {
+				if(Tcl_GetIntFromObj(interp, objv[nextArg], &timeoutMS) == TCL_ERROR) {
 					return TCL_ERROR;
 				}
 			} else {
-				Tcl_WrongNumArgs (interp, 2, objv, "?timeout?");
+				Tcl_WrongNumArgs (interp, 2, objv, "?-fields list? ?timeout?");
 				return TCL_ERROR;
 			}
 
 			rd_kafka_message_t *message = rd_kafka_consumer_poll(rk, timeoutMS);
 
 			if(message) {
-				rd_kafka_timestamp_type_t tstype;
-				Tcl_WideInt timestamp = rd_kafka_message_timestamp(message, &tstype);
-				Tcl_Obj *msgList = kafkatcl_message_to_tcl_list(interp, message, timestamp, tstype);
+				kafkatcl_messageRef *ref = kafkatcl_message_ref_new(kh, message);
+				Tcl_Obj *msgList = kafkatcl_message_ref_to_tcl_list(interp, ref, options.fields);
 
-				rd_kafka_message_destroy(message);
+				kafkatcl_message_ref_release(ref);
 
 				if(msgList)
 					Tcl_SetObjResult(interp, msgList);
@@ -4142,67 +10211,137 @@ kafkatcl_handleSubscriberObjectObjCmd(ClientData cData, Tcl_Interp *interp, int
 			break;
 		}
 
-		case OPT_CALLBACK: {
-			if ((objc < 2) || (objc > 3)) {
-				Tcl_WrongNumArgs (interp, 2, objv, "?callback?");
+		case OPT_CONSUME_BATCH: {
+			int nextArg = 2;
+			kafkatcl_consumeOptions options;
+			int timeoutMS;
+			int count;
+			char *arrayName = NULL;
+			Tcl_Obj *codeObj = NULL;
+
+			if (kafkatcl_parse_consume_options (interp, objc, objv, &nextArg, 0, &options) == TCL_ERROR) {
 				return TCL_ERROR;
 			}
 
-			if (objc < 3) {
-				if(kh->subscriberCallback != NULL)
-					Tcl_SetObjResult (interp, kh->subscriberCallback);
-			} else {
-				kafkatcl_set_subscriber_callback (interp, kh, objv[2]);
+			if (objc - nextArg == 4) {
+				arrayName = Tcl_GetString (objv[nextArg + 2]);
+				codeObj = objv[nextArg + 3];
+			} else if (objc - nextArg == 3 && strcmp (Tcl_GetString (objv[nextArg + 2]), "-list") == 0) {
+				// -list is the default
+			} else if (objc - nextArg != 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-fields list? timeout count ?-list | array code?");
+				return TCL_ERROR;
 			}
 
-			return TCL_OK;
-		}
+			if (Tcl_GetIntFromObj (interp, objv[nextArg], &timeoutMS) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
 
-		case OPT_META: {
-			int suboptIndex;
+			if (Tcl_GetIntFromObj (interp, objv[nextArg + 1], &count) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
 
-			if (objc != 3) {
-				Tcl_WrongNumArgs (interp, 2, objv, "refresh|print");
+			if (count <= 0) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("count must be greater than zero", -1));
 				return TCL_ERROR;
 			}
 
-			static CONST char *subOptions[] = {
-				"refresh",
-				"print",
-				NULL
-			};
+			rd_kafka_message_t **rkMessages = ckalloc (sizeof (rd_kafka_message_t *) * count);
 
-			enum subOptions {
-				SUBOPT_REFRESH,
-				SUBOPT_PRINT,
-			};
+			int gotCount = rd_kafka_consume_batch_queue (kh->consumerQueue, timeoutMS, rkMessages, count);
 
-			// argument must be one of the subOptions defined above
-			if (Tcl_GetIndexFromObj (interp, objv[2], subOptions, "suboption",
-				TCL_EXACT, &suboptIndex) != TCL_OK) {
-				return TCL_ERROR;
+			if (gotCount < 0) {
+				ckfree (rkMessages);
+				return kafkatcl_last_error_to_tcl_error (interp);
 			}
 
-			switch ((enum subOptions) suboptIndex) {
-				case SUBOPT_REFRESH: {
-					if (kafkatcl_refresh_metadata (kh) == TCL_ERROR) {
-						return TCL_ERROR;
+			Tcl_Obj *listObj = (codeObj == NULL) ? Tcl_NewObj () : NULL;
+
+			int i;
+			for (i = 0; i < gotCount; i++) {
+				kafkatcl_messageRef *ref = kafkatcl_message_ref_new (kh, rkMessages[i]);
+
+				if (codeObj == NULL) {
+					Tcl_Obj *msgList = kafkatcl_message_ref_to_tcl_list (interp, ref, options.fields);
+					kafkatcl_message_ref_release (ref);
+
+					// partition EOF, skip it as the array form does
+					if (msgList != NULL) {
+						Tcl_ListObjAppendElement (interp, listObj, msgList);
 					}
+					continue;
+				}
+
+				resultCode = kafkatcl_message_to_tcl_array (interp, arrayName, rkMessages[i], ref, options.fields, 0);
+				kafkatcl_message_ref_release (ref);
+
+				if (resultCode == TCL_BREAK) {
+					resultCode = TCL_OK;
+					continue;
+				} else if (resultCode == TCL_ERROR) {
 					break;
 				}
 
-				case SUBOPT_PRINT: {
-					if (kh->metadata == NULL) {
-						if (kafkatcl_refresh_metadata (kh) == TCL_ERROR) {
-							return TCL_ERROR;
-						}
-					}
+				resultCode = Tcl_EvalObjEx (interp, codeObj, 0);
 
-					metadata_print (NULL, kh->metadata);
+				if (resultCode == TCL_ERROR) {
 					break;
 				}
 			}
-			break;
+
+			/* Free trailing unprocessed messages; message i has been released already */
+			for (i++; i < gotCount; ++i) {
+				rd_kafka_message_destroy (rkMessages[i]);
+			}
+
+			ckfree (rkMessages);
+
+			if (resultCode == TCL_ERROR) {
+				if (listObj != NULL) {
+					Tcl_DecrRefCount (listObj);
+				}
+				return TCL_ERROR;
+			}
+
+			if (listObj != NULL) {
+				Tcl_SetObjResult (interp, listObj);
+			} else {
+				Tcl_SetObjResult (interp, Tcl_NewIntObj (gotCount));
+			}
+
+			return TCL_OK;
+		}
+
+		case OPT_CONSUME_RANGE: {
+			return kafkatcl_subscriber_consume_range (interp, kh, objc, objv);
+		}
+
+		case OPT_CALLBACK: {
+			int nextArg = 2;
+			kafkatcl_consumeOptions options;
+
+			if (kafkatcl_parse_consume_options (interp, objc, objv, &nextArg, 0, &options) == TCL_ERROR) {
+				return TCL_ERROR;
+			}
+
+			if ((objc - nextArg > 1) || (nextArg > 2 && objc == nextArg)) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-fields list? ?callback?");
+				return TCL_ERROR;
+			}
+
+			if (objc < 3) {
+				if(kh->subscriberCallback != NULL)
+					Tcl_SetObjResult (interp, kh->subscriberCallback);
+			} else {
+				kh->subscriberFields = options.fields;
+				kafkatcl_set_subscriber_callback (interp, kh, objv[nextArg]);
+			}
+
+			return TCL_OK;
+		}
+
+		case OPT_META: {
+			return kafkatcl_handle_meta (interp, kh, objc, objv);
 		}
 
 		case OPT_INFO: {
@@ -4232,12 +10371,6 @@ kafkatcl_handleSubscriberObjectObjCmd(ClientData cData, Tcl_Interp *interp, int
 				return TCL_ERROR;
 			}
 
-			if (kh->metadata == NULL) {
-				if (kafkatcl_refresh_metadata (kh) == TCL_ERROR) {
-					return TCL_ERROR;
-				}
-			}
-
 			switch ((enum subOptions) suboptIndex) {
 				case SUBOPT_TOPICS: {
 					if (objc != 3) {
@@ -4245,6 +10378,10 @@ kafkatcl_handleSubscriberObjectObjCmd(ClientData cData, Tcl_Interp *interp, int
 						return TCL_ERROR;
 					}
 
+					if (kafkatcl_metadata_ensure (kh) == TCL_ERROR) {
+						return TCL_ERROR;
+					}
+
 					return kafkatcl_meta_topic_list (kh);
 				}
 
@@ -4254,6 +10391,10 @@ kafkatcl_handleSubscriberObjectObjCmd(ClientData cData, Tcl_Interp *interp, int
 						return TCL_ERROR;
 					}
 
+					if (kafkatcl_metadata_ensure (kh) == TCL_ERROR) {
+						return TCL_ERROR;
+					}
+
 					return kafkatcl_meta_broker_list (kh);
 				}
 
@@ -4342,9 +10483,39 @@ kafkatcl_handleClientData *kafkatcl_createHandle(kafkatcl_objectClientData *ko,
 	kh->kafkaType = kafkaType;
 	kh->threadId = Tcl_GetCurrentThread ();
 	kh->metadata = NULL;
+	kh->metadataBlock = NULL;
+	Tcl_InitHashTable (&kh->metadataTopics, TCL_STRING_KEYS);
+	kh->metadataFetched = 0;
+	kh->metadataTTL = 0;
+	kh->metadataRefreshing = 0;
+	kh->partitionChangeCallbackObj = NULL;
 	kh->topicConf = NULL;
 	kh->subscriberCallback = NULL;
+	kh->subscriberFields = KAFKATCL_FIELDS_DEFAULT;
 	kh->inCallback = 0;
+	kh->consumerQueue = NULL;
+	kh->mainQueue = NULL;
+	kh->mainEvent = NULL;
+	kh->callbackQueue = NULL;
+	Tcl_InitHashTable (&kh->callbackConsumers, KAFKATCL_PARTITION_KEY_WORDS);
+	KT_LIST_INIT (&kh->messageRefs);
+	kh->wakeupPipe[0] = kh->wakeupPipe[1] = -1;
+	KT_LIST_INIT (&kh->flushWaiters);
+	KT_LIST_INIT (&kh->queries);
+	kh->writableCallbackObj = NULL;
+	kh->writableLowWater = 0;
+	kh->writablePending = 0;
+	kh->deliveryReports = 0;
+	kh->pendingMessages = 0;
+	kh->pendingBytes = 0;
+	kh->backpressureHighMessages = KAFKATCL_DEFAULT_BACKPRESSURE_MESSAGES;
+	kh->backpressureLowMessages = KAFKATCL_DEFAULT_BACKPRESSURE_MESSAGES / 2;
+	kh->backpressureHighBytes = KAFKATCL_DEFAULT_BACKPRESSURE_BYTES;
+	kh->backpressureLowBytes = KAFKATCL_DEFAULT_BACKPRESSURE_BYTES / 2;
+	kh->backpressurePaused = NULL;
+	kh->appPaused = NULL;
+	kh->rangePaused = NULL;
+	kh->range = NULL;
 
 	return kh;
 }
@@ -4355,7 +10526,13 @@ kafkatcl_handleClientData *kafkatcl_createHandle(kafkatcl_objectClientData *ko,
  * kafkatcl_createHandleObjectCommand --
  *
  *    given a kafkatcl_objectClientData pointer, an object name (or "#auto"),
- *    and a handle type of producer or consumer, create a handle object
+ *    and a handle type of producer or consumer, create a handle object.
+ *
+ *    a producer gets delivery reports if the kafka object has a delivery
+ *    report callback or deliveryReports is set.  otherwise it's left
+ *    without them, since each report holds onto its message, counted
+ *    against queue.buffering.max.messages, until rd_kafka_poll serves
+ *    it, and a producer that never enters the event loop would fill up.
  *
  * Results:
  *    A standard Tcl result
@@ -4363,7 +10540,7 @@ kafkatcl_handleClientData *kafkatcl_createHandle(kafkatcl_objectClientData *ko,
  *----------------------------------------------------------------------
  */
 int
-kafkatcl_createHandleObjectCommand (kafkatcl_objectClientData *ko, char *cmdName, rd_kafka_type_t kafkaType)
+kafkatcl_createHandleObjectCommand (kafkatcl_objectClientData *ko, char *cmdName, rd_kafka_type_t kafkaType, int deliveryReports)
 {
 	char errStr[256];
 
@@ -4374,6 +10551,32 @@ kafkatcl_createHandleObjectCommand (kafkatcl_objectClientData *ko, char *cmdName
 	// rd_kafka_new consumes its conf object so give it one because
 	// we don't want to give ours up
 	rd_kafka_conf_t *conf = rd_kafka_conf_dup (ko->conf);
+	int events = 0;
+
+	if (kafkaType != RD_KAFKA_PRODUCER) {
+		deliveryReports = 0;
+	} else if (ko->deliveryReportCallbackObj != NULL) {
+		deliveryReports = 1;
+	}
+
+	// get delivery reports, errors and statistics as events from the
+	// main queue, which kafkatcl_main_queue_serve hands out a budget's
+	// worth at a time
+	if (deliveryReports) {
+		events |= RD_KAFKA_EVENT_DR;
+	}
+
+	if (ko->errorCallbackObj != NULL) {
+		events |= RD_KAFKA_EVENT_ERROR;
+	}
+
+	if (ko->statisticsCallbackObj != NULL) {
+		events |= RD_KAFKA_EVENT_STATS;
+	}
+
+	if (events != 0) {
+		rd_kafka_conf_set_events (conf, events);
+	}
 
 	// create the handle
 	rd_kafka_t *rk = rd_kafka_new (kafkaType, conf, errStr, sizeof(errStr));
@@ -4384,8 +10587,22 @@ kafkatcl_createHandleObjectCommand (kafkatcl_objectClientData *ko, char *cmdName
 	}
 
 	kafkatcl_handleClientData *kh = kafkatcl_createHandle(ko, rk, kafkaType);
+	kh->deliveryReports = deliveryReports;
+
+	// have librdkafka wake us through a pipe when there are delivery
+	// reports, errors, stats or messages for us rather than polling
+	if (kafkatcl_wakeup_init (kh, kafkatcl_FileProc) == TCL_ERROR) {
+		rd_kafka_destroy (rk);
+		Tcl_DeleteHashTable (&kh->callbackConsumers);
+		ckfree ((char *)kh);
+		return TCL_ERROR;
+	}
+
 	kh->topicConf = rd_kafka_topic_conf_dup (ko->topicConf);
 
+	kh->mainQueue = rd_kafka_queue_get_main (rk);
+	kafkatcl_wakeup_watch_queue (kh, kh->mainQueue);
+
 	Tcl_CreateEventSource (kafkatcl_EventSetupProc, kafkatcl_EventCheckProc, (ClientData) kh);
 
 	// if cmdName is #auto, generate a unique name for the object
@@ -4397,6 +10614,7 @@ kafkatcl_createHandleObjectCommand (kafkatcl_objectClientData *ko, char *cmdName
 
 	// create a Tcl command to interface to the handle object
 	kh->cmdToken = Tcl_CreateObjCommand (interp, cmdName, kafkatcl_handleObjectObjCmd, kh, kafkatcl_handleObjectDelete);
+	KT_LIST_INSERT_HEAD (&ko->handles, kh, handleInstance);
 	// set the full name to the command in the interpreter result
 	Tcl_GetCommandFullName(interp, kh->cmdToken, Tcl_GetObjResult (interp));
 	if (autoGeneratedName == 1) {
@@ -4504,7 +10722,19 @@ kafkatcl_createSubscriberObjectCommand (kafkatcl_objectClientData *ko, char *cmd
 
 	// Start Tcl setup
 
-	Tcl_CreateEventSource (kafkatcl_EventSetupProc, kafkatcl_SubscriberEventCheckProc, (ClientData) kh);
+	// rather than polling on a timer, have librdkafka wake us through a
+	// pipe when there is something in the consumer queue
+	if (kafkatcl_wakeup_init (kh, kafkatcl_SubscriberFileProc) == TCL_ERROR) {
+		rd_kafka_destroy (rk);
+		Tcl_DeleteHashTable (&kh->callbackConsumers);
+		ckfree ((char *)kh);
+		return TCL_ERROR;
+	}
+
+	kh->consumerQueue = rd_kafka_queue_get_consumer (rk);
+	kafkatcl_wakeup_watch_queue (kh, kh->consumerQueue);
+
+	Tcl_CreateEventSource (kafkatcl_SubscriberEventSetupProc, kafkatcl_SubscriberEventCheckProc, (ClientData) kh);
 
 	// if cmdName is #auto, generate a unique name for the object
 	int autoGeneratedName = 0;
@@ -4515,6 +10745,7 @@ kafkatcl_createSubscriberObjectCommand (kafkatcl_objectClientData *ko, char *cmd
 
 	// create a Tcl command to interface to the handle object
 	kh->cmdToken = Tcl_CreateObjCommand (interp, cmdName, kafkatcl_handleSubscriberObjectObjCmd, kh, kafkatcl_subscriberObjectDelete);
+	KT_LIST_INSERT_HEAD (&ko->handles, kh, handleInstance);
 	// set the full name to the command in the interpreter result
 	Tcl_GetCommandFullName(interp, kh->cmdToken, Tcl_GetObjResult (interp));
 	if (autoGeneratedName == 1) {
@@ -4558,6 +10789,8 @@ kafkatcl_kafkaObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 		"logger",
 		"delete",
 		"subscriber",
+		"event_priority",
+		"event_budget",
 		NULL
 	};
 
@@ -4572,7 +10805,9 @@ kafkatcl_kafkaObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
         OPT_SET_STATISTICS_CALLBACK,
 		OPT_LOGGER,
 		OPT_DELETE,
-		OPT_SUBSCRIPTION_CREATOR
+		OPT_SUBSCRIPTION_CREATOR,
+		OPT_EVENT_PRIORITY,
+		OPT_EVENT_BUDGET
     };
 
     /* basic validation of command line arguments */
@@ -4629,9 +10864,12 @@ kafkatcl_kafkaObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 		case OPT_CONSUMER_CREATOR:
 		case OPT_PRODUCER_CREATOR: {
 			rd_kafka_type_t type;
+			int deliveryReports = 0;
 
-			if (objc != 3) {
-				Tcl_WrongNumArgs (interp, 2, objv, "cmdName");
+			if (optIndex == OPT_PRODUCER_CREATOR && objc == 4 && strcmp (Tcl_GetString (objv[3]), "-deliveryreports") == 0) {
+				deliveryReports = 1;
+			} else if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, (optIndex == OPT_PRODUCER_CREATOR) ? "cmdName ?-deliveryreports?" : "cmdName");
 				return TCL_ERROR;
 			}
 
@@ -4642,7 +10880,7 @@ kafkatcl_kafkaObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 			}
 
 			char *cmdName = Tcl_GetString (objv[2]);
-			resultCode = kafkatcl_createHandleObjectCommand (ko, cmdName, type);
+			resultCode = kafkatcl_createHandleObjectCommand (ko, cmdName, type, deliveryReports);
 			break;
 		}
 
@@ -4656,10 +10894,108 @@ kafkatcl_kafkaObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 			break;
 		}
 
+		case OPT_EVENT_PRIORITY: {
+			static CONST char *kinds[] = {
+				"error",
+				"statistics",
+				"delivery_report",
+				"consume",
+				NULL
+			};
+
+			static CONST char *priorities[] = {
+				"high",
+				"normal",
+				NULL
+			};
+
+			int kind;
+			int priority;
+
+			if (objc > 4) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?kind? ?high|normal?");
+				return TCL_ERROR;
+			}
+
+			if (objc == 2) {
+				Tcl_Obj *listObj = Tcl_NewObj ();
+
+				for (kind = 0; kind < KAFKATCL_EVENT_KINDS; kind++) {
+					Tcl_ListObjAppendElement (NULL, listObj, Tcl_NewStringObj (kinds[kind], -1));
+					Tcl_ListObjAppendElement (NULL, listObj, Tcl_NewStringObj ((ko->eventPosition[kind] == TCL_QUEUE_MARK) ? "high" : "normal", -1));
+				}
+				Tcl_SetObjResult (interp, listObj);
+				break;
+			}
+
+			if (Tcl_GetIndexFromObj (interp, objv[2], kinds, "kind", TCL_EXACT, &kind) != TCL_OK) {
+				return TCL_ERROR;
+			}
+
+			if (objc == 3) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ((ko->eventPosition[kind] == TCL_QUEUE_MARK) ? "high" : "normal", -1));
+				break;
+			}
+
+			if (Tcl_GetIndexFromObj (interp, objv[3], priorities, "priority", TCL_EXACT, &priority) != TCL_OK) {
+				return TCL_ERROR;
+			}
+
+			// high priority events are queued after the high priority
+			// events already waiting but ahead of everything else
+			ko->eventPosition[kind] = (priority == 0) ? TCL_QUEUE_MARK : TCL_QUEUE_TAIL;
+			break;
+		}
+
+		case OPT_EVENT_BUDGET: {
+			int i;
+
+			if (objc == 2) {
+				Tcl_Obj *listObjv[4];
+
+				listObjv[0] = Tcl_NewStringObj ("-messages", -1);
+				listObjv[1] = Tcl_NewIntObj (ko->budgetMessages);
+				listObjv[2] = Tcl_NewStringObj ("-milliseconds", -1);
+				listObjv[3] = Tcl_NewIntObj (ko->budgetMS);
+				Tcl_SetObjResult (interp, Tcl_NewListObj (4, listObjv));
+				break;
+			}
+
+			if (objc % 2 != 0) {
+				Tcl_WrongNumArgs (interp, 2, objv, "?-messages count? ?-milliseconds ms?");
+				return TCL_ERROR;
+			}
+
+			for (i = 2; i < objc; i += 2) {
+				char *option = Tcl_GetString (objv[i]);
+				int value;
+
+				if (Tcl_GetIntFromObj (interp, objv[i + 1], &value) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+
+				if (value < 0) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("budget can't be negative", -1));
+					return TCL_ERROR;
+				}
+
+				if (strcmp (option, "-messages") == 0) {
+					ko->budgetMessages = value;
+				} else if (strcmp (option, "-milliseconds") == 0) {
+					ko->budgetMS = value;
+				} else {
+					Tcl_ResetResult (interp);
+					Tcl_AppendResult (interp, "unknown option '", option, "', should be -messages or -milliseconds", NULL);
+					return TCL_ERROR;
+				}
+			}
+			break;
+		}
+
 		case OPT_DELIVERY_REPORT: {
 			int suboptIndex;
 
-			if ((objc < 3) || (objc > 4)) {
+			if ((objc < 3) || (objc > 6)) {
 				Tcl_WrongNumArgs (interp, 2, objv, "option ?args?");
 				return TCL_ERROR;
 			}
@@ -4668,13 +11004,25 @@ kafkatcl_kafkaObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 				"callback",
 				"sample",
 				"every",
+				"pending",
+				"policy",
+				"stats",
 				NULL
 			};
 
 			enum subOptions {
 				SUBOPT_CALLBACK,
 				SUBOPT_SAMPLE,
-				SUBOPT_EVERY
+				SUBOPT_EVERY,
+				SUBOPT_PENDING,
+				SUBOPT_POLICY,
+				SUBOPT_STATS
+			};
+
+			static CONST char *policies[] = {
+				"all",
+				"errors",
+				NULL
 			};
 
 			// argument must be one of the subOptions defined above
@@ -4683,10 +11031,51 @@ kafkatcl_kafkaObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 				return TCL_ERROR;
 			}
 
+			// sampling subcommands apply to the kafka object as a whole
+			// unless they're given -topic.  setting something for a topic
+			// gives it its own sampling starting from the object's
+			// settings; until then, asking about it reports the object's.
+			kafkatcl_deliveryReportSampling *drs = &ko->deliveryReportSampling;
+			char *topic = NULL;
+			int nextArg = 3;
+
+			if (objc >= 4 && strcmp (Tcl_GetString (objv[3]), "-topic") == 0) {
+				if (suboptIndex == SUBOPT_CALLBACK || suboptIndex == SUBOPT_PENDING) {
+					Tcl_SetObjResult (interp, Tcl_ObjPrintf ("-topic isn't accepted by \"%s\"", subOptions[suboptIndex]));
+					return TCL_ERROR;
+				}
+
+				if (objc < 5) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("value for \"-topic\" missing", -1));
+					return TCL_ERROR;
+				}
+
+				topic = Tcl_GetString (objv[4]);
+				nextArg = 5;
+
+				kafkatcl_deliveryReportSampling *topicDrs = kafkatcl_delivery_report_topic_sampling (ko, topic, 0);
+				if (topicDrs != NULL) {
+					drs = topicDrs;
+				} else if (suboptIndex == SUBOPT_STATS) {
+					Tcl_SetObjResult (interp, Tcl_ObjPrintf ("topic \"%s\" has no delivery report sampling of its own", topic));
+					return TCL_ERROR;
+				}
+			}
+
 			switch ((enum subOptions) suboptIndex) {
 				case SUBOPT_CALLBACK: {
-					if (objc != 4) {
-						Tcl_WrongNumArgs (interp, 3, objv, "command");
+					int fields = 0;
+
+					if (objc == 6 && strcmp (Tcl_GetString (objv[3]), "-fields") == 0) {
+						if (kafkatcl_parse_fields (interp, objv[4], kafkatcl_deliveryReportFieldStrings, &fields) == TCL_ERROR) {
+							return TCL_ERROR;
+						}
+						if (fields == 0) {
+							Tcl_SetObjResult (interp, Tcl_NewStringObj ("-fields must name at least one field", -1));
+							return TCL_ERROR;
+						}
+					} else if (objc != 4) {
+						Tcl_WrongNumArgs (interp, 3, objv, "?-fields list? command");
 						return TCL_ERROR;
 					}
 
@@ -4694,44 +11083,115 @@ kafkatcl_kafkaObjectObjCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_O
 						Tcl_DecrRefCount (ko->deliveryReportCallbackObj);
 					}
 
-					ko->deliveryReportCallbackObj = objv[3];
+					ko->deliveryReportFields = fields;
+					ko->deliveryReportCallbackObj = objv[objc - 1];
 					Tcl_IncrRefCount (ko->deliveryReportCallbackObj);
-
-					rd_kafka_conf_set_dr_msg_cb (ko->conf, kafkatcl_delivery_report_callback);
 					break;
 				}
 
-				case SUBOPT_SAMPLE: {
+				case SUBOPT_PENDING: {
+					Tcl_HashSearch search;
+					Tcl_HashEntry *entry;
+					Tcl_Obj *listObj;
+
 					if (objc != 3) {
 						Tcl_WrongNumArgs (interp, 3, objv, "");
 						return TCL_ERROR;
 					}
-					ko->sampleDeliveryReport = 1;
+
+					// ids of messages produced with -command that are awaiting delivery
+					listObj = Tcl_NewObj ();
+					for (entry = Tcl_FirstHashEntry (&ko->pendingCompletions, &search); entry != NULL; entry = Tcl_NextHashEntry (&search)) {
+						kafkatcl_produceOpaque *kpo = (kafkatcl_produceOpaque *)Tcl_GetHashValue (entry);
+						Tcl_ListObjAppendElement (NULL, listObj, Tcl_NewWideIntObj (kpo->id));
+					}
+					Tcl_SetObjResult (interp, listObj);
+					break;
+				}
+
+				case SUBOPT_SAMPLE: {
+					if (objc != nextArg) {
+						Tcl_WrongNumArgs (interp, 3, objv, "?-topic topic?");
+						return TCL_ERROR;
+					}
+					if (topic != NULL) {
+						drs = kafkatcl_delivery_report_topic_sampling (ko, topic, 1);
+					}
+					drs->sampleNext = 1;
 					break;
 				}
 
 				case SUBOPT_EVERY: {
-					if (objc > 4) {
-						Tcl_WrongNumArgs (interp, 3, objv, "?count?");
+					if (objc > nextArg + 1) {
+						Tcl_WrongNumArgs (interp, 3, objv, "?-topic topic? ?count?");
 						return TCL_ERROR;
 					}
 
-					if (objc == 3) {
-						Tcl_SetObjResult (interp, Tcl_NewIntObj (ko->deliveryReportCountdown));
+					if (objc == nextArg) {
+						Tcl_SetObjResult (interp, Tcl_NewIntObj (drs->countdown));
 						break;
 					}
 
-					if (Tcl_GetIntFromObj (interp, objv[3], &ko->deliveryReportEvery) == TCL_ERROR) {
+					int every;
+
+					if (Tcl_GetIntFromObj (interp, objv[nextArg], &every) == TCL_ERROR) {
 						resultCode = TCL_ERROR;
 						break;
 					}
 
+					if (topic != NULL) {
+						drs = kafkatcl_delivery_report_topic_sampling (ko, topic, 1);
+					}
+					drs->every = every;
+
 					// if we've already been counting, reset the countdown
 					// to the new "every" value
-					if (ko->deliveryReportCountdown > 0) {
-						ko->deliveryReportCountdown = ko->deliveryReportEvery;
+					if (drs->countdown > 0) {
+						drs->countdown = drs->every;
+					}
+
+					break;
+				}
+
+				case SUBOPT_POLICY: {
+					if (objc > nextArg + 1) {
+						Tcl_WrongNumArgs (interp, 3, objv, "?-topic topic? ?all|errors?");
+						return TCL_ERROR;
+					}
+
+					if (objc == nextArg) {
+						Tcl_SetObjResult (interp, Tcl_NewStringObj (policies[drs->policy], -1));
+						break;
+					}
+
+					int policy;
+
+					if (Tcl_GetIndexFromObj (interp, objv[nextArg], policies, "policy", TCL_EXACT, &policy) != TCL_OK) {
+						return TCL_ERROR;
+					}
+
+					if (topic != NULL) {
+						drs = kafkatcl_delivery_report_topic_sampling (ko, topic, 1);
+					}
+					drs->policy = policy;
+					break;
+				}
+
+				case SUBOPT_STATS: {
+					Tcl_Obj *listObjv[6];
+
+					if (objc != nextArg) {
+						Tcl_WrongNumArgs (interp, 3, objv, "?-topic topic?");
+						return TCL_ERROR;
 					}
 
+					listObjv[0] = Tcl_NewStringObj ("delivered", -1);
+					listObjv[1] = Tcl_NewWideIntObj (drs->delivered);
+					listObjv[2] = Tcl_NewStringObj ("failed", -1);
+					listObjv[3] = Tcl_NewWideIntObj (drs->failed);
+					listObjv[4] = Tcl_NewStringObj ("sampled", -1);
+					listObjv[5] = Tcl_NewWideIntObj (drs->sampled);
+					Tcl_SetObjResult (interp, Tcl_NewListObj (6, listObjv));
 					break;
 				}
 
@@ -4952,9 +11412,21 @@ kafkatcl_kafkaObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Ob
 			ko->errorCallbackObj = NULL;
 			ko->statisticsCallbackObj = NULL;
 
-			ko->sampleDeliveryReport = 0;
-			ko->deliveryReportEvery = 1;
-			ko->deliveryReportCountdown = 0;
+			kafkatcl_delivery_report_sampling_init (&ko->deliveryReportSampling);
+			Tcl_InitHashTable (&ko->topicDeliveryReportSampling, TCL_STRING_KEYS);
+			ko->deliveryReportFields = 0;
+			ko->deliveryReportBatch = NULL;
+			ko->nextMessageId = 0;
+			Tcl_InitHashTable (&ko->pendingCompletions, KAFKATCL_MESSAGE_ID_KEY_WORDS);
+
+			// errors, statistics and delivery reports go ahead of
+			// consumed messages, in the order they happened
+			ko->eventPosition[KAFKATCL_EVENT_ERROR] = TCL_QUEUE_MARK;
+			ko->eventPosition[KAFKATCL_EVENT_STATISTICS] = TCL_QUEUE_MARK;
+			ko->eventPosition[KAFKATCL_EVENT_DELIVERY_REPORT] = TCL_QUEUE_TAIL;
+			ko->eventPosition[KAFKATCL_EVENT_CONSUME] = TCL_QUEUE_TAIL;
+			ko->budgetMessages = KAFKATCL_DEFAULT_BUDGET_MESSAGES;
+			ko->budgetMS = KAFKATCL_DEFAULT_BUDGET_MS;
 
 			ko->threadId = Tcl_GetCurrentThread();
 
@@ -4964,6 +11436,7 @@ kafkatcl_kafkaObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Ob
 
 			KT_LIST_INIT (&ko->topicConsumers);
 			KT_LIST_INIT (&ko->queueConsumers);
+			KT_LIST_INIT (&ko->handles);
 
 			cmdName = Tcl_GetString (objv[2]);
 
@@ -20,6 +20,8 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <librdkafka/rdkafka.h>
 
 #define KAFKA_OBJECT_MAGIC 96451241
@@ -27,6 +29,69 @@
 #define KAFKA_TOPIC_MAGIC 71077345
 #define KAFKA_QUEUE_MAGIC 13377331
 
+// message fields that can be requested with -fields, in the order of
+// kafkatcl_fieldStrings
+#define KAFKATCL_FIELD_PAYLOAD		(1 << 0)
+#define KAFKATCL_FIELD_PARTITION	(1 << 1)
+#define KAFKATCL_FIELD_OFFSET		(1 << 2)
+#define KAFKATCL_FIELD_TIMESTAMP	(1 << 3)
+#define KAFKATCL_FIELD_TOPIC		(1 << 4)
+#define KAFKATCL_FIELD_KEY			(1 << 5)
+#define KAFKATCL_FIELD_HEADERS		(1 << 6)
+
+// headers are only included when they're asked for
+#define KAFKATCL_FIELDS_DEFAULT (KAFKATCL_FIELD_PAYLOAD|KAFKATCL_FIELD_PARTITION|KAFKATCL_FIELD_OFFSET|KAFKATCL_FIELD_TIMESTAMP|KAFKATCL_FIELD_TOPIC|KAFKATCL_FIELD_KEY)
+
+// fields of a batched delivery report, in the order of
+// kafkatcl_deliveryReportFieldStrings
+#define KAFKATCL_DR_FIELD_PAYLOAD	(1 << 0)
+#define KAFKATCL_DR_FIELD_PARTITION	(1 << 1)
+#define KAFKATCL_DR_FIELD_OFFSET	(1 << 2)
+#define KAFKATCL_DR_FIELD_TIMESTAMP	(1 << 3)
+#define KAFKATCL_DR_FIELD_TOPIC		(1 << 4)
+#define KAFKATCL_DR_FIELD_KEY		(1 << 5)
+#define KAFKATCL_DR_FIELD_ERR		(1 << 6)
+#define KAFKATCL_DR_FIELD_OPAQUE	(1 << 7)
+
+// which delivery reports are candidates for the delivery report callback
+#define KAFKATCL_DR_POLICY_ALL		0
+#define KAFKATCL_DR_POLICY_ERRORS	1
+
+// longest a -block produce waits in rd_kafka_poll before trying again
+#define KAFKATCL_BLOCK_POLL_MS		100
+
+// kinds of events we queue to the Tcl event loop, each of which can be
+// given its own priority with the event_priority method
+#define KAFKATCL_EVENT_ERROR			0
+#define KAFKATCL_EVENT_STATISTICS		1
+#define KAFKATCL_EVENT_DELIVERY_REPORT	2
+#define KAFKATCL_EVENT_CONSUME			3
+#define KAFKATCL_EVENT_KINDS			4
+
+// how much a consumer or subscriber handle passes to callbacks in one
+// pass through the event loop before giving other event sources a turn
+#define KAFKATCL_DEFAULT_BUDGET_MESSAGES	1000
+#define KAFKATCL_DEFAULT_BUDGET_MS			50
+
+// how many messages or bytes a handle lets pile up waiting for consume
+// callbacks before pausing the partitions they come from
+#define KAFKATCL_DEFAULT_BACKPRESSURE_MESSAGES	100000
+#define KAFKATCL_DEFAULT_BACKPRESSURE_BYTES		(256 * 1024 * 1024)
+
+// consumed payloads up to this size are copied into byte arrays rather
+// than holding onto the message, and with it librdkafka's fetch buffer
+#define KAFKATCL_PAYLOAD_COPY_MAX	1024
+
+// how long deleting a producer waits for the delivery reports of the
+// messages it purged
+#define KAFKATCL_PURGE_FLUSH_MS		5000
+
+// how long to wait for metadata from the brokers
+#define KAFKATCL_METADATA_TIMEOUT_MS	5000
+
+// on_writable low-water mark when there's no queue.buffering.max.messages
+#define KAFKATCL_DEFAULT_QUEUE_MAX_MESSAGES	100000
+
 /* KT_LIST_* - bidirectionally linked list routines from BSD.
  * See LICENSE file for copyright information.
  */
@@ -86,6 +151,17 @@ struct {								\
 extern int
 kafkatcl_kafkaObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objvp[]);
 
+typedef struct kafkatcl_deliveryReportSampling
+{
+	int sampleNext;						// if 1, call back on next produced msg
+	int every;							// call back one out of this many
+	int countdown;						// counter for callback
+	int policy;							// KAFKATCL_DR_POLICY_*
+	Tcl_WideInt delivered;				// reports of messages delivered
+	Tcl_WideInt failed;					// reports of messages that failed
+	Tcl_WideInt sampled;				// reports that made it through sampling
+} kafkatcl_deliveryReportSampling;
+
 typedef struct kafkatcl_objectClientData
 {
     int kafka_object_magic;
@@ -99,13 +175,36 @@ typedef struct kafkatcl_objectClientData
 	Tcl_Obj *errorCallbackObj;
 	Tcl_Obj *statisticsCallbackObj;
 
-	int sampleDeliveryReport;			// if 1, call back on next produced msg
-	int deliveryReportEvery;			// call back one out of this many
-	int deliveryReportCountdown;		// counter for callback
+	kafkatcl_deliveryReportSampling deliveryReportSampling;
+	Tcl_HashTable topicDeliveryReportSampling;	// topic name to its own kafkatcl_deliveryReportSampling
+	int deliveryReportFields;			// KAFKATCL_DR_FIELD_*, 0 for one report per event
+	Tcl_Obj *deliveryReportBatch;		// reports waiting for the batch event
+	Tcl_WideInt nextMessageId;			// id of the next message produced with -command
+	Tcl_HashTable pendingCompletions;	// id to kafkatcl_produceOpaque for -command
+	Tcl_QueuePosition eventPosition[KAFKATCL_EVENT_KINDS];	// where each KAFKATCL_EVENT_* is queued
+	int budgetMessages;					// messages per pass through the event loop, 0 for no limit
+	int budgetMS;						// ms per pass through the event loop, 0 for no limit
 	KT_LIST_HEAD(topicConsumers, kafkatcl_topicClientData) topicConsumers;
 	KT_LIST_HEAD(queueConsumers, kafkatcl_queueClientData) queueConsumers;
+	KT_LIST_HEAD(handles, kafkatcl_handleClientData) handles;	// producer, consumer and subscriber handles
 } kafkatcl_objectClientData;
 
+// a metadata response from librdkafka, shared by the cached topics
+// that point into it and freed when the last of them lets go
+typedef struct kafkatcl_metadataBlock
+{
+	const struct rd_kafka_metadata *metadata;
+	int refCount;
+} kafkatcl_metadataBlock;
+
+// a handle's cached metadata for one topic
+typedef struct kafkatcl_metadataTopic
+{
+	const struct rd_kafka_metadata_topic *topic;
+	kafkatcl_metadataBlock *block;
+	Tcl_WideInt fetched;				// when it was fetched, in milliseconds
+} kafkatcl_metadataTopic;
+
 typedef struct kafkatcl_handleClientData
 {
     int kafka_handle_magic;
@@ -116,11 +215,75 @@ typedef struct kafkatcl_handleClientData
     Tcl_Command cmdToken;
 	rd_kafka_type_t kafkaType;
 	Tcl_ThreadId threadId;
-	const struct rd_kafka_metadata *metadata;
+	const struct rd_kafka_metadata *metadata;	// the whole cluster, or NULL if not fetched yet
+	kafkatcl_metadataBlock *metadataBlock;	// the block holding metadata
+	Tcl_HashTable metadataTopics;		// topic name to its kafkatcl_metadataTopic
+	Tcl_WideInt metadataFetched;		// when metadata was fetched, in milliseconds
+	int metadataTTL;					// ms before metadata is refreshed in the background, 0 for never
+	int metadataRefreshing;				// 1 while metadataThread is fetching metadata
+	Tcl_ThreadId metadataThread;
+	Tcl_Obj *partitionChangeCallbackObj;	// meta on_partition_change command, or NULL
 	Tcl_Obj *subscriberCallback;
+	int subscriberFields;				// KAFKATCL_FIELD_* for the subscriber callback
 	int inCallback;
+	rd_kafka_queue_t *consumerQueue;	// subscriber's consumer queue
+	rd_kafka_queue_t *mainQueue;		// delivery reports, errors and statistics
+	rd_kafka_event_t *mainEvent;		// delivery report event served partway, or NULL
+	rd_kafka_queue_t *callbackQueue;	// all partitions consumed with callbacks
+	Tcl_HashTable callbackConsumers;	// kafkatcl_partitionKey -> running consumer
+	int wakeupPipe[2];					// librdkafka writes here when a watched queue gets data
+	KT_LIST_HEAD(flushWaiters, kafkatcl_flushWaiter) flushWaiters;	// flush -async calls yet to complete
+	KT_LIST_HEAD(queries, kafkatcl_queryEvent) queries;	// -command queries running on worker threads
+	Tcl_Obj *writableCallbackObj;		// on_writable script, or NULL
+	int writableLowWater;				// on_writable fires below this output queue length
+	int writablePending;				// 1 if on_writable is waiting for the queue to drain
+	int deliveryReports;				// 1 if this producer was created with delivery reports
+	int pendingMessages;				// consumed messages queued for callbacks and not yet handled
+	Tcl_WideInt pendingBytes;			// payload and key bytes of those messages
+	int backpressureHighMessages;		// pause partitions above this many pending messages, 0 for no limit
+	int backpressureLowMessages;		// and resume them at or below this many
+	Tcl_WideInt backpressureHighBytes;	// likewise for pending bytes
+	Tcl_WideInt backpressureLowBytes;
+	rd_kafka_topic_partition_list_t *backpressurePaused;	// partitions we paused, or NULL
+	rd_kafka_topic_partition_list_t *appPaused;	// partitions paused with the pause subcommand, or NULL
+	rd_kafka_topic_partition_list_t *rangePaused;	// partitions paused at the end of a consume_range, or NULL
+	struct kafkatcl_consumeRange *range;	// subscriber consume_range -command in progress, or NULL
+	KT_LIST_HEAD(messageRefs, kafkatcl_messageRef) messageRefs;	// consumed messages Tcl still refers to
+	KT_LIST_ENTRY(kafkatcl_handleClientData) handleInstance;
 } kafkatcl_handleClientData;
 
+// a consumed message shared by the Tcl objects that refer to its payload.
+// the message is destroyed when the last reference goes away, or its
+// payload and headers are copied out if the handle is deleted first.
+typedef struct kafkatcl_messageRef
+{
+	int refCount;
+	rd_kafka_message_t *rkmessage;		// NULL once detached from the handle
+	kafkatcl_handleClientData *kh;
+	unsigned char *detachedPayload;
+	size_t detachedLen;
+	rd_kafka_headers_t *detachedHeaders;
+	KT_LIST_ENTRY(kafkatcl_messageRef) messageRefInstance;
+} kafkatcl_messageRef;
+
+// hash key identifying a topic and partition on a handle, for
+// Tcl_InitHashTable with array keys
+typedef struct kafkatcl_partitionKey
+{
+	rd_kafka_topic_t *rkt;
+	int32_t partition;
+	int32_t pad;
+} kafkatcl_partitionKey;
+
+#define KAFKATCL_PARTITION_KEY_WORDS (sizeof (kafkatcl_partitionKey) / sizeof (int))
+
+// message ids of produced messages are hashed as array keys, since a
+// Tcl_WideInt doesn't fit in a one-word key everywhere
+#define KAFKATCL_MESSAGE_ID_KEY_WORDS (sizeof (Tcl_WideInt) / sizeof (int))
+
+// the signature of librdkafka's partitioners
+typedef int32_t (kafkatcl_partitionerProc) (const rd_kafka_topic_t *rkt, const void *keydata, size_t keylen, int32_t partition_cnt, void *rkt_opaque, void *msg_opaque);
+
 typedef struct kafkatcl_topicClientData
 {
     int kafka_topic_magic;
@@ -128,6 +291,7 @@ typedef struct kafkatcl_topicClientData
 	kafkatcl_handleClientData *kh;
 	Tcl_Command cmdToken;
 	char *topic;
+	kafkatcl_partitionerProc *keyPartitioner;	// partitioner of keyed messages, for consistent_partition
 	KT_LIST_ENTRY(kafkatcl_topicClientData) topicConsumerInstance;
 	KT_LIST_HEAD(runningConsumers, kafkatcl_runningConsumer) runningConsumers;
 } kafkatcl_topicClientData;
@@ -150,6 +314,12 @@ typedef struct kafkatcl_deliveryReportEvent
 	rd_kafka_message_t rkmessage;
 } kafkatcl_deliveryReportEvent;
 
+typedef struct kafkatcl_deliveryReportBatchEvent
+{
+    Tcl_Event event;
+	kafkatcl_objectClientData *ko;
+} kafkatcl_deliveryReportBatchEvent;
+
 typedef struct kafkatcl_errorEvent
 {
     Tcl_Event event;
@@ -184,17 +354,178 @@ typedef struct kafkatcl_runningConsumer {
 	kafkatcl_queueClientData *kq;
 	int partition;
 	Tcl_Obj *callbackObj;
+	int fields;							// KAFKATCL_FIELD_* to pass to the callback
+	int batchSize;						// if > 0, pass lists of up to this many messages to the callback
+	int lingerMS;						// how long to wait for a batch to fill up
+	Tcl_Obj *batchObj;					// batch being accumulated, or NULL
+	Tcl_TimerToken lingerTimer;			// flushes a partial batch
+	int batchMessages;					// messages in batchObj
+	size_t batchBytes;					// and their payload and key bytes
+	struct kafkatcl_consumeRange *range;	// consume_range this belongs to, or NULL
+	int64_t rangeEnd;					// offset the range stops at, invalid once it has
 	KT_LIST_ENTRY(kafkatcl_runningConsumer) runningConsumerInstance;
 } kafkatcl_runningConsumer;
 
+// options accepted by consume_range, see kafkatcl_parse_range_options
+typedef struct kafkatcl_rangeOptions
+{
+	Tcl_WideInt from;					// timestamps in milliseconds
+	Tcl_WideInt to;
+	int fields;
+	int timeoutMS;
+	Tcl_Obj *commandObj;				// or NULL to consume the range before returning
+} kafkatcl_rangeOptions;
+
+// a time range being consumed by consume_range -command.  a topic's
+// range is held by its running consumers, a subscriber's by the handle.
+typedef struct kafkatcl_consumeRange
+{
+	kafkatcl_handleClientData *kh;
+	Tcl_Obj *commandObj;				// invoked with each message and then with err and done
+	int fields;
+	int refCount;						// holders, including pending done events
+	int remaining;						// partitions (or for a subscriber, 1) not finished
+	rd_kafka_topic_partition_list_t *ends;	// subscriber: unfinished partitions and where they stop
+} kafkatcl_consumeRange;
+
+// queued after the last message of a partition of a range, or for a
+// subscriber after the last message of the range
+typedef struct kafkatcl_rangeDoneEvent
+{
+    Tcl_Event event;
+	kafkatcl_consumeRange *range;
+	kafkatcl_runningConsumer *krc;		// topic: the partition that finished, else NULL
+} kafkatcl_rangeDoneEvent;
+
+// options accepted by the consuming methods, see kafkatcl_parse_consume_options
+typedef struct kafkatcl_consumeOptions
+{
+	int fields;
+	int batchSize;
+	int lingerMS;
+} kafkatcl_consumeOptions;
+
+// options accepted by producev and producev_batch, see kafkatcl_parse_produce_options
+typedef struct kafkatcl_produceOptions
+{
+	int32_t partition;
+	Tcl_Obj *keyObj;
+	Tcl_Obj *headersObj;
+	Tcl_Obj *opaqueObj;
+	Tcl_Obj *commandObj;
+	Tcl_WideInt timestamp;
+	int nocopy;
+	int blockMS;						// -block timeout, or -1 not to block
+} kafkatcl_produceOptions;
+
+// what the opaque of a produced message points to when there's anything
+// to do when its delivery report comes back; otherwise the opaque is NULL
+typedef struct kafkatcl_produceOpaque
+{
+	Tcl_Obj *payloadObj;				// payload held for -nocopy, or NULL
+	Tcl_Obj *opaqueObj;					// -opaque value to report, or NULL
+	Tcl_Obj *commandObj;				// -command to complete, or NULL
+	Tcl_WideInt id;						// message id for -command
+	Tcl_HashEntry *pendingEntry;		// entry in ko->pendingCompletions
+} kafkatcl_produceOpaque;
+
+// a "flush -async" waiting for the output queue of a handle to empty
+typedef struct kafkatcl_flushWaiter
+{
+	Tcl_Obj *commandObj;
+	Tcl_WideInt deadline;				// when to give up, or -1 to wait as long as it takes
+	KT_LIST_ENTRY(kafkatcl_flushWaiter) flushWaiterInstance;
+} kafkatcl_flushWaiter;
+
+// the completion of a flush -async.  it outlives the handle, so it
+// holds onto the interpreter rather than the handle
+typedef struct kafkatcl_flushEvent
+{
+    Tcl_Event event;
+	Tcl_Interp *interp;
+	Tcl_Obj *commandObj;
+	Tcl_Obj *reportObj;
+} kafkatcl_flushEvent;
+
+// a background metadata refresh, filled in by the thread that fetches
+// it and then queued back to the thread that owns the handle
+typedef struct kafkatcl_metadataEvent
+{
+    Tcl_Event event;
+	kafkatcl_handleClientData *kh;
+	Tcl_ThreadId ownerThreadId;
+	int rktCount;						// how many topics to fetch, -1 for all of them
+	rd_kafka_topic_t **rkts;
+	rd_kafka_resp_err_t err;
+	const struct rd_kafka_metadata *metadata;
+} kafkatcl_metadataEvent;
+
+// kinds of kafkatcl_queryEvent
+#define KAFKATCL_QUERY_METADATA		0
+#define KAFKATCL_QUERY_WATERMARKS	1
+#define KAFKATCL_QUERY_COMMITTED	2
+#define KAFKATCL_QUERY_POSITION		3
+#define KAFKATCL_QUERY_SEEK			4
+#define KAFKATCL_QUERY_OFFSETS_FOR_TIMES	5
+
+// a metadata, watermark, offset or seek query run on a worker thread for a
+// -command caller.  the worker fills in the results and queues it back
+// to the thread that owns the handle.
+typedef struct kafkatcl_queryEvent
+{
+    Tcl_Event event;
+	kafkatcl_handleClientData *kh;
+	Tcl_ThreadId ownerThreadId;
+	Tcl_ThreadId thread;
+	int type;							// KAFKATCL_QUERY_*
+	int timeoutMS;
+	Tcl_Obj *commandObj;				// only touched by the owning thread
+	rd_kafka_resp_err_t err;
+	int rktCount;						// metadata: how many topics, -1 for all of them
+	rd_kafka_topic_t **rkts;
+	const struct rd_kafka_metadata *metadata;
+	rd_kafka_topic_partition_list_t *partitions;	// watermarks, offsets and seeks
+	int64_t *highWatermarks;			// watermarks: the high one for each partition, the low one is the offset
+	KT_LIST_ENTRY(kafkatcl_queryEvent) queryInstance;
+} kafkatcl_queryEvent;
+
+typedef struct kafkatcl_partitionChangeEvent
+{
+    Tcl_Event event;
+	kafkatcl_handleClientData *kh;
+	Tcl_Obj *changesObj;
+} kafkatcl_partitionChangeEvent;
+
+typedef struct kafkatcl_writableEvent
+{
+    Tcl_Event event;
+	kafkatcl_handleClientData *kh;
+} kafkatcl_writableEvent;
+
+typedef struct kafkatcl_produceCompletionEvent
+{
+    Tcl_Event event;
+	kafkatcl_objectClientData *ko;
+	Tcl_Obj *commandObj;
+	Tcl_Obj *reportObj;
+} kafkatcl_produceCompletionEvent;
+
 typedef struct kafkatcl_consumeCallbackEvent
 {
     Tcl_Event event;
 	kafkatcl_runningConsumer *krc;
-	Tcl_WideInt timestamp;
-	rd_kafka_timestamp_type_t timestamp_type;
-	rd_kafka_message_t rkmessage;
+	kafkatcl_messageRef *ref;
+	size_t bytes;						// payload and key bytes, for backpressure
 } kafkatcl_consumeCallbackEvent;
 
+typedef struct kafkatcl_consumeBatchEvent
+{
+    Tcl_Event event;
+	kafkatcl_runningConsumer *krc;
+	Tcl_Obj *batchObj;
+	int messageCount;
+	size_t byteCount;
+} kafkatcl_consumeBatchEvent;
+
 
 /* vim: set ts=4 sw=4 sts=4 noet : */